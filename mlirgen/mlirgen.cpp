@@ -1,3 +1,4 @@
+#include <cmath>
 #include <iostream>
 #include <mlir/IR/MLIRContext.h>
 #include <mlir/IR/Module.h>
@@ -7,6 +8,20 @@
 #include <mlir/EDSC/Intrinsics.h>
 #include <mlir/Support/LLVM.h> // SmallVector
 #include <mlir/Target/LLVMIR/ModuleTranslation.h>
+#include <mlir/Dialect/AffineOps/AffineOps.h>
+#include <mlir/Dialect/LoopOps/LoopOps.h>
+#include <mlir/Dialect/StandardOps/Ops.h>
+#include <mlir/Analysis/Verifier.h>
+#include <mlir/Conversion/AffineToStandard/AffineToStandard.h>
+#include <mlir/Conversion/LoopToStandard/ConvertLoopToStandard.h>
+#include <mlir/Conversion/StandardToLLVM/ConvertStandardToLLVMPass.h>
+#include <mlir/ExecutionEngine/ExecutionEngine.h>
+#include <mlir/ExecutionEngine/OptUtils.h>
+#include <mlir/Pass/PassManager.h>
+#include <mlir/Transforms/Passes.h>
+#include <llvm/Support/TargetSelect.h>
+#include "../src/mldslapi.h"
+#include "../src/benchmark.h"
 using namespace std;
 
 void CreateMainForAddTwoNumbers(mlir::MLIRContext& mlirContext, mlir::OwningModuleRef& module)
@@ -74,9 +89,794 @@ void TestAddTwoNumbers()
     TranslateModuleToLLVM(module.get());
 }
 
+// Lowering of the ml-dsl Function IR to MLIR. Every loop of the Function becomes
+// an affine.for (or a loop.for when its bounds are not constants), vector variables
+// become memrefs and scalars are kept in rank 0 memrefs. Indices that are affine
+// functions of the enclosing loop indices are emitted as affine loads and stores
+// so that the affine passes (tiling, unrolling, vectorization) apply to them.
+//
+// The generated function has the signature
+//     func @forward(%x : memref<Nxf64>, %y : memref<Mxf64>, %valueSet0 : memref<...>, ...)
+// Value sets are passed in as flattened memrefs. When the batch size is a runtime
+// parameter, batched variables become memref<?xf64> and the batch size is passed
+// as a trailing index argument.
+class MLIRFunctionLowering : public IRStatementVisitor, public IRValueVisitor
+{
+    mlir::MLIRContext& m_context;
+    mlir::Location m_loc;
+    mlir::FuncOp m_funcOp;
+    std::unique_ptr<mlir::OpBuilder> m_builder;
+    std::unique_ptr<mlir::OpBuilder> m_entryBuilder;
+
+    std::map<Variable*, mlir::Value*> m_variableMemRefs;
+    std::map<Variable*, mlir::Value*> m_inductionVariables;
+    std::map<ValueSet*, mlir::Value*> m_valueSetMemRefs;
+    std::vector<mlir::Value*> m_allocations;
+    mlir::Value* m_batchSize;
+    mlir::Value* m_result;
+    // Index of the loops created for vector statements, bound to their induction variables
+    Variable m_vectorIndex;
+
+    static int64_t GetLength(ValueType& type)
+    {
+        VectorType* vecType = type.AsVectorType();
+        return vecType ? vecType->GetLength() : 1;
+    }
+    static bool IsIntegral(ValueType& type)
+    {
+        if (VectorType* vecType = type.AsVectorType())
+            return IsIntegral(vecType->GetElementType());
+        return type.IsInteger();
+    }
+    // Element type used for storing values of the given IR type in memory
+    mlir::Type GetStorageType(ValueType& type)
+    {
+        if (VectorType* vecType = type.AsVectorType())
+            return GetStorageType(vecType->GetElementType());
+        if (type.IsInteger())
+            return mlir::IntegerType::get(64, &m_context);
+        if (type.IsBoolean())
+            return mlir::IntegerType::get(1, &m_context);
+        return mlir::FloatType::getF64(&m_context);
+    }
+    mlir::MemRefType GetMemRefType(ValueType& type)
+    {
+        if (VectorType* vecType = type.AsVectorType())
+            return mlir::MemRefType::get({ vecType->GetLength() }, GetStorageType(type));
+        return mlir::MemRefType::get({}, GetStorageType(type));
+    }
+    mlir::MemRefType GetMemRefType(Variable& var)
+    {
+        if (var.IsBatched())
+            return mlir::MemRefType::get({ -1 }, GetStorageType(var.GetType()));
+        return GetMemRefType(var.GetType());
+    }
+    mlir::Value* Lower(Value& value)
+    {
+        value.AcceptIRValueVisitor(*this);
+        return m_result;
+    }
+    // Integer values are computed in the index type
+    mlir::Value* LowerIndex(Value& value)
+    {
+        mlir::Value* result = Lower(value);
+        if (!result->getType().isIndex())
+            result = m_builder->create<mlir::IndexCastOp>(m_loc, result, m_builder->getIndexType());
+        return result;
+    }
+    mlir::Value* ConvertToReal(mlir::Value* value)
+    {
+        if (value->getType().isF64())
+            return value;
+        if (value->getType().isIndex())
+            value = m_builder->create<mlir::IndexCastOp>(m_loc, value, m_builder->getIntegerType(64));
+        return m_builder->create<mlir::SIToFPOp>(m_loc, value, m_builder->getF64Type());
+    }
+    mlir::Value* ConvertForStore(mlir::Value* value, ValueType& type)
+    {
+        if (IsIntegral(type))
+        {
+            if (value->getType().isIndex())
+                return m_builder->create<mlir::IndexCastOp>(m_loc, value, m_builder->getIntegerType(64));
+            return value;
+        }
+        return ConvertToReal(value);
+    }
+    mlir::Value* ConvertAfterLoad(mlir::Value* value, ValueType& type)
+    {
+        if (IsIntegral(type))
+            return m_builder->create<mlir::IndexCastOp>(m_loc, value, m_builder->getIndexType());
+        return value;
+    }
+
+    // Try to express an index as an affine function of the enclosing loop indices
+    bool GetAffineExpr(Value& index, mlir::AffineExpr& expr, llvm::SmallVectorImpl<mlir::Value*>& operands)
+    {
+        if (IntegerConstant* intConst = dynamic_cast<IntegerConstant*>(&index))
+        {
+            expr = mlir::getAffineConstantExpr(intConst->GetValue(), &m_context);
+            return true;
+        }
+        if (Variable* var = dynamic_cast<Variable*>(&index))
+        {
+            auto iter = m_inductionVariables.find(var);
+            if (iter == m_inductionVariables.end())
+                return false;
+            expr = mlir::getAffineDimExpr(operands.size(), &m_context);
+            operands.push_back(iter->second);
+            return true;
+        }
+        if (BinaryAdd* add = dynamic_cast<BinaryAdd*>(&index))
+        {
+            mlir::AffineExpr lhs, rhs;
+            if (!GetAffineExpr(add->GetLHS(), lhs, operands) || !GetAffineExpr(add->GetRHS(), rhs, operands))
+                return false;
+            expr = lhs + rhs;
+            return true;
+        }
+        if (BinaryMultiply* mul = dynamic_cast<BinaryMultiply*>(&index))
+        {
+            IntegerConstant* factor = dynamic_cast<IntegerConstant*>(&mul->GetRHS());
+            Value* other = &mul->GetLHS();
+            if (factor == nullptr)
+            {
+                factor = dynamic_cast<IntegerConstant*>(&mul->GetLHS());
+                other = &mul->GetRHS();
+            }
+            mlir::AffineExpr otherExpr;
+            if (factor == nullptr || !GetAffineExpr(*other, otherExpr, operands))
+                return false;
+            expr = otherExpr * factor->GetValue();
+            return true;
+        }
+        return false;
+    }
+    // Load scalar i of value id of a value set : data[id * valueStride + i * scalarStride]. The scalar
+    // index is either an IR value or the induction variable of a loop created by the lowering.
+    mlir::Value* LoadValueSetScalar(ValueSet& valueSet, Value& elemID, Value* scalarIndex, mlir::Value* scalarIV = nullptr)
+    {
+        mlir::Value* memRef = m_valueSetMemRefs[&valueSet];
+        int64_t valueStride = valueSet.GetValueStride();
+        int64_t scalarStride = valueSet.GetScalarStride();
+        mlir::AffineExpr idExpr;
+        mlir::AffineExpr scalarExpr = mlir::getAffineConstantExpr(0, &m_context);
+        llvm::SmallVector<mlir::Value*, 4> operands;
+        bool affine = GetAffineExpr(elemID, idExpr, operands);
+        if (affine && scalarIndex != nullptr)
+            affine = GetAffineExpr(*scalarIndex, scalarExpr, operands);
+        else if (affine && scalarIV != nullptr)
+        {
+            scalarExpr = mlir::getAffineDimExpr(operands.size(), &m_context);
+            operands.push_back(scalarIV);
+        }
+        if (affine)
+        {
+            auto map = mlir::AffineMap::get(operands.size(), 0, { idExpr * valueStride + scalarExpr * scalarStride });
+            return m_builder->create<mlir::AffineLoadOp>(m_loc, memRef, map, operands);
+        }
+        mlir::Value* index = m_builder->create<mlir::MulIOp>(m_loc, LowerIndex(elemID),
+                                                             m_builder->create<mlir::ConstantIndexOp>(m_loc, valueStride));
+        mlir::Value* scalar = scalarIndex ? LowerIndex(*scalarIndex) : scalarIV;
+        if (scalar != nullptr)
+        {
+            scalar = m_builder->create<mlir::MulIOp>(m_loc, scalar, m_builder->create<mlir::ConstantIndexOp>(m_loc, scalarStride));
+            index = m_builder->create<mlir::AddIOp>(m_loc, index, scalar);
+        }
+        return m_builder->create<mlir::LoadOp>(m_loc, memRef, index);
+    }
+    mlir::Value* LoadElement(mlir::Value* memRef, Value& index, int64_t scale = 1)
+    {
+        mlir::AffineExpr expr;
+        llvm::SmallVector<mlir::Value*, 4> operands;
+        if (GetAffineExpr(index, expr, operands))
+        {
+            auto map = mlir::AffineMap::get(operands.size(), 0, { expr * scale });
+            return m_builder->create<mlir::AffineLoadOp>(m_loc, memRef, map, operands);
+        }
+        mlir::Value* indexVal = LowerIndex(index);
+        if (scale != 1)
+            indexVal = m_builder->create<mlir::MulIOp>(m_loc, indexVal, m_builder->create<mlir::ConstantIndexOp>(m_loc, scale));
+        return m_builder->create<mlir::LoadOp>(m_loc, memRef, indexVal);
+    }
+    void StoreElement(mlir::Value* value, mlir::Value* memRef, Value& index)
+    {
+        mlir::AffineExpr expr;
+        llvm::SmallVector<mlir::Value*, 4> operands;
+        if (GetAffineExpr(index, expr, operands))
+        {
+            auto map = mlir::AffineMap::get(operands.size(), 0, { expr });
+            m_builder->create<mlir::AffineStoreOp>(m_loc, value, memRef, map, operands);
+            return;
+        }
+        m_builder->create<mlir::StoreOp>(m_loc, value, memRef, LowerIndex(index));
+    }
+    // activation is a KernelActivation. The accuracy tiers of the kernels do not apply, the
+    // functions are computed with the standard dialect's operations.
+    mlir::Value* LowerActivation(int32_t activation, mlir::Value* operand)
+    {
+        if (activation == KernelActivationNone)
+            return operand;
+        if (activation == KernelActivationSigmoid)
+        {
+            // 1 / (1 + exp(-x))
+            mlir::Value* negated = m_builder->create<mlir::SubFOp>(m_loc, CreateRealConstant(0.0), operand);
+            mlir::Value* exp = m_builder->create<mlir::ExpOp>(m_loc, negated);
+            mlir::Value* denominator = m_builder->create<mlir::AddFOp>(m_loc, CreateRealConstant(1.0), exp);
+            return m_builder->create<mlir::DivFOp>(m_loc, CreateRealConstant(1.0), denominator);
+        }
+        if (activation == KernelActivationTanh)
+            return m_builder->create<mlir::TanhOp>(m_loc, operand);
+        if (activation == KernelActivationRelu || activation == KernelActivationLeakyRelu)
+        {
+            mlir::Value* zero = CreateRealConstant(0.0);
+            mlir::Value* isPositive = m_builder->create<mlir::CmpFOp>(m_loc, mlir::CmpFPredicate::OGT, operand, zero);
+            mlir::Value* negative = zero;
+            if (activation == KernelActivationLeakyRelu)
+                negative = m_builder->create<mlir::MulFOp>(m_loc, CreateRealConstant(KernelLeakyReluSlope), operand);
+            return m_builder->create<mlir::SelectOp>(m_loc, isPositive, operand, negative);
+        }
+        throw std::runtime_error("MLIR lowering : Unsupported activation function " + std::string(sKernelActivations[activation].name));
+    }
+    mlir::Value* GetMemRef(Variable& var)
+    {
+        auto iter = m_variableMemRefs.find(&var);
+        if (iter == m_variableMemRefs.end())
+            throw std::runtime_error("MLIR lowering : Use of undefined variable " + var.GetName());
+        return iter->second;
+    }
+    template<typename FloatOp, typename IntOp>
+    void LowerBinaryOp(BinaryOp& binOp)
+    {
+        mlir::Value* lhs = Lower(binOp.GetLHS());
+        mlir::Value* rhs = Lower(binOp.GetRHS());
+        if (lhs->getType().isIndex() && rhs->getType().isIndex())
+            m_result = m_builder->create<IntOp>(m_loc, lhs, rhs);
+        else
+            m_result = m_builder->create<FloatOp>(m_loc, ConvertToReal(lhs), ConvertToReal(rhs));
+    }
+    mlir::Value* CreateRealConstant(double val)
+    {
+        return m_builder->create<mlir::ConstantFloatOp>(m_loc, llvm::APFloat(val), m_builder->getF64Type());
+    }
+public:
+    MLIRFunctionLowering(mlir::MLIRContext& context)
+        :m_context(context), m_loc(mlir::UnknownLoc::get(&context)), m_batchSize(nullptr), m_result(nullptr),
+         m_vectorIndex("__vectorIndex", IntegerType::Get())
+    { }
+
+    mlir::FuncOp LowerFunction(Function& function, const std::string& name)
+    {
+        // Signature : input, output and one memref per value set, bound to the set's packed buffer
+        llvm::SmallVector<mlir::Type, 8> argTypes;
+        argTypes.push_back(GetMemRefType(function.GetInputVariable()));
+        argTypes.push_back(GetMemRefType(function.GetOutputVariable()));
+        const std::list<ValueSet*>& valueSets = function.GetValueSets();
+        for (auto iter=valueSets.begin() ; iter!=valueSets.end() ; ++iter)
+        {
+            ValueSet& valueSet = *(*iter);
+            if (IsIntegral(valueSet.GetElementType()) || valueSet.GetElementType().IsBoolean())
+                throw std::runtime_error("MLIR lowering : Only real value sets are supported");
+            // The memrefs are f64 and bound to the sets' buffers in place
+            if (valueSet.GetPrecision() != RealType::Float64 || valueSet.IsQuantized())
+                throw std::runtime_error("MLIR lowering : Only value sets of doubles are supported");
+            int64_t size = static_cast<int64_t>(valueSet.GetElementLength()) * valueSet.GetNumberOfValues();
+            argTypes.push_back(mlir::MemRefType::get({ size }, mlir::FloatType::getF64(&m_context)));
+        }
+        Variable* batchSizeVar = function.GetBatchSizeVariable();
+        if (batchSizeVar != nullptr)
+            argTypes.push_back(mlir::IndexType::get(&m_context));
+        auto funcType = mlir::FunctionType::get(argTypes, {}, &m_context);
+        m_funcOp = mlir::FuncOp::create(m_loc, name, funcType, {});
+        mlir::Block* entryBlock = m_funcOp.addEntryBlock();
+        m_entryBuilder = llvm::make_unique<mlir::OpBuilder>(m_funcOp.getBody());
+        m_builder = llvm::make_unique<mlir::OpBuilder>(m_funcOp.getBody());
+        m_builder->setInsertionPointToEnd(entryBlock);
+
+        m_variableMemRefs[&function.GetInputVariable()] = m_funcOp.getArgument(0);
+        m_variableMemRefs[&function.GetOutputVariable()] = m_funcOp.getArgument(1);
+        unsigned argNum = 2;
+        for (auto iter=valueSets.begin() ; iter!=valueSets.end() ; ++iter)
+            m_valueSetMemRefs[*iter] = m_funcOp.getArgument(argNum++);
+        if (batchSizeVar != nullptr)
+        {
+            m_batchSize = m_funcOp.getArgument(argNum++);
+            m_inductionVariables[batchSizeVar] = m_batchSize;
+        }
+
+        const std::list<IRStatement*>& stms = function.GetStatementList();
+        for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+
+        for (size_t i=0 ; i<m_allocations.size() ; ++i)
+            m_builder->create<mlir::DeallocOp>(m_loc, m_allocations[i]);
+        m_builder->create<mlir::ReturnOp>(m_loc);
+        return m_funcOp;
+    }
+
+    // Statements
+    virtual void Visit(Assignment& assignment)
+    {
+        Value& lhs = assignment.GetLHS();
+        Value& rhs = assignment.GetRHS();
+        if (IndexedValue* indexedLHS = dynamic_cast<IndexedValue*>(&lhs))
+        {
+            mlir::Value* value = ConvertForStore(Lower(rhs), lhs.GetType());
+            StoreElement(value, GetMemRef(indexedLHS->GetVariable()), indexedLHS->GetIndexer());
+            return;
+        }
+        Variable& lhsVar = dynamic_cast<Variable&>(lhs);
+        mlir::Value* memRef = GetMemRef(lhsVar);
+        if (lhsVar.GetType().IsVector())
+        {
+            // Copy a vector element of a value set : var[i] = valueSet[id][i]
+            GetValue& getValue = dynamic_cast<GetValue&>(rhs);
+            int64_t length = GetLength(lhsVar.GetType());
+            auto copyLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, length);
+            mlir::OpBuilder::InsertionGuard guard(*m_builder);
+            m_builder->setInsertionPoint(copyLoop.getBody()->getTerminator());
+            mlir::Value* elementIndex = copyLoop.getInductionVar();
+            mlir::Value* element = LoadValueSetScalar(getValue.GetValueSet(), getValue.GetElementID(), nullptr, elementIndex);
+            m_builder->create<mlir::AffineStoreOp>(m_loc, element, memRef, llvm::ArrayRef<mlir::Value*>(elementIndex));
+            return;
+        }
+        mlir::Value* value = ConvertForStore(Lower(rhs), lhsVar.GetType());
+        m_builder->create<mlir::StoreOp>(m_loc, value, memRef);
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        mlir::OpBuilder::InsertionGuard guard(*m_builder);
+        IntegerConstant* start = dynamic_cast<IntegerConstant*>(&forLoop.GetStart());
+        IntegerConstant* end = dynamic_cast<IntegerConstant*>(&forLoop.GetEnd());
+        if (start && end)
+        {
+            auto loop = m_builder->create<mlir::AffineForOp>(m_loc, start->GetValue(), end->GetValue(), forLoop.GetStep());
+            m_inductionVariables[&forLoop.GetIndexVariable()] = loop.getInductionVar();
+            m_builder->setInsertionPoint(loop.getBody()->getTerminator());
+        }
+        else
+        {
+            mlir::Value* lowerBound = LowerIndex(forLoop.GetStart());
+            mlir::Value* upperBound = LowerIndex(forLoop.GetEnd());
+            mlir::Value* step = m_builder->create<mlir::ConstantIndexOp>(m_loc, forLoop.GetStep());
+            auto loop = m_builder->create<mlir::loop::ForOp>(m_loc, lowerBound, upperBound, step);
+            m_inductionVariables[&forLoop.GetIndexVariable()] = loop.getInductionVar();
+            m_builder->setInsertionPoint(loop.getBody()->getTerminator());
+        }
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+    }
+    virtual void Visit(VariableDefinition& varDefinition)
+    {
+        // Allocations only depend on the batch size, so they are hoisted to the function entry
+        Variable& var = varDefinition.GetVariable();
+        if (m_variableMemRefs.find(&var) != m_variableMemRefs.end())
+            return;
+        mlir::Value* memRef;
+        if (var.IsBatched())
+        {
+            mlir::Value* rowLength = m_entryBuilder->create<mlir::ConstantIndexOp>(m_loc, GetLength(var.GetType()));
+            mlir::Value* size = m_entryBuilder->create<mlir::MulIOp>(m_loc, m_batchSize, rowLength);
+            memRef = m_entryBuilder->create<mlir::AllocOp>(m_loc, GetMemRefType(var), llvm::ArrayRef<mlir::Value*>(size));
+        }
+        else
+            memRef = m_entryBuilder->create<mlir::AllocOp>(m_loc, GetMemRefType(var.GetType()));
+        m_variableMemRefs[&var] = memRef;
+        m_allocations.push_back(memRef);
+    }
+
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        // The dense kernel becomes a plain loop nest. The affine passes tile and unroll it like
+        // the rest of the function.
+        //   for b, for n : acc = bias[n] ; for k : acc += W[n][k] * x[b*inRow + inOffset + k]
+        //                  y[b*outRow + outOffset + n] = activation(acc)
+        // The accumulator is f64 like the value sets, where the other backends may round to float
+        if (denseLayer.GetAccumulatePrecision() != RealType::Float64)
+            throw std::runtime_error("MLIR lowering : Only dense layers accumulating in doubles are supported");
+        mlir::OpBuilder::InsertionGuard guard(*m_builder);
+        int64_t numInputs = denseLayer.GetNumberOfInputs();
+        mlir::Value* batchLoopIndex;
+        if (IntegerConstant* rows = dynamic_cast<IntegerConstant*>(&denseLayer.GetBatchSize()))
+        {
+            auto batchLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, rows->GetValue());
+            batchLoopIndex = batchLoop.getInductionVar();
+            m_builder->setInsertionPoint(batchLoop.getBody()->getTerminator());
+        }
+        else
+        {
+            // The runtime batch size is a function argument, so it is a valid symbol for the bound
+            mlir::Value* rows = LowerIndex(denseLayer.GetBatchSize());
+            auto upperBound = mlir::AffineMap::get(0, 1, { mlir::getAffineSymbolExpr(0, &m_context) });
+            auto batchLoop = m_builder->create<mlir::AffineForOp>(m_loc, llvm::ArrayRef<mlir::Value*>(), m_builder->getConstantAffineMap(0),
+                                                                  llvm::ArrayRef<mlir::Value*>(rows), upperBound);
+            batchLoopIndex = batchLoop.getInductionVar();
+            m_builder->setInsertionPoint(batchLoop.getBody()->getTerminator());
+        }
+        auto neuronLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, denseLayer.GetNumberOfNeurons());
+        mlir::Value* neuronIndex = neuronLoop.getInductionVar();
+        m_builder->setInsertionPoint(neuronLoop.getBody()->getTerminator());
+
+        mlir::Value* accumulator = m_entryBuilder->create<mlir::AllocOp>(m_loc, mlir::MemRefType::get({}, m_builder->getF64Type()));
+        m_allocations.push_back(accumulator);
+        mlir::Value* initial = CreateRealConstant(0.0);
+        if (denseLayer.GetBiases() != nullptr)
+            initial = m_builder->create<mlir::AffineLoadOp>(m_loc, m_valueSetMemRefs[denseLayer.GetBiases()],
+                                                            llvm::ArrayRef<mlir::Value*>(neuronIndex));
+        ValueSet& weights = denseLayer.GetWeights();
+        m_builder->create<mlir::StoreOp>(m_loc, initial, accumulator);
+
+        mlir::AffineExpr b = mlir::getAffineDimExpr(0, &m_context);
+        mlir::AffineExpr n = mlir::getAffineDimExpr(1, &m_context);
+        mlir::AffineExpr k = mlir::getAffineDimExpr(2, &m_context);
+        {
+            mlir::OpBuilder::InsertionGuard inputGuard(*m_builder);
+            auto inputLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, numInputs);
+            m_builder->setInsertionPoint(inputLoop.getBody()->getTerminator());
+            llvm::SmallVector<mlir::Value*, 3> operands = { batchLoopIndex, neuronIndex, inputLoop.getInductionVar() };
+            auto weightMap = mlir::AffineMap::get(3, 0, { n * weights.GetValueStride() + k * weights.GetScalarStride() });
+            auto inputMap = mlir::AffineMap::get(3, 0, { b * denseLayer.GetInputRowLength() + denseLayer.GetInputOffset() + k });
+            mlir::Value* weight = m_builder->create<mlir::AffineLoadOp>(m_loc, m_valueSetMemRefs[&weights], weightMap, operands);
+            mlir::Value* input = m_builder->create<mlir::AffineLoadOp>(m_loc, GetMemRef(denseLayer.GetInput()), inputMap, operands);
+            mlir::Value* product = m_builder->create<mlir::MulFOp>(m_loc, weight, input);
+            mlir::Value* sum = m_builder->create<mlir::AddFOp>(m_loc, m_builder->create<mlir::LoadOp>(m_loc, accumulator), product);
+            m_builder->create<mlir::StoreOp>(m_loc, sum, accumulator);
+        }
+        mlir::Value* result = LowerActivation(denseLayer.GetActivation(), m_builder->create<mlir::LoadOp>(m_loc, accumulator));
+        llvm::SmallVector<mlir::Value*, 2> outputOperands = { batchLoopIndex, neuronIndex };
+        auto outputMap = mlir::AffineMap::get(2, 0, { b * denseLayer.GetOutputRowLength() + denseLayer.GetOutputOffset() + n });
+        m_builder->create<mlir::AffineStoreOp>(m_loc, result, GetMemRef(denseLayer.GetOutput()), outputMap, outputOperands);
+    }
+
+    // for b, for i : var[offset + b*rowLength + i] = activation(var[offset + b*rowLength + i])
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        if (!sKernelActivations[vectorActivation.GetActivation()].elementwise)
+            throw std::runtime_error("MLIR lowering : Unsupported layer activation " +
+                                     std::string(sKernelActivations[vectorActivation.GetActivation()].name));
+        mlir::OpBuilder::InsertionGuard guard(*m_builder);
+        mlir::Value* rowIndex;
+        if (IntegerConstant* rows = dynamic_cast<IntegerConstant*>(&vectorActivation.GetBatchSize()))
+        {
+            auto rowLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, rows->GetValue());
+            rowIndex = rowLoop.getInductionVar();
+            m_builder->setInsertionPoint(rowLoop.getBody()->getTerminator());
+        }
+        else
+        {
+            mlir::Value* rows = LowerIndex(vectorActivation.GetBatchSize());
+            auto upperBound = mlir::AffineMap::get(0, 1, { mlir::getAffineSymbolExpr(0, &m_context) });
+            auto rowLoop = m_builder->create<mlir::AffineForOp>(m_loc, llvm::ArrayRef<mlir::Value*>(), m_builder->getConstantAffineMap(0),
+                                                                llvm::ArrayRef<mlir::Value*>(rows), upperBound);
+            rowIndex = rowLoop.getInductionVar();
+            m_builder->setInsertionPoint(rowLoop.getBody()->getTerminator());
+        }
+        auto elementLoop = m_builder->create<mlir::AffineForOp>(m_loc, 0, vectorActivation.GetLength());
+        m_builder->setInsertionPoint(elementLoop.getBody()->getTerminator());
+        mlir::AffineExpr b = mlir::getAffineDimExpr(0, &m_context);
+        mlir::AffineExpr i = mlir::getAffineDimExpr(1, &m_context);
+        llvm::SmallVector<mlir::Value*, 2> operands = { rowIndex, elementLoop.getInductionVar() };
+        auto map = mlir::AffineMap::get(2, 0, { b * vectorActivation.GetRowLength() + vectorActivation.GetOffset() + i });
+        mlir::Value* memRef = GetMemRef(vectorActivation.GetVariable());
+        mlir::Value* value = m_builder->create<mlir::AffineLoadOp>(m_loc, memRef, map, operands);
+        m_builder->create<mlir::AffineStoreOp>(m_loc, LowerActivation(vectorActivation.GetActivation(), value), memRef, map, operands);
+    }
+
+    // Vector statements become plain affine loops, which the affine vectorizer and the LLVM
+    // backend turn into SIMD code for the target
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        mlir::OpBuilder::InsertionGuard guard(*m_builder);
+        auto loop = m_builder->create<mlir::AffineForOp>(m_loc, 0, vectorOperation.GetLength());
+        m_inductionVariables[&m_vectorIndex] = loop.getInductionVar();
+        m_builder->setInsertionPoint(loop.getBody()->getTerminator());
+        mlir::Value* lhs = ConvertToReal(Lower(vectorOperation.GetLHS().GetElement(m_vectorIndex)));
+        mlir::Value* rhs = ConvertToReal(Lower(vectorOperation.GetRHS().GetElement(m_vectorIndex)));
+        mlir::Value* result;
+        switch (vectorOperation.GetOperation())
+        {
+        case VectorOperation::Add: result = m_builder->create<mlir::AddFOp>(m_loc, lhs, rhs); break;
+        case VectorOperation::Subtract: result = m_builder->create<mlir::SubFOp>(m_loc, lhs, rhs); break;
+        case VectorOperation::Multiply: result = m_builder->create<mlir::MulFOp>(m_loc, lhs, rhs); break;
+        default: result = m_builder->create<mlir::DivFOp>(m_loc, lhs, rhs); break;
+        }
+        m_builder->create<mlir::AffineStoreOp>(m_loc, result, GetMemRef(vectorOperation.GetResult()),
+                                               llvm::ArrayRef<mlir::Value*>(loop.getInductionVar()));
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        mlir::Value* resultMemRef = GetMemRef(vectorReduction.GetResult());
+        Reduction::ReductionType reductionType = vectorReduction.GetReductionType();
+        double identity = reductionType == Reduction::Sum ? 0.0 : reductionType == Reduction::Multiply ? 1.0 : -INFINITY;
+        m_builder->create<mlir::StoreOp>(m_loc, CreateRealConstant(identity), resultMemRef);
+
+        mlir::OpBuilder::InsertionGuard guard(*m_builder);
+        auto loop = m_builder->create<mlir::AffineForOp>(m_loc, 0, vectorReduction.GetLength());
+        m_inductionVariables[&m_vectorIndex] = loop.getInductionVar();
+        m_builder->setInsertionPoint(loop.getBody()->getTerminator());
+        mlir::Value* element = ConvertToReal(Lower(vectorReduction.GetOperand().GetElement(m_vectorIndex)));
+        if (vectorReduction.GetFactor() != nullptr)
+        {
+            mlir::Value* factor = ConvertToReal(Lower(vectorReduction.GetFactor()->GetElement(m_vectorIndex)));
+            element = m_builder->create<mlir::MulFOp>(m_loc, element, factor);
+        }
+        mlir::Value* acc = m_builder->create<mlir::LoadOp>(m_loc, resultMemRef);
+        mlir::Value* result;
+        if (reductionType == Reduction::Sum)
+            result = m_builder->create<mlir::AddFOp>(m_loc, acc, element);
+        else if (reductionType == Reduction::Multiply)
+            result = m_builder->create<mlir::MulFOp>(m_loc, acc, element);
+        else
+        {
+            mlir::Value* greater = m_builder->create<mlir::CmpFOp>(m_loc, mlir::CmpFPredicate::OGT, element, acc);
+            result = m_builder->create<mlir::SelectOp>(m_loc, greater, element, acc);
+        }
+        m_builder->create<mlir::StoreOp>(m_loc, result, resultMemRef);
+    }
+
+    // Values
+    virtual void Visit(IntegerConstant& intConst)
+    {
+        m_result = m_builder->create<mlir::ConstantIndexOp>(m_loc, intConst.GetValue());
+    }
+    virtual void Visit(BooleanConstant& boolConst)
+    {
+        m_result = m_builder->create<mlir::ConstantIntOp>(m_loc, boolConst.GetValue() ? 1 : 0, 1);
+    }
+    virtual void Visit(RealConstant& realConst)
+    {
+        m_result = CreateRealConstant(realConst.GetValue());
+    }
+    virtual void Visit(RealVectorConstant& realVecConst)
+    {
+        throw std::runtime_error("MLIR lowering : Vector constants must be lowered into value sets");
+    }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        m_result = Lower(unaryPlus.GetOperand());
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        mlir::Value* operand = Lower(unaryMinus.GetOperand());
+        if (operand->getType().isIndex())
+            m_result = m_builder->create<mlir::SubIOp>(m_loc, m_builder->create<mlir::ConstantIndexOp>(m_loc, 0), operand);
+        else
+            m_result = m_builder->create<mlir::SubFOp>(m_loc, CreateRealConstant(0.0), operand);
+    }
+    virtual void Visit(BinaryAdd& binaryAdd)
+    {
+        LowerBinaryOp<mlir::AddFOp, mlir::AddIOp>(binaryAdd);
+    }
+    virtual void Visit(BinarySubtract& binarySubtract)
+    {
+        LowerBinaryOp<mlir::SubFOp, mlir::SubIOp>(binarySubtract);
+    }
+    virtual void Visit(BinaryMultiply& binaryMultiply)
+    {
+        LowerBinaryOp<mlir::MulFOp, mlir::MulIOp>(binaryMultiply);
+    }
+    virtual void Visit(BinaryDivide& binaryDivide)
+    {
+        LowerBinaryOp<mlir::DivFOp, mlir::DivISOp>(binaryDivide);
+    }
+    virtual void Visit(GetInputValue& getInput)
+    {
+        throw std::runtime_error("MLIR lowering : GetInputValue must be lowered before code generation");
+    }
+    virtual void Visit(Reduction& reduction)
+    {
+        throw std::runtime_error("MLIR lowering : Reduction must be lowered before code generation");
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        m_result = LowerActivation(function.GetActivation(), ConvertToReal(Lower(function.GetOperand())));
+    }
+    virtual void Visit(Variable& variable)
+    {
+        auto iter = m_inductionVariables.find(&variable);
+        if (iter != m_inductionVariables.end())
+        {
+            m_result = iter->second;
+            return;
+        }
+        mlir::Value* value = m_builder->create<mlir::LoadOp>(m_loc, GetMemRef(variable));
+        m_result = ConvertAfterLoad(value, variable.GetType());
+    }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        mlir::Value* value = LoadElement(GetMemRef(indexedVal.GetVariable()), indexedVal.GetIndexer());
+        m_result = ConvertAfterLoad(value, indexedVal.GetType());
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        ValueSet& valueSet = getValue.GetValueSet();
+        if (valueSet.GetElementType().IsVector() && getValue.GetScalarIndex() == nullptr)
+            throw std::runtime_error("MLIR lowering : Vector value set elements can only be assigned to variables");
+        mlir::Value* value = LoadValueSetScalar(valueSet, getValue.GetElementID(), getValue.GetScalarIndex());
+        m_result = ConvertAfterLoad(value, getValue.GetType());
+    }
+};
+
+// Descriptor the LLVM lowering uses for a 1-D memref argument
+struct MemRefDescriptor1D
+{
+    double* allocated;
+    double* aligned;
+    int64_t offset;
+    int64_t size;
+    int64_t stride;
+};
+
+// Owns a JIT compiled network. The MLIR module is lowered affine -> std -> llvm,
+// optimized with the LLVM O3 pipeline and compiled by the execution engine.
+class MLIRCompiledNetwork
+{
+    std::unique_ptr<mlir::ExecutionEngine> m_engine;
+    std::vector<MemRefDescriptor1D> m_descriptors;
+    std::vector<MemRefDescriptor1D*> m_descriptorPtrs;
+    std::vector<void*> m_args;
+    int64_t m_inputLength;
+    int64_t m_outputLength;
+    bool m_runtimeBatchSize;
+    int64_t m_batchSize;
+
+    static MemRefDescriptor1D CreateDescriptor(double* data, int64_t size)
+    {
+        MemRefDescriptor1D descriptor = { data, data, 0, size, 1 };
+        return descriptor;
+    }
+public:
+    MLIRCompiledNetwork(mlir::MLIRContext& context, Function& function, bool optimizeLoops)
+    {
+        mlir::OwningModuleRef module = mlir::ModuleOp::create(mlir::UnknownLoc::get(&context));
+        MLIRFunctionLowering lowering(context);
+        module->push_back(lowering.LowerFunction(function, "forward"));
+        if (failed(mlir::verify(*module)))
+            throw std::runtime_error("MLIR lowering : Generated module failed verification");
+
+        mlir::PassManager passManager(&context);
+        if (optimizeLoops)
+        {
+            passManager.addPass(mlir::createCanonicalizerPass());
+            passManager.addPass(mlir::createLoopTilingPass(32 * 1024));
+            passManager.addPass(mlir::createLoopUnrollPass());
+        }
+        passManager.addPass(mlir::createLowerAffinePass());
+        passManager.addPass(mlir::createLowerToCFGPass());
+        passManager.addPass(mlir::createLowerToLLVMPass());
+        if (failed(passManager.run(*module)))
+            throw std::runtime_error("MLIR lowering : Lowering to the LLVM dialect failed");
+
+        auto optPipeline = mlir::makeOptimizingTransformer(3, 0, nullptr);
+        auto maybeEngine = mlir::ExecutionEngine::create(*module, optPipeline);
+        if (!maybeEngine)
+            throw std::runtime_error("MLIR lowering : Failed to create the execution engine");
+        m_engine = std::move(*maybeEngine);
+
+        // Value sets are passed in place. Arguments 0 and 1 are rebound on every run.
+        m_inputLength = function.GetInputVariable().GetType().AsVectorType()->GetLength();
+        m_outputLength = function.GetOutputVariable().GetType().AsVectorType()->GetLength();
+        m_runtimeBatchSize = function.GetBatchSizeVariable() != nullptr;
+        m_batchSize = 1;
+        const std::list<ValueSet*>& valueSets = function.GetValueSets();
+        m_descriptors.resize(2 + valueSets.size());
+        size_t argNum = 2;
+        for (auto iter=valueSets.begin() ; iter!=valueSets.end() ; ++iter)
+        {
+            ValueSet& valueSet = *(*iter);
+            int64_t size = static_cast<int64_t>(valueSet.GetElementLength()) * valueSet.GetNumberOfValues();
+            m_descriptors[argNum++] = CreateDescriptor(static_cast<double*>(const_cast<void*>(valueSet.GetData())), size);
+        }
+        m_descriptorPtrs.resize(m_descriptors.size());
+        m_args.resize(m_descriptors.size());
+        for (size_t i=0 ; i<m_descriptors.size() ; ++i)
+        {
+            m_descriptorPtrs[i] = &m_descriptors[i];
+            m_args[i] = &m_descriptorPtrs[i];
+        }
+        if (m_runtimeBatchSize)
+            m_args.push_back(&m_batchSize);
+    }
+    int64_t GetInputLength() { return m_inputLength; }
+    int64_t GetOutputLength() { return m_outputLength; }
+    // batchSize must be 1 unless the function was lowered with a runtime batch size
+    void Run(const double* input, double* output, int64_t batchSize = 1)
+    {
+        if (batchSize != 1 && !m_runtimeBatchSize)
+            throw std::runtime_error("MLIR lowering : Function was lowered without a runtime batch size");
+        m_batchSize = batchSize;
+        m_descriptors[0] = CreateDescriptor(const_cast<double*>(input), m_inputLength * batchSize);
+        m_descriptors[1] = CreateDescriptor(output, m_outputLength * batchSize);
+        if (m_engine->invoke("forward", m_args))
+            throw std::runtime_error("MLIR lowering : JIT invocation failed");
+    }
+};
+
+static void AddSigmoidNeurons(Layer& layer, int32_t numNeurons, int32_t numInputs, bool outputLayer)
+{
+    for (int32_t i=0 ; i<numNeurons ; ++i)
+    {
+        int32_t id = 0;
+        Neuron& neuron = outputLayer ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+        std::vector<double> weights(numInputs);
+        for (int32_t j=0 ; j<numInputs ; ++j)
+            weights[j] = (double)rand()/RAND_MAX - 0.5;
+        Value& x = GetInputValue::Create(neuron);
+        Value& w = Constant(weights);
+        Value& b = Constant((double)rand()/RAND_MAX - 0.5);
+        neuron.SetForwardPropagationValue(ActivationFunction::Create(Reduction::Create(w*x, Reduction::Sum) + b, "sigmoid"));
+    }
+}
+
+void TestNetworkJIT(int32_t numInputs, int32_t numHidden, int32_t numOutputs)
+{
+    Network& net = Network::Create();
+    int32_t inputLayerID, hiddenLayerID, outputLayerID;
+    Layer& inputLayer = net.AddLayer(inputLayerID);
+    Layer& hiddenLayer = net.AddLayer(hiddenLayerID);
+    Layer& outputLayer = net.AddLayer(outputLayerID);
+    for (int32_t i=0 ; i<numInputs ; ++i)
+    {
+        int32_t id = 0;
+        InputNeuron& neuron = inputLayer.AddInputNeuron(id);
+        neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+    }
+    AddSigmoidNeurons(hiddenLayer, numHidden, numInputs, false);
+    AddSigmoidNeurons(outputLayer, numOutputs, numHidden, true);
+    net.FullyConnectLayers(inputLayerID, hiddenLayerID);
+    net.FullyConnectLayers(hiddenLayerID, outputLayerID);
+    net.CheckTypes();
+    CollectMergeableNeuronsIntoEnsembles(net);
+    Function& func = ConstructIRForNetwork(net);
+
+    mlir::MLIRContext mlirContext;
+    MLIRCompiledNetwork compiledNetwork(mlirContext, func, true);
+    Interpreter interpreter(func);
+
+    std::vector<double> x(numInputs), y(numOutputs), expected(numOutputs);
+    for (int32_t i=0 ; i<numInputs ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    compiledNetwork.Run(x.data(), y.data());
+    interpreter.Run(x.data(), expected.data());
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+    {
+        if (std::abs(y[i] - expected[i]) > 1e-9)
+            cout << "Mismatch at output " << i << " : " << y[i] << " != " << expected[i] << endl;
+    }
+    cout << "MLIR JIT : " << MeasureInferencesPerSecond([&]() { compiledNetwork.Run(x.data(), y.data()); })
+         << " inferences/sec" << endl;
+
+    // Same network with the batch size as a runtime parameter
+    const int32_t batchSize = 32;
+    LoweringOptions options;
+    options.batchSize = LoweringOptions::RuntimeBatchSize;
+    Function& batchedFunc = ConstructIRForNetwork(net, options);
+    MLIRCompiledNetwork batchedNetwork(mlirContext, batchedFunc, true);
+    std::vector<double> xBatch(batchSize * numInputs), yBatch(batchSize * numOutputs);
+    for (size_t i=0 ; i<xBatch.size() ; ++i)
+        xBatch[i] = (double)rand()/RAND_MAX;
+    batchedNetwork.Run(xBatch.data(), yBatch.data(), batchSize);
+    for (int32_t b=0 ; b<batchSize ; ++b)
+    {
+        interpreter.Run(&xBatch[b * numInputs], expected.data());
+        for (int32_t i=0 ; i<numOutputs ; ++i)
+        {
+            if (std::abs(yBatch[b * numOutputs + i] - expected[i]) > 1e-9)
+                cout << "Mismatch at batch row " << b << " output " << i << endl;
+        }
+    }
+    cout << "MLIR JIT, batch " << batchSize << " : "
+         << MeasureInferencesPerSecond([&]() { batchedNetwork.Run(xBatch.data(), yBatch.data(), batchSize); }, batchSize)
+         << " inferences/sec" << endl;
+    Network::Destroy(net);
+}
+
 int main()
 {
 	// cout <<"Simple program to write a DSL with MLIR" <<endl;
-	TestAddTwoNumbers();
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+	// TestAddTwoNumbers();
+    TestNetworkJIT(256, 512, 10);
 	return 0;
 }
@@ -0,0 +1,117 @@
+#include <new>
+#include "arena.h"
+
+// Every ArenaObject is preceded by a header telling where its memory came from. The
+// header keeps the object aligned like memory returned by the global operator new.
+struct ObjectHeader
+{
+    Arena* arena; // nullptr for objects on the heap
+    size_t destroyed;
+};
+
+static const size_t HeaderSize = (sizeof(ObjectHeader) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+static thread_local Arena* sCurrentArena = nullptr;
+
+static ObjectHeader* GetHeader(void* memory)
+{
+    return reinterpret_cast<ObjectHeader*>(static_cast<char*>(memory) - HeaderSize);
+}
+
+Arena::Arena(size_t slabSize)
+    :m_slabSize(slabSize), m_capacity(0), m_next(nullptr), m_end(nullptr)
+{
+}
+
+Arena::~Arena()
+{
+    for (size_t i=m_objects.size() ; i>0 ; --i)
+    {
+        ArenaObject* object = m_objects[i-1];
+        ObjectHeader* header = GetHeader(object);
+        if (header->destroyed == 0)
+        {
+            header->destroyed = 1;
+            object->~ArenaObject();
+        }
+    }
+    for (size_t i=0 ; i<m_slabs.size() ; ++i)
+        ::operator delete(m_slabs[i]);
+    if (sCurrentArena == this)
+        sCurrentArena = nullptr;
+}
+
+void* Arena::Allocate(size_t size)
+{
+    size = (size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+    if (size > static_cast<size_t>(m_end - m_next))
+    {
+        // Large objects get a slab of their own so the current slab is not wasted
+        if (size > m_slabSize / 4)
+        {
+            char* slab = static_cast<char*>(::operator new(size));
+            m_slabs.push_back(slab);
+            m_capacity += size;
+            return slab;
+        }
+        char* slab = static_cast<char*>(::operator new(m_slabSize));
+        m_slabs.push_back(slab);
+        m_capacity += m_slabSize;
+        m_next = slab;
+        m_end = slab + m_slabSize;
+    }
+    void* memory = m_next;
+    m_next += size;
+    return memory;
+}
+
+Arena* Arena::GetCurrent()
+{
+    return sCurrentArena;
+}
+
+ArenaScope::ArenaScope(Arena& arena)
+    :m_previous(sCurrentArena)
+{
+    sCurrentArena = &arena;
+}
+
+ArenaScope::~ArenaScope()
+{
+    sCurrentArena = m_previous;
+}
+
+void* ArenaObject::operator new(size_t size)
+{
+    Arena* arena = sCurrentArena;
+    char* memory = static_cast<char*>(arena ? arena->Allocate(HeaderSize + size) : ::operator new(HeaderSize + size));
+    ObjectHeader* header = reinterpret_cast<ObjectHeader*>(memory);
+    header->arena = arena;
+    header->destroyed = 0;
+    void* object = memory + HeaderSize;
+    if (arena != nullptr)
+        arena->m_objects.push_back(static_cast<ArenaObject*>(object));
+    return object;
+}
+
+void ArenaObject::operator delete(void* memory)
+{
+    if (memory == nullptr)
+        return;
+    ObjectHeader* header = GetHeader(memory);
+    if (header->arena == nullptr)
+        ::operator delete(header);
+    else
+        header->destroyed = 1; // the memory is released with the arena
+}
+
+void ArenaObject::Release(ArenaObject* object)
+{
+    if (object != nullptr && !IsInArena(object))
+        delete object;
+}
+
+bool ArenaObject::IsInArena(ArenaObject* object)
+{
+    return GetHeader(object)->arena != nullptr;
+}
@@ -0,0 +1,74 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+// Bulk allocation for DSL values and IR nodes. While an ArenaScope is
+// active on a thread, every ArenaObject created with new on that thread is placed in
+// the scope's arena: consecutive objects are carved out of large slabs with a bump
+// pointer and the arena destroys all of them at once when it is destroyed.
+//
+//     Arena arena;
+//     {
+//         ArenaScope scope(arena);
+//         // build the network's values, lower it ...
+//     }
+//     // run it ...
+//     // ~Arena frees every value and statement created in the scope
+//
+// Outside a scope objects come from the heap as before. Owners release the objects
+// they own with ArenaObject::Release, which leaves arena objects to their arena.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ArenaObject;
+
+class Arena
+{
+    size_t m_slabSize;
+    size_t m_capacity;
+    std::vector<char*> m_slabs;
+    char* m_next;
+    char* m_end;
+    std::vector<ArenaObject*> m_objects;
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+    void* Allocate(size_t size);
+public:
+    Arena(size_t slabSize = 1 << 20);
+    // Destroys the objects in the reverse order of their creation
+    ~Arena();
+    size_t GetNumberOfObjects() { return m_objects.size(); }
+    // Bytes reserved for slabs
+    size_t GetCapacity() { return m_capacity; }
+    // Arena used by new on this thread, nullptr outside of an ArenaScope
+    static Arena* GetCurrent();
+
+    friend class ArenaObject;
+    friend class ArenaScope;
+};
+
+class ArenaScope
+{
+    Arena* m_previous;
+public:
+    ArenaScope(Arena& arena);
+    ~ArenaScope();
+};
+
+// Base of the classes allocated in arenas. Objects must be created with new; the
+// ArenaObject subobject must be at the start of the object (single inheritance).
+class ArenaObject
+{
+public:
+    ArenaObject() { }
+    virtual ~ArenaObject() { }
+    static void* operator new(size_t size);
+    static void operator delete(void* memory);
+    // Delete an owned object unless its arena destroys it
+    static void Release(ArenaObject* object);
+    static bool IsInArena(ArenaObject* object);
+};
+
+#endif // _ARENA_H_
@@ -0,0 +1,30 @@
+#ifndef _BENCHMARK_H_
+#define _BENCHMARK_H_
+
+// Throughput measurement shared by all backends so that their numbers are
+// comparable with the reference interpreter.
+
+#include <chrono>
+#include <cstdint>
+
+// Calls runInference repeatedly for at least minSeconds (after one warm up
+// call) and returns the number of inferences per second. inferencesPerCall is
+// the number of input vectors processed by a single call.
+template<typename T>
+double MeasureInferencesPerSecond(T runInference, int64_t inferencesPerCall = 1, double minSeconds = 0.5)
+{
+    typedef std::chrono::steady_clock Clock;
+    runInference();
+    int64_t calls = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0.0;
+    while (elapsed < minSeconds)
+    {
+        runInference();
+        ++calls;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return static_cast<double>(calls * inferencesPerCall) / elapsed;
+}
+
+#endif // _BENCHMARK_H_
@@ -0,0 +1,98 @@
+#include <stdexcept>
+#include <algorithm>
+#include "neuron.h"
+#include "layer.h"
+#include "connection.h"
+
+Connection::Connection(Layer& sourceLayer, Layer& sinkLayer)
+    :m_sourceLayer(sourceLayer), m_sinkLayer(sinkLayer),
+     m_numSourceNeurons(sourceLayer.GetNumberOfNeurons()), m_numSinkNeurons(sinkLayer.GetNumberOfNeurons())
+{
+    for (int32_t i=0 ; i<m_numSourceNeurons ; ++i)
+    {
+        if (dynamic_cast<OutputNeuron*>(&sourceLayer.GetNeuron(i)) != nullptr)
+            throw std::runtime_error("An output neuron cannot be a source");
+    }
+    for (int32_t i=0 ; i<m_numSinkNeurons ; ++i)
+    {
+        if (dynamic_cast<InputNeuron*>(&sinkLayer.GetNeuron(i)) != nullptr)
+            throw std::runtime_error("An input neuron cannot be a sink");
+    }
+}
+
+bool Connection::GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride)
+{
+    int32_t numSources = GetNumberOfSources(sinkID);
+    if (numSources == 0)
+        return false;
+    first = GetSourceID(sinkID, 0);
+    stride = numSources > 1 ? GetSourceID(sinkID, 1) - first : 1;
+    for (int32_t i=2 ; i<numSources ; ++i)
+    {
+        if (GetSourceID(sinkID, i) != first + i * stride)
+            return false;
+    }
+    return true;
+}
+
+bool DenseConnection::GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride)
+{
+    first = 0;
+    stride = 1;
+    return IsConnectedSink(sinkID) && m_numSourceNeurons > 0;
+}
+
+ConvolutionalConnection::ConvolutionalConnection(Layer& sourceLayer, Layer& sinkLayer, int32_t start, int32_t windowSize, int32_t windowStride)
+    :Connection(sourceLayer, sinkLayer), m_start(start), m_windowSize(windowSize), m_windowStride(windowStride)
+{
+    if (windowSize <= 0 || windowStride <= 0 || start < 0)
+        throw std::runtime_error("Convolutional connections need a positive window size and stride");
+    if (m_numSinkNeurons > 0 && start + (m_numSinkNeurons - 1) * windowStride + windowSize > m_numSourceNeurons)
+        throw std::runtime_error("Convolutional window exceeds the source layer");
+}
+
+static int32_t FloorDivide(int32_t a, int32_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Sink i reads source s when start + i * stride <= s < start + i * stride + windowSize
+int32_t ConvolutionalConnection::GetNumberOfSinks(int32_t sourceID)
+{
+    if (!IsConnectedSource(sourceID))
+        return 0;
+    int32_t firstSink = std::max(FloorDivide(sourceID - m_start - m_windowSize, m_windowStride) + 1, 0);
+    int32_t lastSink = std::min(FloorDivide(sourceID - m_start, m_windowStride), m_numSinkNeurons - 1);
+    return std::max(lastSink - firstSink + 1, 0);
+}
+
+int32_t ConvolutionalConnection::GetSinkID(int32_t sourceID, int32_t index)
+{
+    return std::max(FloorDivide(sourceID - m_start - m_windowSize, m_windowStride) + 1, 0) + index;
+}
+
+bool ConvolutionalConnection::GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride)
+{
+    first = m_start + sinkID * m_windowStride;
+    stride = 1;
+    return IsConnectedSink(sinkID);
+}
+
+SparseConnection::SparseConnection(Layer& sourceLayer, Layer& sinkLayer, std::map<int32_t, std::vector<int32_t>>& connections)
+    :Connection(sourceLayer, sinkLayer), m_sources(m_numSinkNeurons), m_sinks(m_numSourceNeurons)
+{
+    for (int32_t sinkID=0 ; sinkID<m_numSinkNeurons ; ++sinkID)
+    {
+        std::map<int32_t, std::vector<int32_t>>::iterator iter = connections.find(sinkID);
+        if (iter == connections.end())
+            throw std::runtime_error("Connections for all neurons in sink layer not specified by the connection map");
+        std::vector<int32_t>& sourceIDs = iter->second;
+        for (size_t i=0 ; i<sourceIDs.size() ; ++i)
+        {
+            if (sourceIDs[i] < 0 || sourceIDs[i] >= m_numSourceNeurons)
+                throw std::runtime_error("Connection map refers to a neuron outside the source layer");
+            m_sinks[sourceIDs[i]].push_back(sinkID);
+        }
+        m_sources[sinkID] = sourceIDs;
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <vector>
+#include <map>
+#include <cstdint>
+
+class Layer;
+
+// Describes which neurons of a source layer feed which neurons of a sink layer.
+// Regular patterns are stored as a handful of integers instead of one entry per
+// edge, and the sources and sinks of a neuron are computed from them on demand.
+// Neurons are identified by their index in their layer.
+class Connection
+{
+protected:
+    Layer& m_sourceLayer;
+    Layer& m_sinkLayer;
+    // Layer sizes when the layers were connected. Neurons added later are not connected, and
+    // have no sources or sinks in this connection.
+    int32_t m_numSourceNeurons;
+    int32_t m_numSinkNeurons;
+    Connection(Layer& sourceLayer, Layer& sinkLayer);
+    bool IsConnectedSource(int32_t sourceID) { return sourceID >= 0 && sourceID < m_numSourceNeurons; }
+    bool IsConnectedSink(int32_t sinkID) { return sinkID >= 0 && sinkID < m_numSinkNeurons; }
+public:
+    virtual ~Connection() { }
+    Layer& GetSourceLayer() { return m_sourceLayer; }
+    Layer& GetSinkLayer() { return m_sinkLayer; }
+    virtual int32_t GetNumberOfSources(int32_t sinkID) = 0;
+    virtual int32_t GetSourceID(int32_t sinkID, int32_t index) = 0;
+    virtual int32_t GetNumberOfSinks(int32_t sourceID) = 0;
+    virtual int32_t GetSinkID(int32_t sourceID, int32_t index) = 0;
+    // True when the sources of sinkID are first, first + stride, first + 2*stride, ...
+    virtual bool GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride);
+};
+
+// Every sink neuron reads every source neuron
+class DenseConnection : public Connection
+{
+    DenseConnection(Layer& sourceLayer, Layer& sinkLayer)
+        :Connection(sourceLayer, sinkLayer)
+    { }
+public:
+    virtual int32_t GetNumberOfSources(int32_t sinkID) { return IsConnectedSink(sinkID) ? m_numSourceNeurons : 0; }
+    virtual int32_t GetSourceID(int32_t sinkID, int32_t index) { return index; }
+    virtual int32_t GetNumberOfSinks(int32_t sourceID) { return IsConnectedSource(sourceID) ? m_numSinkNeurons : 0; }
+    virtual int32_t GetSinkID(int32_t sourceID, int32_t index) { return index; }
+    virtual bool GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride);
+    static DenseConnection& Create(Layer& sourceLayer, Layer& sinkLayer)
+    {
+        return *(new DenseConnection(sourceLayer, sinkLayer));
+    }
+};
+
+// Sink neuron i reads the window of windowSize source neurons starting at start + i * windowStride
+class ConvolutionalConnection : public Connection
+{
+    int32_t m_start;
+    int32_t m_windowSize;
+    int32_t m_windowStride;
+    ConvolutionalConnection(Layer& sourceLayer, Layer& sinkLayer, int32_t start, int32_t windowSize, int32_t windowStride);
+public:
+    int32_t GetStart() { return m_start; }
+    int32_t GetWindowSize() { return m_windowSize; }
+    int32_t GetWindowStride() { return m_windowStride; }
+    virtual int32_t GetNumberOfSources(int32_t sinkID) { return IsConnectedSink(sinkID) ? m_windowSize : 0; }
+    virtual int32_t GetSourceID(int32_t sinkID, int32_t index) { return m_start + sinkID * m_windowStride + index; }
+    virtual int32_t GetNumberOfSinks(int32_t sourceID);
+    virtual int32_t GetSinkID(int32_t sourceID, int32_t index);
+    virtual bool GetAffineSources(int32_t sinkID, int32_t& first, int32_t& stride);
+    static ConvolutionalConnection& Create(Layer& sourceLayer, Layer& sinkLayer, int32_t start, int32_t windowSize, int32_t windowStride = 1)
+    {
+        return *(new ConvolutionalConnection(sourceLayer, sinkLayer, start, windowSize, windowStride));
+    }
+};
+
+// Arbitrary connections given as the list of source neurons of every sink neuron
+class SparseConnection : public Connection
+{
+    std::vector<std::vector<int32_t> > m_sources;
+    std::vector<std::vector<int32_t> > m_sinks;
+    SparseConnection(Layer& sourceLayer, Layer& sinkLayer, std::map<int32_t, std::vector<int32_t>>& connections);
+public:
+    virtual int32_t GetNumberOfSources(int32_t sinkID) { return IsConnectedSink(sinkID) ? static_cast<int32_t>(m_sources[sinkID].size()) : 0; }
+    virtual int32_t GetSourceID(int32_t sinkID, int32_t index) { return m_sources[sinkID][index]; }
+    virtual int32_t GetNumberOfSinks(int32_t sourceID) { return IsConnectedSource(sourceID) ? static_cast<int32_t>(m_sinks[sourceID].size()) : 0; }
+    virtual int32_t GetSinkID(int32_t sourceID, int32_t index) { return m_sinks[sourceID][index]; }
+    static SparseConnection& Create(Layer& sourceLayer, Layer& sinkLayer, std::map<int32_t, std::vector<int32_t>>& connections)
+    {
+        return *(new SparseConnection(sourceLayer, sinkLayer, connections));
+    }
+};
+
+#endif // _CONNECTION_H_
@@ -0,0 +1,761 @@
+#include <algorithm>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "ir.h"
+#include "cppemitter.h"
+#include "kernels.h"
+#include "threadpool.h"
+
+// Number of tasks each parallel stage of the parallel entry point is split into
+static const int64_t ParallelTasksPerStage = 256;
+
+static std::string FormatReal(double val)
+{
+    std::stringstream strStream;
+    strStream.precision(17);
+    strStream << val;
+    std::string str = strStream.str();
+    if (str.find_first_of(".en") == std::string::npos)
+        str += ".0";
+    return str;
+}
+
+static std::string GetCTypeName(ValueType& type)
+{
+    if (VectorType* vecType = type.AsVectorType())
+        return GetCTypeName(vecType->GetElementType());
+    if (type.IsInteger())
+        return "int64_t";
+    if (type.IsBoolean())
+        return "bool";
+    if (type.IsReal())
+        return "double";
+    throw std::runtime_error("EmitCPlusPlus : Unsupported type");
+}
+
+// The scalars of value sets stored at a lower precision use the storage types of kernels.h
+static std::string GetStorageTypeName(ValueSet& valueSet)
+{
+    static const char* names[] = { nullptr, "float", "KernelFloat16", "KernelBFloat16" };
+    if (valueSet.IsQuantized())
+        return "int8_t";
+    if (valueSet.GetPrecision() != RealType::Float64)
+        return names[valueSet.GetPrecision()];
+    return GetCTypeName(valueSet.GetElementType());
+}
+
+static int32_t GetVectorLength(ValueType& type)
+{
+    VectorType* vecType = type.AsVectorType();
+    if (vecType == nullptr)
+        return -1;
+    if (vecType->GetLength() < 0)
+        throw std::runtime_error("EmitCPlusPlus : Vector variables must have a known length");
+    return vecType->GetLength();
+}
+
+// Names and layout decisions shared by the statement and value emitters
+struct CppEmitterContext
+{
+    std::map<ValueSet*, std::string> valueSetNames;
+    std::map<Variable*, int64_t> workspaceOffsets;
+    int64_t workspaceSize;
+    // Name of the batch size parameter, empty when the batch size is fixed
+    std::string batchSizeName;
+};
+
+// Quantized sets are followed by arrays of their scales, zero points and sums named
+// name_scales, name_zeroPoints and name_sums
+static void EmitQuantizedValueSet(ValueSet& valueSet, const std::string& name, std::ostream& ostr)
+{
+    int32_t elemLength = valueSet.GetElementLength();
+    int32_t numValues = valueSet.GetNumberOfValues();
+    int64_t size = static_cast<int64_t>(elemLength) * numValues;
+    int32_t rowLength = valueSet.GetLayout() == ValueSet::RowMajor ? elemLength : numValues;
+    const int8_t* data = static_cast<const int8_t*>(valueSet.GetData());
+    ostr << "alignas(" << ValueSet::Alignment << ") static const int8_t " << name << "[] = {";
+    for (int64_t i=0 ; i<size ; ++i)
+    {
+        if (i % rowLength == 0)
+            ostr << "\n    ";
+        ostr << static_cast<int32_t>(data[i]) << ", ";
+    }
+    ostr << "\n};\n";
+    ostr << "static const double " << name << "_scales[] = {";
+    for (int32_t id=0 ; id<numValues ; ++id)
+        ostr << (id % 8 == 0 ? "\n    " : "") << FormatReal(valueSet.GetScales()[id]) << ", ";
+    ostr << "\n};\n";
+    ostr << "static const int32_t " << name << "_zeroPoints[] = {";
+    for (int32_t id=0 ; id<numValues ; ++id)
+        ostr << (id % 16 == 0 ? "\n    " : "") << valueSet.GetZeroPoints()[id] << ", ";
+    ostr << "\n};\n";
+    ostr << "static const int32_t " << name << "_sums[] = {";
+    for (int32_t id=0 ; id<numValues ; ++id)
+        ostr << (id % 16 == 0 ? "\n    " : "") << valueSet.GetQuantizedSums()[id] << ", ";
+    ostr << "\n};\n\n";
+}
+
+// Value sets are emitted in their packed storage order
+static void EmitValueSet(ValueSet& valueSet, const std::string& name, std::ostream& ostr)
+{
+    if (valueSet.IsQuantized())
+        return EmitQuantizedValueSet(valueSet, name, ostr);
+    std::string typeName = GetStorageTypeName(valueSet);
+    int32_t elemLength = valueSet.GetElementLength();
+    int32_t numValues = valueSet.GetNumberOfValues();
+    int64_t size = static_cast<int64_t>(elemLength) * numValues;
+    bool rowMajor = valueSet.GetLayout() == ValueSet::RowMajor;
+    ostr << "alignas(" << ValueSet::Alignment << ") static const " << typeName << " " << name << "[] = {";
+    for (int64_t i=0 ; i<size ; ++i)
+    {
+        if (i % (rowMajor ? elemLength : numValues) == 0)
+            ostr << "\n    ";
+        double value = rowMajor ? valueSet.GetScalar(i / elemLength, i % elemLength) : valueSet.GetScalar(i % numValues, i / numValues);
+        if (typeName == "int64_t")
+            ostr << static_cast<int64_t>(value);
+        else if (typeName == "bool")
+            ostr << (value != 0.0 ? "true" : "false");
+        else if (typeName == "float")
+            ostr << FormatReal(value) << "f";
+        else if (typeName == "KernelFloat16")
+            ostr << "{" << KernelFloatToFloat16(static_cast<float>(value)) << "}";
+        else if (typeName == "KernelBFloat16")
+            ostr << "{" << KernelFloatToBFloat16(static_cast<float>(value)) << "}";
+        else
+            ostr << FormatReal(value);
+        ostr << ", ";
+    }
+    ostr << "\n};\n\n";
+}
+
+class CppValueEmitter : public IRValueVisitor
+{
+    CppEmitterContext& m_context;
+    std::ostream& m_ostr;
+
+    void EmitBinaryOp(BinaryOp& binOp, char op)
+    {
+        m_ostr << "(";
+        binOp.GetLHS().AcceptIRValueVisitor(*this);
+        m_ostr << " " << op << " ";
+        binOp.GetRHS().AcceptIRValueVisitor(*this);
+        m_ostr << ")";
+    }
+public:
+    CppValueEmitter(CppEmitterContext& context, std::ostream& ostr)
+        :m_context(context), m_ostr(ostr)
+    { }
+    virtual void Visit(IntegerConstant& intConst)
+    {
+        m_ostr << intConst.GetValue();
+    }
+    virtual void Visit(BooleanConstant& boolConst)
+    {
+        m_ostr << (boolConst.GetValue() ? "true" : "false");
+    }
+    virtual void Visit(RealConstant& realConst)
+    {
+        m_ostr << FormatReal(realConst.GetValue());
+    }
+    virtual void Visit(RealVectorConstant& realVecConst)
+    {
+        throw std::runtime_error("EmitCPlusPlus : Vector constants must be lowered into value sets");
+    }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        unaryPlus.GetOperand().AcceptIRValueVisitor(*this);
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        m_ostr << "(-";
+        unaryMinus.GetOperand().AcceptIRValueVisitor(*this);
+        m_ostr << ")";
+    }
+    virtual void Visit(BinaryAdd& binaryAdd)
+    {
+        EmitBinaryOp(binaryAdd, '+');
+    }
+    virtual void Visit(BinarySubtract& binarySubtract)
+    {
+        EmitBinaryOp(binarySubtract, '-');
+    }
+    virtual void Visit(BinaryMultiply& binaryMultiply)
+    {
+        EmitBinaryOp(binaryMultiply, '*');
+    }
+    virtual void Visit(BinaryDivide& binaryDivide)
+    {
+        EmitBinaryOp(binaryDivide, '/');
+    }
+    virtual void Visit(GetInputValue& getInput)
+    {
+        throw std::runtime_error("EmitCPlusPlus : GetInputValue must be lowered before code generation");
+    }
+    virtual void Visit(Reduction& reduction)
+    {
+        throw std::runtime_error("EmitCPlusPlus : Reduction must be lowered before code generation");
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        if (function.GetActivation() < 0 || !sKernelActivations[function.GetActivation()].elementwise)
+            throw std::runtime_error("EmitCPlusPlus : Unsupported activation function " + function.GetName());
+        m_ostr << "ApplyKernelActivation(";
+        function.GetOperand().AcceptIRValueVisitor(*this);
+        m_ostr << ", " << function.GetActivation() << ", " << function.GetAccuracy() << ")";
+    }
+    virtual void Visit(Variable& variable)
+    {
+        m_ostr << variable.GetName();
+    }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        m_ostr << indexedVal.GetVariable().GetName() << "[";
+        indexedVal.GetIndexer().AcceptIRValueVisitor(*this);
+        m_ostr << "]";
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        ValueSet& valueSet = getValue.GetValueSet();
+        if (valueSet.IsQuantized())
+            throw std::runtime_error("EmitCPlusPlus : Quantized value sets can only be read by dense layers");
+        bool wholeVector = GetVectorLength(valueSet.GetElementType()) >= 0 && getValue.GetScalarIndex() == nullptr;
+        // Whole vector elements evaluate to a pointer to the first scalar of the element,
+        // scalars of narrow value sets are converted to double
+        bool convert = !wholeVector && valueSet.GetPrecision() != RealType::Float64;
+        if (convert)
+            m_ostr << "KernelFromStorage<double>(";
+        if (wholeVector)
+            m_ostr << "(";
+        m_ostr << m_context.valueSetNames[&valueSet];
+        m_ostr << (wholeVector ? " + " : "[");
+        getValue.GetElementID().AcceptIRValueVisitor(*this);
+        if (valueSet.GetValueStride() != 1)
+            m_ostr << " * " << valueSet.GetValueStride();
+        if (getValue.GetScalarIndex() != nullptr)
+        {
+            m_ostr << " + ";
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+            if (valueSet.GetScalarStride() != 1)
+                m_ostr << " * " << valueSet.GetScalarStride();
+        }
+        m_ostr << (wholeVector ? ")" : "]");
+        if (convert)
+            m_ostr << ")";
+    }
+};
+
+class CppStatementEmitter : public IRStatementVisitor
+{
+    CppEmitterContext& m_context;
+    std::ostream& m_ostr;
+    int32_t m_indent;
+
+    void Indent()
+    {
+        for (int32_t i=0 ; i<m_indent ; ++i)
+            m_ostr << "    ";
+    }
+    void EmitValue(Value& value)
+    {
+        CppValueEmitter valueEmitter(m_context, m_ostr);
+        value.AcceptIRValueVisitor(valueEmitter);
+    }
+    std::string ValueToString(Value& value)
+    {
+        std::stringstream strStream;
+        CppValueEmitter valueEmitter(m_context, strStream);
+        value.AcceptIRValueVisitor(valueEmitter);
+        return strStream.str();
+    }
+public:
+    CppStatementEmitter(CppEmitterContext& context, std::ostream& ostr, int32_t indent)
+        :m_context(context), m_ostr(ostr), m_indent(indent)
+    { }
+    // Iterations [begin, end) of a loop
+    void EmitForLoop(ForLoop& forLoop, const std::string& begin, const std::string& end)
+    {
+        const std::string& indexName = forLoop.GetIndexVariable().GetName();
+        Indent();
+        m_ostr << "for (int64_t " << indexName << " = " << begin << "; " << indexName << " < " << end << "; ";
+        if (forLoop.GetStep() == 1)
+            m_ostr << "++" << indexName << ")\n";
+        else
+            m_ostr << indexName << " += " << forLoop.GetStep() << ")\n";
+        Indent();
+        m_ostr << "{\n";
+        m_indent += 1;
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+        m_indent -= 1;
+        Indent();
+        m_ostr << "}\n";
+    }
+    void EmitQuantizedDenseLayer(DenseLayer& denseLayer, const std::string& begin, const std::string& end)
+    {
+        Indent();
+        ValueSet& weights = denseLayer.GetWeights();
+        const std::string& name = m_context.valueSetNames[&weights];
+        std::string neuronOffset = begin.empty() ? "" : " + " + begin;
+        m_ostr << "QuantizedDenseLayerForward(" << name;
+        if (!begin.empty())
+            m_ostr << " + " << begin << " * " << weights.GetValueStride();
+        m_ostr << ", " << weights.GetValueStride() << ", " << weights.GetScalarStride() << ", ";
+        m_ostr << name << "_scales" << neuronOffset << ", " << name << "_zeroPoints" << neuronOffset << ", "
+               << name << "_sums" << neuronOffset << ", ";
+        m_ostr << (denseLayer.GetBiases() ? m_context.valueSetNames[denseLayer.GetBiases()] + neuronOffset
+                                          : "static_cast<const double*>(nullptr)") << ", ";
+        if (begin.empty())
+            m_ostr << denseLayer.GetNumberOfNeurons();
+        else
+            m_ostr << end << " - " << begin;
+        m_ostr << ", " << denseLayer.GetNumberOfInputs() << ", " << FormatReal(denseLayer.GetInputQuantization().scale) << ", "
+               << denseLayer.GetInputQuantization().zeroPoint << ", ";
+        m_ostr << denseLayer.GetInput().GetName() << " + " << denseLayer.GetInputOffset() << ", " << denseLayer.GetInputRowLength() << ", ";
+        m_ostr << denseLayer.GetOutput().GetName() << " + " << denseLayer.GetOutputOffset() << neuronOffset << ", "
+               << denseLayer.GetOutputRowLength() << ", ";
+        EmitValue(denseLayer.GetBatchSize());
+        m_ostr << ", " << denseLayer.GetActivation() << ", " << denseLayer.GetAccuracy() << ");\n";
+    }
+    // Neurons [begin, end) of a dense layer. begin is empty for the whole layer.
+    void EmitDenseLayer(DenseLayer& denseLayer, const std::string& begin, const std::string& end)
+    {
+        ValueSet& weights = denseLayer.GetWeights();
+        if (weights.IsQuantized())
+            return EmitQuantizedDenseLayer(denseLayer, begin, end);
+        Indent();
+        std::string neuronOffset = begin.empty() ? "" : " + " + begin;
+        m_ostr << "DenseLayerForward<" << (denseLayer.GetAccumulatePrecision() == RealType::Float32 ? "float" : "double") << ", "
+               << GetStorageTypeName(weights) << ">(" << m_context.valueSetNames[&weights];
+        if (!begin.empty())
+            m_ostr << " + " << begin << " * " << weights.GetValueStride();
+        m_ostr << ", " << weights.GetValueStride() << ", " << weights.GetScalarStride() << ", ";
+        m_ostr << (denseLayer.GetBiases() ? m_context.valueSetNames[denseLayer.GetBiases()] + neuronOffset : "nullptr") << ", ";
+        if (begin.empty())
+            m_ostr << denseLayer.GetNumberOfNeurons();
+        else
+            m_ostr << end << " - " << begin;
+        m_ostr << ", " << denseLayer.GetNumberOfInputs() << ", ";
+        m_ostr << denseLayer.GetInput().GetName() << " + " << denseLayer.GetInputOffset() << ", " << denseLayer.GetInputRowLength() << ", ";
+        m_ostr << denseLayer.GetOutput().GetName() << " + " << denseLayer.GetOutputOffset() << neuronOffset << ", "
+               << denseLayer.GetOutputRowLength() << ", ";
+        EmitValue(denseLayer.GetBatchSize());
+        m_ostr << ", " << denseLayer.GetActivation() << ", " << denseLayer.GetAccuracy() << ");\n";
+    }
+    virtual void Visit(Assignment& assignment)
+    {
+        Indent();
+        int32_t vectorLength = GetVectorLength(assignment.GetLHS().GetType());
+        GetValue* getValue = dynamic_cast<GetValue*>(&assignment.GetRHS());
+        if (vectorLength >= 0 && getValue != nullptr &&
+            (getValue->GetValueSet().GetScalarStride() != 1 || getValue->GetValueSet().GetPrecision() != RealType::Float64))
+        {
+            // Gather a vector element out of a transposed or narrow value set
+            m_ostr << "for (int64_t __i = 0; __i < " << vectorLength << "; ++__i) ";
+            EmitValue(assignment.GetLHS());
+            m_ostr << "[__i] = KernelFromStorage<double>(";
+            EmitValue(*getValue);
+            m_ostr << "[__i * " << getValue->GetValueSet().GetScalarStride() << "]);\n";
+            return;
+        }
+        if (vectorLength >= 0)
+        {
+            // Whole vector assignments only come from value set elements
+            m_ostr << "memcpy(";
+            EmitValue(assignment.GetLHS());
+            m_ostr << ", ";
+            EmitValue(assignment.GetRHS());
+            m_ostr << ", " << vectorLength << " * sizeof(" << GetCTypeName(assignment.GetLHS().GetType()) << "));\n";
+            return;
+        }
+        EmitValue(assignment.GetLHS());
+        m_ostr << " = ";
+        EmitValue(assignment.GetRHS());
+        m_ostr << ";\n";
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        EmitForLoop(forLoop, ValueToString(forLoop.GetStart()), ValueToString(forLoop.GetEnd()));
+    }
+    virtual void Visit(VariableDefinition& varDefinition)
+    {
+        Variable& var = varDefinition.GetVariable();
+        std::string typeName = GetCTypeName(var.GetType());
+        int32_t vectorLength = GetVectorLength(var.GetType());
+        Indent();
+        std::map<Variable*, int64_t>::iterator offsetIter = m_context.workspaceOffsets.find(&var);
+        if (offsetIter != m_context.workspaceOffsets.end() && var.IsBatched())
+            m_ostr << "double* " << var.GetName() << " = __workspace + " << offsetIter->second << " * " << m_context.batchSizeName << ";\n";
+        else if (offsetIter != m_context.workspaceOffsets.end())
+            m_ostr << "double* " << var.GetName() << " = __workspace + " << offsetIter->second << ";\n";
+        else if (vectorLength >= 0)
+            m_ostr << typeName << " " << var.GetName() << "[" << vectorLength << "];\n";
+        else
+            m_ostr << typeName << " " << var.GetName() << ";\n";
+    }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        EmitDenseLayer(denseLayer, "", "");
+    }
+    // Pointer to the first element of a vector operand followed by its stride
+    void EmitVectorOperand(VectorOperand& operand)
+    {
+        if (ValueSet* valueSet = operand.GetValueSet())
+        {
+            if (valueSet->GetPrecision() != RealType::Float64 || valueSet->IsQuantized())
+                throw std::runtime_error("EmitCPlusPlus : Vector kernels can only read value sets of doubles");
+            m_ostr << "(" << m_context.valueSetNames[valueSet] << " + ";
+            EmitValue(*operand.GetElementID());
+            m_ostr << " * " << valueSet->GetValueStride() << "), " << valueSet->GetScalarStride();
+            return;
+        }
+        Variable& var = *operand.GetVariable();
+        if (GetVectorLength(var.GetType()) < 0)
+            m_ostr << "&" << var.GetName();
+        else
+        {
+            m_ostr << "(" << var.GetName() << " + ";
+            EmitValue(*operand.GetOffset());
+            m_ostr << ")";
+        }
+        m_ostr << ", " << operand.GetStride();
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        Indent();
+        m_ostr << "VectorOperationForward(" << vectorOperation.GetOperation() << ", ";
+        EmitVectorOperand(vectorOperation.GetLHS());
+        m_ostr << ", ";
+        EmitVectorOperand(vectorOperation.GetRHS());
+        m_ostr << ", " << vectorOperation.GetResult().GetName() << ", " << vectorOperation.GetLength() << ");\n";
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        Indent();
+        if (vectorReduction.GetFactor() != nullptr)
+        {
+            m_ostr << vectorReduction.GetResult().GetName() << " = VectorDotProductForward(";
+            EmitVectorOperand(vectorReduction.GetOperand());
+            m_ostr << ", ";
+            EmitVectorOperand(*vectorReduction.GetFactor());
+            m_ostr << ", " << vectorReduction.GetLength() << ");\n";
+            return;
+        }
+        m_ostr << vectorReduction.GetResult().GetName() << " = VectorReduceForward(" << vectorReduction.GetReductionType() << ", ";
+        EmitVectorOperand(vectorReduction.GetOperand());
+        m_ostr << ", " << vectorReduction.GetLength() << ");\n";
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        Indent();
+        m_ostr << "LayerActivationForward(" << vectorActivation.GetVariable().GetName() << " + " << vectorActivation.GetOffset() << ", "
+               << vectorActivation.GetLength() << ", " << vectorActivation.GetRowLength() << ", ";
+        EmitValue(vectorActivation.GetBatchSize());
+        m_ostr << ", " << vectorActivation.GetActivation() << ", " << vectorActivation.GetAccuracy() << ");\n";
+    }
+};
+
+static void EmitWorkspaceSetup(CppEmitterContext& context, std::ostream& ostr)
+{
+    if (context.workspaceSize > 0 && !context.batchSizeName.empty())
+    {
+        ostr << "    if (__workspaceStorage.size() < (size_t)(" << context.batchSizeName << " * " << context.workspaceSize << "))\n";
+        ostr << "        __workspaceStorage.resize(" << context.batchSizeName << " * " << context.workspaceSize << ");\n";
+        ostr << "    double* __workspace = __workspaceStorage.data();\n";
+    }
+}
+
+// Iterations of a statement of a parallel stage that can be split across tasks. Returns false
+// when the statement has to run as a single task.
+static bool GetParallelIterations(IRStatement& stm, int64_t& begin, int64_t& count, int64_t& grain)
+{
+    if (DenseLayer* denseLayer = dynamic_cast<DenseLayer*>(&stm))
+    {
+        begin = 0;
+        count = denseLayer->GetNumberOfNeurons();
+        grain = DenseKernelTileNeurons;
+        return true;
+    }
+    ForLoop* forLoop = dynamic_cast<ForLoop*>(&stm);
+    IntegerConstant* start = forLoop ? dynamic_cast<IntegerConstant*>(&forLoop->GetStart()) : nullptr;
+    IntegerConstant* end = forLoop ? dynamic_cast<IntegerConstant*>(&forLoop->GetEnd()) : nullptr;
+    if (start == nullptr || end == nullptr)
+        return false;
+    begin = start->GetValue();
+    count = std::max<int64_t>(end->GetValue() - start->GetValue(), 0);
+    grain = forLoop->GetStep();
+    return true;
+}
+
+// The top level variables are defined in every task function and in the entry point, which
+// only use some of them
+static void EmitVoidCasts(const std::vector<VariableDefinition*>& definitions, std::ostream& ostr)
+{
+    for (size_t j=0 ; j<definitions.size() ; ++j)
+        ostr << "    (void)" << definitions[j]->GetVariable().GetName() << ";\n";
+}
+
+// The parallel entry point runs the stages of the function one after the other. Each parallel
+// stage becomes a task function and a table of (statement, begin, end) chunks which the
+// caller's parallel-for runs to completion before the next stage starts. Tasks find the
+// arguments and the calling thread's workspace through a context structure.
+static void EmitParallelEntryPoint(Function& function, CppEmitterContext& context, std::ostream& ostr, const std::string& entryPoint)
+{
+    Variable& inputVar = function.GetInputVariable();
+    Variable& outputVar = function.GetOutputVariable();
+    bool runtimeBatchSize = !context.batchSizeName.empty();
+    std::vector<VariableDefinition*> definitions;
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter);
+        if (definition == nullptr)
+            continue;
+        if (context.workspaceOffsets.find(&definition->GetVariable()) == context.workspaceOffsets.end())
+            throw std::runtime_error("EmitCPlusPlus : Parallel code needs all top level variables in the workspace");
+        definitions.push_back(definition);
+    }
+
+    ostr << "\ntypedef void (*__mldsl_task)(void* context, int64_t task);\n";
+    ostr << "typedef void (*__mldsl_parallel_for)(void* scheduler, int64_t numTasks, __mldsl_task task, void* context);\n\n";
+    ostr << "struct __mldsl_context\n{\n    const double* input;\n    double* output;\n    int64_t batchSize;\n    double* workspace;\n};\n\n";
+
+    std::vector<ParallelStage> stages = GetParallelStages(function);
+    std::vector<int64_t> stageTasks(stages.size(), 0);
+    for (size_t i=0 ; i<stages.size() ; ++i)
+    {
+        if (!stages[i].parallel)
+            continue;
+        std::vector<IRStatement*>& stageStms = stages[i].statements;
+        std::vector<int64_t> begins(stageStms.size()), counts(stageStms.size()), grains(stageStms.size());
+        std::vector<bool> splittable(stageStms.size());
+        int64_t totalIterations = 0;
+        for (size_t j=0 ; j<stageStms.size() ; ++j)
+        {
+            splittable[j] = GetParallelIterations(*stageStms[j], begins[j], counts[j], grains[j]);
+            if (splittable[j])
+                totalIterations += counts[j];
+        }
+
+        std::stringstream taskTable;
+        for (size_t j=0 ; j<stageStms.size() ; ++j)
+        {
+            if (splittable[j] && counts[j] == 0)
+                continue;
+            int64_t numChunks = 1;
+            if (splittable[j])
+                numChunks = ThreadPool::GetNumberOfChunks(counts[j], grains[j],
+                                                          (ParallelTasksPerStage * counts[j] + totalIterations - 1) / totalIterations);
+            for (int64_t chunk=0 ; chunk<numChunks ; ++chunk)
+            {
+                int64_t chunkBegin = splittable[j] ? begins[j] + ThreadPool::GetChunkStart(counts[j], grains[j], numChunks, chunk) : 0;
+                int64_t chunkEnd = splittable[j] ? begins[j] + ThreadPool::GetChunkStart(counts[j], grains[j], numChunks, chunk + 1) : 0;
+                taskTable << (stageTasks[i] % 8 == 0 ? "\n    " : " ") << "{" << j << ", " << chunkBegin << ", " << chunkEnd << "},";
+                ++stageTasks[i];
+            }
+        }
+        if (stageTasks[i] == 0)
+            continue;
+        ostr << "static const int64_t __stage" << i << "Tasks[][3] = {" << taskTable.str() << "\n};\n\n";
+
+        ostr << "static void __stage" << i << "(void* __contextPointer, int64_t __task)\n{\n";
+        ostr << "    const __mldsl_context& __context = *static_cast<const __mldsl_context*>(__contextPointer);\n";
+        ostr << "    const double* " << inputVar.GetName() << " = __context.input;\n";
+        ostr << "    double* " << outputVar.GetName() << " = __context.output;\n";
+        if (runtimeBatchSize)
+            ostr << "    int64_t " << context.batchSizeName << " = __context.batchSize;\n";
+        if (context.workspaceSize > 0)
+            ostr << "    double* __workspace = __context.workspace;\n";
+        CppStatementEmitter definitionEmitter(context, ostr, 1);
+        for (size_t j=0 ; j<definitions.size() ; ++j)
+            definitions[j]->AcceptVisitor(definitionEmitter);
+        ostr << "    (void)" << inputVar.GetName() << ";\n    (void)" << outputVar.GetName() << ";\n";
+        if (runtimeBatchSize)
+            ostr << "    (void)" << context.batchSizeName << ";\n";
+        EmitVoidCasts(definitions, ostr);
+        ostr << "    int64_t __begin = __stage" << i << "Tasks[__task][1];\n";
+        ostr << "    int64_t __end = __stage" << i << "Tasks[__task][2];\n";
+        ostr << "    switch (__stage" << i << "Tasks[__task][0])\n    {\n";
+        CppStatementEmitter statementEmitter(context, ostr, 2);
+        for (size_t j=0 ; j<stageStms.size() ; ++j)
+        {
+            ostr << "    case " << j << ":\n";
+            if (!splittable[j])
+                stageStms[j]->AcceptVisitor(statementEmitter);
+            else if (DenseLayer* denseLayer = dynamic_cast<DenseLayer*>(stageStms[j]))
+                statementEmitter.EmitDenseLayer(*denseLayer, "__begin", "__end");
+            else
+                statementEmitter.EmitForLoop(*dynamic_cast<ForLoop*>(stageStms[j]), "__begin", "__end");
+            ostr << "        break;\n";
+        }
+        ostr << "    }\n}\n\n";
+    }
+
+    ostr << "extern \"C\" void " << entryPoint << "_parallel(const double* " << inputVar.GetName() << ", double* " << outputVar.GetName();
+    if (runtimeBatchSize)
+        ostr << ", int64_t " << context.batchSizeName;
+    ostr << ", __mldsl_parallel_for __parallelFor, void* __scheduler)\n{\n";
+    EmitWorkspaceSetup(context, ostr);
+    CppStatementEmitter statementEmitter(context, ostr, 1);
+    for (size_t j=0 ; j<definitions.size() ; ++j)
+        definitions[j]->AcceptVisitor(statementEmitter);
+    EmitVoidCasts(definitions, ostr);
+    ostr << "    __mldsl_context __context = { " << inputVar.GetName() << ", " << outputVar.GetName() << ", "
+         << (runtimeBatchSize ? context.batchSizeName : "1") << ", " << (context.workspaceSize > 0 ? "__workspace" : "nullptr") << " };\n";
+    for (size_t i=0 ; i<stages.size() ; ++i)
+    {
+        if (!stages[i].parallel)
+            stages[i].statements.front()->AcceptVisitor(statementEmitter);
+        else if (stageTasks[i] > 0)
+            ostr << "    __parallelFor(__scheduler, " << stageTasks[i] << ", __stage" << i << ", &__context);\n";
+    }
+    ostr << "}\n";
+}
+
+void EmitCPlusPlus(Function& function, std::ostream& ostr, const std::string& entryPoint, bool parallel)
+{
+    CppEmitterContext context;
+    Variable* batchSizeVar = function.GetBatchSizeVariable();
+    if (batchSizeVar != nullptr)
+        context.batchSizeName = batchSizeVar->GetName();
+
+    // Layer outputs are defined at the top level of the function. They live in one workspace
+    // that is allocated per thread so the generated code stays reentrant, and share memory
+    // when they are not live at the same time. With a runtime batch size the offsets are per
+    // row and the workspace grows with the largest batch seen.
+    WorkspacePlan plan = PlanWorkspace(function);
+    context.workspaceOffsets = plan.offsets;
+    context.workspaceSize = plan.size;
+
+    ostr << "// Generated by ml-dsl. Do not edit.\n";
+    ostr << "#include <cmath>\n#include <cstdint>\n#include <cstring>\n#include \"kernels.h\"\n";
+    if (batchSizeVar != nullptr)
+        ostr << "#include <vector>\n";
+    ostr << "\n";
+
+    const std::list<ValueSet*>& valueSets = function.GetValueSets();
+    int32_t valueSetNum = 0;
+    for (std::list<ValueSet*>::const_iterator iter=valueSets.begin() ; iter!=valueSets.end() ; ++iter)
+    {
+        std::string name = "__valueSet" + std::to_string(valueSetNum++);
+        context.valueSetNames[*iter] = name;
+        EmitValueSet(*(*iter), name, ostr);
+    }
+
+    if (context.workspaceSize > 0 && batchSizeVar != nullptr)
+        ostr << "static thread_local std::vector<double> __workspaceStorage;\n\n";
+    else if (context.workspaceSize > 0)
+        ostr << "static thread_local double __workspace[" << context.workspaceSize << "];\n\n";
+
+    Variable& inputVar = function.GetInputVariable();
+    Variable& outputVar = function.GetOutputVariable();
+    ostr << "extern \"C\" int32_t " << entryPoint << "_input_length() { return " << GetVectorLength(inputVar.GetType()) << "; }\n";
+    ostr << "extern \"C\" int32_t " << entryPoint << "_output_length() { return " << GetVectorLength(outputVar.GetType()) << "; }\n";
+    ostr << "extern \"C\" int32_t " << entryPoint << "_batch_size() { return " << (batchSizeVar ? 0 : function.GetBatchSize()) << "; }\n\n";
+    ostr << "extern \"C\" void " << entryPoint << "(const double* " << inputVar.GetName() << ", double* " << outputVar.GetName();
+    if (batchSizeVar != nullptr)
+        ostr << ", int64_t " << context.batchSizeName;
+    ostr << ")\n{\n";
+    EmitWorkspaceSetup(context, ostr);
+    CppStatementEmitter statementEmitter(context, ostr, 1);
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+        (*iter)->AcceptVisitor(statementEmitter);
+    ostr << "}\n";
+    if (parallel)
+        EmitParallelEntryPoint(function, context, ostr, entryPoint);
+}
+
+// Directory holding kernels.h, which generated code includes. Defaults to the directory this
+// file was compiled from.
+static std::string GetKernelIncludeDirectory()
+{
+    const char* includeDir = getenv("MLDSL_INCLUDE_DIR");
+    if (includeDir != nullptr)
+        return includeDir;
+    std::string thisFile = __FILE__;
+    size_t slash = thisFile.find_last_of('/');
+    return slash == std::string::npos ? "." : thisFile.substr(0, slash);
+}
+
+// Single quotes keep spaces and shell metacharacters in a path from being interpreted
+static std::string QuoteShellArgument(const std::string& argument)
+{
+    std::string quoted = "'";
+    for (size_t i=0 ; i<argument.size() ; ++i)
+        quoted += argument[i] == '\'' ? std::string("'\\''") : std::string(1, argument[i]);
+    return quoted + "'";
+}
+
+void CompileNativeModel(const std::string& sourcePath, const std::string& sharedObjectPath)
+{
+    // $CXX is not quoted so that it can hold a launcher or extra flags
+    const char* compiler = getenv("CXX");
+    std::string command = std::string(compiler ? compiler : "g++") + " -std=c++11 -O3 -march=native -shared -fPIC -I" +
+                          QuoteShellArgument(GetKernelIncludeDirectory()) + " " + QuoteShellArgument(sourcePath) +
+                          " -o " + QuoteShellArgument(sharedObjectPath);
+    if (system(command.c_str()) != 0)
+        throw std::runtime_error("CompileNativeModel : Command failed : " + command);
+}
+
+NativeModel::NativeModel(const std::string& sharedObjectPath, const std::string& entryPoint)
+{
+    m_handle = dlopen(sharedObjectPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (m_handle == nullptr)
+        throw std::runtime_error("NativeModel : " + std::string(dlerror()));
+    void* entry = dlsym(m_handle, entryPoint.c_str());
+    LengthQuery inputLength = reinterpret_cast<LengthQuery>(dlsym(m_handle, (entryPoint + "_input_length").c_str()));
+    LengthQuery outputLength = reinterpret_cast<LengthQuery>(dlsym(m_handle, (entryPoint + "_output_length").c_str()));
+    LengthQuery batchSize = reinterpret_cast<LengthQuery>(dlsym(m_handle, (entryPoint + "_batch_size").c_str()));
+    if (entry == nullptr || inputLength == nullptr || outputLength == nullptr || batchSize == nullptr)
+    {
+        dlclose(m_handle);
+        throw std::runtime_error("NativeModel : " + sharedObjectPath + " does not export " + entryPoint);
+    }
+    m_inputLength = inputLength();
+    m_outputLength = outputLength();
+    m_batchSize = batchSize();
+    m_entryPoint = m_batchSize == 0 ? nullptr : reinterpret_cast<EntryPoint>(entry);
+    m_batchedEntryPoint = m_batchSize == 0 ? reinterpret_cast<BatchedEntryPoint>(entry) : nullptr;
+    m_parallelEntryPoint = dlsym(m_handle, (entryPoint + "_parallel").c_str());
+    m_threadPool = nullptr;
+}
+
+// Runs the tasks of one stage of the generated parallel entry point on a ThreadPool
+static void RunOnThreadPool(void* scheduler, int64_t numTasks, void (*task)(void*, int64_t), void* context)
+{
+    static_cast<ThreadPool*>(scheduler)->RunTasks(numTasks, [task, context](int64_t taskIndex, int32_t threadIndex)
+    {
+        task(context, taskIndex);
+    });
+}
+
+void NativeModel::SetThreadPool(ThreadPool* pool)
+{
+    if (pool != nullptr && m_parallelEntryPoint == nullptr)
+        throw std::runtime_error("NativeModel : Model was compiled without parallel code");
+    m_threadPool = pool;
+}
+
+void NativeModel::Run(const double* input, double* output, int32_t batchSize)
+{
+    if (m_threadPool != nullptr && m_batchSize == 0)
+        reinterpret_cast<BatchedParallelEntryPoint>(m_parallelEntryPoint)(input, output, batchSize, RunOnThreadPool, m_threadPool);
+    else if (m_threadPool != nullptr && batchSize == 1)
+        reinterpret_cast<ParallelEntryPoint>(m_parallelEntryPoint)(input, output, RunOnThreadPool, m_threadPool);
+    else if (m_batchedEntryPoint != nullptr)
+        m_batchedEntryPoint(input, output, batchSize);
+    else if (batchSize == 1)
+        m_entryPoint(input, output);
+    else
+        throw std::runtime_error("NativeModel : Model was compiled without a runtime batch size");
+}
+
+NativeModel::~NativeModel()
+{
+    dlclose(m_handle);
+}
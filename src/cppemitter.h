@@ -0,0 +1,73 @@
+#ifndef _CPPEMITTER_H_
+#define _CPPEMITTER_H_
+
+// Native backend. A lowered Function is emitted as a C++ translation unit
+// (plain loops over double buffers, weights baked in as static arrays, dense
+// ensembles as calls into kernels.h) which is then compiled ahead of time into
+// a shared object and loaded with dlopen.
+//
+// The generated translation unit exports
+//     extern "C" void <entryPoint>(const double* x, double* y);
+//     extern "C" int32_t <entryPoint>_input_length();
+//     extern "C" int32_t <entryPoint>_output_length();
+//     extern "C" int32_t <entryPoint>_batch_size();
+// When the function was lowered with a runtime batch size, _batch_size()
+// returns 0, the lengths are per input vector and the entry point takes the
+// batch size as a third int64_t argument.
+//
+// With parallel code generation it also exports
+//     extern "C" void <entryPoint>_parallel(const double* x, double* y, [int64_t batchSize,]
+//                                           ParallelFor parallelFor, void* scheduler);
+// which calls parallelFor(scheduler, numTasks, task, context) once per parallel
+// stage (see GetParallelStages). parallelFor must call task(context, i) for
+// every i in [0, numTasks), from any threads, and return when all have finished.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+class Function;
+class ThreadPool;
+
+void EmitCPlusPlus(Function& function, std::ostream& ostr, const std::string& entryPoint = "mldsl_forward", bool parallel = false);
+
+// Compile generated source into a shared object with the host compiler ($CXX or g++).
+// kernels.h is looked up in $MLDSL_INCLUDE_DIR, or next to this library's sources.
+void CompileNativeModel(const std::string& sourcePath, const std::string& sharedObjectPath);
+
+class NativeModel
+{
+    typedef void (*EntryPoint)(const double*, double*);
+    typedef void (*BatchedEntryPoint)(const double*, double*, int64_t);
+    typedef int32_t (*LengthQuery)();
+    typedef void (*ParallelTask)(void*, int64_t);
+    typedef void (*ParallelFor)(void*, int64_t, ParallelTask, void*);
+    typedef void (*ParallelEntryPoint)(const double*, double*, ParallelFor, void*);
+    typedef void (*BatchedParallelEntryPoint)(const double*, double*, int64_t, ParallelFor, void*);
+
+    void* m_handle;
+    EntryPoint m_entryPoint;
+    BatchedEntryPoint m_batchedEntryPoint;
+    void* m_parallelEntryPoint; // nullptr when the model was generated without parallel code
+    ThreadPool* m_threadPool;
+    int32_t m_inputLength;
+    int32_t m_outputLength;
+    int32_t m_batchSize;
+
+    // The model owns its library handle, which is closed once
+    NativeModel(const NativeModel&);
+    NativeModel& operator=(const NativeModel&);
+public:
+    NativeModel(const std::string& sharedObjectPath, const std::string& entryPoint = "mldsl_forward");
+    ~NativeModel();
+    int32_t GetInputLength() { return m_inputLength; }
+    int32_t GetOutputLength() { return m_outputLength; }
+    // 0 when the batch size is given to Run
+    int32_t GetBatchSize() { return m_batchSize; }
+    void Run(const double* input, double* output, int32_t batchSize = 1);
+    // Run the parallel entry point on the threads of pool from now on, or the sequential one
+    // when pool is nullptr. The pool must outlive its use by the model.
+    void SetThreadPool(ThreadPool* pool);
+};
+
+#endif // _CPPEMITTER_H_
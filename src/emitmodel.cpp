@@ -0,0 +1,69 @@
+// Ahead-of-time driver for the native backend. Builds a fully connected
+// sigmoid network with random weights and writes the generated C++ for it.
+//
+// Usage: mldsl-emit <output.cpp> [layer sizes...]
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include "mldslapi.h"
+#include "cppemitter.h"
+
+static void AddRandomWeightedNeurons(Layer& layer, int32_t numNeurons, int32_t numInputs, bool outputLayer)
+{
+    for (int32_t i=0 ; i<numNeurons ; ++i)
+    {
+        int32_t id = 0;
+        Neuron& neuron = outputLayer ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+        std::vector<double> weights(numInputs);
+        for (int32_t j=0 ; j<numInputs ; ++j)
+            weights[j] = (double)rand()/RAND_MAX - 0.5;
+        Value& x = GetInputValue::Create(neuron);
+        Value& w = Constant(weights);
+        Value& b = Constant((double)rand()/RAND_MAX - 0.5);
+        neuron.SetForwardPropagationValue(ActivationFunction::Create(Reduction::Create(w*x, Reduction::Sum) + b, "sigmoid"));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <output.cpp> [layer sizes...]" << std::endl;
+        return 1;
+    }
+    std::vector<int32_t> layerSizes;
+    for (int i=2 ; i<argc ; ++i)
+        layerSizes.push_back(atoi(argv[i]));
+    if (layerSizes.size() < 2)
+        layerSizes = { 256, 512, 512, 10 };
+
+    Network& net = Network::Create();
+    for (size_t l=0 ; l<layerSizes.size() ; ++l)
+    {
+        int32_t layerID;
+        Layer& layer = net.AddLayer(layerID);
+        if (l == 0)
+        {
+            for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+            {
+                int32_t id = 0;
+                InputNeuron& neuron = layer.AddInputNeuron(id);
+                neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+            }
+            continue;
+        }
+        AddRandomWeightedNeurons(layer, layerSizes[l], layerSizes[l-1], l == layerSizes.size() - 1);
+        net.FullyConnectLayers(layerID - 1, layerID);
+    }
+    if (!net.CheckTypes())
+        return 1;
+
+    CollectMergeableNeuronsIntoEnsembles(net);
+    Function& func = ConstructIRForNetwork(net);
+
+    std::ofstream out(argv[1]);
+    EmitCPlusPlus(func, out);
+    Network::Destroy(net);
+    return 0;
+}
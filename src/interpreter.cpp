@@ -0,0 +1,929 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include "ir.h"
+#include "interpreter.h"
+#include "kernels.h"
+#include "threadpool.h"
+
+struct ExecutionFrame
+{
+    double** slotBases;
+};
+
+class ExecutableValue
+{
+public:
+    virtual double Evaluate(ExecutionFrame& frame) = 0;
+    virtual ~ExecutableValue() { }
+};
+
+class ExecutableStatement
+{
+public:
+    virtual void Execute(ExecutionFrame& frame) = 0;
+    virtual ~ExecutableStatement() { }
+    // Statements of a parallel stage execute their iterations [begin, end) on
+    // different threads in chunks that start at multiples of the grain size
+    virtual void GetIterationRange(ExecutionFrame& frame, int64_t& begin, int64_t& end) { begin = 0; end = 1; }
+    virtual int64_t GetGrainSize() { return 1; }
+    virtual void ExecuteRange(ExecutionFrame& frame, int64_t begin, int64_t end) { Execute(frame); }
+};
+
+class ConstantNode : public ExecutableValue
+{
+    double m_value;
+public:
+    ConstantNode(double value)
+        :m_value(value)
+    { }
+    double Evaluate(ExecutionFrame& frame) { return m_value; }
+};
+
+class VariableNode : public ExecutableValue
+{
+    int32_t m_slot;
+public:
+    VariableNode(int32_t slot)
+        :m_slot(slot)
+    { }
+    double Evaluate(ExecutionFrame& frame) { return frame.slotBases[m_slot][0]; }
+};
+
+class IndexedValueNode : public ExecutableValue
+{
+    int32_t m_slot;
+    ExecutableValue* m_index;
+public:
+    IndexedValueNode(int32_t slot, ExecutableValue* index)
+        :m_slot(slot), m_index(index)
+    { }
+    ~IndexedValueNode() { delete m_index; }
+    double Evaluate(ExecutionFrame& frame)
+    {
+        int64_t index = static_cast<int64_t>(m_index->Evaluate(frame));
+        return frame.slotBases[m_slot][index];
+    }
+};
+
+// StorageType is the C++ type of the scalars of the value set
+template<typename StorageType>
+class GetValueNode : public ExecutableValue
+{
+    const StorageType* m_data;
+    int64_t m_valueStride;
+    int64_t m_scalarStride;
+    ExecutableValue* m_elementID;
+    ExecutableValue* m_scalarIndex; // nullptr for scalar value sets
+public:
+    GetValueNode(ValueSet& valueSet, ExecutableValue* elementID, ExecutableValue* scalarIndex)
+        :m_data(static_cast<const StorageType*>(valueSet.GetData())), m_valueStride(valueSet.GetValueStride()),
+         m_scalarStride(valueSet.GetScalarStride()), m_elementID(elementID), m_scalarIndex(scalarIndex)
+    { }
+    ~GetValueNode() { delete m_elementID; delete m_scalarIndex; }
+    double Evaluate(ExecutionFrame& frame)
+    {
+        int64_t id = static_cast<int64_t>(m_elementID->Evaluate(frame));
+        int64_t index = m_scalarIndex ? static_cast<int64_t>(m_scalarIndex->Evaluate(frame)) : 0;
+        return KernelFromStorage<double>(m_data[id * m_valueStride + index * m_scalarStride]);
+    }
+};
+
+class NegateNode : public ExecutableValue
+{
+    ExecutableValue* m_operand;
+public:
+    NegateNode(ExecutableValue* operand)
+        :m_operand(operand)
+    { }
+    ~NegateNode() { delete m_operand; }
+    double Evaluate(ExecutionFrame& frame) { return -m_operand->Evaluate(frame); }
+};
+
+template<typename OpType>
+class BinaryOpNode : public ExecutableValue
+{
+    ExecutableValue* m_lhs;
+    ExecutableValue* m_rhs;
+public:
+    BinaryOpNode(ExecutableValue* lhs, ExecutableValue* rhs)
+        :m_lhs(lhs), m_rhs(rhs)
+    { }
+    ~BinaryOpNode() { delete m_lhs; delete m_rhs; }
+    double Evaluate(ExecutionFrame& frame) { return OpType()(m_lhs->Evaluate(frame), m_rhs->Evaluate(frame)); }
+};
+
+class ActivationNode : public ExecutableValue
+{
+    int32_t m_activation;
+    int32_t m_accuracy;
+    ExecutableValue* m_operand;
+public:
+    ActivationNode(int32_t activation, int32_t accuracy, ExecutableValue* operand)
+        :m_activation(activation), m_accuracy(accuracy), m_operand(operand)
+    { }
+    ~ActivationNode() { delete m_operand; }
+    double Evaluate(ExecutionFrame& frame) { return ApplyKernelActivation(m_operand->Evaluate(frame), m_activation, m_accuracy); }
+};
+
+class AssignmentNode : public ExecutableStatement
+{
+    int32_t m_slot;
+    ExecutableValue* m_index; // nullptr when the LHS is a scalar variable
+    ExecutableValue* m_rhs;
+public:
+    AssignmentNode(int32_t slot, ExecutableValue* index, ExecutableValue* rhs)
+        :m_slot(slot), m_index(index), m_rhs(rhs)
+    { }
+    ~AssignmentNode() { delete m_index; delete m_rhs; }
+    void Execute(ExecutionFrame& frame)
+    {
+        double value = m_rhs->Evaluate(frame);
+        int64_t index = m_index ? static_cast<int64_t>(m_index->Evaluate(frame)) : 0;
+        frame.slotBases[m_slot][index] = value;
+    }
+};
+
+// Assignment of a whole vector element of a value set to a vector variable
+template<typename StorageType>
+class CopyValueNode : public ExecutableStatement
+{
+    int32_t m_slot;
+    const StorageType* m_data;
+    int32_t m_elementLength;
+    int64_t m_valueStride;
+    int64_t m_scalarStride;
+    ExecutableValue* m_elementID;
+public:
+    CopyValueNode(int32_t slot, ValueSet& valueSet, ExecutableValue* elementID)
+        :m_slot(slot), m_data(static_cast<const StorageType*>(valueSet.GetData())), m_elementLength(valueSet.GetElementLength()),
+         m_valueStride(valueSet.GetValueStride()), m_scalarStride(valueSet.GetScalarStride()), m_elementID(elementID)
+    { }
+    ~CopyValueNode() { delete m_elementID; }
+    void Execute(ExecutionFrame& frame)
+    {
+        int64_t id = static_cast<int64_t>(m_elementID->Evaluate(frame));
+        const StorageType* value = m_data + id * m_valueStride;
+        double* dest = frame.slotBases[m_slot];
+        if (m_scalarStride == 1 && sizeof(StorageType) == sizeof(double))
+            memcpy(dest, value, m_elementLength * sizeof(double));
+        else
+        {
+            for (int32_t i=0 ; i<m_elementLength ; ++i)
+                dest[i] = KernelFromStorage<double>(value[i * m_scalarStride]);
+        }
+    }
+};
+
+class ForLoopNode : public ExecutableStatement
+{
+    int32_t m_indexSlot;
+    ExecutableValue* m_start;
+    ExecutableValue* m_end;
+    int64_t m_step;
+    std::vector<ExecutableStatement*> m_body;
+public:
+    ForLoopNode(int32_t indexSlot, ExecutableValue* start, ExecutableValue* end, int64_t step)
+        :m_indexSlot(indexSlot), m_start(start), m_end(end), m_step(step)
+    { }
+    ~ForLoopNode()
+    {
+        delete m_start;
+        delete m_end;
+        for (size_t i=0 ; i<m_body.size() ; ++i)
+            delete m_body[i];
+    }
+    void AddStatement(ExecutableStatement* stm) { m_body.push_back(stm); }
+    void Execute(ExecutionFrame& frame)
+    {
+        int64_t start;
+        int64_t end;
+        GetIterationRange(frame, start, end);
+        ExecuteRange(frame, start, end);
+    }
+    void GetIterationRange(ExecutionFrame& frame, int64_t& begin, int64_t& end)
+    {
+        begin = static_cast<int64_t>(m_start->Evaluate(frame));
+        end = static_cast<int64_t>(m_end->Evaluate(frame));
+    }
+    // Chunks start at an iteration
+    int64_t GetGrainSize() { return m_step; }
+    void ExecuteRange(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        double* index = frame.slotBases[m_indexSlot];
+        for (int64_t i=begin ; i<end ; i+=m_step)
+        {
+            *index = static_cast<double>(i);
+            for (size_t j=0 ; j<m_body.size() ; ++j)
+                m_body[j]->Execute(frame);
+        }
+    }
+};
+
+class DenseLayerNode : public ExecutableStatement
+{
+    const void* m_weights;
+    int64_t m_neuronStride;
+    int64_t m_weightInputStride;
+    const void* m_biases;
+    RealType::Precision m_weightPrecision;
+    RealType::Precision m_accumulatePrecision;
+    int32_t m_numNeurons;
+    int32_t m_numInputs;
+    int32_t m_inputSlot;
+    int32_t m_inputOffset;
+    int32_t m_inputRowLength;
+    int32_t m_outputSlot;
+    int32_t m_outputOffset;
+    int32_t m_outputRowLength;
+    ExecutableValue* m_batchSize;
+    int32_t m_activation;
+    int32_t m_accuracy;
+
+    template<typename AccumulatorType, typename WeightType>
+    void Forward(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        int64_t batchSize = static_cast<int64_t>(m_batchSize->Evaluate(frame));
+        const WeightType* weights = static_cast<const WeightType*>(m_weights);
+        const WeightType* biases = static_cast<const WeightType*>(m_biases);
+        DenseLayerForward<AccumulatorType>(weights + begin * m_neuronStride, m_neuronStride, m_weightInputStride, biases ? biases + begin : nullptr,
+                                           end - begin, m_numInputs, frame.slotBases[m_inputSlot] + m_inputOffset, m_inputRowLength,
+                                           frame.slotBases[m_outputSlot] + m_outputOffset + begin, m_outputRowLength, batchSize,
+                                           m_activation, m_accuracy);
+    }
+    template<typename AccumulatorType>
+    void Forward(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        switch (m_weightPrecision)
+        {
+        case RealType::Float32: return Forward<AccumulatorType, float>(frame, begin, end);
+        case RealType::Float16: return Forward<AccumulatorType, KernelFloat16>(frame, begin, end);
+        case RealType::BFloat16: return Forward<AccumulatorType, KernelBFloat16>(frame, begin, end);
+        default: return Forward<AccumulatorType, double>(frame, begin, end);
+        }
+    }
+public:
+    DenseLayerNode(const void* weights, int64_t neuronStride, int64_t weightInputStride, const void* biases,
+                   RealType::Precision weightPrecision, RealType::Precision accumulatePrecision, int32_t numNeurons, int32_t numInputs,
+                   int32_t inputSlot, int32_t inputOffset, int32_t inputRowLength,
+                   int32_t outputSlot, int32_t outputOffset, int32_t outputRowLength, ExecutableValue* batchSize,
+                   int32_t activation, int32_t accuracy)
+        :m_weights(weights), m_neuronStride(neuronStride), m_weightInputStride(weightInputStride), m_biases(biases),
+         m_weightPrecision(weightPrecision), m_accumulatePrecision(accumulatePrecision), m_numNeurons(numNeurons), m_numInputs(numInputs),
+         m_inputSlot(inputSlot), m_inputOffset(inputOffset), m_inputRowLength(inputRowLength),
+         m_outputSlot(outputSlot), m_outputOffset(outputOffset), m_outputRowLength(outputRowLength),
+         m_batchSize(batchSize), m_activation(activation), m_accuracy(accuracy)
+    { }
+    ~DenseLayerNode() { delete m_batchSize; }
+    void Execute(ExecutionFrame& frame)
+    {
+        ExecuteRange(frame, 0, m_numNeurons);
+    }
+    // Split by neurons. Chunks keep whole register tiles.
+    void GetIterationRange(ExecutionFrame& frame, int64_t& begin, int64_t& end) { begin = 0; end = m_numNeurons; }
+    int64_t GetGrainSize() { return DenseKernelTileNeurons; }
+    void ExecuteRange(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        if (m_accumulatePrecision == RealType::Float32)
+            Forward<float>(frame, begin, end);
+        else
+            Forward<double>(frame, begin, end);
+    }
+};
+
+// Dense layer with int8 weights. The biases are stored at the precision of the weights' element type.
+class QuantizedDenseLayerNode : public ExecutableStatement
+{
+    ValueSet& m_weights;
+    const void* m_biases;
+    KernelQuantization m_inputQuantization;
+    int32_t m_inputSlot;
+    int32_t m_inputOffset;
+    int32_t m_inputRowLength;
+    int32_t m_outputSlot;
+    int32_t m_outputOffset;
+    int32_t m_outputRowLength;
+    ExecutableValue* m_batchSize;
+    int32_t m_activation;
+    int32_t m_accuracy;
+
+    template<typename BiasType>
+    void Forward(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        int64_t batchSize = static_cast<int64_t>(m_batchSize->Evaluate(frame));
+        const int8_t* weights = static_cast<const int8_t*>(m_weights.GetData());
+        const BiasType* biases = static_cast<const BiasType*>(m_biases);
+        QuantizedDenseLayerForward(weights + begin * m_weights.GetValueStride(), m_weights.GetValueStride(), m_weights.GetScalarStride(),
+                                   m_weights.GetScales().data() + begin, m_weights.GetZeroPoints().data() + begin,
+                                   m_weights.GetQuantizedSums().data() + begin, biases ? biases + begin : nullptr, end - begin,
+                                   m_weights.GetElementLength(), m_inputQuantization.scale, m_inputQuantization.zeroPoint,
+                                   frame.slotBases[m_inputSlot] + m_inputOffset, m_inputRowLength,
+                                   frame.slotBases[m_outputSlot] + m_outputOffset + begin, m_outputRowLength, batchSize,
+                                   m_activation, m_accuracy);
+    }
+public:
+    QuantizedDenseLayerNode(ValueSet& weights, const void* biases, const KernelQuantization& inputQuantization,
+                            int32_t inputSlot, int32_t inputOffset, int32_t inputRowLength,
+                            int32_t outputSlot, int32_t outputOffset, int32_t outputRowLength, ExecutableValue* batchSize,
+                            int32_t activation, int32_t accuracy)
+        :m_weights(weights), m_biases(biases), m_inputQuantization(inputQuantization),
+         m_inputSlot(inputSlot), m_inputOffset(inputOffset), m_inputRowLength(inputRowLength),
+         m_outputSlot(outputSlot), m_outputOffset(outputOffset), m_outputRowLength(outputRowLength),
+         m_batchSize(batchSize), m_activation(activation), m_accuracy(accuracy)
+    { }
+    ~QuantizedDenseLayerNode() { delete m_batchSize; }
+    void Execute(ExecutionFrame& frame)
+    {
+        ExecuteRange(frame, 0, m_weights.GetNumberOfValues());
+    }
+    void GetIterationRange(ExecutionFrame& frame, int64_t& begin, int64_t& end) { begin = 0; end = m_weights.GetNumberOfValues(); }
+    int64_t GetGrainSize() { return DenseKernelTileNeurons; }
+    void ExecuteRange(ExecutionFrame& frame, int64_t begin, int64_t end)
+    {
+        switch (m_weights.GetPrecision())
+        {
+        case RealType::Float32: return Forward<float>(frame, begin, end);
+        case RealType::Float16: return Forward<KernelFloat16>(frame, begin, end);
+        case RealType::BFloat16: return Forward<KernelBFloat16>(frame, begin, end);
+        default: return Forward<double>(frame, begin, end);
+        }
+    }
+};
+
+class VectorActivationNode : public ExecutableStatement
+{
+    int32_t m_slot;
+    int32_t m_offset;
+    int32_t m_length;
+    int32_t m_rowLength;
+    ExecutableValue* m_batchSize;
+    int32_t m_activation;
+    int32_t m_accuracy;
+public:
+    VectorActivationNode(int32_t slot, int32_t offset, int32_t length, int32_t rowLength, ExecutableValue* batchSize,
+                         int32_t activation, int32_t accuracy)
+        :m_slot(slot), m_offset(offset), m_length(length), m_rowLength(rowLength), m_batchSize(batchSize),
+         m_activation(activation), m_accuracy(accuracy)
+    { }
+    ~VectorActivationNode() { delete m_batchSize; }
+    void Execute(ExecutionFrame& frame)
+    {
+        int64_t batchSize = static_cast<int64_t>(m_batchSize->Evaluate(frame));
+        LayerActivationForward(frame.slotBases[m_slot] + m_offset, m_length, m_rowLength, batchSize, m_activation, m_accuracy);
+    }
+};
+
+// Base address and stride of a VectorOperand
+class ExecutableVectorOperand
+{
+    int32_t m_slot; // -1 for value set operands
+    ExecutableValue* m_offset;
+    const double* m_data;
+    int64_t m_valueStride;
+    ExecutableValue* m_elementID;
+    int64_t m_stride;
+public:
+    ExecutableVectorOperand(int32_t slot, ExecutableValue* offset, int64_t stride)
+        :m_slot(slot), m_offset(offset), m_data(nullptr), m_valueStride(0), m_elementID(nullptr), m_stride(stride)
+    { }
+    ExecutableVectorOperand(ValueSet& valueSet, ExecutableValue* elementID)
+        :m_slot(-1), m_offset(nullptr), m_data(static_cast<const double*>(valueSet.GetData())), m_valueStride(valueSet.GetValueStride()),
+         m_elementID(elementID), m_stride(valueSet.GetScalarStride())
+    { }
+    ~ExecutableVectorOperand() { delete m_offset; delete m_elementID; }
+    int64_t GetStride() { return m_stride; }
+    const double* GetBase(ExecutionFrame& frame)
+    {
+        if (m_slot < 0)
+            return m_data + static_cast<int64_t>(m_elementID->Evaluate(frame)) * m_valueStride;
+        return frame.slotBases[m_slot] + static_cast<int64_t>(m_offset->Evaluate(frame));
+    }
+};
+
+class VectorOperationNode : public ExecutableStatement
+{
+    int32_t m_operation;
+    int32_t m_resultSlot;
+    ExecutableVectorOperand* m_lhs;
+    ExecutableVectorOperand* m_rhs;
+    int32_t m_length;
+public:
+    VectorOperationNode(int32_t operation, int32_t resultSlot, ExecutableVectorOperand* lhs, ExecutableVectorOperand* rhs, int32_t length)
+        :m_operation(operation), m_resultSlot(resultSlot), m_lhs(lhs), m_rhs(rhs), m_length(length)
+    { }
+    ~VectorOperationNode() { delete m_lhs; delete m_rhs; }
+    void Execute(ExecutionFrame& frame)
+    {
+        VectorOperationForward(m_operation, m_lhs->GetBase(frame), m_lhs->GetStride(), m_rhs->GetBase(frame), m_rhs->GetStride(),
+                               frame.slotBases[m_resultSlot], m_length);
+    }
+};
+
+class VectorReductionNode : public ExecutableStatement
+{
+    int32_t m_reduction;
+    int32_t m_resultSlot;
+    ExecutableVectorOperand* m_operand;
+    int32_t m_length;
+public:
+    VectorReductionNode(int32_t reduction, int32_t resultSlot, ExecutableVectorOperand* operand, int32_t length)
+        :m_reduction(reduction), m_resultSlot(resultSlot), m_operand(operand), m_length(length)
+    { }
+    ~VectorReductionNode() { delete m_operand; }
+    void Execute(ExecutionFrame& frame)
+    {
+        frame.slotBases[m_resultSlot][0] = VectorReduceForward(m_reduction, m_operand->GetBase(frame), m_operand->GetStride(), m_length);
+    }
+};
+
+class DotProductNode : public ExecutableStatement
+{
+    int32_t m_resultSlot;
+    ExecutableVectorOperand* m_operand;
+    ExecutableVectorOperand* m_factor;
+    int32_t m_length;
+public:
+    DotProductNode(int32_t resultSlot, ExecutableVectorOperand* operand, ExecutableVectorOperand* factor, int32_t length)
+        :m_resultSlot(resultSlot), m_operand(operand), m_factor(factor), m_length(length)
+    { }
+    ~DotProductNode() { delete m_operand; delete m_factor; }
+    void Execute(ExecutionFrame& frame)
+    {
+        frame.slotBases[m_resultSlot][0] = VectorDotProductForward(m_operand->GetBase(frame), m_operand->GetStride(),
+                                                                   m_factor->GetBase(frame), m_factor->GetStride(), m_length);
+    }
+};
+
+static int32_t GetStorageLength(ValueType& type)
+{
+    if (VectorType* vecType = type.AsVectorType())
+    {
+        if (vecType->GetLength() < 0)
+            throw std::runtime_error("Interpreter : Vector variables must have a known length");
+        return vecType->GetLength();
+    }
+    return 1;
+}
+
+class ExecutableValueBuilder : public IRValueVisitor
+{
+    Interpreter& m_interpreter;
+    ExecutableValue* m_result;
+
+    template<typename OpType>
+    void BuildBinaryOp(BinaryOp& binOp)
+    {
+        ExecutableValue* lhs = Build(binOp.GetLHS());
+        ExecutableValue* rhs = Build(binOp.GetRHS());
+        m_result = new BinaryOpNode<OpType>(lhs, rhs);
+    }
+public:
+    ExecutableValueBuilder(Interpreter& interpreter)
+        :m_interpreter(interpreter), m_result(nullptr)
+    { }
+    ExecutableValue* Build(Value& value)
+    {
+        ExecutableValueBuilder builder(m_interpreter);
+        value.AcceptIRValueVisitor(builder);
+        return builder.m_result;
+    }
+    virtual void Visit(IntegerConstant& intConst)
+    {
+        m_result = new ConstantNode(static_cast<double>(intConst.GetValue()));
+    }
+    virtual void Visit(BooleanConstant& boolConst)
+    {
+        m_result = new ConstantNode(boolConst.GetValue() ? 1.0 : 0.0);
+    }
+    virtual void Visit(RealConstant& realConst)
+    {
+        m_result = new ConstantNode(realConst.GetValue());
+    }
+    virtual void Visit(RealVectorConstant& realVecConst)
+    {
+        throw std::runtime_error("Interpreter : Vector constants must be lowered into value sets");
+    }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        m_result = Build(unaryPlus.GetOperand());
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        m_result = new NegateNode(Build(unaryMinus.GetOperand()));
+    }
+    virtual void Visit(BinaryAdd& binaryAdd)
+    {
+        BuildBinaryOp<std::plus<double>>(binaryAdd);
+    }
+    virtual void Visit(BinarySubtract& binarySubtract)
+    {
+        BuildBinaryOp<std::minus<double>>(binarySubtract);
+    }
+    virtual void Visit(BinaryMultiply& binaryMultiply)
+    {
+        BuildBinaryOp<std::multiplies<double>>(binaryMultiply);
+    }
+    virtual void Visit(BinaryDivide& binaryDivide)
+    {
+        BuildBinaryOp<std::divides<double>>(binaryDivide);
+    }
+    virtual void Visit(GetInputValue& getInput)
+    {
+        throw std::runtime_error("Interpreter : GetInputValue must be lowered before execution");
+    }
+    virtual void Visit(Reduction& reduction)
+    {
+        throw std::runtime_error("Interpreter : Reduction must be lowered before execution");
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        if (function.GetActivation() < 0 || !sKernelActivations[function.GetActivation()].elementwise)
+            throw std::runtime_error("Interpreter : Unsupported activation function " + function.GetName());
+        m_result = new ActivationNode(function.GetActivation(), function.GetAccuracy(), Build(function.GetOperand()));
+    }
+    virtual void Visit(Variable& variable)
+    {
+        m_result = new VariableNode(m_interpreter.GetSlot(variable));
+    }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        int32_t slot = m_interpreter.GetSlot(indexedVal.GetVariable());
+        m_result = new IndexedValueNode(slot, Build(indexedVal.GetIndexer()));
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        ExecutableValue* scalarIndex = getValue.GetScalarIndex() ? Build(*getValue.GetScalarIndex()) : nullptr;
+        ValueSet& valueSet = getValue.GetValueSet();
+        if (valueSet.IsQuantized())
+            throw std::runtime_error("Interpreter : Quantized value sets can only be read by dense layers");
+        ExecutableValue* elementID = Build(getValue.GetElementID());
+        switch (valueSet.GetPrecision())
+        {
+        case RealType::Float32: m_result = new GetValueNode<float>(valueSet, elementID, scalarIndex); break;
+        case RealType::Float16: m_result = new GetValueNode<KernelFloat16>(valueSet, elementID, scalarIndex); break;
+        case RealType::BFloat16: m_result = new GetValueNode<KernelBFloat16>(valueSet, elementID, scalarIndex); break;
+        default: m_result = new GetValueNode<double>(valueSet, elementID, scalarIndex); break;
+        }
+    }
+};
+
+class ExecutableStatementBuilder : public IRStatementVisitor
+{
+    Interpreter& m_interpreter;
+    ExecutableValueBuilder m_valueBuilder;
+    ExecutableStatement* m_result;
+public:
+    ExecutableStatementBuilder(Interpreter& interpreter)
+        :m_interpreter(interpreter), m_valueBuilder(interpreter), m_result(nullptr)
+    { }
+    // Returns nullptr for statements that have nothing to execute (definitions)
+    ExecutableStatement* Build(IRStatement& stm)
+    {
+        m_result = nullptr;
+        stm.AcceptVisitor(*this);
+        return m_result;
+    }
+    virtual void Visit(Assignment& assignment)
+    {
+        Value& lhs = assignment.GetLHS();
+        Value& rhs = assignment.GetRHS();
+        if (IndexedValue* indexedLHS = dynamic_cast<IndexedValue*>(&lhs))
+        {
+            int32_t slot = m_interpreter.GetSlot(indexedLHS->GetVariable());
+            m_result = new AssignmentNode(slot, m_valueBuilder.Build(indexedLHS->GetIndexer()), m_valueBuilder.Build(rhs));
+            return;
+        }
+        Variable* lhsVar = dynamic_cast<Variable*>(&lhs);
+        if (lhsVar == nullptr)
+            throw std::runtime_error("Interpreter : LHS of an assignment must be a variable or indexed reference");
+        int32_t slot = m_interpreter.GetSlot(*lhsVar);
+        if (lhsVar->GetType().IsVector())
+        {
+            GetValue* getValue = dynamic_cast<GetValue*>(&rhs);
+            if (getValue == nullptr)
+                throw std::runtime_error("Interpreter : Only value set elements can be assigned to vector variables");
+            ValueSet& valueSet = getValue->GetValueSet();
+            if (valueSet.IsQuantized())
+                throw std::runtime_error("Interpreter : Quantized value sets can only be read by dense layers");
+            ExecutableValue* elementID = m_valueBuilder.Build(getValue->GetElementID());
+            switch (valueSet.GetPrecision())
+            {
+            case RealType::Float32: m_result = new CopyValueNode<float>(slot, valueSet, elementID); break;
+            case RealType::Float16: m_result = new CopyValueNode<KernelFloat16>(slot, valueSet, elementID); break;
+            case RealType::BFloat16: m_result = new CopyValueNode<KernelBFloat16>(slot, valueSet, elementID); break;
+            default: m_result = new CopyValueNode<double>(slot, valueSet, elementID); break;
+            }
+            return;
+        }
+        m_result = new AssignmentNode(slot, nullptr, m_valueBuilder.Build(rhs));
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        int32_t indexSlot = m_interpreter.GetSlot(forLoop.GetIndexVariable());
+        ForLoopNode* loopNode = new ForLoopNode(indexSlot, m_valueBuilder.Build(forLoop.GetStart()), m_valueBuilder.Build(forLoop.GetEnd()),
+                                               forLoop.GetStep());
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+        {
+            ExecutableStatementBuilder bodyBuilder(m_interpreter);
+            ExecutableStatement* stm = bodyBuilder.Build(*(*iter));
+            if (stm != nullptr)
+                loopNode->AddStatement(stm);
+        }
+        m_result = loopNode;
+    }
+    virtual void Visit(VariableDefinition& varDefinition)
+    {
+        // Storage is allocated up front, so definitions only need a slot
+        m_interpreter.GetSlot(varDefinition.GetVariable());
+    }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        const void* biases = denseLayer.GetBiases() ? denseLayer.GetBiases()->GetData() : nullptr;
+        ValueSet& weights = denseLayer.GetWeights();
+        if (weights.IsQuantized())
+        {
+            m_result = new QuantizedDenseLayerNode(weights, biases, denseLayer.GetInputQuantization(),
+                                                   m_interpreter.GetSlot(denseLayer.GetInput()), denseLayer.GetInputOffset(),
+                                                   denseLayer.GetInputRowLength(), m_interpreter.GetSlot(denseLayer.GetOutput()),
+                                                   denseLayer.GetOutputOffset(), denseLayer.GetOutputRowLength(),
+                                                   m_valueBuilder.Build(denseLayer.GetBatchSize()), denseLayer.GetActivation(),
+                                                   denseLayer.GetAccuracy());
+            return;
+        }
+        m_result = new DenseLayerNode(weights.GetData(), weights.GetValueStride(), weights.GetScalarStride(), biases,
+                                      weights.GetPrecision(), denseLayer.GetAccumulatePrecision(),
+                                      denseLayer.GetNumberOfNeurons(), denseLayer.GetNumberOfInputs(),
+                                      m_interpreter.GetSlot(denseLayer.GetInput()), denseLayer.GetInputOffset(), denseLayer.GetInputRowLength(),
+                                      m_interpreter.GetSlot(denseLayer.GetOutput()), denseLayer.GetOutputOffset(), denseLayer.GetOutputRowLength(),
+                                      m_valueBuilder.Build(denseLayer.GetBatchSize()), denseLayer.GetActivation(),
+                                      denseLayer.GetAccuracy());
+    }
+    ExecutableVectorOperand* BuildVectorOperand(VectorOperand& operand)
+    {
+        if (operand.GetValueSet() != nullptr)
+        {
+            if (operand.GetValueSet()->GetPrecision() != RealType::Float64 || operand.GetValueSet()->IsQuantized())
+                throw std::runtime_error("Interpreter : Vector kernels can only read value sets of doubles");
+            return new ExecutableVectorOperand(*operand.GetValueSet(), m_valueBuilder.Build(*operand.GetElementID()));
+        }
+        return new ExecutableVectorOperand(m_interpreter.GetSlot(*operand.GetVariable()), m_valueBuilder.Build(*operand.GetOffset()),
+                                           operand.GetStride());
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        m_result = new VectorOperationNode(vectorOperation.GetOperation(), m_interpreter.GetSlot(vectorOperation.GetResult()),
+                                           BuildVectorOperand(vectorOperation.GetLHS()), BuildVectorOperand(vectorOperation.GetRHS()),
+                                           vectorOperation.GetLength());
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        if (vectorReduction.GetFactor() != nullptr)
+        {
+            m_result = new DotProductNode(m_interpreter.GetSlot(vectorReduction.GetResult()), BuildVectorOperand(vectorReduction.GetOperand()),
+                                          BuildVectorOperand(*vectorReduction.GetFactor()), vectorReduction.GetLength());
+            return;
+        }
+        m_result = new VectorReductionNode(vectorReduction.GetReductionType(), m_interpreter.GetSlot(vectorReduction.GetResult()),
+                                           BuildVectorOperand(vectorReduction.GetOperand()), vectorReduction.GetLength());
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        m_result = new VectorActivationNode(m_interpreter.GetSlot(vectorActivation.GetVariable()), vectorActivation.GetOffset(),
+                                            vectorActivation.GetLength(), vectorActivation.GetRowLength(),
+                                            m_valueBuilder.Build(vectorActivation.GetBatchSize()), vectorActivation.GetActivation(),
+                                            vectorActivation.GetAccuracy());
+    }
+};
+
+// Stop splitting the iterations of a stage once there are about this many chunks per thread
+static const int64_t ChunksPerThread = 4;
+
+Interpreter::Interpreter(Function& function)
+    :m_function(function), m_threadPool(nullptr), m_planSize(0), m_storageBatchSize(0), m_batchSizeSlot(-1)
+{
+    Variable& inputVar = function.GetInputVariable();
+    Variable& outputVar = function.GetOutputVariable();
+    m_inputLength = GetStorageLength(inputVar.GetType());
+    m_outputLength = GetStorageLength(outputVar.GetType());
+    GetSlot(inputVar);
+    GetSlot(outputVar);
+    if (function.GetBatchSizeVariable() != nullptr)
+        m_batchSizeSlot = GetSlot(*function.GetBatchSizeVariable());
+
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    std::map<IRStatement*, ExecutableStatement*> executableStatements;
+    int32_t group = 0;
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        ExecutableStatementBuilder builder(*this);
+        ExecutableStatement* stm = builder.Build(*(*iter));
+        if (stm != nullptr)
+            m_statements.push_back(stm);
+        executableStatements[*iter] = stm;
+        m_slotGroups.resize(m_slotSizes.size(), group++);
+    }
+
+    m_slotShared.assign(m_slotSizes.size(), false);
+    m_slotShared[0] = m_slotShared[1] = true;
+    if (m_batchSizeSlot >= 0)
+        m_slotShared[m_batchSizeSlot] = true;
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter))
+            m_slotShared[GetSlot(definition->GetVariable())] = true;
+    }
+    WorkspacePlan plan = PlanWorkspace(function);
+    m_slotOffsets.assign(m_slotSizes.size(), -1);
+    for (std::map<Variable*, int64_t>::iterator iter=plan.offsets.begin() ; iter!=plan.offsets.end() ; ++iter)
+        m_slotOffsets[GetSlot(*iter->first)] = iter->second;
+    m_planSize = plan.size;
+
+    std::vector<ParallelStage> stages = GetParallelStages(function);
+    for (size_t i=0 ; i<stages.size() ; ++i)
+    {
+        ExecutableStage stage;
+        stage.parallel = stages[i].parallel;
+        for (size_t j=0 ; j<stages[i].statements.size() ; ++j)
+            stage.statements.push_back(executableStatements[stages[i].statements[j]]);
+        m_stages.push_back(stage);
+    }
+
+    LayOutStorage(1);
+}
+
+// Now that all variables are known, lay them out. Shared slots go where the workspace plan
+// puts them, followed by the shared slots it does not place. Local slots are laid out one
+// after the other within their group, and every group starts at the same offset. The input
+// and output slots are bound to the caller's buffers on every run.
+void Interpreter::LayOutStorage(int32_t batchSize)
+{
+    size_t numThreads = m_threadPool ? m_threadPool->GetNumberOfThreads() : 1;
+    size_t planSize = static_cast<size_t>(m_planSize);
+    size_t sharedSize = 0;
+    size_t localSize = 0;
+    size_t localOffset = 0;
+    for (size_t slot=2 ; slot<m_slotSizes.size() ; ++slot)
+    {
+        size_t size = static_cast<size_t>(m_slotSizes[slot]) * (m_slotBatched[slot] ? batchSize : 1);
+        if (m_slotOffsets[slot] >= 0)
+            planSize = std::max(planSize, static_cast<size_t>(m_planSize) * (m_slotBatched[slot] ? batchSize : 1));
+        else if (m_slotShared[slot])
+            sharedSize += size;
+        else
+        {
+            if (m_slotGroups[slot] != m_slotGroups[slot - 1])
+                localOffset = 0;
+            localOffset += size;
+            localSize = std::max(localSize, localOffset);
+        }
+    }
+    m_storage.assign(planSize + sharedSize, 0.0);
+    m_threadStorage.resize(numThreads);
+    m_threadSlotBases.resize(numThreads);
+    for (size_t thread=0 ; thread<numThreads ; ++thread)
+    {
+        m_threadStorage[thread].assign(localSize, 0.0);
+        m_threadSlotBases[thread].assign(m_slotSizes.size(), nullptr);
+        size_t sharedOffset = planSize;
+        localOffset = 0;
+        for (size_t slot=2 ; slot<m_slotSizes.size() ; ++slot)
+        {
+            size_t size = static_cast<size_t>(m_slotSizes[slot]) * (m_slotBatched[slot] ? batchSize : 1);
+            if (m_slotOffsets[slot] >= 0)
+            {
+                size_t offset = static_cast<size_t>(m_slotOffsets[slot]) * (m_slotBatched[slot] ? batchSize : 1);
+                m_threadSlotBases[thread][slot] = m_storage.data() + offset;
+            }
+            else if (m_slotShared[slot])
+            {
+                m_threadSlotBases[thread][slot] = m_storage.data() + sharedOffset;
+                sharedOffset += size;
+            }
+            else
+            {
+                if (m_slotGroups[slot] != m_slotGroups[slot - 1])
+                    localOffset = 0;
+                m_threadSlotBases[thread][slot] = m_threadStorage[thread].data() + localOffset;
+                localOffset += size;
+            }
+        }
+    }
+    m_storageBatchSize = batchSize;
+}
+
+void Interpreter::SetThreadPool(ThreadPool* pool)
+{
+    m_threadPool = pool;
+    LayOutStorage(m_storageBatchSize);
+}
+
+void Interpreter::KeepVariable(Variable& var)
+{
+    std::map<Variable*, int32_t>::iterator iter = m_variableSlots.find(&var);
+    if (iter == m_variableSlots.end() || iter->second < 2 || !m_slotShared[iter->second])
+        throw std::runtime_error("Interpreter : Only variables defined at the top level can be kept");
+    m_slotOffsets[iter->second] = -1;
+    LayOutStorage(m_storageBatchSize);
+}
+
+const double* Interpreter::GetValues(Variable& var)
+{
+    std::map<Variable*, int32_t>::iterator iter = m_variableSlots.find(&var);
+    if (iter == m_variableSlots.end() || iter->second < 2 || !m_slotShared[iter->second] || m_slotOffsets[iter->second] >= 0)
+        throw std::runtime_error("Interpreter : Values can only be read from kept variables");
+    return m_threadSlotBases[0][iter->second];
+}
+
+Interpreter::~Interpreter()
+{
+    for (size_t i=0 ; i<m_statements.size() ; ++i)
+        delete m_statements[i];
+}
+
+int32_t Interpreter::GetSlot(Variable& var)
+{
+    std::map<Variable*, int32_t>::iterator iter = m_variableSlots.find(&var);
+    if (iter != m_variableSlots.end())
+        return iter->second;
+    int32_t slot = static_cast<int32_t>(m_slotSizes.size());
+    m_slotSizes.push_back(GetStorageLength(var.GetType()));
+    m_slotBatched.push_back(var.IsBatched());
+    m_variableSlots[&var] = slot;
+    return slot;
+}
+
+void Interpreter::Run(const double* input, double* output, int32_t batchSize)
+{
+    if (m_batchSizeSlot >= 0)
+    {
+        if (batchSize < 1)
+            throw std::runtime_error("Interpreter : Batch size must be positive");
+        if (batchSize > m_storageBatchSize)
+            LayOutStorage(batchSize);
+        m_threadSlotBases[0][m_batchSizeSlot][0] = static_cast<double>(batchSize);
+    }
+    else if (batchSize != 1)
+        throw std::runtime_error("Interpreter : Function was lowered without a runtime batch size");
+    for (size_t thread=0 ; thread<m_threadSlotBases.size() ; ++thread)
+    {
+        m_threadSlotBases[thread][0] = const_cast<double*>(input);
+        m_threadSlotBases[thread][1] = output;
+    }
+    if (m_threadPool == nullptr)
+    {
+        ExecutionFrame frame = { m_threadSlotBases[0].data() };
+        for (size_t i=0 ; i<m_statements.size() ; ++i)
+            m_statements[i]->Execute(frame);
+        return;
+    }
+    for (size_t i=0 ; i<m_stages.size() ; ++i)
+        RunStage(m_stages[i]);
+}
+
+// Split the iterations of all statements of the stage into about ChunksPerThread chunks per
+// thread, in proportion to their iteration counts, and let the pool run them.
+void Interpreter::RunStage(ExecutableStage& stage)
+{
+    ExecutionFrame frame = { m_threadSlotBases[0].data() };
+    if (!stage.parallel)
+    {
+        stage.statements[0]->Execute(frame);
+        return;
+    }
+    std::vector<int64_t> begins(stage.statements.size());
+    std::vector<int64_t> ends(stage.statements.size());
+    int64_t totalIterations = 0;
+    for (size_t i=0 ; i<stage.statements.size() ; ++i)
+    {
+        stage.statements[i]->GetIterationRange(frame, begins[i], ends[i]);
+        totalIterations += std::max<int64_t>(ends[i] - begins[i], 0);
+    }
+    if (totalIterations == 0)
+        return;
+    int64_t targetChunks = m_threadPool->GetNumberOfThreads() * ChunksPerThread;
+    m_tasks.clear();
+    for (size_t i=0 ; i<stage.statements.size() ; ++i)
+    {
+        int64_t count = ends[i] - begins[i];
+        if (count <= 0)
+            continue;
+        int64_t grain = stage.statements[i]->GetGrainSize();
+        int64_t numChunks = ThreadPool::GetNumberOfChunks(count, grain, (targetChunks * count + totalIterations - 1) / totalIterations);
+        for (int64_t chunk=0 ; chunk<numChunks ; ++chunk)
+        {
+            ParallelTask task = { stage.statements[i], begins[i] + ThreadPool::GetChunkStart(count, grain, numChunks, chunk),
+                                  begins[i] + ThreadPool::GetChunkStart(count, grain, numChunks, chunk + 1) };
+            m_tasks.push_back(task);
+        }
+    }
+    m_threadPool->RunTasks(static_cast<int64_t>(m_tasks.size()), [this](int64_t task, int32_t threadIndex)
+    {
+        ExecutionFrame threadFrame = { m_threadSlotBases[threadIndex].data() };
+        ParallelTask& parallelTask = m_tasks[task];
+        parallelTask.statement->ExecuteRange(threadFrame, parallelTask.begin, parallelTask.end);
+    });
+}
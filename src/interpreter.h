@@ -0,0 +1,93 @@
+#ifndef _INTERPRETER_H_
+#define _INTERPRETER_H_
+
+// Reference executor for the lowered IR. The statements of a Function are
+// translated once into a tree of executable nodes in which every variable
+// has already been resolved to a storage slot. Running the network therefore
+// does no name or map lookups and only walks the pre-built nodes.
+//
+// With a thread pool, the statements run stage by stage (see GetParallelStages).
+// The loops and dense layers of a stage are split into chunks which the pool's
+// threads execute concurrently. Layer buffers are shared, while loop indices and
+// temporaries get separate storage for every thread.
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+class Function;
+class Variable;
+class ExecutableStatement;
+class ThreadPool;
+
+class Interpreter
+{
+    friend class ExecutableStatementBuilder;
+    friend class ExecutableValueBuilder;
+
+    Function& m_function;
+    int32_t m_inputLength;
+    int32_t m_outputLength;
+    std::vector<ExecutableStatement*> m_statements;
+
+    struct ExecutableStage
+    {
+        bool parallel;
+        std::vector<ExecutableStatement*> statements;
+    };
+    struct ParallelTask
+    {
+        ExecutableStatement* statement;
+        int64_t begin;
+        int64_t end;
+    };
+    std::vector<ExecutableStage> m_stages;
+    std::vector<ParallelTask> m_tasks;
+    ThreadPool* m_threadPool;
+
+    // Slot 0 is bound to the input and slot 1 to the output on every run. Shared
+    // slots (the batch size and variables defined at the top level) point into
+    // m_storage, all other slots into the storage of the executing thread.
+    // Batched slots hold m_storageBatchSize rows of m_slotSizes elements. Shared
+    // slots placed by the workspace plan have an offset per row, -1 otherwise.
+    // Local slots of different top level statements (their groups) are never live
+    // at the same time and overlap.
+    std::map<Variable*, int32_t> m_variableSlots;
+    std::vector<int32_t> m_slotSizes;
+    std::vector<bool> m_slotBatched;
+    std::vector<bool> m_slotShared;
+    std::vector<int64_t> m_slotOffsets;
+    std::vector<int32_t> m_slotGroups;
+    int64_t m_planSize;
+    std::vector<double> m_storage;
+    std::vector<std::vector<double> > m_threadStorage;
+    std::vector<std::vector<double*> > m_threadSlotBases;
+    int32_t m_storageBatchSize;
+    int32_t m_batchSizeSlot; // -1 unless the batch size is a runtime parameter
+
+    int32_t GetSlot(Variable& var);
+    void LayOutStorage(int32_t batchSize);
+    void RunStage(ExecutableStage& stage);
+public:
+    Interpreter(Function& function);
+    ~Interpreter();
+    // Lengths of one call for functions with a compile time batch size and of
+    // one input vector for functions with a runtime batch size
+    int32_t GetInputLength() { return m_inputLength; }
+    int32_t GetOutputLength() { return m_outputLength; }
+    bool HasRuntimeBatchSize() { return m_batchSizeSlot >= 0; }
+    // Compute one inference, or batchSize inferences when the batch size is a
+    // runtime parameter. input must hold batchSize * GetInputLength() values and
+    // output must have room for batchSize * GetOutputLength() values.
+    void Run(const double* input, double* output, int32_t batchSize = 1);
+    // Run on the threads of pool from now on, or single threaded when pool is
+    // nullptr. The pool must outlive its use by the interpreter.
+    void SetThreadPool(ThreadPool* pool);
+    // Gives a variable defined at the top level of the function storage of its own, where
+    // GetValues reads the rows the last run computed. The workspace plan may otherwise
+    // reuse its storage for later layers.
+    void KeepVariable(Variable& var);
+    const double* GetValues(Variable& var);
+};
+
+#endif // _INTERPRETER_H_
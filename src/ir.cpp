@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <set>
 #include <sstream>
 #include "ir.h"
 
@@ -6,24 +12,176 @@ int32_t ForLoop::sLoopIndexNum = 0;
 void IndexedValue::InferType()
 {
     ValueType& variableType = m_var.GetType();
-    VectorType *varVectorType = dynamic_cast<VectorType*>(&variableType);
+    VectorType *varVectorType = variableType.AsVectorType();
     if (varVectorType == nullptr)
         throw std::runtime_error("Variable in an indexed value must be a vector");
-    ValueType& indexType = m_indexer.GetType();
-    ScalarType *indexScalarType = dynamic_cast<ScalarType*>(&indexType);
-    if (indexScalarType == nullptr)
+    if (!m_indexer.GetType().IsScalar())
         throw std::runtime_error("Index in an indexed value must be a scalar");
-    m_type = varVectorType->GetElementType().Clone();
+    m_type = &varVectorType->GetElementType();
 }
 
 
+static char* AllocateAligned(size_t size)
+{
+    void* mem = nullptr;
+    if (posix_memalign(&mem, ValueSet::Alignment, std::max<size_t>(size, 1)) != 0)
+        throw std::bad_alloc();
+    return static_cast<char*>(mem);
+}
+
+ValueSet::ValueSet(int32_t id, ValueType& elemType)
+    :m_id(id), m_elemType(elemType), m_elemLength(1), m_numValues(0), m_capacity(0), m_layout(RowMajor),
+     m_precision(RealType::Float64), m_scalarSize(sizeof(double)), m_data(nullptr), m_quantized(false)
+{
+    ValueType* scalarType = &elemType;
+    if (VectorType* vecType = elemType.AsVectorType())
+    {
+        if (vecType->GetLength() < 0)
+            throw std::runtime_error("ValueSet : Vector elements must have a known length");
+        m_elemLength = vecType->GetLength();
+        scalarType = &vecType->GetElementType();
+    }
+    if (scalarType->IsReal())
+    {
+        m_precision = static_cast<RealType*>(scalarType)->GetPrecision();
+        m_scalarSize = static_cast<RealType*>(scalarType)->GetSize();
+    }
+}
+
+ValueSet::~ValueSet()
+{
+    free(m_data);
+}
+
+void ValueSet::Reserve(int32_t capacity)
+{
+    char* data = AllocateAligned(static_cast<size_t>(capacity) * m_elemLength * m_scalarSize);
+    if (m_data != nullptr)
+        memcpy(data, m_data, static_cast<size_t>(m_numValues) * m_elemLength * m_scalarSize);
+    free(m_data);
+    m_data = data;
+    m_capacity = capacity;
+}
+
+double ValueSet::GetScalar(int32_t id, int32_t i)
+{
+    int64_t position = id * GetValueStride() + i * GetScalarStride();
+    if (m_quantized)
+        return m_scales[id] * (reinterpret_cast<int8_t*>(m_data)[position] - m_zeroPoints[id]);
+    switch (m_precision)
+    {
+    case RealType::Float32:
+        return KernelFromStorage<double>(reinterpret_cast<float*>(m_data)[position]);
+    case RealType::Float16:
+        return KernelFromStorage<double>(reinterpret_cast<KernelFloat16*>(m_data)[position]);
+    case RealType::BFloat16:
+        return KernelFromStorage<double>(reinterpret_cast<KernelBFloat16*>(m_data)[position]);
+    default:
+        return reinterpret_cast<double*>(m_data)[position];
+    }
+}
+
+void ValueSet::SetScalar(int64_t position, double value)
+{
+    switch (m_precision)
+    {
+    case RealType::Float32:
+        return KernelToStorage(value, reinterpret_cast<float*>(m_data)[position]);
+    case RealType::Float16:
+        return KernelToStorage(value, reinterpret_cast<KernelFloat16*>(m_data)[position]);
+    case RealType::BFloat16:
+        return KernelToStorage(value, reinterpret_cast<KernelBFloat16*>(m_data)[position]);
+    default:
+        return KernelToStorage(value, reinterpret_cast<double*>(m_data)[position]);
+    }
+}
+
+// Real values are rounded to the precision of the set
 int32_t ValueSet::AddValue(ConstantValue& constVal)
 {
-    if (!(m_elemType == constVal.GetType()))
+    if (!(m_elemType == GetTypeWithPrecision(constVal.GetType(), m_precision)))
         throw std::runtime_error("Values in a set must be the same type");
-    int32_t id = m_values.size();
-    m_values.push_back(&constVal);
-    return id;
+    if (m_layout != RowMajor || m_quantized)
+        throw std::runtime_error("ValueSet : Values can only be added to unquantized sets in the row major layout");
+    if (m_numValues == m_capacity)
+        Reserve(m_capacity == 0 ? 16 : 2 * m_capacity);
+
+    int64_t position = static_cast<int64_t>(m_numValues) * m_elemLength;
+    if (IntegerConstant* intConst = dynamic_cast<IntegerConstant*>(&constVal))
+        SetScalar(position, static_cast<double>(intConst->GetValue()));
+    else if (BooleanConstant* boolConst = dynamic_cast<BooleanConstant*>(&constVal))
+        SetScalar(position, boolConst->GetValue() ? 1.0 : 0.0);
+    else if (RealConstant* realConst = dynamic_cast<RealConstant*>(&constVal))
+        SetScalar(position, realConst->GetValue());
+    else if (RealVectorConstant* vecConst = dynamic_cast<RealVectorConstant*>(&constVal))
+    {
+        const std::vector<double>& values = vecConst->GetValue();
+        for (int32_t i=0 ; i<m_elemLength ; ++i)
+            SetScalar(position + i, values[i]);
+    }
+    else
+        throw std::runtime_error("ValueSet : Unknown constant type");
+    return m_numValues++;
+}
+
+void ValueSet::SetLayout(Layout layout)
+{
+    if (layout == m_layout || m_elemLength == 1)
+    {
+        m_layout = layout;
+        return;
+    }
+    char* data = AllocateAligned(static_cast<size_t>(m_numValues) * m_elemLength * m_scalarSize);
+    for (int32_t id=0 ; id<m_numValues ; ++id)
+    {
+        for (int32_t i=0 ; i<m_elemLength ; ++i)
+        {
+            int64_t packed = layout == RowMajor ? static_cast<int64_t>(id) * m_elemLength + i : static_cast<int64_t>(i) * m_numValues + id;
+            int64_t position = id * GetValueStride() + i * GetScalarStride();
+            memcpy(data + packed * m_scalarSize, m_data + position * m_scalarSize, m_scalarSize);
+        }
+    }
+    free(m_data);
+    m_data = data;
+    m_capacity = m_numValues;
+    m_layout = layout;
+}
+
+void ValueSet::Quantize()
+{
+    if (m_quantized)
+        return;
+    if (!m_elemType.IsVector() || !m_elemType.AsVectorType()->GetElementType().IsReal())
+        throw std::runtime_error("ValueSet : Only sets of real vectors can be quantized");
+    char* data = AllocateAligned(static_cast<size_t>(m_numValues) * m_elemLength);
+    m_scales.resize(m_numValues);
+    m_zeroPoints.resize(m_numValues);
+    m_quantizedSums.assign(m_numValues, 0);
+    for (int32_t id=0 ; id<m_numValues ; ++id)
+    {
+        double minimum = GetScalar(id, 0);
+        double maximum = minimum;
+        for (int32_t i=1 ; i<m_elemLength ; ++i)
+        {
+            minimum = std::min(minimum, GetScalar(id, i));
+            maximum = std::max(maximum, GetScalar(id, i));
+        }
+        KernelQuantization quantization = GetKernelQuantization(minimum, maximum);
+        m_scales[id] = quantization.scale;
+        m_zeroPoints[id] = quantization.zeroPoint;
+        for (int32_t i=0 ; i<m_elemLength ; ++i)
+        {
+            int64_t position = id * GetValueStride() + i * GetScalarStride();
+            int8_t q = KernelQuantize(GetScalar(id, i), quantization.scale, quantization.zeroPoint);
+            reinterpret_cast<int8_t*>(data)[position] = q;
+            m_quantizedSums[id] += q;
+        }
+    }
+    free(m_data);
+    m_data = data;
+    m_capacity = m_numValues;
+    m_scalarSize = 1;
+    m_quantized = true;
 }
 
 void Assignment::CheckTypes()
@@ -31,7 +189,7 @@ void Assignment::CheckTypes()
     if (!(m_rhs.GetType() == m_lhs.GetType()))
         throw std::runtime_error("Assignment : LHS and RHS types must be identical");
     ValueType& lhsType = m_lhs.GetType();
-    if (dynamic_cast<ScalarType*>(&lhsType) == nullptr)
+    if (!lhsType.IsScalar())
         throw std::runtime_error("Assignment : LHS must be a scalar value");
     // check that lhs is an l-value
     bool lhsIsLValue = (dynamic_cast<Variable*>(&m_lhs) != nullptr) ||
@@ -43,17 +201,108 @@ void Assignment::CheckTypes()
 void ForLoop::CheckTypes()
 {
     ValueType& startType = m_start.GetType();
-    if (dynamic_cast<ScalarType*>(&startType) == nullptr)
+    if (!startType.IsScalar())
         throw std::runtime_error("ForLoop : Start must be a scalar value");
     ValueType& endType = m_end.GetType();
-    if (dynamic_cast<ScalarType*>(&endType) == nullptr)
+    if (!endType.IsScalar())
         throw std::runtime_error("ForLoop : End must be a scalar value");
+    if (m_step < 1)
+        throw std::runtime_error("ForLoop : Step must be positive");
     for (std::list<IRStatement*>::iterator stm=m_statements.begin() ; stm!=m_statements.end() ; ++stm)
     {
         (*stm)->CheckTypes();
     }
 }
 
+void DenseLayer::CheckTypes()
+{
+    if (m_numInputs <= 0)
+        throw std::runtime_error("DenseLayer : Weights must be vectors of known length");
+    if (m_biases != nullptr && !m_biases->GetElementType().IsReal())
+        throw std::runtime_error("DenseLayer : Biases must be real values");
+    if (m_biases != nullptr && m_biases->GetNumberOfValues() != m_numNeurons)
+        throw std::runtime_error("DenseLayer : Expected one bias per neuron");
+    if (m_activation < 0 || m_activation >= KernelActivationCount || !sKernelActivations[m_activation].elementwise)
+        throw std::runtime_error("DenseLayer : Activation must be an elementwise kernel activation");
+    if (m_accumulatePrecision != RealType::Float64 && m_accumulatePrecision != RealType::Float32)
+        throw std::runtime_error("DenseLayer : Sums must be accumulated in Float64 or Float32");
+    if (m_biases != nullptr && m_biases->GetPrecision() != m_weights.GetPrecision())
+        throw std::runtime_error("DenseLayer : Weights and biases must be stored at the same precision");
+    if (IsQuantized() && !(m_inputQuantization.scale > 0.0))
+        throw std::runtime_error("DenseLayer : Quantized inputs need a positive scale");
+    if (!m_batchSize.GetType().IsScalar())
+        throw std::runtime_error("DenseLayer : Batch size must be a scalar value");
+}
+
+Value& VectorOperand::GetElement(Value& index)
+{
+    if (m_valueSet != nullptr)
+        return GetValue::Create(*m_valueSet, *m_elemID, index);
+    if (!m_variable->GetType().IsVector())
+        return *m_variable;
+    Value& scaledIndex = m_stride == 1 ? index : BinaryMultiply::Create(index, Constant(m_stride));
+    return IndexedValue::Create(*m_variable, BinaryAdd::Create(*m_offset, scaledIndex));
+}
+
+static void CheckVectorOperand(VectorOperand& operand, const char* statementName)
+{
+    ValueType& type = operand.GetValueSet() ? operand.GetValueSet()->GetElementType() : operand.GetVariable()->GetType();
+    VectorType* vecType = type.AsVectorType();
+    if (!(vecType ? vecType->GetElementType().IsReal() : type.IsReal()))
+        throw std::runtime_error(std::string(statementName) + " : Operands must be real values");
+    if (vecType == nullptr && operand.GetStride() != 0)
+        throw std::runtime_error(std::string(statementName) + " : Scalar operands must have a stride of 0");
+}
+
+void VectorOperation::CheckTypes()
+{
+    VectorType* resultType = m_result.GetType().AsVectorType();
+    if (resultType == nullptr || !resultType->GetElementType().IsReal())
+        throw std::runtime_error("VectorOperation : Result must be a real vector");
+    if (resultType->GetLength() < m_length)
+        throw std::runtime_error("VectorOperation : Result is shorter than the operation");
+    CheckVectorOperand(m_lhs, "VectorOperation");
+    CheckVectorOperand(m_rhs, "VectorOperation");
+}
+
+void VectorReduction::CheckTypes()
+{
+    if (!m_result.GetType().IsReal())
+        throw std::runtime_error("VectorReduction : Result must be a real scalar");
+    if (m_length < 1)
+        throw std::runtime_error("VectorReduction : Cannot reduce an empty vector");
+    CheckVectorOperand(m_operand, "VectorReduction");
+    if (m_factor != nullptr)
+        CheckVectorOperand(*m_factor, "VectorReduction");
+}
+
+void VectorActivation::CheckTypes()
+{
+    VectorType* vecType = m_variable.GetType().AsVectorType();
+    if (vecType == nullptr || !vecType->GetElementType().IsReal())
+        throw std::runtime_error("VectorActivation : Variable must be a real vector");
+    if (m_length < 1 || m_rowLength < m_length || vecType->GetLength() < m_offset + m_length)
+        throw std::runtime_error("VectorActivation : Rows do not fit in the variable");
+    if (m_activation < 0 || m_activation >= KernelActivationCount)
+        throw std::runtime_error("VectorActivation : Unknown activation");
+    if (!m_batchSize.GetType().IsScalar())
+        throw std::runtime_error("VectorActivation : Batch size must be a scalar value");
+}
+
+static void PrintVectorOperand(VectorOperand& operand, std::ostream& ostr)
+{
+    if (operand.GetValueSet() != nullptr)
+    {
+        ostr << "valueSet" << operand.GetValueSet()->GetID() << "[";
+        PrintValueExpression(*operand.GetElementID(), ostr);
+        ostr << "][i]";
+        return;
+    }
+    ostr << operand.GetVariable()->GetName() << "[";
+    PrintValueExpression(*operand.GetOffset(), ostr);
+    ostr << " + i*" << operand.GetStride() << "]";
+}
+
 class PrintIRStatementVisitor : public IRStatementVisitor
 {
     std::ostream& m_ostr;
@@ -79,10 +328,12 @@ public:
     virtual void Visit(ForLoop& forLoop)
     {
         Indent();
-        m_ostr << "for " << forLoop.GetIndexVariable().GetName() << " = ";
+        m_ostr << (forLoop.IsParallel() ? "parallel for " : "for ") << forLoop.GetIndexVariable().GetName() << " = ";
         PrintValueExpression(forLoop.GetStart(), m_ostr);
         m_ostr << " : ";
         PrintValueExpression(forLoop.GetEnd(), m_ostr);
+        if (forLoop.GetStep() != 1)
+            m_ostr << " step " << forLoop.GetStep();
         m_ostr << "\n";
         Indent();
         m_ostr << "{\n";
@@ -101,6 +352,59 @@ public:
         PrintValueType(varDefinition.GetVariable().GetType(), m_ostr);
         m_ostr << std::endl;
     }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        Indent();
+        m_ostr << "Dense : " << denseLayer.GetOutput().GetName() << "[" << denseLayer.GetOutputOffset() << " : "
+               << denseLayer.GetOutputOffset() + denseLayer.GetNumberOfNeurons() << "] = " << sKernelActivations[denseLayer.GetActivation()].name
+               << "(valueSet" << denseLayer.GetWeights().GetID() << " * " << denseLayer.GetInput().GetName() << "["
+               << denseLayer.GetInputOffset() << " : " << denseLayer.GetInputOffset() + denseLayer.GetNumberOfInputs() << "]";
+        if (denseLayer.GetBiases() != nullptr)
+            m_ostr << " + valueSet" << denseLayer.GetBiases()->GetID();
+        m_ostr << ")";
+        if (denseLayer.IsQuantized())
+            m_ostr << " in int8 with input scale " << denseLayer.GetInputQuantization().scale << " and zero point "
+                   << denseLayer.GetInputQuantization().zeroPoint;
+        else if (denseLayer.GetAccumulatePrecision() == RealType::Float32)
+            m_ostr << " in float32";
+        m_ostr << " for batch rows 0 : ";
+        PrintValueExpression(denseLayer.GetBatchSize(), m_ostr);
+        m_ostr << "\n";
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        static const char* operators[] = { " + ", " - ", " * ", " / " };
+        Indent();
+        m_ostr << "Vector : " << vectorOperation.GetResult().GetName() << "[i] = ";
+        PrintVectorOperand(vectorOperation.GetLHS(), m_ostr);
+        m_ostr << operators[vectorOperation.GetOperation()];
+        PrintVectorOperand(vectorOperation.GetRHS(), m_ostr);
+        m_ostr << " for i = 0 : " << vectorOperation.GetLength() << "\n";
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        static const char* reductions[] = { "Sum", "Multiply", "Max" };
+        Indent();
+        m_ostr << "Vector : " << vectorReduction.GetResult().GetName() << " = " << reductions[vectorReduction.GetReductionType()] << "(";
+        PrintVectorOperand(vectorReduction.GetOperand(), m_ostr);
+        if (vectorReduction.GetFactor() != nullptr)
+        {
+            m_ostr << " * ";
+            PrintVectorOperand(*vectorReduction.GetFactor(), m_ostr);
+        }
+        m_ostr << " for i = 0 : " << vectorReduction.GetLength() << ")\n";
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        Indent();
+        m_ostr << "Vector : " << vectorActivation.GetVariable().GetName() << "[" << vectorActivation.GetOffset() << " : "
+               << vectorActivation.GetOffset() + vectorActivation.GetLength() << "] = "
+               << sKernelActivations[vectorActivation.GetActivation()].name << "(" << vectorActivation.GetVariable().GetName() << "["
+               << vectorActivation.GetOffset() << " : " << vectorActivation.GetOffset() + vectorActivation.GetLength()
+               << "]) for batch rows 0 : ";
+        PrintValueExpression(vectorActivation.GetBatchSize(), m_ostr);
+        m_ostr << "\n";
+    }
 };
 
 void Print(IRStatement& stm, std::ostream& ostr, int32_t indent)
@@ -108,3 +412,296 @@ void Print(IRStatement& stm, std::ostream& ostr, int32_t indent)
     PrintIRStatementVisitor printVisitor(ostr, indent);
     stm.AcceptVisitor(printVisitor);
 }
+
+// Collects the variables a value refers to
+class CollectVariablesVisitor : public IRValueVisitor
+{
+    std::set<Variable*>& m_variables;
+
+    void VisitBinaryOp(BinaryOp& binOp)
+    {
+        binOp.GetLHS().AcceptIRValueVisitor(*this);
+        binOp.GetRHS().AcceptIRValueVisitor(*this);
+    }
+public:
+    CollectVariablesVisitor(std::set<Variable*>& variables)
+        :m_variables(variables)
+    { }
+    virtual void Visit(IntegerConstant& intConst) { }
+    virtual void Visit(BooleanConstant& boolConst) { }
+    virtual void Visit(RealConstant& realConst) { }
+    virtual void Visit(RealVectorConstant& realVecConst) { }
+    virtual void Visit(UnaryPlus& unaryPlus) { unaryPlus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(UnaryMinus& unaryMinus) { unaryMinus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitBinaryOp(binaryAdd); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitBinaryOp(binarySubtract); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { VisitBinaryOp(binaryMultiply); }
+    virtual void Visit(BinaryDivide& binaryDivide) { VisitBinaryOp(binaryDivide); }
+    virtual void Visit(GetInputValue& getInput) { }
+    virtual void Visit(Reduction& reduction) { reduction.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(ActivationFunction& function) { function.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(Variable& variable) { m_variables.insert(&variable); }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        m_variables.insert(&indexedVal.GetVariable());
+        indexedVal.GetIndexer().AcceptIRValueVisitor(*this);
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        getValue.GetElementID().AcceptIRValueVisitor(*this);
+        if (getValue.GetScalarIndex() != nullptr)
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+    }
+};
+
+// Collects the variables a statement reads and writes
+class VariableAccessVisitor : public IRStatementVisitor
+{
+    std::set<Variable*> m_reads;
+    std::set<Variable*> m_writes;
+    CollectVariablesVisitor m_readCollector;
+public:
+    VariableAccessVisitor()
+        :m_readCollector(m_reads)
+    { }
+    std::set<Variable*>& GetReads() { return m_reads; }
+    std::set<Variable*>& GetWrites() { return m_writes; }
+    virtual void Visit(Assignment& assignment)
+    {
+        assignment.GetRHS().AcceptIRValueVisitor(m_readCollector);
+        if (IndexedValue* indexedLHS = dynamic_cast<IndexedValue*>(&assignment.GetLHS()))
+        {
+            m_writes.insert(&indexedLHS->GetVariable());
+            indexedLHS->GetIndexer().AcceptIRValueVisitor(m_readCollector);
+        }
+        else if (Variable* lhsVar = dynamic_cast<Variable*>(&assignment.GetLHS()))
+            m_writes.insert(lhsVar);
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        forLoop.GetStart().AcceptIRValueVisitor(m_readCollector);
+        forLoop.GetEnd().AcceptIRValueVisitor(m_readCollector);
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+    }
+    virtual void Visit(VariableDefinition& varDefinition) { }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        m_reads.insert(&denseLayer.GetInput());
+        denseLayer.GetBatchSize().AcceptIRValueVisitor(m_readCollector);
+        m_writes.insert(&denseLayer.GetOutput());
+    }
+    void AddReads(VectorOperand& operand)
+    {
+        if (operand.GetVariable() != nullptr)
+        {
+            m_reads.insert(operand.GetVariable());
+            operand.GetOffset()->AcceptIRValueVisitor(m_readCollector);
+        }
+        else
+            operand.GetElementID()->AcceptIRValueVisitor(m_readCollector);
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        AddReads(vectorOperation.GetLHS());
+        AddReads(vectorOperation.GetRHS());
+        m_writes.insert(&vectorOperation.GetResult());
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        AddReads(vectorReduction.GetOperand());
+        if (vectorReduction.GetFactor() != nullptr)
+            AddReads(*vectorReduction.GetFactor());
+        m_writes.insert(&vectorReduction.GetResult());
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        m_reads.insert(&vectorActivation.GetVariable());
+        vectorActivation.GetBatchSize().AcceptIRValueVisitor(m_readCollector);
+        m_writes.insert(&vectorActivation.GetVariable());
+    }
+};
+
+static bool IsParallelStatement(IRStatement& stm)
+{
+    if (ForLoop* forLoop = dynamic_cast<ForLoop*>(&stm))
+        return forLoop->IsParallel();
+    return dynamic_cast<DenseLayer*>(&stm) != nullptr;
+}
+
+static bool Intersect(std::set<Variable*>& first, std::set<Variable*>& second)
+{
+    for (std::set<Variable*>::iterator iter=first.begin() ; iter!=first.end() ; ++iter)
+    {
+        if (second.count(*iter) != 0)
+            return true;
+    }
+    return false;
+}
+
+std::vector<ParallelStage> GetParallelStages(Function& function)
+{
+    // Only variables visible to all statements can create conflicts. Anything else is a
+    // temporary or an index defined inside a loop.
+    std::set<Variable*> sharedVariables;
+    sharedVariables.insert(&function.GetInputVariable());
+    sharedVariables.insert(&function.GetOutputVariable());
+    if (function.GetBatchSizeVariable() != nullptr)
+        sharedVariables.insert(function.GetBatchSizeVariable());
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter))
+            sharedVariables.insert(&definition->GetVariable());
+    }
+
+    std::vector<ParallelStage> stages;
+    std::set<Variable*> stageReads;
+    std::set<Variable*> stageWrites;
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (dynamic_cast<VariableDefinition*>(*iter) != nullptr)
+            continue;
+        VariableAccessVisitor accesses;
+        (*iter)->AcceptVisitor(accesses);
+        std::set<Variable*> reads;
+        std::set<Variable*> writes;
+        std::set_intersection(accesses.GetReads().begin(), accesses.GetReads().end(), sharedVariables.begin(), sharedVariables.end(),
+                              std::inserter(reads, reads.begin()));
+        std::set_intersection(accesses.GetWrites().begin(), accesses.GetWrites().end(), sharedVariables.begin(), sharedVariables.end(),
+                              std::inserter(writes, writes.begin()));
+
+        // Parallel statements write disjoint elements of their outputs, so they only conflict
+        // through reads of what another statement writes
+        bool parallel = IsParallelStatement(*(*iter));
+        bool joinStage = parallel && !stages.empty() && stages.back().parallel &&
+                         !Intersect(reads, stageWrites) && !Intersect(writes, stageReads);
+        if (!joinStage)
+        {
+            ParallelStage stage;
+            stage.parallel = parallel;
+            stages.push_back(stage);
+            stageReads.clear();
+            stageWrites.clear();
+        }
+        stages.back().statements.push_back(*iter);
+        stageReads.insert(reads.begin(), reads.end());
+        stageWrites.insert(writes.begin(), writes.end());
+    }
+    return stages;
+}
+
+// Stages in which a planned workspace variable is live, and its placement
+struct LiveRange
+{
+    Variable* var;
+    int64_t length;
+    int32_t first;
+    int32_t last;
+    int64_t offset;
+};
+
+static bool IsLongerRange(LiveRange* first, LiveRange* second)
+{
+    if (first->length != second->length)
+        return first->length > second->length;
+    return first->first < second->first;
+}
+
+static bool IsLowerRange(LiveRange* first, LiveRange* second)
+{
+    return first->offset < second->offset;
+}
+
+WorkspacePlan PlanWorkspace(Function& function)
+{
+    std::vector<ParallelStage> stages = GetParallelStages(function);
+    std::map<IRStatement*, int32_t> statementStages;
+    for (size_t i=0 ; i<stages.size() ; ++i)
+    {
+        for (size_t j=0 ; j<stages[i].statements.size() ; ++j)
+            statementStages[stages[i].statements[j]] = static_cast<int32_t>(i);
+    }
+
+    // Collect the live range of every planned variable in stages. Variables that are never
+    // accessed are live where they are defined.
+    std::vector<LiveRange> ranges;
+    std::map<Variable*, size_t> rangeIndices;
+    int32_t stage = -1;
+    bool anyBatched = false;
+    bool anyUnbatched = false;
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter))
+        {
+            Variable& var = definition->GetVariable();
+            VectorType* vecType = var.GetType().AsVectorType();
+            if (vecType == nullptr || !vecType->GetElementType().IsReal())
+                continue;
+            if (vecType->GetLength() < 0)
+                throw std::runtime_error("PlanWorkspace : Vector variables must have a known length");
+            (var.IsBatched() ? anyBatched : anyUnbatched) = true;
+            LiveRange range = { &var, vecType->GetLength(), -1, stage + 1, 0 };
+            rangeIndices[&var] = ranges.size();
+            ranges.push_back(range);
+            continue;
+        }
+        stage = statementStages[*iter];
+        VariableAccessVisitor accesses;
+        (*iter)->AcceptVisitor(accesses);
+        std::set<Variable*>& reads = accesses.GetReads();
+        std::set<Variable*> used(reads.begin(), reads.end());
+        used.insert(accesses.GetWrites().begin(), accesses.GetWrites().end());
+        for (std::set<Variable*>::iterator usedIter=used.begin() ; usedIter!=used.end() ; ++usedIter)
+        {
+            std::map<Variable*, size_t>::iterator rangeIter = rangeIndices.find(*usedIter);
+            if (rangeIter == rangeIndices.end())
+                continue;
+            LiveRange& range = ranges[rangeIter->second];
+            if (range.first < 0)
+                range.first = stage;
+            range.last = stage;
+        }
+    }
+    // Batched offsets are scaled by the batch size, which would make them overlap unbatched ones
+    if (anyBatched && anyUnbatched)
+        throw std::runtime_error("PlanWorkspace : Top level vectors must all be batched or all unbatched");
+
+    // Place the longest variables first, each at the lowest offset where it does not overlap
+    // a placed variable that is live in one of the same stages
+    std::vector<LiveRange*> order;
+    for (size_t i=0 ; i<ranges.size() ; ++i)
+    {
+        if (ranges[i].first < 0)
+            ranges[i].first = ranges[i].last;
+        order.push_back(&ranges[i]);
+    }
+    std::sort(order.begin(), order.end(), IsLongerRange);
+    WorkspacePlan plan;
+    plan.size = 0;
+    std::vector<LiveRange*> placed;
+    for (size_t i=0 ; i<order.size() ; ++i)
+    {
+        LiveRange& range = *order[i];
+        std::vector<LiveRange*> conflicts;
+        for (size_t j=0 ; j<placed.size() ; ++j)
+        {
+            if (placed[j]->first <= range.last && range.first <= placed[j]->last)
+                conflicts.push_back(placed[j]);
+        }
+        std::sort(conflicts.begin(), conflicts.end(), IsLowerRange);
+        range.offset = 0;
+        for (size_t j=0 ; j<conflicts.size() ; ++j)
+        {
+            if (conflicts[j]->offset >= range.offset + range.length)
+                break;
+            range.offset = std::max(range.offset, conflicts[j]->offset + conflicts[j]->length);
+        }
+        placed.push_back(&range);
+        plan.offsets[range.var] = range.offset;
+        plan.size = std::max(plan.size, range.offset + range.length);
+    }
+    return plan;
+}
@@ -7,6 +7,7 @@
 // of "lowering" a network object.
 
 #include <list>
+#include <map>
 #include <string>
 #include <vector>
 #include "irvaluevisitor.h"
@@ -29,19 +30,24 @@ public:
 class Variable : public IRValue
 {
     std::string m_name;
+    // A batched variable holds one value of its type for every input in the batch. Only
+    // used when the batch size is a runtime parameter, in which case storage has to be
+    // sized when the function is called.
+    bool m_batched;
 public:
-    Variable(const std::string& name, ValueType& type)
-        :m_name(name)
+    Variable(const std::string& name, ValueType& type, bool batched = false)
+        :m_name(name), m_batched(batched)
     {
         m_type = &type;
     }
     void InferType() { /* Nothing to do because type is already specified */ }
     void AcceptIRValueVisitor(IRValueVisitor& visitor) { visitor.Visit(*this); }
     const std::string& GetName() { return m_name; }
+    bool IsBatched() { return m_batched; }
 
-    static Variable& Create(const std::string& name, ValueType& type)
+    static Variable& Create(const std::string& name, ValueType& type, bool batched = false)
     {
-        return *(new Variable(name, type));
+        return *(new Variable(name, type, batched));
     }
 };
 
@@ -72,56 +78,132 @@ public:
 // mean we have arrays of structs that represent all neuron properties.
 // The approach we have taken is a struct of arrays. It is not yet 
 // clear to me whether one is better than the other.
-class ValueSet 
+//
+// The values are copied into one aligned, contiguous buffer of doubles (integer
+// and boolean values are stored exactly). Sets of real values can be stored at a
+// lower precision, given by the real type of their element type, in which case the
+// buffer holds float, KernelFloat16 or KernelBFloat16 scalars. With the RowMajor
+// layout the scalars of a value are consecutive, with the Transposed layout scalar
+// i of all values is consecutive. Scalar i of value id is at
+//     GetData()[id * GetValueStride() + i * GetScalarStride()]
+// A quantized set holds int8 scalars, with a scale and zero point per value (see
+// KernelQuantization), and GetScalar returns the dequantized reals.
+class ValueSet : public ArenaObject
 {
+public:
+    enum Layout { RowMajor, Transposed };
+    static const size_t Alignment = 64;
+private:
     int32_t m_id;
     ValueType& m_elemType;
-    std::vector<ConstantValue*> m_values;
+    int32_t m_elemLength; // number of scalars per value
+    int32_t m_numValues;
+    int32_t m_capacity;
+    Layout m_layout;
+    RealType::Precision m_precision;
+    int32_t m_scalarSize; // bytes
+    char* m_data;
+    bool m_quantized;
+    std::vector<double> m_scales;
+    std::vector<int32_t> m_zeroPoints;
+    std::vector<int32_t> m_quantizedSums;
+
+    void Reserve(int32_t capacity);
+    void SetScalar(int64_t position, double value);
 public:
-    ValueSet(int32_t id, ValueType& elemType)
-        :m_id(id), m_elemType(elemType)
-    { }
+    ValueSet(int32_t id, ValueType& elemType);
+    ~ValueSet();
     int32_t GetID() { return m_id; }
     ValueType& GetElementType() { return m_elemType; }
     int32_t AddValue(ConstantValue& constVal);
-    ConstantValue& GetValue(int32_t id) { return *m_values[id]; }
+    int32_t GetNumberOfValues() { return m_numValues; }
+    int32_t GetElementLength() { return m_elemLength; }
+    Layout GetLayout() { return m_layout; }
+    // Repacks the buffer. Values can only be added in the RowMajor layout.
+    void SetLayout(Layout layout);
+    // Float64 unless the set holds reals stored at a lower precision
+    RealType::Precision GetPrecision() { return m_precision; }
+    const void* GetData() { return m_data; }
+    int64_t GetValueStride() { return m_layout == RowMajor ? m_elemLength : 1; }
+    int64_t GetScalarStride() { return m_layout == RowMajor ? 1 : m_numValues; }
+    double GetScalar(int32_t id, int32_t i);
+    // Stores the real vectors of the set as int8, each with the scale and zero point that map
+    // its range onto [-128, 127]. The precision stays that of the element type, which is
+    // what the values are read as.
+    void Quantize();
+    bool IsQuantized() { return m_quantized; }
+    // Per value, empty unless the set is quantized. The sums are those of the stored int8 scalars.
+    const std::vector<double>& GetScales() { return m_scales; }
+    const std::vector<int32_t>& GetZeroPoints() { return m_zeroPoints; }
+    const std::vector<int32_t>& GetQuantizedSums() { return m_quantizedSums; }
 };
 
+// Value id of a value set. With a scalar index, scalar 'index' of a vector value.
 class GetValue : public IRValue
 {
     ValueSet& m_valueSet;
     Value& m_elemID;
+    Value* m_scalarIndex; // nullptr for the whole value
 public:
-    GetValue(ValueSet& valSet, Value& elemID)
-        :m_valueSet(valSet), m_elemID(elemID)
+    GetValue(ValueSet& valSet, Value& elemID, Value* scalarIndex = nullptr)
+        :m_valueSet(valSet), m_elemID(elemID), m_scalarIndex(scalarIndex)
     { }
     Value& GetElementID() { return m_elemID; }
+    Value* GetScalarIndex() { return m_scalarIndex; }
     ValueSet& GetValueSet() { return m_valueSet; }
     void AcceptIRValueVisitor(IRValueVisitor& visitor) { visitor.Visit(*this); }
     virtual void InferType()
     {
-        m_type = m_valueSet.GetElementType().Clone();
+        VectorType* vecType = m_valueSet.GetElementType().AsVectorType();
+        if (m_scalarIndex != nullptr && vecType != nullptr)
+            m_type = &vecType->GetElementType();
+        else
+            m_type = &m_valueSet.GetElementType();
     }
     static GetValue& Create(ValueSet& valSet, Value& elemID)
     {
         return *(new GetValue(valSet, elemID));
     }
+    static GetValue& Create(ValueSet& valSet, Value& elemID, Value& scalarIndex)
+    {
+        return *(new GetValue(valSet, elemID, &scalarIndex));
+    }
 };
 
 
 // TODO Consider moving the IRStatement list functionality that is common to function
 // and for loop into a shared class
-class Function
+// The function owns its value sets. Statements and values are only freed in bulk by an Arena.
+class Function : public ArenaObject
 {
     Variable& m_inputVar;
     Variable& m_outputVar;
+    // Number of inputs processed per call when it is fixed at compile time. Variable lengths
+    // already include the batch in that case.
+    int32_t m_batchSize;
+    // Integer parameter holding the batch size when it is only known at runtime
+    Variable* m_batchSizeVar;
     std::list<ValueSet*> m_valueSets;
     std::list<IRStatement*> m_stmList;
 public:
     Function(Variable& inputVar, Variable& outputVar)
-        :m_inputVar(inputVar), m_outputVar(outputVar)
+        :m_inputVar(inputVar), m_outputVar(outputVar), m_batchSize(1), m_batchSizeVar(nullptr)
     {}
+    ~Function()
+    {
+        for (auto iter=m_valueSets.begin() ; iter!=m_valueSets.end() ; ++iter)
+            ArenaObject::Release(*iter);
+    }
+    Variable& GetInputVariable() { return m_inputVar; }
+    Variable& GetOutputVariable() { return m_outputVar; }
+    int32_t GetBatchSize() { return m_batchSize; }
+    void SetBatchSize(int32_t batchSize) { m_batchSize = batchSize; }
+    Variable* GetBatchSizeVariable() { return m_batchSizeVar; }
+    void SetBatchSizeVariable(Variable& batchSizeVar) { m_batchSizeVar = &batchSizeVar; }
+    const std::list<ValueSet*>& GetValueSets() { return m_valueSets; }
     const std::list<IRStatement*>& GetStatementList() { return m_stmList; }
+    // For passes that rewrite the top level statements
+    std::list<IRStatement*>& GetStatements() { return m_stmList; }
     void AddStatement(IRStatement& stm) { m_stmList.push_back(&stm); }
     static Function& Create(Variable& inputVar, Variable& outputVar)
     {
@@ -137,7 +219,7 @@ public:
 
 class IRStatementVisitor;
 
-class IRStatement
+class IRStatement : public ArenaObject
 {
 public:
     virtual void CheckTypes() = 0;
@@ -182,8 +264,12 @@ class ForLoop : public IRStatement
 {
     Value& m_start;
     Value& m_end;
-    // Value& m_step; TODO is this needed?
+    // The index runs from start in increments of step while it is below end
+    int64_t m_step;
     Variable* m_indexVar;
+    // Set when the iterations are independent and may run on different threads. The
+    // iterations then write distinct elements and only use temporaries defined in the body.
+    bool m_parallel;
 
     std::list<IRStatement*> m_statements;
 
@@ -195,14 +281,14 @@ class ForLoop : public IRStatement
         return ret;
     }
 public:
-    ForLoop(Value& start, Value& end)
-        :m_start(start), m_end(end)
+    ForLoop(Value& start, Value& end, int64_t step = 1)
+        :m_start(start), m_end(end), m_step(step), m_parallel(false)
     {
-        m_indexVar = new Variable(GetLoopVarName(), *(new IntegerType));
+        m_indexVar = new Variable(GetLoopVarName(), IntegerType::Get());
     }
     ~ForLoop()
     {
-        delete m_indexVar;
+        ArenaObject::Release(m_indexVar);
     }
     void AddStatement(IRStatement& stm) { m_statements.push_back(&stm); }
     void CheckTypes();
@@ -210,14 +296,346 @@ public:
     Variable& GetIndexVariable() { return *m_indexVar; }
     Value& GetStart() { return m_start; }
     Value& GetEnd() { return m_end; }
+    int64_t GetStep() { return m_step; }
+    bool IsParallel() { return m_parallel; }
+    void SetParallel(bool parallel) { m_parallel = parallel; }
     std::list<IRStatement*>& GetStatements() { return m_statements; }
-    static ForLoop& Create(Value& start, Value& end)
+    static ForLoop& Create(Value& start, Value& end, int64_t step = 1)
+    {
+        return *(new ForLoop(start, end, step));
+    }
+};
+
+// A whole fully connected ensemble evaluated by a blocked matrix kernel:
+//   output[b*outputRowLength + outputOffset + n] =
+//       activation(biases[n] + sum_k weights[n][k] * input[b*inputRowLength + inputOffset + k])
+// for every neuron n of the ensemble and every row b of the batch. Created by
+// the lowering when it recognizes the dense neuron pattern. When the weights are
+// quantized, the inputs are quantized to int8 with the input quantization and the
+// sums are computed in int32 and dequantized before the bias is added.
+class DenseLayer : public IRStatement
+{
+    ValueSet& m_weights;
+    ValueSet* m_biases; // nullptr when the neurons have no bias
+    Variable& m_input;
+    Variable& m_output;
+    int32_t m_numNeurons;
+    int32_t m_numInputs;
+    int32_t m_inputOffset;
+    int32_t m_outputOffset;
+    int32_t m_inputRowLength;
+    int32_t m_outputRowLength;
+    Value& m_batchSize;
+    int32_t m_activation; // KernelActivation, KernelActivationNone when there is no activation function
+    int32_t m_accuracy; // KernelAccuracy
+    RealType::Precision m_accumulatePrecision; // Float64 or Float32
+    KernelQuantization m_inputQuantization;
+public:
+    DenseLayer(ValueSet& weights, ValueSet* biases, Variable& input, int32_t inputOffset, int32_t inputRowLength,
+               Variable& output, int32_t outputOffset, int32_t outputRowLength, Value& batchSize, int32_t activation, int32_t accuracy,
+               RealType::Precision accumulatePrecision)
+        :m_weights(weights), m_biases(biases), m_input(input), m_output(output), m_numNeurons(weights.GetNumberOfValues()),
+         m_numInputs(0), m_inputOffset(inputOffset), m_outputOffset(outputOffset), m_inputRowLength(inputRowLength),
+         m_outputRowLength(outputRowLength), m_batchSize(batchSize), m_activation(activation), m_accuracy(accuracy),
+         m_accumulatePrecision(accumulatePrecision)
+    {
+        if (VectorType* vecType = weights.GetElementType().AsVectorType())
+            m_numInputs = vecType->GetLength();
+        m_inputQuantization.scale = 1.0;
+        m_inputQuantization.zeroPoint = 0;
+    }
+    ValueSet& GetWeights() { return m_weights; }
+    ValueSet* GetBiases() { return m_biases; }
+    Variable& GetInput() { return m_input; }
+    Variable& GetOutput() { return m_output; }
+    int32_t GetNumberOfNeurons() { return m_numNeurons; }
+    int32_t GetNumberOfInputs() { return m_numInputs; }
+    int32_t GetInputOffset() { return m_inputOffset; }
+    int32_t GetOutputOffset() { return m_outputOffset; }
+    int32_t GetInputRowLength() { return m_inputRowLength; }
+    int32_t GetOutputRowLength() { return m_outputRowLength; }
+    Value& GetBatchSize() { return m_batchSize; }
+    int32_t GetActivation() { return m_activation; }
+    int32_t GetAccuracy() { return m_accuracy; }
+    RealType::Precision GetAccumulatePrecision() { return m_accumulatePrecision; }
+    bool IsQuantized() { return m_weights.IsQuantized(); }
+    const KernelQuantization& GetInputQuantization() { return m_inputQuantization; }
+    void SetInputQuantization(const KernelQuantization& quantization) { m_inputQuantization = quantization; }
+    void CheckTypes();
+    void AcceptVisitor(IRStatementVisitor& visitor) { visitor.Visit(*this); }
+    static DenseLayer& Create(ValueSet& weights, ValueSet* biases, Variable& input, int32_t inputOffset, int32_t inputRowLength,
+                              Variable& output, int32_t outputOffset, int32_t outputRowLength, Value& batchSize, int32_t activation, int32_t accuracy,
+                              RealType::Precision accumulatePrecision = RealType::Float64)
+    {
+        return *(new DenseLayer(weights, biases, input, inputOffset, inputRowLength, output, outputOffset, outputRowLength,
+                                batchSize, activation, accuracy, accumulatePrecision));
+    }
+};
+
+// A strided run of real scalars used by the vector statements. Element i is
+// var[offset + i * stride] of a variable, or scalar i of value elemID of a value
+// set. A stride of 0 broadcasts a scalar variable.
+class VectorOperand
+{
+    Variable* m_variable;
+    Value* m_offset;
+    int32_t m_stride;
+    ValueSet* m_valueSet;
+    Value* m_elemID;
+public:
+    VectorOperand(Variable& var, Value& offset, int32_t stride)
+        :m_variable(&var), m_offset(&offset), m_stride(stride), m_valueSet(nullptr), m_elemID(nullptr)
+    { }
+    VectorOperand(ValueSet& valueSet, Value& elemID)
+        :m_variable(nullptr), m_offset(nullptr), m_stride(0), m_valueSet(&valueSet), m_elemID(&elemID)
+    { }
+    // nullptr for value set operands
+    Variable* GetVariable() { return m_variable; }
+    Value* GetOffset() { return m_offset; }
+    int32_t GetStride() { return m_stride; }
+    // nullptr for variable operands
+    ValueSet* GetValueSet() { return m_valueSet; }
+    Value* GetElementID() { return m_elemID; }
+    // Element 'index' as a scalar IR value
+    Value& GetElement(Value& index);
+};
+
+// result[i] = lhs[i] op rhs[i] for 0 <= i < length, where result is a real vector
+// variable. Executed by the SIMD kernels in kernels.h.
+class VectorOperation : public IRStatement
+{
+public:
+    enum OperationType { Add, Subtract, Multiply, Divide };
+private:
+    OperationType m_operation;
+    Variable& m_result;
+    VectorOperand m_lhs;
+    VectorOperand m_rhs;
+    int32_t m_length;
+public:
+    VectorOperation(OperationType operation, Variable& result, const VectorOperand& lhs, const VectorOperand& rhs, int32_t length)
+        :m_operation(operation), m_result(result), m_lhs(lhs), m_rhs(rhs), m_length(length)
+    { }
+    OperationType GetOperation() { return m_operation; }
+    Variable& GetResult() { return m_result; }
+    VectorOperand& GetLHS() { return m_lhs; }
+    VectorOperand& GetRHS() { return m_rhs; }
+    int32_t GetLength() { return m_length; }
+    void CheckTypes();
+    void AcceptVisitor(IRStatementVisitor& visitor) { visitor.Visit(*this); }
+    static VectorOperation& Create(OperationType operation, Variable& result, const VectorOperand& lhs, const VectorOperand& rhs, int32_t length)
+    {
+        return *(new VectorOperation(operation, result, lhs, rhs, length));
+    }
+};
+
+// result = operand[0] op operand[1] op ... op operand[length-1] for a real scalar
+// variable result. The kernels reassociate the operation to use several
+// accumulators, so sums can differ from a sequential loop in the last bits.
+// A sum can have a factor, in which case element i is operand[i] * factor[i] and
+// the statement is a dot product that never stores the products.
+class VectorReduction : public IRStatement
+{
+    Reduction::ReductionType m_reductionType;
+    Variable& m_result;
+    VectorOperand m_operand;
+    VectorOperand* m_factor;
+    int32_t m_length;
+public:
+    VectorReduction(Reduction::ReductionType reductionType, Variable& result, const VectorOperand& operand, int32_t length)
+        :m_reductionType(reductionType), m_result(result), m_operand(operand), m_factor(nullptr), m_length(length)
+    { }
+    VectorReduction(Variable& result, const VectorOperand& operand, const VectorOperand& factor, int32_t length)
+        :m_reductionType(Reduction::Sum), m_result(result), m_operand(operand), m_factor(new VectorOperand(factor)), m_length(length)
+    { }
+    ~VectorReduction() { delete m_factor; }
+    Reduction::ReductionType GetReductionType() { return m_reductionType; }
+    Variable& GetResult() { return m_result; }
+    VectorOperand& GetOperand() { return m_operand; }
+    // nullptr unless the statement is a dot product
+    VectorOperand* GetFactor() { return m_factor; }
+    int32_t GetLength() { return m_length; }
+    void CheckTypes();
+    void AcceptVisitor(IRStatementVisitor& visitor) { visitor.Visit(*this); }
+    static VectorReduction& Create(Reduction::ReductionType reductionType, Variable& result, const VectorOperand& operand, int32_t length)
+    {
+        return *(new VectorReduction(reductionType, result, operand, length));
+    }
+    static VectorReduction& CreateDotProduct(Variable& result, const VectorOperand& operand, const VectorOperand& factor, int32_t length)
+    {
+        return *(new VectorReduction(result, operand, factor, length));
+    }
+};
+
+// var[offset + b * rowLength + i] = activation(var[offset + b * rowLength + i]) for
+// 0 <= i < length and 0 <= b < batchSize, in place. Applies the activation of a whole
+// layer once its ensembles have written their values. Softmax normalizes each row.
+class VectorActivation : public IRStatement
+{
+    Variable& m_variable;
+    int32_t m_offset;
+    int32_t m_length;
+    int32_t m_rowLength;
+    Value& m_batchSize;
+    int32_t m_activation; // KernelActivation
+    int32_t m_accuracy; // KernelAccuracy
+public:
+    VectorActivation(Variable& var, int32_t offset, int32_t length, int32_t rowLength, Value& batchSize, int32_t activation, int32_t accuracy)
+        :m_variable(var), m_offset(offset), m_length(length), m_rowLength(rowLength), m_batchSize(batchSize),
+         m_activation(activation), m_accuracy(accuracy)
+    { }
+    Variable& GetVariable() { return m_variable; }
+    int32_t GetOffset() { return m_offset; }
+    int32_t GetLength() { return m_length; }
+    int32_t GetRowLength() { return m_rowLength; }
+    Value& GetBatchSize() { return m_batchSize; }
+    int32_t GetActivation() { return m_activation; }
+    int32_t GetAccuracy() { return m_accuracy; }
+    void CheckTypes();
+    void AcceptVisitor(IRStatementVisitor& visitor) { visitor.Visit(*this); }
+    static VectorActivation& Create(Variable& var, int32_t offset, int32_t length, int32_t rowLength, Value& batchSize,
+                                    int32_t activation, int32_t accuracy)
     {
-        return *(new ForLoop(start, end));
+        return *(new VectorActivation(var, offset, length, rowLength, batchSize, activation, accuracy));
     }
 };
 
+// Range of the values of every layer of a network, indexed by layer, observed on sample inputs
+struct QuantizationCalibration
+{
+    std::vector<double> minimums;
+    std::vector<double> maximums;
+};
+
+struct LoweringOptions
+{
+    // Number of input vectors processed by one call of the lowered function.
+    // RuntimeBatchSize makes the batch size a parameter of the function instead.
+    static const int32_t RuntimeBatchSize = 0;
+    int32_t batchSize;
+    // Lower fully connected ensembles to DenseLayer statements instead of per neuron loops
+    bool useDenseKernels;
+    // Lower elementwise operations and reductions over real vectors to VectorOperation and
+    // VectorReduction statements instead of scalar loops
+    bool useVectorKernels;
+    // Storage order of the value sets holding the neurons' constants
+    ValueSet::Layout valueSetLayout;
+    // Precision the real constants of the neurons are stored at. Per neuron loops read them
+    // as doubles and do not use vector kernels when it is not Float64.
+    RealType::Precision weightPrecision;
+    // Precision the dense kernels accumulate in, Float64 or Float32. Per neuron loops and
+    // layer outputs are always computed in double.
+    RealType::Precision accumulatePrecision;
+    // When set, the weights of the dense layers are quantized to int8 and the layers quantize
+    // their inputs with the calibrated range of the previous layer (see CalibrateQuantization).
+    // Ensembles lowered to per neuron loops keep real weights.
+    const QuantizationCalibration* quantization;
+    // KernelAccuracy of the activation functions that do not ask for a tier of their own
+    int32_t activationAccuracy;
+    // When all neurons of a layer share an activation function, store their values before
+    // the activation and apply it with one VectorActivation after the layer's ensembles.
+    // Layers with a softmax are always lowered this way.
+    bool splitActivations;
+    // Bytes of data cache that TransformLoops fits the tiles of loop nests in. 0 disables tiling.
+    int64_t cacheSize;
+    // Neurons of an ensemble loop that TransformLoops evaluates together, so that they share
+    // the loads of their inputs. 1 disables unroll-and-jam.
+    int32_t unrollAndJamFactor;
+    // Run OptimizeLoops on the lowered function
+    bool optimizeLoops;
+    // Run FuseLoops after OptimizeLoops. Fused loops are sequential, so this trades the
+    // parallelism of the fused layers for locality. Unroll-and-jam is skipped for the
+    // functions that can be fused.
+    bool fuseLoops;
+
+    LoweringOptions()
+        :batchSize(1), useDenseKernels(true), useVectorKernels(true), valueSetLayout(ValueSet::RowMajor), weightPrecision(RealType::Float64),
+         accumulatePrecision(RealType::Float64), quantization(nullptr), activationAccuracy(KernelAccuracyExact), splitActivations(false),
+         cacheSize(32 * 1024),
+         unrollAndJamFactor(4), optimizeLoops(true), fuseLoops(false)
+    { }
+};
+
+// Consecutive top level statements of a function that can run concurrently. A
+// parallel stage holds parallel loops and dense layers (which are split by neuron)
+// that write disjoint elements and do not read what the others write, e.g. all
+// ensembles of one layer. A sequential stage holds a single statement. Stages
+// run one after the other, so a barrier is only needed between them.
+struct ParallelStage
+{
+    bool parallel;
+    std::vector<IRStatement*> statements;
+};
+
+// Placement of the real vectors defined at the top level of a function in one
+// workspace, in elements per batch row. A variable is live from the first to the
+// last stage that accesses it, and variables that are never live in the same
+// stage share memory, so a chain of layers alternates between two buffers.
+struct WorkspacePlan
+{
+    std::map<Variable*, int64_t> offsets;
+    int64_t size;
+};
+
 void Print(IRStatement& stm, std::ostream& ostr, int32_t indent=0);
+std::vector<ParallelStage> GetParallelStages(Function& function);
+WorkspacePlan PlanWorkspace(Function& function);
+// Forwards single use temporaries and constants, hoists loop invariant scalars out of
+// sequential inner loops and turns products of their index into induction variables.
+// Defined in iroptimizer.cpp.
+void OptimizeLoops(Function& function);
+// Interleaves the loop of a layer with the loop of the next layer when every iteration of the
+// consumer only reads a sliding window of the producer's output, as with convolutional
+// connections, so that outputs are read while they are still in cache. Only functions with a
+// batch size of 1 are fused. Defined in iroptimizer.cpp.
+void FuseLoops(Function& function);
+// Loop transformations on a statement list. Each replaces the loop at loopIter by equivalent
+// loops, points loopIter at the first of them and returns true, or leaves the list alone and
+// returns false when it does not apply. Defined in iroptimizer.cpp.
+//
+// Splits a loop with constant bounds into a loop over tiles of tileSize iterations, whose
+// body runs the iterations of a tile, and a loop over the remaining iterations.
+bool StripMineLoop(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int64_t tileSize);
+// Swaps a parallel loop with the loop that is its body. The outer loop of the result is
+// sequential, since the iterations of the inner loop may depend on each other.
+bool InterchangeLoops(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter);
+// Runs a parallel loop and the loop that is its body, both with constant bounds, in tiles of
+// outerTileSize x innerTileSize iterations.
+bool TileLoopNest(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int64_t outerTileSize,
+                  int64_t innerTileSize);
+// Runs factor iterations of a parallel loop with constant bounds in each iteration, and fuses
+// the inner loops of the copies so that they share the loads of what does not depend on the
+// outer index.
+bool UnrollAndJamLoop(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int32_t factor);
+// Tiles the top level loop nests to fit options.cacheSize and unrolls and jams the ensemble
+// loops that contain a reduction loop by options.unrollAndJamFactor
+void TransformLoops(Function& function, const LoweringOptions& options);
 Function& ConstructIRForNetwork(Network& network);
+Function& ConstructIRForNetwork(Network& network, LoweringOptions& options);
+// Name of the variable holding the outputs of a layer in lowered functions
+std::string ConstructLayerOutputName(int32_t layerIdx);
+
+// Differences between the outputs of a network lowered with quantization and of the same
+// network lowered without it, over a set of sample inputs
+struct QuantizationReport
+{
+    int32_t numSamples;
+    double maxAbsoluteError;
+    double meanAbsoluteError;
+    // Largest minus smallest reference output, the scale the errors compare to
+    double outputRange;
+    // Fraction of the samples whose largest output is the same neuron in both
+    double argmaxAgreement;
+};
+
+// Post-training quantization. Defined in quantization.cpp.
+//
+// Runs the network on numSamples input vectors (numSamples rows of the input layer's
+// length) and records the range of every layer.
+QuantizationCalibration CalibrateQuantization(Network& network, const double* samples, int32_t numSamples);
+// Lowers the network with options, which should have a calibration, and without
+// quantization and compares their outputs on the samples
+QuantizationReport CompareQuantizedNetwork(Network& network, const LoweringOptions& options, const double* samples, int32_t numSamples);
+void PrintQuantizationReport(const QuantizationReport& report, std::ostream& ostr);
 
 #endif // _IR_H_
@@ -3,6 +3,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
 #include <cassert>
 #include "valuetype.h"
 #include "value.h"
@@ -12,9 +13,57 @@
 #include "layer.h"
 #include "network.h"
 #include "ir.h"
+#include "kernels.h"
 
+// Index (in the previous layer, or in the network input for input neurons)
+// of the first value a neuron reads.
+static int32_t GetFirstInputIndex(Neuron& neuron)
+{
+    if (dynamic_cast<InputNeuron*>(&neuron) != nullptr)
+        return neuron.GetNeuronID();
+    int32_t first, stride;
+    if (neuron.GetAffineSources(first, stride))
+        return first;
+    ConnectedNeurons sources = neuron.GetSources();
+    return sources.empty() ? 0 : sources.front()->GetNeuronID();
+}
+
+// True when the IDs of the neuron's sources are first, first + stride, first + 2*stride, ...
+static bool GetAffineSourceStride(Neuron& neuron, int32_t& stride)
+{
+    int32_t first;
+    return neuron.GetAffineSources(first, stride);
+}
+
+// Hash of the IDs of a neuron's sources relative to its first source. Neurons with the same
+// input pattern (see AreNeuronsMergeable) have the same hash.
+static size_t GetInputPatternHash(Neuron& neuron)
+{
+    int32_t numInputs = neuron.GetNumInputs();
+    int32_t first, stride;
+    if (neuron.GetAffineSources(first, stride))
+        return CombineHash(numInputs, numInputs > 1 ? stride : 0);
+    ConnectedNeurons sources = neuron.GetSources();
+    size_t hash = numInputs;
+    for (int32_t i=1 ; i<numInputs ; ++i)
+        hash = CombineHash(hash, sources[i]->GetNeuronID() - sources[0]->GetNeuronID());
+    return hash;
+}
+
+// Neurons anywhere in a layer are grouped in one pass with a hash map keyed by the structure of
+// their forward value and their input pattern. The lowered ensemble loop computes the output index
+// and the first input index of a neuron as affine functions of the loop index, so a neuron only
+// extends an ensemble when both continue the ensemble's sequences. Interleaved neuron kinds thus
+// form one strided ensemble per kind.
 class CollectMergeableNeuronsIntoEnsemblesVisitor : public NetworkVisitor
 {
+    struct OpenEnsemble
+    {
+        Ensemble* ensemble;
+        Neuron* lastNeuron;
+        int32_t outputStride;
+        int32_t inputStride;
+    };
 public:
     CollectMergeableNeuronsIntoEnsemblesVisitor()
     { }
@@ -28,18 +77,43 @@ public:
     }
     virtual void Visit(Layer& layer)
     {
-        Neuron* currentEnsembleRep = nullptr;
-        Ensemble *currentEnsemble = nullptr;
+        // Ensembles that can still be extended, by hash. Hash collisions are resolved with AreNeuronsMergeable.
+        std::unordered_map<size_t, std::vector<OpenEnsemble> > openEnsembles;
 
         for (int32_t i=0 ; i<layer.GetNumberOfNeurons() ; ++i)
         {
             Neuron& currentNeuron = layer.GetNeuron(i);
-            if (currentEnsembleRep == nullptr || !AreNeuronsMergeable(currentNeuron, *currentEnsembleRep))
+            size_t hash = CombineHash(GetStructuralHash(currentNeuron.GetForwardPropagationValue()), GetInputPatternHash(currentNeuron));
+            std::vector<OpenEnsemble>& bucket = openEnsembles[hash];
+            OpenEnsemble* open = nullptr;
+            for (size_t j=0 ; j<bucket.size() && open == nullptr ; ++j)
             {
-                currentEnsemble = &(layer.CreateNewEnsemble());
-                currentEnsembleRep = &currentNeuron;
+                if (AreNeuronsMergeable(currentNeuron, *(bucket[j].ensemble->GetNeurons().front())))
+                    open = &bucket[j];
             }
-            currentEnsemble->AddNeuron(currentNeuron);
+            if (open == nullptr)
+            {
+                OpenEnsemble newEnsemble = { &(layer.CreateNewEnsemble()), nullptr, 0, 0 };
+                bucket.push_back(newEnsemble);
+                open = &bucket.back();
+            }
+            else
+            {
+                int32_t outputStride = currentNeuron.GetNeuronID() - open->lastNeuron->GetNeuronID();
+                int32_t inputStride = GetFirstInputIndex(currentNeuron) - GetFirstInputIndex(*(open->lastNeuron));
+                if (open->ensemble->GetNumberOfNeurons() == 1)
+                {
+                    open->outputStride = outputStride;
+                    open->inputStride = inputStride;
+                }
+                else if (outputStride != open->outputStride || inputStride != open->inputStride)
+                {
+                    // The sequence is broken, later neurons of this kind go to a new ensemble
+                    open->ensemble = &(layer.CreateNewEnsemble());
+                }
+            }
+            open->ensemble->AddNeuron(currentNeuron);
+            open->lastNeuron = &currentNeuron;
         }
     }
     virtual void Visit(Neuron& neuron)
@@ -56,22 +130,29 @@ public:
 
 void CollectMergeableNeuronsIntoEnsembles(Network& network)
 {
+    // Values are simplified first so the ensembles are formed on the values that are lowered
+    SimplifyNetworkValues(network);
     CollectMergeableNeuronsIntoEnsemblesVisitor collectVisitor;
     network.AcceptVisitor(collectVisitor);
 }
 
-static std::string ConstructLayerOutputName(int32_t layerIdx)
+// Activation functions created with a tier of their own keep it, the others use the lowering's
+static int32_t GetActivationAccuracy(int32_t functionAccuracy, int32_t loweringAccuracy)
+{
+    return functionAccuracy != KernelAccuracyDefault ? functionAccuracy : loweringAccuracy;
+}
+
+std::string ConstructLayerOutputName(int32_t layerIdx)
 {
     std::stringstream strStream;
     strStream << "__layer" << layerIdx << "Result";
     return strStream.str();
 }
 
-static VectorType& ConstructLayerOutputType(Layer& layer)
+// rowsPerVariable is the number of input vectors whose layer outputs are stored in the variable
+static VectorType& ConstructLayerOutputType(Layer& layer, int32_t rowsPerVariable = 1)
 {
-    RealType& elemType = *(new RealType());
-    VectorType& outputType = *(new VectorType(elemType, layer.GetNumberOfNeurons()));
-    return outputType;
+    return VectorType::Get(RealType::Get(), layer.GetNumberOfNeurons() * rowsPerVariable);
 }
 
 // Collect all constants into different property bags
@@ -156,7 +237,12 @@ public:
 class ReferenceCreator
 {
 public:
+    virtual ~ReferenceCreator() { }
     virtual Value& operator()(Variable& var) = 0;
+    // Reference to the value of a value set with ID elemID
+    virtual Value& operator()(ValueSet& valueSet, Value& elemID) = 0;
+    // Reference into a strided view of a vector variable starting at var[offset]
+    virtual Value& operator()(Variable& var, Value& offset, int32_t stride) = 0;
 };
 
 class VariableRefCreator : public ReferenceCreator
@@ -166,6 +252,14 @@ public:
     { 
         return var;
     }
+    Value& operator()(ValueSet& valueSet, Value& elemID)
+    {
+        return GetValue::Create(valueSet, elemID);
+    }
+    Value& operator()(Variable& var, Value& offset, int32_t stride)
+    {
+        return IndexedValue::Create(var, offset);
+    }
 };
 
 class IndexVariableRefCreator : public ReferenceCreator
@@ -179,28 +273,83 @@ public:
     {
         return IndexedValue::Create(var, m_index);
     }
+    Value& operator()(ValueSet& valueSet, Value& elemID)
+    {
+        return GetValue::Create(valueSet, elemID, m_index);
+    }
+    Value& operator()(Variable& var, Value& offset, int32_t stride)
+    {
+        Value& scaledIndex = stride == 1 ? static_cast<Value&>(m_index) : BinaryMultiply::Create(m_index, Constant(stride));
+        return IndexedValue::Create(var, BinaryAdd::Create(offset, scaledIndex));
+    }
+};
+
+// Gathers of the previous layer's outputs that are the same for all neurons of an ensemble are
+// computed once by statements run before the layer's ensemble loops, and shared by all ensembles
+// of the layer that read the same elements.
+struct SharedInputGathers
+{
+    std::map<std::pair<Variable*, std::vector<int32_t>>, Variable*> variables;
+    std::list<IRStatement*> statements;
+    int32_t count;
+    SharedInputGathers()
+        :count(0)
+    { }
 };
 
 // Collect all constants into different property bags
 class ValueIRGenerator : public ValueVisitor
 {
+    // Values are mapped to the variables below through their representatives, so values
+    // computing the same result are only lowered once
+    ValueNumbering m_valueNumbering;
     std::map<Value*, Variable*> m_valueToVariableMap;
     std::map<ConstantValue*, ValueSet*> m_constantToValueSetMap;
+    // Vector constants are read straight from their value set by the loops that use them
+    // and only copied into a variable when a whole vector is needed
+    std::map<Value*, ValueSet*> m_vectorConstants;
+    // Vector inputs whose sources are an affine range are read in place from the previous layer's
+    // buffer : element i is m_inputVar[baseIndex + i * stride]
+    struct InputView
+    {
+        Variable* baseIndex;
+        int32_t stride;
+    };
+    std::map<Value*, InputView> m_inputViews;
     Neuron& m_neuron;
     Variable& m_inputVar;
     Variable& m_loopVariable;
+    int32_t m_inputStride;
     std::list<IRStatement*>& m_stmList;
+    // Statements that only depend on the neuron (loads from value sets). In batched
+    // lowering these go outside the batch loop so they are shared by the whole batch.
+    std::list<IRStatement*>& m_constantStmList;
+    // Index into the batch and the length of one input row, when lowering for a batch
+    Variable* m_batchIndex;
+    int32_t m_inputRowLength;
+    Variable* m_batchInputOffset;
     int32_t m_varID;
+    bool m_useVectorKernels;
+    int32_t m_activationAccuracy;
+    // Helpers handed out by GetCodeGenerationParams, freed with the generator
+    std::vector<StatementListInsertor*> m_stmListInsertors;
+    std::vector<ReferenceCreator*> m_refCreators;
+    // nullptr when lowering for a batch
+    SharedInputGathers* m_sharedInputs;
 
-    void AddDefinition(Variable& v)
+    Value* GetRepresentative(Value& v)
+    {
+        return &(m_valueNumbering.GetRepresentative(v));
+    }
+    void AddDefinition(Variable& v, std::list<IRStatement*>& stmList)
     {
         VariableDefinition& defn = VariableDefinition::Create(v);
-        m_stmList.push_back(&defn);
+        stmList.push_back(&defn);
     }
     void AddVariableForValue(Value& v, Variable& var)
     {
-        assert(m_valueToVariableMap.find(&v) == m_valueToVariableMap.end());
-        m_valueToVariableMap[&v] = &var;
+        assert(m_valueToVariableMap.find(GetRepresentative(v)) == m_valueToVariableMap.end());
+        m_valueToVariableMap[GetRepresentative(v)] = &var;
     }
     std::string GetTempVariableName()
     {
@@ -209,30 +358,178 @@ class ValueIRGenerator : public ValueVisitor
         return ret;
     }
     Variable& CreateTempVariable(ValueType& type)
+    {
+        return CreateTempVariable(type, m_stmList);
+    }
+    Variable& CreateTempVariable(ValueType& type, std::list<IRStatement*>& stmList)
     {
         auto varName = GetTempVariableName();
         Variable& var = Variable::Create(varName, type);
-        AddDefinition(var);
+        AddDefinition(var, stmList);
         return var;
     }
     void VisitConstant(ConstantValue& constant)
     {
         if (GetCorrespondingVariable(constant) != nullptr)
             return;
-        Variable& var = CreateTempVariable(*(constant.GetType().Clone()));
+        auto valueSetIter = m_constantToValueSetMap.find(&constant);
+        assert (valueSetIter != m_constantToValueSetMap.end());
+        if (constant.GetType().IsVector())
+        {
+            m_vectorConstants[GetRepresentative(constant)] = valueSetIter->second;
+            return;
+        }
+        Variable& var = CreateTempVariable(constant.GetType(), m_constantStmList);
         AddVariableForValue(constant, var);
 
         // Create a value set getter
-        auto valueSetIter = m_constantToValueSetMap.find(&constant);
-        assert (valueSetIter != m_constantToValueSetMap.end());
         GetValue& getVal = GetValue::Create(*(valueSetIter->second), m_loopVariable);
         
         // Add assignment statement
         Assignment& assignmentStm = Assignment::Create(var, getVal);
-        m_stmList.push_back(&assignmentStm);
+        m_constantStmList.push_back(&assignmentStm);
+    }
+    // Offset of the current input vector's row in a batched input buffer
+    Variable& GetBatchInputOffset()
+    {
+        if (m_batchInputOffset == nullptr)
+        {
+            m_batchInputOffset = &CreateTempVariable(IntegerType::Get());
+            Value& offset = BinaryMultiply::Create(*m_batchIndex, Constant(m_inputRowLength));
+            m_stmList.push_back(&Assignment::Create(*m_batchInputOffset, offset));
+        }
+        return *m_batchInputOffset;
+    }
+    // Index of an input of the current neuron given the index of that input for the first neuron in the ensemble
+    Variable& CreateInputIndex(int32_t firstNeuronInputIndex)
+    {
+        Variable& indexVar = CreateTempVariable(IntegerType::Get());
+        Value* indexVal = &m_loopVariable;
+        if (m_inputStride == 0)
+            indexVal = &Constant(firstNeuronInputIndex);
+        else
+        {
+            if (m_inputStride != 1)
+                indexVal = &BinaryMultiply::Create(*indexVal, Constant(m_inputStride));
+            if (firstNeuronInputIndex != 0)
+                indexVal = &BinaryAdd::Create(Constant(firstNeuronInputIndex), *indexVal);
+        }
+        if (m_batchIndex != nullptr)
+            indexVal = &BinaryAdd::Create(*indexVal, GetBatchInputOffset());
+        IRStatement& indexValAssignment = Assignment::Create(indexVar, *indexVal);
+        m_stmList.push_back(&indexValAssignment);
+        return indexVar;
+    }
+    // Variable holding the value of an operand. Vector constants are copied out of their value set.
+    Variable& GetOperandVariable(Value& v)
+    {
+        Variable* var = GetCorrespondingVariable(v);
+        if (var != nullptr)
+            return *var;
+        auto viewIter = m_inputViews.find(GetRepresentative(v));
+        if (viewIter != m_inputViews.end())
+        {
+            std::vector<int32_t> inputIndices(v.GetType().AsVectorType()->GetLength());
+            for (size_t i=0 ; i<inputIndices.size() ; ++i)
+                inputIndices[i] = GetFirstInputIndex(m_neuron) + static_cast<int32_t>(i) * viewIter->second.stride;
+            if (Variable* shared = GetSharedInputGather(v.GetType(), inputIndices))
+            {
+                AddVariableForValue(v, *shared);
+                return *shared;
+            }
+            // Gather the view into a variable with a loop
+            Variable& copy = CreateTempVariable(v.GetType());
+            AddVariableForValue(v, copy);
+            ForLoop& gatherLoop = ForLoop::Create(Constant(0), Constant(v.GetType().AsVectorType()->GetLength()));
+            IndexVariableRefCreator refCreator(gatherLoop.GetIndexVariable());
+            Value& element = refCreator(m_inputVar, *(viewIter->second.baseIndex), viewIter->second.stride);
+            gatherLoop.AddStatement(Assignment::Create(refCreator(copy), element));
+            m_stmList.push_back(&gatherLoop);
+            return copy;
+        }
+        auto iter = m_vectorConstants.find(GetRepresentative(v));
+        assert(iter != m_vectorConstants.end());
+        Variable& copy = CreateTempVariable(v.GetType(), m_constantStmList);
+        AddVariableForValue(v, copy);
+        m_constantStmList.push_back(&Assignment::Create(copy, GetValue::Create(*(iter->second), m_loopVariable)));
+        return copy;
+    }
+    // Variable holding the elements of the input variable with the given indices, gathered once
+    // before the layer's ensemble loops. nullptr when the gathered inputs differ between the
+    // neurons of the ensemble or shared gathers are not used.
+    Variable* GetSharedInputGather(ValueType& type, std::vector<int32_t>& inputIndices)
+    {
+        if (m_sharedInputs == nullptr || m_inputStride != 0 || !IsRealValue(type) || !type.IsVector())
+            return nullptr;
+        auto key = std::make_pair(&m_inputVar, inputIndices);
+        auto iter = m_sharedInputs->variables.find(key);
+        if (iter != m_sharedInputs->variables.end())
+            return iter->second;
+
+        Variable& var = Variable::Create("_sharedInput" + std::to_string(m_sharedInputs->count), type);
+        ++m_sharedInputs->count;
+        m_sharedInputs->variables[key] = &var;
+        AddDefinition(var, m_sharedInputs->statements);
+        int32_t stride = inputIndices.size() > 1 ? inputIndices[1] - inputIndices[0] : 1;
+        bool affine = true;
+        for (size_t i=2 ; i<inputIndices.size() && affine ; ++i)
+            affine = inputIndices[i] == inputIndices[0] + static_cast<int32_t>(i) * stride;
+        if (affine)
+        {
+            ForLoop& gatherLoop = ForLoop::Create(Constant(0), Constant(static_cast<int32_t>(inputIndices.size())));
+            IndexVariableRefCreator refCreator(gatherLoop.GetIndexVariable());
+            gatherLoop.AddStatement(Assignment::Create(refCreator(var), refCreator(m_inputVar, Constant(inputIndices[0]), stride)));
+            m_sharedInputs->statements.push_back(&gatherLoop);
+            return &var;
+        }
+        for (size_t i=0 ; i<inputIndices.size() ; ++i)
+        {
+            Value& element = IndexedValue::Create(m_inputVar, Constant(inputIndices[i]));
+            m_sharedInputs->statements.push_back(&Assignment::Create(IndexedValue::Create(var, Constant(static_cast<int32_t>(i))), element));
+        }
+        return &var;
+    }
+    // Reference to an operand inside the statement generated for an operation
+    Value& GetOperandReference(Value& v, ReferenceCreator& refCreator)
+    {
+        if (GetCorrespondingVariable(v) == nullptr)
+        {
+            auto iter = m_vectorConstants.find(GetRepresentative(v));
+            if (iter != m_vectorConstants.end())
+                return refCreator(*(iter->second), m_loopVariable);
+            auto viewIter = m_inputViews.find(GetRepresentative(v));
+            if (viewIter != m_inputViews.end())
+                return refCreator(m_inputVar, *(viewIter->second.baseIndex), viewIter->second.stride);
+        }
+        return refCreator(GetOperandVariable(v));
+    }
+    // Operand of a vector statement. Vector constants and input views are read in place.
+    VectorOperand GetVectorOperand(Value& v)
+    {
+        if (GetCorrespondingVariable(v) == nullptr)
+        {
+            auto iter = m_vectorConstants.find(GetRepresentative(v));
+            if (iter != m_vectorConstants.end())
+                return VectorOperand(*(iter->second), m_loopVariable);
+            auto viewIter = m_inputViews.find(GetRepresentative(v));
+            if (viewIter != m_inputViews.end())
+                return VectorOperand(m_inputVar, *(viewIter->second.baseIndex), viewIter->second.stride);
+        }
+        Variable& var = GetOperandVariable(v);
+        bool scalar = !var.GetType().IsVector();
+        return VectorOperand(var, Constant(0), scalar ? 0 : 1);
+    }
+    static bool IsRealValue(ValueType& type)
+    {
+        VectorType* vecType = type.AsVectorType();
+        return vecType ? vecType->GetElementType().IsReal() : type.IsReal();
+    }
+    static bool IsRealValue(Value& v)
+    {
+        return IsRealValue(v.GetType());
     }
     template<typename T>
-    void VisitBinaryOperation(BinaryOp& binOp, T& creationFunc)
+    void VisitBinaryOperation(BinaryOp& binOp, T& creationFunc, VectorOperation::OperationType operation)
     {
         if (GetCorrespondingVariable(binOp) != nullptr)
             return;
@@ -241,17 +538,26 @@ class ValueIRGenerator : public ValueVisitor
         binOp.GetRHS().AcceptVisitor(*this);
 
         // Create an output variable
-        Variable& var = CreateTempVariable(*(binOp.GetType().Clone()));
+        Variable& var = CreateTempVariable(binOp.GetType());
         AddVariableForValue(binOp, var);
 
+        VectorType* vecType = binOp.GetType().AsVectorType();
+        if (m_useVectorKernels && vecType != nullptr && IsRealValue(binOp.GetLHS()) && IsRealValue(binOp.GetRHS()))
+        {
+            VectorOperand lhs = GetVectorOperand(binOp.GetLHS());
+            VectorOperand rhs = GetVectorOperand(binOp.GetRHS());
+            m_stmList.push_back(&VectorOperation::Create(operation, var, lhs, rhs, vecType->GetLength()));
+            return;
+        }
+
         // Check the type and add a loop if required
         auto codeGenerationParams = GetCodeGenerationParams(binOp);
     
         // Generate statement based on whether or not operands need to be indexed
-        Variable& lhs = *(GetCorrespondingVariable(binOp.GetLHS()));
-        Variable& rhs = *(GetCorrespondingVariable(binOp.GetRHS()));
+        Value& lhs = GetOperandReference(binOp.GetLHS(), codeGenerationParams.refCreator);
+        Value& rhs = GetOperandReference(binOp.GetRHS(), codeGenerationParams.refCreator);
 
-        Value& computedValue = creationFunc(codeGenerationParams.refCreator(lhs), codeGenerationParams.refCreator(rhs));
+        Value& computedValue = creationFunc(lhs, rhs);
         IRStatement& stm  = Assignment::Create(codeGenerationParams.refCreator(var), computedValue);
         codeGenerationParams.stmListInsertor.Insert(stm);
     }
@@ -262,34 +568,53 @@ class ValueIRGenerator : public ValueVisitor
     };
     CodeGenerationParameters GetCodeGenerationParams(Value& v)
     {
-        VectorType* vecType = dynamic_cast<VectorType*>(&(v.GetType()));
+        VectorType* vecType = v.GetType().AsVectorType();
         if (vecType != nullptr)
         {
             ForLoop& forLoop = ForLoop::Create(Constant(0), Constant(vecType->GetLength()));
             m_stmList.push_back(&forLoop);
-            auto stmListInsertor = new StatementListInsertor(forLoop.GetStatements());
-            auto refCreator = new IndexVariableRefCreator(forLoop.GetIndexVariable());
-            CodeGenerationParameters ret = {*stmListInsertor, *refCreator };
-            return ret;
+            m_stmListInsertors.push_back(new StatementListInsertor(forLoop.GetStatements()));
+            m_refCreators.push_back(new IndexVariableRefCreator(forLoop.GetIndexVariable()));
         }
         else
         {
-            auto stmListInsertor = new StatementListInsertor(m_stmList);
-            auto refCreator = new VariableRefCreator;
-            CodeGenerationParameters ret = {*stmListInsertor, *refCreator };
-            return ret;
+            m_stmListInsertors.push_back(new StatementListInsertor(m_stmList));
+            m_refCreators.push_back(new VariableRefCreator);
         }
+        CodeGenerationParameters ret = { *m_stmListInsertors.back(), *m_refCreators.back() };
+        return ret;
     }
 public:
     ValueIRGenerator(Neuron& neuron, std::map<ConstantValue*, ValueSet*>& constantToValueSetMap,
-                     Variable& loopVar, std::list<IRStatement*>& stmList, Variable& inputVar)
-        :m_varID(0), m_constantToValueSetMap(constantToValueSetMap),
-         m_loopVariable(loopVar), m_stmList(stmList), m_neuron(neuron), m_inputVar(inputVar)
+                     Variable& loopVar, std::list<IRStatement*>& stmList, Variable& inputVar, int32_t inputStride)
+        :m_constantToValueSetMap(constantToValueSetMap), m_neuron(neuron), m_inputVar(inputVar),
+         m_loopVariable(loopVar), m_inputStride(inputStride), m_stmList(stmList), m_constantStmList(stmList),
+         m_batchIndex(nullptr), m_inputRowLength(0), m_batchInputOffset(nullptr), m_varID(0), m_useVectorKernels(false),
+         m_activationAccuracy(KernelAccuracyExact), m_sharedInputs(nullptr)
+    {
+    }
+    ValueIRGenerator(Neuron& neuron, std::map<ConstantValue*, ValueSet*>& constantToValueSetMap,
+                     Variable& loopVar, std::list<IRStatement*>& constantStmList, Variable& inputVar, int32_t inputStride,
+                     Variable& batchIndex, std::list<IRStatement*>& batchStmList, int32_t inputRowLength)
+        :m_constantToValueSetMap(constantToValueSetMap), m_neuron(neuron), m_inputVar(inputVar),
+         m_loopVariable(loopVar), m_inputStride(inputStride), m_stmList(batchStmList), m_constantStmList(constantStmList),
+         m_batchIndex(&batchIndex), m_inputRowLength(inputRowLength), m_batchInputOffset(nullptr), m_varID(0), m_useVectorKernels(false),
+         m_activationAccuracy(KernelAccuracyExact), m_sharedInputs(nullptr)
     {
     }
+    ~ValueIRGenerator()
+    {
+        for (size_t i=0 ; i<m_stmListInsertors.size() ; ++i)
+            delete m_stmListInsertors[i];
+        for (size_t i=0 ; i<m_refCreators.size() ; ++i)
+            delete m_refCreators[i];
+    }
+    void SetUseVectorKernels(bool useVectorKernels) { m_useVectorKernels = useVectorKernels; }
+    void SetActivationAccuracy(int32_t accuracy) { m_activationAccuracy = accuracy; }
+    void SetSharedInputGathers(SharedInputGathers& sharedInputs) { m_sharedInputs = &sharedInputs; }
     Variable* GetCorrespondingVariable(Value& v)
     {
-        auto iter = m_valueToVariableMap.find(&v);
+        auto iter = m_valueToVariableMap.find(GetRepresentative(v));
         if(iter != m_valueToVariableMap.end())
             return iter->second;
         return nullptr;
@@ -320,9 +645,9 @@ public:
         if (GetCorrespondingVariable(unaryPlus) != nullptr)
             return;
         Value& operand = unaryPlus.GetOperand();
+        // +x has the representative of x, so this only makes sure x has a variable
         operand.AcceptVisitor(*this);
-        Variable& operandVar = *(GetCorrespondingVariable(operand));
-        AddVariableForValue(unaryPlus, operandVar);
+        GetOperandVariable(operand);
     }
     virtual void Visit(UnaryMinus& unaryMinus)
     {
@@ -332,99 +657,173 @@ public:
         unaryMinus.GetOperand().AcceptVisitor(*this);
 
         // Create an output variable
-        Variable& var = CreateTempVariable(*(unaryMinus.GetType().Clone()));
+        Variable& var = CreateTempVariable(unaryMinus.GetType());
         AddVariableForValue(unaryMinus, var);
 
         // Check the type and add a loop if required
         auto codeGenerationParams = GetCodeGenerationParams(unaryMinus);
     
         // Generate statement based on whether or not operands need to be indexed
-        Variable& input = *(GetCorrespondingVariable(unaryMinus.GetOperand()));
-        IRStatement& stm  = Assignment::Create(codeGenerationParams.refCreator(var), UnaryMinus::Create(codeGenerationParams.refCreator(input)));
+        Value& input = GetOperandReference(unaryMinus.GetOperand(), codeGenerationParams.refCreator);
+        IRStatement& stm  = Assignment::Create(codeGenerationParams.refCreator(var), UnaryMinus::Create(input));
         codeGenerationParams.stmListInsertor.Insert(stm);
     }
     virtual void Visit(BinaryAdd& binaryAdd)
     {
-        VisitBinaryOperation(binaryAdd, BinaryAdd::Create);
+        VisitBinaryOperation(binaryAdd, BinaryAdd::Create, VectorOperation::Add);
     }
     virtual void Visit(BinarySubtract& binarySubtract)
     {
-        VisitBinaryOperation(binarySubtract, BinarySubtract::Create);
+        VisitBinaryOperation(binarySubtract, BinarySubtract::Create, VectorOperation::Subtract);
     }
     virtual void Visit(BinaryMultiply& binaryMultiply)
     {
-        VisitBinaryOperation(binaryMultiply, BinaryMultiply::Create);
+        VisitBinaryOperation(binaryMultiply, BinaryMultiply::Create, VectorOperation::Multiply);
     }
     virtual void Visit(BinaryDivide& binaryDivide)
     {
-        VisitBinaryOperation(binaryDivide, BinaryDivide::Create);
+        VisitBinaryOperation(binaryDivide, BinaryDivide::Create, VectorOperation::Divide);
     }
     virtual void Visit(GetInputValue& getInput) 
     {
-        if (GetCorrespondingVariable(getInput) != nullptr)
+        if (GetCorrespondingVariable(getInput) != nullptr || m_inputViews.find(GetRepresentative(getInput)) != m_inputViews.end())
+            return;
+        int32_t sourceStride = 0;
+        if (getInput.GetType().IsVector() && GetAffineSourceStride(m_neuron, sourceStride))
+        {
+            // Only the index of the first input is computed. The operations using the input index the
+            // previous layer's buffer directly.
+            InputView view = { &CreateInputIndex(GetFirstInputIndex(m_neuron)), sourceStride };
+            m_inputViews[GetRepresentative(getInput)] = view;
             return;
-        Variable& var = CreateTempVariable(*(getInput.GetType().Clone()));
+        }
+        if (VectorType *vectorType = getInput.GetType().AsVectorType())
+        {
+            std::vector<int32_t> inputIndices(vectorType->GetLength());
+            for (int32_t i=0 ; i<vectorType->GetLength() ; ++i)
+                inputIndices[i] = m_neuron.GetSources()[i]->GetNeuronID();
+            if (Variable* shared = GetSharedInputGather(getInput.GetType(), inputIndices))
+            {
+                AddVariableForValue(getInput, *shared);
+                return;
+            }
+        }
+        Variable& var = CreateTempVariable(getInput.GetType());
         AddVariableForValue(getInput, var);
 
-        if (VectorType *vectorType = dynamic_cast<VectorType*>(&(getInput.GetType())))
+        if (VectorType *vectorType = getInput.GetType().AsVectorType())
         {
-            // FirstIndex = first neuron first input index + Loop index
+            // Sources without a regular pattern are gathered one by one :
+            // FirstIndex = first neuron first input index + Loop index * input stride
             // inputVar[0] = prevOutput[FirstIndex]
-            // SecondIndex = first neuron second input index + Loop index
+            // SecondIndex = first neuron second input index + Loop index * input stride
             // inputVar[1] = prevOutput[SecondIndex]
             // ...
             for (int32_t i=0 ; i<vectorType->GetLength() ; ++i)
             {
-                int32_t neuronInputIndex = m_neuron.GetSources()[i]->GetNeuronID();
-                Variable& indexVar = CreateTempVariable(*(new IntegerType));
-                Value& indexVal = BinaryAdd::Create(Constant(neuronInputIndex), m_loopVariable);
-                IRStatement& indexValAssignment = Assignment::Create(indexVar, indexVal);
-                m_stmList.push_back(&indexValAssignment);
+                Variable& indexVar = CreateInputIndex(m_neuron.GetSources()[i]->GetNeuronID());
 
                 Value& lhs = IndexedValue::Create(var, Constant(i));
-                Value& rhs = IndexedValue::Create(m_inputVar, indexVal);
+                Value& rhs = IndexedValue::Create(m_inputVar, indexVar);
                 IRStatement& inputInitialization = Assignment::Create(lhs, rhs);
                 m_stmList.push_back(&inputInitialization);
             }
         }
         else
         {
-            int32_t neuronInputIndex;
-            if (InputNeuron* inputNeuron = dynamic_cast<InputNeuron*>(&m_neuron))
-                neuronInputIndex = m_neuron.GetNeuronID();
-            else
-                neuronInputIndex = m_neuron.GetSources()[0]->GetNeuronID();
-            Variable& indexVar = CreateTempVariable(*(new IntegerType));
-            Value& indexVal = BinaryAdd::Create(Constant(neuronInputIndex), m_loopVariable);
-            IRStatement& indexValAssignment = Assignment::Create(indexVar, indexVal);
-            m_stmList.push_back(&indexValAssignment);
+            int32_t neuronInputIndex = GetFirstInputIndex(m_neuron);
+            Variable& indexVar = CreateInputIndex(neuronInputIndex);
 
             Value& lhs = var;
-            Value& rhs = IndexedValue::Create(m_inputVar, indexVal);
+            Value& rhs = IndexedValue::Create(m_inputVar, indexVar);
             IRStatement& inputInitialization = Assignment::Create(lhs, rhs);
             m_stmList.push_back(&inputInitialization);
         }
     }   
+    // Sum(a*b) where a*b has not been computed yet is lowered to one multiply-accumulate
+    // loop, without materializing the product vector. Another user of a*b lowered later
+    // computes the product on its own.
+    BinaryMultiply* GetFusableProduct(Reduction& reduction)
+    {
+        BinaryMultiply* product = dynamic_cast<BinaryMultiply*>(&(reduction.GetOperand()));
+        if (reduction.GetReductionType() != Reduction::Sum || product == nullptr || GetCorrespondingVariable(*product) != nullptr)
+            return nullptr;
+        if (!IsRealValue(product->GetLHS()) || !IsRealValue(product->GetRHS()))
+            return nullptr;
+        // The loop below indexes both operands
+        if (!m_useVectorKernels && (!product->GetLHS().GetType().IsVector() ||
+                                    !product->GetRHS().GetType().IsVector()))
+            return nullptr;
+        return product;
+    }
+    void VisitDotProduct(Reduction& reduction, BinaryMultiply& product)
+    {
+        product.GetLHS().AcceptVisitor(*this);
+        product.GetRHS().AcceptVisitor(*this);
+
+        Variable& var = CreateTempVariable(reduction.GetType());
+        AddVariableForValue(reduction, var);
+
+        int32_t length = product.GetType().AsVectorType()->GetLength();
+        if (m_useVectorKernels)
+        {
+            VectorOperand lhs = GetVectorOperand(product.GetLHS());
+            VectorOperand rhs = GetVectorOperand(product.GetRHS());
+            m_stmList.push_back(&VectorReduction::CreateDotProduct(var, lhs, rhs, length));
+            return;
+        }
+
+        // var = 0
+        // for i = 0 to length
+        //     var = var + lhs[i] * rhs[i]
+        m_stmList.push_back(&Assignment::Create(var, RealConstant::Create(0.0)));
+        ForLoop& forLoop = ForLoop::Create(Constant(0), Constant(length));
+        IndexVariableRefCreator refCreator(forLoop.GetIndexVariable());
+        Value& lhs = GetOperandReference(product.GetLHS(), refCreator);
+        Value& rhs = GetOperandReference(product.GetRHS(), refCreator);
+        forLoop.AddStatement(Assignment::Create(var, BinaryAdd::Create(var, BinaryMultiply::Create(lhs, rhs))));
+        m_stmList.push_back(&forLoop);
+    }
     virtual void Visit(Reduction& reduction)
     {
         if (GetCorrespondingVariable(reduction) != nullptr)
             return;
-        
+
+        if (BinaryMultiply* product = GetFusableProduct(reduction))
+        {
+            VisitDotProduct(reduction, *product);
+            return;
+        }
+
         reduction.GetOperand().AcceptVisitor(*this);
         
-        Variable& var = CreateTempVariable(*(reduction.GetType().Clone()));
+        Variable& var = CreateTempVariable(reduction.GetType());
         AddVariableForValue(reduction, var);
 
-        Variable& inputVar = *(GetCorrespondingVariable(reduction.GetOperand()));
-        VectorType* vecType = dynamic_cast<VectorType*>(&(reduction.GetOperand().GetType()));
+        VectorType* vecType = reduction.GetOperand().GetType().AsVectorType();
         assert (vecType != nullptr);
+        if (m_useVectorKernels && IsRealValue(reduction))
+        {
+            VectorOperand operand = GetVectorOperand(reduction.GetOperand());
+            m_stmList.push_back(&VectorReduction::Create(reduction.GetReductionType(), var, operand, vecType->GetLength()));
+            return;
+        }
+
+        Variable& inputVar = GetOperandVariable(reduction.GetOperand());
 
         IRStatement& initStm = Assignment::Create(var, IndexedValue::Create(inputVar, Constant(0)));
         m_stmList.push_back(&initStm);
 
         ForLoop& forLoop = ForLoop::Create(Constant(1), Constant(vecType->GetLength()));
-        Value& iterationValue = BinaryAdd::Create(var, IndexedValue::Create(inputVar, forLoop.GetIndexVariable()));
-        IRStatement& assignment = Assignment::Create(var, iterationValue);
+        Value& element = IndexedValue::Create(inputVar, forLoop.GetIndexVariable());
+        Value* iterationValue = nullptr;
+        if (reduction.GetReductionType() == Reduction::Sum)
+            iterationValue = &BinaryAdd::Create(var, element);
+        else if (reduction.GetReductionType() == Reduction::Multiply)
+            iterationValue = &BinaryMultiply::Create(var, element);
+        else
+            throw std::runtime_error("Max reductions can only be lowered to vector kernels");
+        IRStatement& assignment = Assignment::Create(var, *iterationValue);
         forLoop.AddStatement(assignment);
         m_stmList.push_back(&forLoop);
     }
@@ -435,27 +834,95 @@ public:
         
         Value& operand = function.GetOperand();
         operand.AcceptVisitor(*this);
-        Variable& operandVar = *(GetCorrespondingVariable(operand));
+        Variable& operandVar = GetOperandVariable(operand);
      
-        assert(dynamic_cast<ScalarType*>(&(function.GetType())) != nullptr);
-        Variable& var = CreateTempVariable(*(function.GetType().Clone()));
+        assert(function.GetType().IsScalar());
+        if (!sKernelActivations[function.GetActivation()].elementwise)
+            throw std::runtime_error("Activation function " + function.GetName() + " can only be applied to a whole layer");
+        Variable& var = CreateTempVariable(function.GetType());
         AddVariableForValue(function, var);
-        IRStatement& assignStm = Assignment::Create(var, ActivationFunction::Create(operandVar, function.GetName()));
+        int32_t accuracy = GetActivationAccuracy(function.GetAccuracy(), m_activationAccuracy);
+        IRStatement& assignStm = Assignment::Create(var, ActivationFunction::Create(operandVar, function.GetName(), accuracy));
         m_stmList.push_back(&assignStm);
     }
 };
 
+// Parts of a neuron computing activation(Sum(w*x) + b). bias is nullptr when
+// the neuron has no bias and activation is KernelActivationNone when it has no activation.
+struct DenseNeuronPattern
+{
+    RealVectorConstant* weights;
+    RealConstant* bias;
+    GetInputValue* input;
+    int32_t activation;
+    int32_t accuracy;
+};
+
+static bool MatchDenseNeuron(Value& forwardValue, DenseNeuronPattern& pattern)
+{
+    Value* value = &forwardValue;
+    pattern.activation = KernelActivationNone;
+    pattern.accuracy = KernelAccuracyExact;
+    if (ActivationFunction* activation = dynamic_cast<ActivationFunction*>(value))
+    {
+        pattern.activation = activation->GetActivation();
+        pattern.accuracy = activation->GetAccuracy();
+        value = &(activation->GetOperand());
+    }
+    pattern.bias = nullptr;
+    if (BinaryAdd* add = dynamic_cast<BinaryAdd*>(value))
+    {
+        pattern.bias = dynamic_cast<RealConstant*>(&(add->GetRHS()));
+        value = &(add->GetLHS());
+        if (pattern.bias == nullptr)
+        {
+            pattern.bias = dynamic_cast<RealConstant*>(&(add->GetLHS()));
+            value = &(add->GetRHS());
+        }
+        if (pattern.bias == nullptr)
+            return false;
+    }
+    Reduction* reduction = dynamic_cast<Reduction*>(value);
+    if (reduction == nullptr || reduction->GetReductionType() != Reduction::Sum)
+        return false;
+    BinaryMultiply* mul = dynamic_cast<BinaryMultiply*>(&(reduction->GetOperand()));
+    if (mul == nullptr)
+        return false;
+    pattern.weights = dynamic_cast<RealVectorConstant*>(&(mul->GetLHS()));
+    pattern.input = dynamic_cast<GetInputValue*>(&(mul->GetRHS()));
+    if (pattern.weights == nullptr || pattern.input == nullptr)
+    {
+        pattern.weights = dynamic_cast<RealVectorConstant*>(&(mul->GetRHS()));
+        pattern.input = dynamic_cast<GetInputValue*>(&(mul->GetLHS()));
+    }
+    return pattern.weights != nullptr && pattern.input != nullptr && 
+           sKernelActivations[pattern.activation].elementwise;
+}
+
+// The dense kernel reads a contiguous block of the previous layer which must be the
+// same for all neurons of the ensemble (input stride 0).
+static bool HasContiguousSharedInputs(Ensemble& ensemble)
+{
+    auto& neurons = ensemble.GetNeurons();
+    if (neurons.size() > 1 && GetFirstInputIndex(*neurons[1]) != GetFirstInputIndex(*neurons[0]))
+        return false;
+    int32_t stride;
+    return GetAffineSourceStride(*neurons.front(), stride) && stride == 1;
+}
+
 void AddValuesToValueSets(std::vector<ValueSet*>& valueSets, std::vector<ConstantValue*>& constants)
 {
     assert(valueSets.size() == constants.size());
     for(size_t i=0; i<constants.size() ; ++i)
     {
-        auto valueSet = *valueSets[i];
+        auto& valueSet = *valueSets[i];
         valueSet.AddValue(*constants[i]);
     }
 }
 
-std::map<ConstantValue*, ValueSet*> CreateValueSetsForEnsemble(Ensemble& ensemble, Function& func, std::vector<ValueSet*>& ensembleValueSets)
+// Real constants are stored at the given precision
+std::map<ConstantValue*, ValueSet*> CreateValueSetsForEnsemble(Ensemble& ensemble, Function& func, std::vector<ValueSet*>& ensembleValueSets,
+                                                               RealType::Precision precision)
 {
     auto& firstNeuron = *(ensemble.GetNeurons().front());
     CollectConstantValuesVisitor constantCollector;
@@ -465,7 +932,7 @@ std::map<ConstantValue*, ValueSet*> CreateValueSetsForEnsemble(Ensemble& ensembl
     auto& constants = constantCollector.GetConstants();
     for(size_t id=0; id<constants.size() ; ++id)
     {
-        ValueSet& valueSet = func.CreateValueSet((int)id, constants[id]->GetType());
+        ValueSet& valueSet = func.CreateValueSet((int)id, GetTypeWithPrecision(constants[id]->GetType(), precision));
         ensembleValueSets.push_back(&valueSet);
         constantToValueSetMap[constants[id]] = &valueSet;
     }
@@ -480,21 +947,51 @@ IR code structure
 4. ..
 5. Allocate layer 2 ouput
 6. Ensemble 1, layer 2 loop --> layer 2 output 
+
+When lowering for a batch, each ensemble loop contains the loads of the neuron's
+constants followed by a loop over the batch. The layer buffers hold one row of
+outputs per input vector. Otherwise inputs gathered the same way by all neurons of
+an ensemble are gathered once before the layer's ensemble loops.
 */
-void ConstructIRForEnsemble(Function& func, Ensemble& ensemble, Variable& output, Variable& input)
+// The activation function of every neuron of a layer, when they all have the same one with the
+// same accuracy. Returns nullptr otherwise.
+static ActivationFunction* GetLayerActivation(Layer& layer)
+{
+    ActivationFunction* layerActivation = nullptr;
+    Ensembles& ensembles = layer.GetEnsembles();
+    for (size_t i=0 ; i<ensembles.size() ; ++i)
+    {
+        auto& neurons = ensembles[i]->GetNeurons();
+        for (size_t j=0 ; j<neurons.size() ; ++j)
+        {
+            ActivationFunction* activation = dynamic_cast<ActivationFunction*>(&(neurons[j]->GetForwardPropagationValue()));
+            if (activation == nullptr || activation->GetActivation() < 0)
+                return nullptr;
+            if (layerActivation != nullptr && (activation->GetActivation() != layerActivation->GetActivation() ||
+                                               activation->GetAccuracy() != layerActivation->GetAccuracy()))
+                return nullptr;
+            layerActivation = activation;
+        }
+    }
+    return layerActivation;
+}
+
+// With splitActivation, the ensemble writes the operand of its neurons' activation function, which
+// is applied to the whole layer afterwards. With an input quantization, a dense ensemble gets int8
+// weights and quantizes its inputs.
+void ConstructIRForEnsemble(Function& func, std::list<IRStatement*>& layerStmList, SharedInputGathers& sharedInputs, Ensemble& ensemble,
+                            Variable& output, Variable& input, LoweringOptions& options, Value* batchSize, int32_t inputRowLength,
+                            int32_t outputRowLength, bool splitActivation, const KernelQuantization* inputQuantization)
 {
     // 1. Create a ValueSet for all appropriate properties of the neuron (currently assuming its a weighted neuron)
     std::vector<ValueSet*> ensembleValueSets;
-    auto constantToValueSetMap = CreateValueSetsForEnsemble(ensemble, func, ensembleValueSets);
+    auto constantToValueSetMap = CreateValueSetsForEnsemble(ensemble, func, ensembleValueSets, options.weightPrecision);
 
     auto& neurons = ensemble.GetNeurons();
-
-    // 0. One loop per ensemble, each loops over all neurons in the ensemble
     auto& firstNeuron = *(neurons.front());
-    int32_t baseIndex = firstNeuron.GetLayer().GetNeuronID(firstNeuron);
-    ForLoop& ensembleLoop = ForLoop::Create(Constant(baseIndex),
-                                            Constant(baseIndex + ensemble.GetNumberOfNeurons()));
-    func.AddStatement(ensembleLoop);
+    int32_t baseIndex = firstNeuron.GetNeuronID();
+    // Neuron i of the ensemble writes output baseIndex + i * outputStride
+    int32_t outputStride = neurons.size() > 1 ? neurons[1]->GetNeuronID() - baseIndex : 1;
 
     for(size_t i=0; i<neurons.size() ; ++i)
     {
@@ -504,35 +1001,133 @@ void ConstructIRForEnsemble(Function& func, Ensemble& ensemble, Variable& output
         neuron->GetForwardPropagationValue().AcceptVisitor(collectConstants);
         AddValuesToValueSets(ensembleValueSets, collectConstants.GetConstants());
     }
+    for (size_t i=0 ; i<ensembleValueSets.size() ; ++i)
+        ensembleValueSets[i]->SetLayout(options.valueSetLayout);
 
-    // 2. Construct IR for the representative neuron for the ensemble
-    ValueIRGenerator irGenerator(firstNeuron, constantToValueSetMap, ensembleLoop.GetIndexVariable(), ensembleLoop.GetStatements(), input);
-    firstNeuron.GetForwardPropagationValue().AcceptVisitor(irGenerator);
+    Value& forwardValue = splitActivation ? static_cast<ActivationFunction&>(firstNeuron.GetForwardPropagationValue()).GetOperand()
+                                          : firstNeuron.GetForwardPropagationValue();
 
-    IndexedValue& indexedValue = IndexedValue::Create(output, ensembleLoop.GetIndexVariable());
-    Value& result = *irGenerator.GetCorrespondingVariable(firstNeuron.GetForwardPropagationValue());
-    auto& assignmentStm = Assignment::Create(indexedValue, result);
-    ensembleLoop.AddStatement(assignmentStm);
+    // Fully connected ensembles are computed by the dense kernel as a whole
+    DenseNeuronPattern pattern;
+    if (options.useDenseKernels && outputStride == 1 && MatchDenseNeuron(forwardValue, pattern) &&
+        HasContiguousSharedInputs(ensemble))
+    {
+        ValueSet& weights = *constantToValueSetMap[pattern.weights];
+        ValueSet* biases = pattern.bias ? constantToValueSetMap[pattern.bias] : nullptr;
+        Value& rows = batchSize ? *batchSize : Constant(1);
+        DenseLayer& denseLayer = DenseLayer::Create(weights, biases, input, GetFirstInputIndex(firstNeuron), inputRowLength,
+                                                    output, baseIndex, outputRowLength, rows, pattern.activation,
+                                                    GetActivationAccuracy(pattern.accuracy, options.activationAccuracy),
+                                                    options.accumulatePrecision);
+        if (inputQuantization != nullptr)
+        {
+            weights.Quantize();
+            denseLayer.SetInputQuantization(*inputQuantization);
+        }
+        layerStmList.push_back(&denseLayer);
+        return;
+    }
+
+    // 0. One loop per ensemble, each loops over all neurons in the ensemble. The loop index is the
+    // position of the neuron in the ensemble (which is also the index into the ensemble's value sets)
+    // Every neuron only writes its own output, so the iterations are independent.
+    ForLoop& ensembleLoop = ForLoop::Create(Constant(0), Constant(ensemble.GetNumberOfNeurons()));
+    ensembleLoop.SetParallel(true);
+    layerStmList.push_back(&ensembleLoop);
+
+    int32_t inputStride = 0;
+    if (neurons.size() > 1)
+        inputStride = GetFirstInputIndex(*neurons[1]) - GetFirstInputIndex(firstNeuron);
+
+    Value* outputIndex = &ensembleLoop.GetIndexVariable();
+    if (outputStride != 1)
+        outputIndex = &BinaryMultiply::Create(*outputIndex, Constant(outputStride));
+    if (baseIndex != 0)
+        outputIndex = &BinaryAdd::Create(Constant(baseIndex), *outputIndex);
+    if (batchSize == nullptr)
+    {
+        // 2. Construct IR for the representative neuron for the ensemble
+        ValueIRGenerator irGenerator(firstNeuron, constantToValueSetMap, ensembleLoop.GetIndexVariable(), ensembleLoop.GetStatements(), input, inputStride);
+        irGenerator.SetUseVectorKernels(options.useVectorKernels && options.weightPrecision == RealType::Float64);
+        irGenerator.SetActivationAccuracy(options.activationAccuracy);
+        irGenerator.SetSharedInputGathers(sharedInputs);
+        forwardValue.AcceptVisitor(irGenerator);
+
+        IndexedValue& indexedValue = IndexedValue::Create(output, *outputIndex);
+        Value& result = *irGenerator.GetCorrespondingVariable(forwardValue);
+        auto& assignmentStm = Assignment::Create(indexedValue, result);
+        ensembleLoop.AddStatement(assignmentStm);
+        return;
+    }
+
+    // 2. Construct IR for the representative neuron. Constants are loaded once per neuron and the
+    // rest is computed for every input vector in the batch.
+    ForLoop& batchLoop = ForLoop::Create(Constant(0), *batchSize);
+    Variable& batchIndex = batchLoop.GetIndexVariable();
+    ValueIRGenerator irGenerator(firstNeuron, constantToValueSetMap, ensembleLoop.GetIndexVariable(), ensembleLoop.GetStatements(), input, inputStride,
+                                 batchIndex, batchLoop.GetStatements(), inputRowLength);
+    irGenerator.SetUseVectorKernels(options.useVectorKernels && options.weightPrecision == RealType::Float64);
+    irGenerator.SetActivationAccuracy(options.activationAccuracy);
+    forwardValue.AcceptVisitor(irGenerator);
+    ensembleLoop.AddStatement(batchLoop);
+
+    Value& batchOutputIndex = BinaryAdd::Create(BinaryMultiply::Create(batchIndex, Constant(outputRowLength)), *outputIndex);
+    IndexedValue& indexedValue = IndexedValue::Create(output, batchOutputIndex);
+    Value& result = *irGenerator.GetCorrespondingVariable(forwardValue);
+    batchLoop.AddStatement(Assignment::Create(indexedValue, result));
 }
 
 Function& ConstructIRForNetwork(Network& network)
 {
+    LoweringOptions options;
+    return ConstructIRForNetwork(network, options);
+}
+
+Function& ConstructIRForNetwork(Network& network, LoweringOptions& options)
+{
+    // With a compile time batch, every layer variable holds all rows of the batch. With a runtime
+    // batch size, variables are sized for one row and marked as batched.
+    bool batched = options.batchSize != 1;
+    bool runtimeBatchSize = options.batchSize == LoweringOptions::RuntimeBatchSize;
+    int32_t rowsPerVariable = runtimeBatchSize ? 1 : options.batchSize;
+
     Layer& inputLayer = network.GetLayer(0);
-    VectorType& inputVarType = ConstructLayerOutputType(inputLayer);
-    Variable& inputVar = Variable::Create("x", inputVarType);
+    VectorType& inputVarType = ConstructLayerOutputType(inputLayer, rowsPerVariable);
+    Variable& inputVar = Variable::Create("x", inputVarType, runtimeBatchSize);
 
     Layer& outputLayer = network.GetLayer(network.GetNumberOfLayers()-1);
-    VectorType& outputVarType = ConstructLayerOutputType(outputLayer);
-    Variable& outputVar = Variable::Create("y", outputVarType);
+    VectorType& outputVarType = ConstructLayerOutputType(outputLayer, rowsPerVariable);
+    Variable& outputVar = Variable::Create("y", outputVarType, runtimeBatchSize);
     
     Function& function = Function::Create(inputVar, outputVar);
 
+    Value* batchSize = nullptr;
+    if (runtimeBatchSize)
+    {
+        Variable& batchSizeVar = Variable::Create("batchSize", IntegerType::Get());
+        function.SetBatchSizeVariable(batchSizeVar);
+        batchSize = &batchSizeVar;
+    }
+    else if (batched)
+    {
+        function.SetBatchSize(options.batchSize);
+        batchSize = &Constant(options.batchSize);
+    }
+
     // First create a loop to go over the input layer
     // std::string inputLayerOutputVarName = ConstructLayerOutputName(0);
     // VectorType& inputLayerOutputType = ConstructLayerOutputType(inputLayer);
     // Variable& inputLayerOutput = Variable::Create(inputLayerOutputVarName, inputLayerOutputType);
     
     Variable *prevLayerOutput = &inputVar;
+    int32_t prevLayerNeurons = inputLayer.GetNumberOfNeurons();
+    const QuantizationCalibration* calibration = options.quantization;
+    // Gathers are shared within a layer, while their count runs over the whole function so that
+    // the names of the top level definitions are unique
+    SharedInputGathers sharedInputs;
+    if (calibration != nullptr && (calibration->minimums.size() != static_cast<size_t>(network.GetNumberOfLayers()) ||
+                                   calibration->maximums.size() != calibration->minimums.size()))
+        throw std::runtime_error("ConstructIRForNetwork : Quantization calibration must have a range for every layer");
 
     // Loop over the layers
     // auto layerLoop = ForLoop::Create(Constant(0), Constant(network.GetNumberOfLayers()));
@@ -541,7 +1136,8 @@ Function& ConstructIRForNetwork(Network& network)
         Layer& layer = network.GetLayer(i);
         std::string layerOutputVarName = ConstructLayerOutputName(i); 
         bool lastLayer = i == network.GetNumberOfLayers() - 1;
-        Variable& layerOutputVar = lastLayer ? outputVar : Variable::Create(layerOutputVarName, ConstructLayerOutputType(layer));
+        Variable& layerOutputVar = lastLayer ? outputVar : Variable::Create(layerOutputVarName, ConstructLayerOutputType(layer, rowsPerVariable),
+                                                                            runtimeBatchSize);
         
         if(!lastLayer)
         {
@@ -549,14 +1145,50 @@ Function& ConstructIRForNetwork(Network& network)
             function.AddStatement(outputVarDefnStm);
         }
         
+        // A softmax needs the values of the whole layer, so it is always applied afterwards
+        ActivationFunction* layerActivation = GetLayerActivation(layer);
+        bool splitActivation = layerActivation != nullptr &&
+                               (options.splitActivations || !sKernelActivations[layerActivation->GetActivation()].elementwise);
+
+        // The input layer reads the network input, which is not quantized
+        KernelQuantization inputQuantization;
+        if (calibration != nullptr && i > 0)
+            inputQuantization = GetKernelQuantization(calibration->minimums[i - 1], calibration->maximums[i - 1]);
+
         auto ensembles = layer.GetEnsembles();
-        for (int32_t j=0 ; j<ensembles.size() ; ++j)
+        std::list<IRStatement*> layerStmList;
+        sharedInputs.variables.clear();
+        sharedInputs.statements.clear();
+        for (size_t j=0 ; j<ensembles.size() ; ++j)
         {
             auto ensemble = ensembles[j];
-            ConstructIRForEnsemble(function, *ensemble, layerOutputVar, *prevLayerOutput);
+            ConstructIRForEnsemble(function, layerStmList, sharedInputs, *ensemble, layerOutputVar, *prevLayerOutput, options, batchSize,
+                                   prevLayerNeurons, layer.GetNumberOfNeurons(), splitActivation,
+                                   calibration != nullptr && i > 0 ? &inputQuantization : nullptr);
+        }
+        for (auto iter=sharedInputs.statements.begin() ; iter!=sharedInputs.statements.end() ; ++iter)
+            function.AddStatement(*(*iter));
+        for (auto iter=layerStmList.begin() ; iter!=layerStmList.end() ; ++iter)
+            function.AddStatement(*(*iter));
+        if (splitActivation)
+        {
+            Value& rows = batchSize ? *batchSize : Constant(1);
+            int32_t accuracy = GetActivationAccuracy(layerActivation->GetAccuracy(), options.activationAccuracy);
+            function.AddStatement(VectorActivation::Create(layerOutputVar, 0, layer.GetNumberOfNeurons(), layer.GetNumberOfNeurons(), rows,
+                                                           layerActivation->GetActivation(), accuracy));
         }
         prevLayerOutput = &layerOutputVar;
+        prevLayerNeurons = layer.GetNumberOfNeurons();
     }
 
+    // Unrolled loops have a step other than one and cannot be fused, so fusion takes precedence
+    LoweringOptions transformOptions = options;
+    if (options.fuseLoops && options.batchSize == 1)
+        transformOptions.unrollAndJamFactor = 1;
+    TransformLoops(function, transformOptions);
+    if (options.optimizeLoops)
+        OptimizeLoops(function);
+    if (options.fuseLoops)
+        FuseLoops(function);
     return function;
 }
@@ -0,0 +1,1365 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ir.h"
+
+// Scalar optimizations of the loops created by the lowering. Every temporary the lowering
+// defines is a slot in the interpreter and a load and store in generated code, and many of
+// them only carry a value to the next statement or hold a value that does not change in an
+// inner loop.
+
+// Reads and writes of variables by statements, including the statements of nested loops
+struct VariableUses
+{
+    std::map<Variable*, int32_t> reads;
+    std::map<Variable*, int32_t> writes;
+    // Read where the variable cannot be replaced by a value: by the bounds of a loop, which
+    // are fixed when the loop is created, or as the variable of a vector operand
+    std::set<Variable*> fixedReads;
+    bool readsIndexedValues;
+
+    VariableUses()
+        :readsIndexedValues(false)
+    { }
+    int32_t GetReads(Variable& var) { return reads.count(&var) ? reads[&var] : 0; }
+    int32_t GetWrites(Variable& var) { return writes.count(&var) ? writes[&var] : 0; }
+};
+
+class ReadCountVisitor : public IRValueVisitor
+{
+    VariableUses& m_uses;
+
+    void VisitBinaryOp(BinaryOp& binOp)
+    {
+        binOp.GetLHS().AcceptIRValueVisitor(*this);
+        binOp.GetRHS().AcceptIRValueVisitor(*this);
+    }
+public:
+    ReadCountVisitor(VariableUses& uses)
+        :m_uses(uses)
+    { }
+    virtual void Visit(IntegerConstant& intConst) { }
+    virtual void Visit(BooleanConstant& boolConst) { }
+    virtual void Visit(RealConstant& realConst) { }
+    virtual void Visit(RealVectorConstant& realVecConst) { }
+    virtual void Visit(UnaryPlus& unaryPlus) { unaryPlus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(UnaryMinus& unaryMinus) { unaryMinus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitBinaryOp(binaryAdd); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitBinaryOp(binarySubtract); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { VisitBinaryOp(binaryMultiply); }
+    virtual void Visit(BinaryDivide& binaryDivide) { VisitBinaryOp(binaryDivide); }
+    virtual void Visit(GetInputValue& getInput) { }
+    virtual void Visit(Reduction& reduction) { reduction.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(ActivationFunction& function) { function.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(Variable& variable) { ++m_uses.reads[&variable]; }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        ++m_uses.reads[&indexedVal.GetVariable()];
+        m_uses.readsIndexedValues = true;
+        indexedVal.GetIndexer().AcceptIRValueVisitor(*this);
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        getValue.GetElementID().AcceptIRValueVisitor(*this);
+        if (getValue.GetScalarIndex() != nullptr)
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+    }
+};
+
+class VariableUseVisitor : public IRStatementVisitor
+{
+    VariableUses& m_uses;
+    ReadCountVisitor m_readCounter;
+
+    void AddReads(VectorOperand& operand)
+    {
+        if (operand.GetVariable() != nullptr)
+        {
+            ++m_uses.reads[operand.GetVariable()];
+            m_uses.fixedReads.insert(operand.GetVariable());
+            m_uses.readsIndexedValues = true;
+            operand.GetOffset()->AcceptIRValueVisitor(m_readCounter);
+        }
+        else
+            operand.GetElementID()->AcceptIRValueVisitor(m_readCounter);
+    }
+public:
+    VariableUseVisitor(VariableUses& uses)
+        :m_uses(uses), m_readCounter(uses)
+    { }
+    virtual void Visit(Assignment& assignment)
+    {
+        assignment.GetRHS().AcceptIRValueVisitor(m_readCounter);
+        if (IndexedValue* indexedLHS = dynamic_cast<IndexedValue*>(&assignment.GetLHS()))
+        {
+            ++m_uses.writes[&indexedLHS->GetVariable()];
+            indexedLHS->GetIndexer().AcceptIRValueVisitor(m_readCounter);
+        }
+        else if (Variable* lhsVar = dynamic_cast<Variable*>(&assignment.GetLHS()))
+            ++m_uses.writes[lhsVar];
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        VariableUses boundUses;
+        ReadCountVisitor boundCounter(boundUses);
+        forLoop.GetStart().AcceptIRValueVisitor(boundCounter);
+        forLoop.GetEnd().AcceptIRValueVisitor(boundCounter);
+        for (std::map<Variable*, int32_t>::iterator iter=boundUses.reads.begin() ; iter!=boundUses.reads.end() ; ++iter)
+        {
+            m_uses.reads[iter->first] += iter->second;
+            m_uses.fixedReads.insert(iter->first);
+        }
+        ++m_uses.writes[&forLoop.GetIndexVariable()];
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+    }
+    virtual void Visit(VariableDefinition& varDefinition) { }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        ++m_uses.reads[&denseLayer.GetInput()];
+        denseLayer.GetBatchSize().AcceptIRValueVisitor(m_readCounter);
+        ++m_uses.writes[&denseLayer.GetOutput()];
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        AddReads(vectorOperation.GetLHS());
+        AddReads(vectorOperation.GetRHS());
+        ++m_uses.writes[&vectorOperation.GetResult()];
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        AddReads(vectorReduction.GetOperand());
+        if (vectorReduction.GetFactor() != nullptr)
+            AddReads(*vectorReduction.GetFactor());
+        ++m_uses.writes[&vectorReduction.GetResult()];
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        ++m_uses.reads[&vectorActivation.GetVariable()];
+        vectorActivation.GetBatchSize().AcceptIRValueVisitor(m_readCounter);
+        ++m_uses.writes[&vectorActivation.GetVariable()];
+    }
+};
+
+static VariableUses GetVariableUses(IRStatement& stm)
+{
+    VariableUses uses;
+    VariableUseVisitor visitor(uses);
+    stm.AcceptVisitor(visitor);
+    return uses;
+}
+
+static VariableUses GetVariableUses(Value& value)
+{
+    VariableUses uses;
+    ReadCountVisitor visitor(uses);
+    value.AcceptIRValueVisitor(visitor);
+    return uses;
+}
+
+static bool WritesAny(VariableUses& uses, VariableUses& variables)
+{
+    for (std::map<Variable*, int32_t>::iterator iter=variables.reads.begin() ; iter!=variables.reads.end() ; ++iter)
+    {
+        if (uses.GetWrites(*iter->first) != 0)
+            return true;
+    }
+    return false;
+}
+
+static IntegerConstant* AsIntegerConstant(Value& v)
+{
+    return dynamic_cast<IntegerConstant*>(&v);
+}
+
+// Integer arithmetic with constant operands, mostly index computations. Returns nullptr
+// when nothing simplifies.
+static Value* SimplifyIntegerOperation(char operation, Value& lhs, Value& rhs)
+{
+    if (!lhs.GetType().IsInteger() || !rhs.GetType().IsInteger())
+        return nullptr;
+    IntegerConstant* lhsConst = AsIntegerConstant(lhs);
+    IntegerConstant* rhsConst = AsIntegerConstant(rhs);
+    if (lhsConst != nullptr && rhsConst != nullptr && operation != '/')
+    {
+        int64_t l = lhsConst->GetValue();
+        int64_t r = rhsConst->GetValue();
+        return &IntegerConstant::Create(operation == '+' ? l + r : (operation == '-' ? l - r : l * r));
+    }
+    int64_t identity = operation == '*' || operation == '/' ? 1 : 0;
+    if (rhsConst != nullptr && rhsConst->GetValue() == identity)
+        return &lhs;
+    if (lhsConst != nullptr && lhsConst->GetValue() == identity && (operation == '+' || operation == '*'))
+        return &rhs;
+    if (operation == '*' && ((lhsConst && lhsConst->GetValue() == 0) || (rhsConst && rhsConst->GetValue() == 0)))
+        return &IntegerConstant::Create(0);
+    // (x + c1) + c2 is x + (c1 + c2)
+    BinaryAdd* lhsAdd = dynamic_cast<BinaryAdd*>(&lhs);
+    if (operation == '+' && rhsConst != nullptr && lhsAdd != nullptr && AsIntegerConstant(lhsAdd->GetRHS()) != nullptr)
+        return &BinaryAdd::Create(lhsAdd->GetLHS(), IntegerConstant::Create(AsIntegerConstant(lhsAdd->GetRHS())->GetValue() + rhsConst->GetValue()));
+    return nullptr;
+}
+
+// Rebuilds a value with variables replaced by values, and products of a loop index and a
+// constant replaced by induction variables. Integer arithmetic is simplified on the way.
+// Parts of the value that do not change are shared with the original.
+class SubstitutionVisitor : public IRValueVisitor
+{
+    std::map<Variable*, Value*> m_replacements;
+    Variable* m_productIndex;
+    std::map<int64_t, Variable*> m_indexProducts;
+    Value* m_result;
+
+    template<typename OpType>
+    void VisitBinaryOp(OpType& binOp, char operation)
+    {
+        Value& lhs = Substitute(binOp.GetLHS());
+        Value& rhs = Substitute(binOp.GetRHS());
+        if (operation == '*' && m_productIndex != nullptr)
+        {
+            IntegerConstant* factor = &lhs == m_productIndex ? AsIntegerConstant(rhs) : (&rhs == m_productIndex ? AsIntegerConstant(lhs) : nullptr);
+            if (factor != nullptr && m_indexProducts.count(factor->GetValue()) != 0)
+            {
+                m_result = m_indexProducts[factor->GetValue()];
+                return;
+            }
+        }
+        if (Value* simplified = SimplifyIntegerOperation(operation, lhs, rhs))
+            m_result = simplified;
+        else if (&lhs == &binOp.GetLHS() && &rhs == &binOp.GetRHS())
+            m_result = &binOp;
+        else
+            m_result = &OpType::Create(lhs, rhs);
+    }
+public:
+    SubstitutionVisitor()
+        :m_productIndex(nullptr), m_result(nullptr)
+    { }
+    void AddReplacement(Variable& var, Value& value) { m_replacements[&var] = &value; }
+    void AddIndexProduct(Variable& index, int64_t factor, Variable& product)
+    {
+        m_productIndex = &index;
+        m_indexProducts[factor] = &product;
+    }
+    Value& Substitute(Value& v)
+    {
+        v.AcceptIRValueVisitor(*this);
+        return *m_result;
+    }
+    // Variables that are written can only be replaced by variables
+    Variable& SubstituteVariable(Variable& var)
+    {
+        std::map<Variable*, Value*>::iterator iter = m_replacements.find(&var);
+        Variable* replacement = iter != m_replacements.end() ? dynamic_cast<Variable*>(iter->second) : nullptr;
+        return replacement ? *replacement : var;
+    }
+    virtual void Visit(IntegerConstant& intConst) { m_result = &intConst; }
+    virtual void Visit(BooleanConstant& boolConst) { m_result = &boolConst; }
+    virtual void Visit(RealConstant& realConst) { m_result = &realConst; }
+    virtual void Visit(RealVectorConstant& realVecConst) { m_result = &realVecConst; }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        Value& operand = Substitute(unaryPlus.GetOperand());
+        m_result = &operand == &unaryPlus.GetOperand() ? &unaryPlus : &UnaryPlus::Create(operand);
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        Value& operand = Substitute(unaryMinus.GetOperand());
+        m_result = &operand == &unaryMinus.GetOperand() ? &unaryMinus : &UnaryMinus::Create(operand);
+    }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitBinaryOp(binaryAdd, '+'); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitBinaryOp(binarySubtract, '-'); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { VisitBinaryOp(binaryMultiply, '*'); }
+    virtual void Visit(BinaryDivide& binaryDivide) { VisitBinaryOp(binaryDivide, '/'); }
+    virtual void Visit(GetInputValue& getInput) { m_result = &getInput; }
+    virtual void Visit(Reduction& reduction)
+    {
+        Value& operand = Substitute(reduction.GetOperand());
+        m_result = &operand == &reduction.GetOperand() ? &reduction : &Reduction::Create(operand, reduction.GetReductionType());
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        Value& operand = Substitute(function.GetOperand());
+        m_result = &operand == &function.GetOperand() ? &function : &ActivationFunction::Create(operand, function.GetName(), function.GetAccuracy());
+    }
+    virtual void Visit(Variable& variable)
+    {
+        std::map<Variable*, Value*>::iterator iter = m_replacements.find(&variable);
+        m_result = iter != m_replacements.end() ? iter->second : &variable;
+    }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        Value& indexer = Substitute(indexedVal.GetIndexer());
+        m_result = &indexer == &indexedVal.GetIndexer() ? &indexedVal : &IndexedValue::Create(indexedVal.GetVariable(), indexer);
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        Value& elemID = Substitute(getValue.GetElementID());
+        Value* scalarIndex = getValue.GetScalarIndex() ? &Substitute(*getValue.GetScalarIndex()) : nullptr;
+        if (&elemID == &getValue.GetElementID() && scalarIndex == getValue.GetScalarIndex())
+            m_result = &getValue;
+        else if (scalarIndex != nullptr)
+            m_result = &GetValue::Create(getValue.GetValueSet(), elemID, *scalarIndex);
+        else
+            m_result = &GetValue::Create(getValue.GetValueSet(), elemID);
+    }
+};
+
+// Applies a substitution to a statement. Loops are rewritten in place and their bounds are
+// left alone, unless loops are cloned. Other statements are replaced when they change.
+class StatementSubstitutionVisitor : public IRStatementVisitor
+{
+    SubstitutionVisitor& m_substitution;
+    bool m_cloneLoops;
+    IRStatement* m_result;
+
+    VectorOperand Substitute(VectorOperand& operand)
+    {
+        if (operand.GetVariable() != nullptr)
+            return VectorOperand(m_substitution.SubstituteVariable(*operand.GetVariable()), m_substitution.Substitute(*operand.GetOffset()),
+                                 operand.GetStride());
+        return VectorOperand(*operand.GetValueSet(), m_substitution.Substitute(*operand.GetElementID()));
+    }
+public:
+    StatementSubstitutionVisitor(SubstitutionVisitor& substitution, bool cloneLoops = false)
+        :m_substitution(substitution), m_cloneLoops(cloneLoops), m_result(nullptr)
+    { }
+    IRStatement& Substitute(IRStatement& stm)
+    {
+        stm.AcceptVisitor(*this);
+        return *m_result;
+    }
+    virtual void Visit(Assignment& assignment)
+    {
+        Variable* lhsVar = dynamic_cast<Variable*>(&assignment.GetLHS());
+        Value& lhs = lhsVar ? m_substitution.SubstituteVariable(*lhsVar) : m_substitution.Substitute(assignment.GetLHS());
+        Value& rhs = m_substitution.Substitute(assignment.GetRHS());
+        bool unchanged = &lhs == &assignment.GetLHS() && &rhs == &assignment.GetRHS();
+        m_result = unchanged ? &assignment : &Assignment::Create(lhs, rhs);
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        if (!m_cloneLoops)
+        {
+            for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+                *iter = &Substitute(*(*iter));
+            m_result = &forLoop;
+            return;
+        }
+        ForLoop& clone = ForLoop::Create(m_substitution.Substitute(forLoop.GetStart()), m_substitution.Substitute(forLoop.GetEnd()),
+                                         forLoop.GetStep());
+        clone.SetParallel(forLoop.IsParallel());
+        m_substitution.AddReplacement(forLoop.GetIndexVariable(), clone.GetIndexVariable());
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            clone.AddStatement(Substitute(*(*iter)));
+        m_result = &clone;
+    }
+    // Cloned loops get their own temporaries, named apart from the originals since clones may
+    // share a scope
+    virtual void Visit(VariableDefinition& varDefinition)
+    {
+        static int32_t sCloneNum = 0;
+        m_result = &varDefinition;
+        if (!m_cloneLoops)
+            return;
+        Variable& var = varDefinition.GetVariable();
+        Variable& clone = Variable::Create(var.GetName() + "_" + std::to_string(sCloneNum++), var.GetType(), var.IsBatched());
+        m_substitution.AddReplacement(var, clone);
+        m_result = &VariableDefinition::Create(clone);
+    }
+    virtual void Visit(DenseLayer& denseLayer) { m_result = &denseLayer; }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        m_result = &VectorOperation::Create(vectorOperation.GetOperation(), m_substitution.SubstituteVariable(vectorOperation.GetResult()),
+                                            Substitute(vectorOperation.GetLHS()), Substitute(vectorOperation.GetRHS()), vectorOperation.GetLength());
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        Variable& result = m_substitution.SubstituteVariable(vectorReduction.GetResult());
+        if (vectorReduction.GetFactor() != nullptr)
+            m_result = &VectorReduction::CreateDotProduct(result, Substitute(vectorReduction.GetOperand()), Substitute(*vectorReduction.GetFactor()),
+                                                          vectorReduction.GetLength());
+        else
+            m_result = &VectorReduction::Create(vectorReduction.GetReductionType(), result, Substitute(vectorReduction.GetOperand()),
+                                                vectorReduction.GetLength());
+    }
+    virtual void Visit(VectorActivation& vectorActivation) { m_result = &vectorActivation; }
+};
+
+static bool IsCopyOrConstant(Value& v)
+{
+    return dynamic_cast<Variable*>(&v) != nullptr || dynamic_cast<ConstantValue*>(&v) != nullptr;
+}
+
+// The scalar temporary defined by stm in the list and assigned only by assignment, or nullptr
+static Variable* GetSingleAssignmentTemporary(IRStatement& stm, std::map<Variable*, std::list<IRStatement*>::iterator>& definitions,
+                                              VariableUses& uses)
+{
+    Assignment* assignment = dynamic_cast<Assignment*>(&stm);
+    Variable* var = assignment ? dynamic_cast<Variable*>(&assignment->GetLHS()) : nullptr;
+    if (var == nullptr || definitions.count(var) == 0 || uses.GetWrites(*var) != 1 || uses.fixedReads.count(var) != 0)
+        return nullptr;
+    return var;
+}
+
+static void CollectScalarDefinitions(std::list<IRStatement*>& stms, std::map<Variable*, std::list<IRStatement*>::iterator>& definitions)
+{
+    for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter);
+        if (definition != nullptr && definition->GetVariable().GetType().IsScalar())
+            definitions[&definition->GetVariable()] = iter;
+    }
+}
+
+// Replaces the scalar temporaries of a statement list that are assigned once by their value.
+// Copies and constants are propagated to all reads, other values only to a single read by a
+// later statement of the list, so that nothing is computed more often than before. Temporaries
+// that are never read are removed.
+static void ForwardTemporaries(std::list<IRStatement*>& stms)
+{
+    std::map<Variable*, std::list<IRStatement*>::iterator> definitions;
+    CollectScalarDefinitions(stms, definitions);
+    VariableUses listUses;
+    VariableUseVisitor listUseVisitor(listUses);
+    for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+        (*iter)->AcceptVisitor(listUseVisitor);
+
+    std::list<IRStatement*>::iterator iter = stms.begin();
+    while (iter != stms.end())
+    {
+        Variable* var = GetSingleAssignmentTemporary(*(*iter), definitions, listUses);
+        if (var == nullptr)
+        {
+            ++iter;
+            continue;
+        }
+        Value& value = static_cast<Assignment*>(*iter)->GetRHS();
+        VariableUses valueUses = GetVariableUses(value);
+        std::vector<std::list<IRStatement*>::iterator> readers;
+        int32_t reads = 0;
+        std::list<IRStatement*>::iterator next = iter;
+        for (++next ; next!=stms.end() ; ++next)
+        {
+            int32_t stmReads = GetVariableUses(*(*next)).GetReads(*var);
+            if (stmReads != 0)
+                readers.push_back(next);
+            reads += stmReads;
+        }
+        bool forward = valueUses.GetReads(*var) == 0 && (readers.empty() || IsCopyOrConstant(value) ||
+                       (reads == 1 && dynamic_cast<ForLoop*>(*readers.back()) == nullptr));
+        // The value must read the same variables at the last read. A statement reads before it
+        // writes, unless it is a loop.
+        if (forward && !readers.empty())
+        {
+            next = iter;
+            for (++next ; forward && next!=readers.back() ; ++next)
+            {
+                VariableUses uses = GetVariableUses(*(*next));
+                forward = !WritesAny(uses, valueUses);
+            }
+            if (forward && dynamic_cast<ForLoop*>(*readers.back()) != nullptr)
+            {
+                VariableUses uses = GetVariableUses(*(*readers.back()));
+                forward = !WritesAny(uses, valueUses);
+            }
+        }
+        if (!forward)
+        {
+            ++iter;
+            continue;
+        }
+        SubstitutionVisitor substitution;
+        substitution.AddReplacement(*var, value);
+        StatementSubstitutionVisitor stmSubstitution(substitution);
+        for (size_t i=0 ; i<readers.size() ; ++i)
+            *readers[i] = &stmSubstitution.Substitute(*(*readers[i]));
+        stms.erase(definitions[var]);
+        definitions.erase(var);
+        iter = stms.erase(iter);
+    }
+}
+
+// Moves the assignments of a sequential loop's scalar temporaries that do not depend on the
+// iteration in front of the loop. Values that read a variable's elements are only moved
+// when the loop is known to run, since the index may not be valid otherwise.
+static void HoistInvariants(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator loopIter)
+{
+    ForLoop& loop = static_cast<ForLoop&>(*(*loopIter));
+    if (loop.IsParallel())
+        return;
+    IntegerConstant* start = AsIntegerConstant(loop.GetStart());
+    IntegerConstant* end = AsIntegerConstant(loop.GetEnd());
+    bool runs = start != nullptr && end != nullptr && start->GetValue() < end->GetValue();
+    std::list<IRStatement*>& body = loop.GetStatements();
+    std::map<Variable*, std::list<IRStatement*>::iterator> definitions;
+    CollectScalarDefinitions(body, definitions);
+    VariableUses loopUses = GetVariableUses(loop);
+
+    std::list<IRStatement*>::iterator iter = body.begin();
+    while (iter != body.end())
+    {
+        Variable* var = GetSingleAssignmentTemporary(*(*iter), definitions, loopUses);
+        if (var == nullptr)
+        {
+            ++iter;
+            continue;
+        }
+        VariableUses valueUses = GetVariableUses(static_cast<Assignment*>(*iter)->GetRHS());
+        if (WritesAny(loopUses, valueUses) || (valueUses.readsIndexedValues && !runs))
+        {
+            ++iter;
+            continue;
+        }
+        stms.insert(loopIter, *definitions[var]);
+        stms.insert(loopIter, *iter);
+        body.erase(definitions[var]);
+        definitions.erase(var);
+        iter = body.erase(iter);
+        // Values depending on this one may now be invariant too
+        loopUses.writes[var] = 0;
+    }
+}
+
+// Finds the constant factors the index of a loop is multiplied by
+class IndexProductVisitor : public IRValueVisitor
+{
+    Variable& m_index;
+    std::set<int64_t>& m_factors;
+
+    void VisitBinaryOp(BinaryOp& binOp)
+    {
+        binOp.GetLHS().AcceptIRValueVisitor(*this);
+        binOp.GetRHS().AcceptIRValueVisitor(*this);
+    }
+public:
+    IndexProductVisitor(Variable& index, std::set<int64_t>& factors)
+        :m_index(index), m_factors(factors)
+    { }
+    virtual void Visit(IntegerConstant& intConst) { }
+    virtual void Visit(BooleanConstant& boolConst) { }
+    virtual void Visit(RealConstant& realConst) { }
+    virtual void Visit(RealVectorConstant& realVecConst) { }
+    virtual void Visit(UnaryPlus& unaryPlus) { unaryPlus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(UnaryMinus& unaryMinus) { unaryMinus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitBinaryOp(binaryAdd); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitBinaryOp(binarySubtract); }
+    virtual void Visit(BinaryMultiply& binaryMultiply)
+    {
+        IntegerConstant* factor = nullptr;
+        if (&binaryMultiply.GetLHS() == &m_index)
+            factor = AsIntegerConstant(binaryMultiply.GetRHS());
+        else if (&binaryMultiply.GetRHS() == &m_index)
+            factor = AsIntegerConstant(binaryMultiply.GetLHS());
+        if (factor != nullptr)
+            m_factors.insert(factor->GetValue());
+        else
+            VisitBinaryOp(binaryMultiply);
+    }
+    virtual void Visit(BinaryDivide& binaryDivide) { VisitBinaryOp(binaryDivide); }
+    virtual void Visit(GetInputValue& getInput) { }
+    virtual void Visit(Reduction& reduction) { reduction.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(ActivationFunction& function) { function.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(Variable& variable) { }
+    virtual void Visit(IndexedValue& indexedVal) { indexedVal.GetIndexer().AcceptIRValueVisitor(*this); }
+    virtual void Visit(GetValue& getValue)
+    {
+        getValue.GetElementID().AcceptIRValueVisitor(*this);
+        if (getValue.GetScalarIndex() != nullptr)
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+    }
+};
+
+class IndexProductStatementVisitor : public IRStatementVisitor
+{
+    IndexProductVisitor m_valueVisitor;
+
+    void VisitOperand(VectorOperand& operand)
+    {
+        (operand.GetVariable() ? operand.GetOffset() : operand.GetElementID())->AcceptIRValueVisitor(m_valueVisitor);
+    }
+public:
+    IndexProductStatementVisitor(Variable& index, std::set<int64_t>& factors)
+        :m_valueVisitor(index, factors)
+    { }
+    virtual void Visit(Assignment& assignment)
+    {
+        assignment.GetLHS().AcceptIRValueVisitor(m_valueVisitor);
+        assignment.GetRHS().AcceptIRValueVisitor(m_valueVisitor);
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+    }
+    virtual void Visit(VariableDefinition& varDefinition) { }
+    virtual void Visit(DenseLayer& denseLayer) { }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        VisitOperand(vectorOperation.GetLHS());
+        VisitOperand(vectorOperation.GetRHS());
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        VisitOperand(vectorReduction.GetOperand());
+        if (vectorReduction.GetFactor() != nullptr)
+            VisitOperand(*vectorReduction.GetFactor());
+    }
+    virtual void Visit(VectorActivation& vectorActivation) { }
+};
+
+// Replaces index * factor in the body of a sequential loop by a variable that starts at
+// start * factor and is incremented by step * factor at the end of every iteration
+static void ReduceIndexProducts(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator loopIter)
+{
+    ForLoop& loop = static_cast<ForLoop&>(*(*loopIter));
+    IntegerConstant* start = AsIntegerConstant(loop.GetStart());
+    if (loop.IsParallel() || start == nullptr)
+        return;
+    Variable& index = loop.GetIndexVariable();
+    std::set<int64_t> factors;
+    IndexProductStatementVisitor productVisitor(index, factors);
+    std::list<IRStatement*>& body = loop.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+        (*iter)->AcceptVisitor(productVisitor);
+    if (factors.empty())
+        return;
+
+    SubstitutionVisitor substitution;
+    std::vector<IRStatement*> increments;
+    for (std::set<int64_t>::iterator iter=factors.begin() ; iter!=factors.end() ; ++iter)
+    {
+        Variable& product = Variable::Create(index.GetName() + "x" + std::to_string(*iter), IntegerType::Get());
+        stms.insert(loopIter, &VariableDefinition::Create(product));
+        stms.insert(loopIter, &Assignment::Create(product, IntegerConstant::Create(start->GetValue() * *iter)));
+        increments.push_back(&Assignment::Create(product, BinaryAdd::Create(product, IntegerConstant::Create(loop.GetStep() * *iter))));
+        substitution.AddIndexProduct(index, *iter, product);
+    }
+    StatementSubstitutionVisitor stmSubstitution(substitution);
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+        *iter = &stmSubstitution.Substitute(*(*iter));
+    body.insert(body.end(), increments.begin(), increments.end());
+}
+
+static void OptimizeStatementList(std::list<IRStatement*>& stms)
+{
+    ForwardTemporaries(stms);
+    for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        ForLoop* forLoop = dynamic_cast<ForLoop*>(*iter);
+        if (forLoop == nullptr)
+            continue;
+        ReduceIndexProducts(stms, iter);
+        OptimizeStatementList(forLoop->GetStatements());
+        HoistInvariants(stms, iter);
+    }
+    ForwardTemporaries(stms);
+}
+
+void OptimizeLoops(Function& function)
+{
+    // Top level loops are left in place, so that nothing is moved out of a parallel loop and
+    // all top level variables stay layer outputs
+    const std::list<IRStatement*>& stms = function.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (ForLoop* forLoop = dynamic_cast<ForLoop*>(*iter))
+            OptimizeStatementList(forLoop->GetStatements());
+    }
+}
+
+// constant + sum of coefficient * variable, for integer index computations
+struct AffineIndex
+{
+    bool valid;
+    int64_t constant;
+    std::map<Variable*, int64_t> coefficients;
+
+    AffineIndex()
+        :valid(true), constant(0)
+    { }
+};
+
+class AffineIndexVisitor : public IRValueVisitor
+{
+    AffineIndex m_result;
+
+    void SetInvalid()
+    {
+        m_result = AffineIndex();
+        m_result.valid = false;
+    }
+    void Scale(AffineIndex& index, int64_t factor)
+    {
+        index.constant *= factor;
+        for (std::map<Variable*, int64_t>::iterator iter=index.coefficients.begin() ; iter!=index.coefficients.end() ; ++iter)
+            iter->second *= factor;
+    }
+    void VisitSum(BinaryOp& binOp, int64_t rhsSign)
+    {
+        AffineIndex lhs = Get(binOp.GetLHS());
+        AffineIndex rhs = Get(binOp.GetRHS());
+        Scale(rhs, rhsSign);
+        lhs.valid = lhs.valid && rhs.valid;
+        lhs.constant += rhs.constant;
+        for (std::map<Variable*, int64_t>::iterator iter=rhs.coefficients.begin() ; iter!=rhs.coefficients.end() ; ++iter)
+            lhs.coefficients[iter->first] += iter->second;
+        m_result = lhs;
+    }
+public:
+    AffineIndex Get(Value& v)
+    {
+        v.AcceptIRValueVisitor(*this);
+        return m_result;
+    }
+    virtual void Visit(IntegerConstant& intConst)
+    {
+        m_result = AffineIndex();
+        m_result.constant = intConst.GetValue();
+    }
+    virtual void Visit(BooleanConstant& boolConst) { SetInvalid(); }
+    virtual void Visit(RealConstant& realConst) { SetInvalid(); }
+    virtual void Visit(RealVectorConstant& realVecConst) { SetInvalid(); }
+    virtual void Visit(UnaryPlus& unaryPlus) { m_result = Get(unaryPlus.GetOperand()); }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        m_result = Get(unaryMinus.GetOperand());
+        Scale(m_result, -1);
+    }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitSum(binaryAdd, 1); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitSum(binarySubtract, -1); }
+    virtual void Visit(BinaryMultiply& binaryMultiply)
+    {
+        AffineIndex lhs = Get(binaryMultiply.GetLHS());
+        AffineIndex rhs = Get(binaryMultiply.GetRHS());
+        if (!lhs.valid || !rhs.valid || (!lhs.coefficients.empty() && !rhs.coefficients.empty()))
+            return SetInvalid();
+        if (lhs.coefficients.empty())
+        {
+            Scale(rhs, lhs.constant);
+            m_result = rhs;
+        }
+        else
+        {
+            Scale(lhs, rhs.constant);
+            m_result = lhs;
+        }
+    }
+    virtual void Visit(BinaryDivide& binaryDivide) { SetInvalid(); }
+    virtual void Visit(GetInputValue& getInput) { SetInvalid(); }
+    virtual void Visit(Reduction& reduction) { SetInvalid(); }
+    virtual void Visit(ActivationFunction& function) { SetInvalid(); }
+    virtual void Visit(Variable& variable)
+    {
+        m_result = AffineIndex();
+        m_result.coefficients[&variable] = 1;
+    }
+    virtual void Visit(IndexedValue& indexedVal) { SetInvalid(); }
+    virtual void Visit(GetValue& getValue) { SetInvalid(); }
+};
+
+// Collects the indices of the reads of a vector variable in a value
+class IndexedReadVisitor : public IRValueVisitor
+{
+    Variable& m_var;
+    std::vector<Value*>& m_indices;
+    bool& m_wholeRead;
+
+    void VisitBinaryOp(BinaryOp& binOp)
+    {
+        binOp.GetLHS().AcceptIRValueVisitor(*this);
+        binOp.GetRHS().AcceptIRValueVisitor(*this);
+    }
+public:
+    IndexedReadVisitor(Variable& var, std::vector<Value*>& indices, bool& wholeRead)
+        :m_var(var), m_indices(indices), m_wholeRead(wholeRead)
+    { }
+    virtual void Visit(IntegerConstant& intConst) { }
+    virtual void Visit(BooleanConstant& boolConst) { }
+    virtual void Visit(RealConstant& realConst) { }
+    virtual void Visit(RealVectorConstant& realVecConst) { }
+    virtual void Visit(UnaryPlus& unaryPlus) { unaryPlus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(UnaryMinus& unaryMinus) { unaryMinus.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(BinaryAdd& binaryAdd) { VisitBinaryOp(binaryAdd); }
+    virtual void Visit(BinarySubtract& binarySubtract) { VisitBinaryOp(binarySubtract); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { VisitBinaryOp(binaryMultiply); }
+    virtual void Visit(BinaryDivide& binaryDivide) { VisitBinaryOp(binaryDivide); }
+    virtual void Visit(GetInputValue& getInput) { }
+    virtual void Visit(Reduction& reduction) { reduction.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(ActivationFunction& function) { function.GetOperand().AcceptIRValueVisitor(*this); }
+    virtual void Visit(Variable& variable) { m_wholeRead = m_wholeRead || &variable == &m_var; }
+    virtual void Visit(IndexedValue& indexedVal)
+    {
+        if (&indexedVal.GetVariable() == &m_var)
+            m_indices.push_back(&indexedVal.GetIndexer());
+        indexedVal.GetIndexer().AcceptIRValueVisitor(*this);
+    }
+    virtual void Visit(GetValue& getValue)
+    {
+        getValue.GetElementID().AcceptIRValueVisitor(*this);
+        if (getValue.GetScalarIndex() != nullptr)
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+    }
+};
+
+// Elements of a vector variable that one iteration of a loop reads, as the window
+// [stride * index + first, stride * index + last] of the loop index. Valid when every read
+// is an affine function of the index, of the indices of inner loops with constant bounds and
+// of integer temporaries assigned once with such a function, and the loop does not write
+// the variable.
+class ReadWindowVisitor : public IRStatementVisitor
+{
+    Variable& m_var;
+    Variable& m_index;
+    VariableUses& m_loopUses;
+    // Inclusive ranges of the indices of inner loops
+    std::map<Variable*, std::pair<int64_t, int64_t> > m_indexRanges;
+    std::map<Variable*, AffineIndex> m_temporaries;
+    bool m_valid;
+    bool m_anyRead;
+    int64_t m_stride;
+    int64_t m_first;
+    int64_t m_last;
+
+    AffineIndex GetAffineIndex(Value& v)
+    {
+        AffineIndex affine = AffineIndexVisitor().Get(v);
+        AffineIndex expanded;
+        expanded.valid = affine.valid;
+        expanded.constant = affine.constant;
+        for (std::map<Variable*, int64_t>::iterator iter=affine.coefficients.begin() ; iter!=affine.coefficients.end() ; ++iter)
+        {
+            std::map<Variable*, AffineIndex>::iterator temporary = m_temporaries.find(iter->first);
+            if (temporary == m_temporaries.end())
+            {
+                expanded.coefficients[iter->first] += iter->second;
+                continue;
+            }
+            expanded.constant += iter->second * temporary->second.constant;
+            std::map<Variable*, int64_t>& coefficients = temporary->second.coefficients;
+            for (std::map<Variable*, int64_t>::iterator coefficient=coefficients.begin() ; coefficient!=coefficients.end() ; ++coefficient)
+                expanded.coefficients[coefficient->first] += iter->second * coefficient->second;
+        }
+        return expanded;
+    }
+    // Reads of index + [0, extent]
+    void AddRead(Value& index, int64_t extent)
+    {
+        AffineIndex affine = GetAffineIndex(index);
+        if (!affine.valid)
+        {
+            m_valid = false;
+            return;
+        }
+        int64_t stride = 0;
+        int64_t first = affine.constant;
+        int64_t last = affine.constant + extent;
+        for (std::map<Variable*, int64_t>::iterator iter=affine.coefficients.begin() ; iter!=affine.coefficients.end() ; ++iter)
+        {
+            std::map<Variable*, std::pair<int64_t, int64_t> >::iterator range = m_indexRanges.find(iter->first);
+            if (iter->first == &m_index)
+                stride = iter->second;
+            else if (range == m_indexRanges.end())
+                m_valid = false;
+            else
+            {
+                first += iter->second * (iter->second > 0 ? range->second.first : range->second.second);
+                last += iter->second * (iter->second > 0 ? range->second.second : range->second.first);
+            }
+        }
+        if (m_anyRead && stride != m_stride)
+            m_valid = false;
+        m_stride = stride;
+        m_first = m_anyRead ? std::min(m_first, first) : first;
+        m_last = m_anyRead ? std::max(m_last, last) : last;
+        m_anyRead = true;
+    }
+    void AddReads(Value& v)
+    {
+        std::vector<Value*> indices;
+        bool wholeRead = false;
+        IndexedReadVisitor readVisitor(m_var, indices, wholeRead);
+        v.AcceptIRValueVisitor(readVisitor);
+        m_valid = m_valid && !wholeRead;
+        for (size_t i=0 ; i<indices.size() ; ++i)
+            AddRead(*indices[i], 0);
+    }
+    void AddReads(VectorOperand& operand, int32_t length)
+    {
+        if (operand.GetVariable() == nullptr)
+            return AddReads(*operand.GetElementID());
+        AddReads(*operand.GetOffset());
+        if (operand.GetVariable() != &m_var)
+            return;
+        m_valid = m_valid && operand.GetStride() >= 0;
+        AddRead(*operand.GetOffset(), static_cast<int64_t>(length - 1) * operand.GetStride());
+    }
+public:
+    ReadWindowVisitor(Variable& var, Variable& index, VariableUses& loopUses)
+        :m_var(var), m_index(index), m_loopUses(loopUses), m_valid(true), m_anyRead(false), m_stride(0), m_first(0), m_last(0)
+    { }
+    bool GetWindow(int64_t& stride, int64_t& first, int64_t& last)
+    {
+        stride = m_stride;
+        first = m_first;
+        last = m_last;
+        return m_valid && m_anyRead;
+    }
+    virtual void Visit(Assignment& assignment)
+    {
+        AddReads(assignment.GetRHS());
+        if (IndexedValue* indexedLHS = dynamic_cast<IndexedValue*>(&assignment.GetLHS()))
+        {
+            m_valid = m_valid && &indexedLHS->GetVariable() != &m_var;
+            AddReads(indexedLHS->GetIndexer());
+        }
+        else
+            m_valid = m_valid && &assignment.GetLHS() != &m_var;
+        Variable* lhsVar = dynamic_cast<Variable*>(&assignment.GetLHS());
+        if (lhsVar != nullptr && lhsVar->GetType().IsInteger() && m_loopUses.GetWrites(*lhsVar) == 1)
+        {
+            AffineIndex affine = GetAffineIndex(assignment.GetRHS());
+            if (affine.valid)
+                m_temporaries[lhsVar] = affine;
+        }
+    }
+    virtual void Visit(ForLoop& forLoop)
+    {
+        AddReads(forLoop.GetStart());
+        AddReads(forLoop.GetEnd());
+        IntegerConstant* start = AsIntegerConstant(forLoop.GetStart());
+        IntegerConstant* end = AsIntegerConstant(forLoop.GetEnd());
+        if (start != nullptr && end != nullptr && start->GetValue() < end->GetValue())
+            m_indexRanges[&forLoop.GetIndexVariable()] = std::make_pair(start->GetValue(), end->GetValue() - 1);
+        std::list<IRStatement*>& stms = forLoop.GetStatements();
+        for (std::list<IRStatement*>::iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            (*iter)->AcceptVisitor(*this);
+    }
+    virtual void Visit(VariableDefinition& varDefinition) { }
+    virtual void Visit(DenseLayer& denseLayer)
+    {
+        m_valid = m_valid && &denseLayer.GetInput() != &m_var && &denseLayer.GetOutput() != &m_var;
+        AddReads(denseLayer.GetBatchSize());
+    }
+    virtual void Visit(VectorOperation& vectorOperation)
+    {
+        AddReads(vectorOperation.GetLHS(), vectorOperation.GetLength());
+        AddReads(vectorOperation.GetRHS(), vectorOperation.GetLength());
+        m_valid = m_valid && &vectorOperation.GetResult() != &m_var;
+    }
+    virtual void Visit(VectorReduction& vectorReduction)
+    {
+        AddReads(vectorReduction.GetOperand(), vectorReduction.GetLength());
+        if (vectorReduction.GetFactor() != nullptr)
+            AddReads(*vectorReduction.GetFactor(), vectorReduction.GetLength());
+        m_valid = m_valid && &vectorReduction.GetResult() != &m_var;
+    }
+    virtual void Visit(VectorActivation& vectorActivation)
+    {
+        m_valid = m_valid && &vectorActivation.GetVariable() != &m_var;
+        AddReads(vectorActivation.GetBatchSize());
+    }
+};
+
+// Copy of the body of a loop for another value of its index
+static void CloneLoopBody(ForLoop& loop, Value& index, std::list<IRStatement*>& stms)
+{
+    SubstitutionVisitor substitution;
+    substitution.AddReplacement(loop.GetIndexVariable(), index);
+    StatementSubstitutionVisitor stmSubstitution(substitution, true);
+    std::list<IRStatement*>& body = loop.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+        stms.push_back(&stmSubstitution.Substitute(*(*iter)));
+}
+
+// Iterations [start, end) of a loop as another loop
+static ForLoop& CloneLoopRange(ForLoop& loop, int64_t start, int64_t end)
+{
+    ForLoop& clone = ForLoop::Create(IntegerConstant::Create(start), IntegerConstant::Create(end), loop.GetStep());
+    clone.SetParallel(loop.IsParallel());
+    CloneLoopBody(loop, clone.GetIndexVariable(), clone.GetStatements());
+    return clone;
+}
+
+// The vector of length n that a loop over [0, n) writes at element i in iteration i, and that
+// it does not read. Returns nullptr for other loops.
+static Variable* GetProducedVariable(ForLoop& loop, VariableUses& uses)
+{
+    IntegerConstant* start = AsIntegerConstant(loop.GetStart());
+    IntegerConstant* end = AsIntegerConstant(loop.GetEnd());
+    if (start == nullptr || end == nullptr || start->GetValue() != 0 || loop.GetStep() != 1)
+        return nullptr;
+    std::list<IRStatement*>& body = loop.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+    {
+        Assignment* assignment = dynamic_cast<Assignment*>(*iter);
+        IndexedValue* lhs = assignment ? dynamic_cast<IndexedValue*>(&assignment->GetLHS()) : nullptr;
+        if (lhs == nullptr || &lhs->GetIndexer() != &loop.GetIndexVariable())
+            continue;
+        Variable& var = lhs->GetVariable();
+        VectorType* vecType = var.GetType().AsVectorType();
+        if (vecType != nullptr && !var.IsBatched() && vecType->GetLength() == end->GetValue() &&
+            uses.GetWrites(var) == 1 && uses.GetReads(var) == 0)
+            return &var;
+    }
+    return nullptr;
+}
+
+// True when the two loops access a variable other than except that one of them writes
+static bool HaveConflicts(VariableUses& first, VariableUses& second, Variable& except)
+{
+    for (std::map<Variable*, int32_t>::iterator iter=first.writes.begin() ; iter!=first.writes.end() ; ++iter)
+    {
+        if (iter->first != &except && (second.GetReads(*iter->first) != 0 || second.GetWrites(*iter->first) != 0))
+            return true;
+    }
+    for (std::map<Variable*, int32_t>::iterator iter=second.writes.begin() ; iter!=second.writes.end() ; ++iter)
+    {
+        if (iter->first != &except && first.GetReads(*iter->first) != 0)
+            return true;
+    }
+    return false;
+}
+
+// Fuses the producer loop with the consumer loop that follows it when every iteration j of the
+// consumer reads a window [s*j + first, s*j + last] of the producer's output. The producer's
+// iterations up to last - s run first, then iteration j of the fused loop runs the s producer
+// iterations that complete the window of consumer iteration j, followed by that consumer
+// iteration. The rest of the producer runs last. Both loops keep the order of their iterations,
+// so they need not be parallel. Returns false when the loops cannot be fused.
+static bool FuseProducerAndConsumer(ForLoop& producer, ForLoop& consumer, std::list<IRStatement*>& fused)
+{
+    VariableUses producerUses = GetVariableUses(producer);
+    VariableUses consumerUses = GetVariableUses(consumer);
+    Variable* produced = GetProducedVariable(producer, producerUses);
+    IntegerConstant* consumerStart = AsIntegerConstant(consumer.GetStart());
+    IntegerConstant* consumerEnd = AsIntegerConstant(consumer.GetEnd());
+    if (produced == nullptr || consumerStart == nullptr || consumerEnd == nullptr || consumerStart->GetValue() != 0 || consumer.GetStep() != 1 ||
+        HaveConflicts(producerUses, consumerUses, *produced))
+        return false;
+    int64_t stride, first, last;
+    ReadWindowVisitor windowVisitor(*produced, consumer.GetIndexVariable(), consumerUses);
+    std::list<IRStatement*>& consumerBody = consumer.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=consumerBody.begin() ; iter!=consumerBody.end() ; ++iter)
+        (*iter)->AcceptVisitor(windowVisitor);
+    if (!windowVisitor.GetWindow(stride, first, last))
+        return false;
+    int64_t producerIterations = AsIntegerConstant(producer.GetEnd())->GetValue();
+    int64_t consumerIterations = consumerEnd->GetValue();
+    int64_t prologueEnd = last + 1 - stride;
+    int64_t fusedEnd = prologueEnd + stride * consumerIterations;
+    if (stride < 1 || first < 0 || prologueEnd < 0 || fusedEnd > producerIterations)
+        return false;
+
+    if (prologueEnd > 0)
+        fused.push_back(&CloneLoopRange(producer, 0, prologueEnd));
+    ForLoop& fusedLoop = ForLoop::Create(IntegerConstant::Create(0), IntegerConstant::Create(consumerIterations));
+    Variable& index = fusedLoop.GetIndexVariable();
+    if (stride == 1)
+    {
+        Value& producerIndex = prologueEnd == 0 ? static_cast<Value&>(index) : BinaryAdd::Create(index, IntegerConstant::Create(prologueEnd));
+        CloneLoopBody(producer, producerIndex, fusedLoop.GetStatements());
+    }
+    else
+    {
+        Value& windowEnd = BinaryMultiply::Create(index, IntegerConstant::Create(stride));
+        ForLoop& producerLoop = ForLoop::Create(BinaryAdd::Create(windowEnd, IntegerConstant::Create(prologueEnd)),
+                                                BinaryAdd::Create(windowEnd, IntegerConstant::Create(prologueEnd + stride)));
+        CloneLoopBody(producer, producerLoop.GetIndexVariable(), producerLoop.GetStatements());
+        fusedLoop.AddStatement(producerLoop);
+    }
+    CloneLoopBody(consumer, index, fusedLoop.GetStatements());
+    fused.push_back(&fusedLoop);
+    if (fusedEnd < producerIterations)
+        fused.push_back(&CloneLoopRange(producer, fusedEnd, producerIterations));
+    return true;
+}
+
+void FuseLoops(Function& function)
+{
+    if (function.GetBatchSize() != 1 || function.GetBatchSizeVariable() != nullptr)
+        return;
+    std::list<IRStatement*>& stms = function.GetStatements();
+    std::list<IRStatement*>::iterator iter = stms.begin();
+    while (iter != stms.end())
+    {
+        ForLoop* producer = dynamic_cast<ForLoop*>(*iter);
+        // Only the definition of the consumer's output may separate the two loops
+        std::list<IRStatement*>::iterator next = iter;
+        for (++next ; next!=stms.end() && dynamic_cast<VariableDefinition*>(*next) != nullptr ; ++next)
+            ;
+        ForLoop* consumer = next != stms.end() ? dynamic_cast<ForLoop*>(*next) : nullptr;
+        std::list<IRStatement*> fused;
+        if (producer == nullptr || consumer == nullptr || !FuseProducerAndConsumer(*producer, *consumer, fused))
+        {
+            ++iter;
+            continue;
+        }
+        ++next;
+        stms.insert(next, fused.begin(), fused.end());
+        stms.erase(std::find(iter, next, consumer));
+        stms.erase(iter);
+        // The fused loop is the producer of the next layer's loop, unless the rest of the
+        // producer runs after it
+        iter = --next;
+    }
+}
+
+// Number of iterations of a loop with constant bounds, or -1 for other loops
+static int64_t GetConstantIterationCount(ForLoop& loop)
+{
+    IntegerConstant* start = AsIntegerConstant(loop.GetStart());
+    IntegerConstant* end = AsIntegerConstant(loop.GetEnd());
+    if (start == nullptr || end == nullptr)
+        return -1;
+    return std::max<int64_t>(end->GetValue() - start->GetValue() + loop.GetStep() - 1, 0) / loop.GetStep();
+}
+
+static bool AreSameBounds(Value& lhs, Value& rhs)
+{
+    IntegerConstant* lhsConst = AsIntegerConstant(lhs);
+    IntegerConstant* rhsConst = AsIntegerConstant(rhs);
+    return &lhs == &rhs || (lhsConst != nullptr && rhsConst != nullptr && lhsConst->GetValue() == rhsConst->GetValue());
+}
+
+// The loop a loop's body consists of, or nullptr when the loops are not perfectly nested or
+// the bounds of the inner loop depend on the outer index
+static ForLoop* GetPerfectlyNestedLoop(ForLoop& loop)
+{
+    std::list<IRStatement*>& body = loop.GetStatements();
+    ForLoop* inner = body.size() == 1 ? dynamic_cast<ForLoop*>(body.front()) : nullptr;
+    if (inner == nullptr || GetVariableUses(inner->GetStart()).GetReads(loop.GetIndexVariable()) != 0 ||
+        GetVariableUses(inner->GetEnd()).GetReads(loop.GetIndexVariable()) != 0)
+        return nullptr;
+    return inner;
+}
+
+// Copy of the body of a loop nest for other values of the two indices
+static void CloneLoopNestBody(ForLoop& outer, Value& outerIndex, ForLoop& inner, Value& innerIndex, std::list<IRStatement*>& stms)
+{
+    SubstitutionVisitor substitution;
+    substitution.AddReplacement(outer.GetIndexVariable(), outerIndex);
+    substitution.AddReplacement(inner.GetIndexVariable(), innerIndex);
+    StatementSubstitutionVisitor stmSubstitution(substitution, true);
+    std::list<IRStatement*>& body = inner.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+        stms.push_back(&stmSubstitution.Substitute(*(*iter)));
+}
+
+// Replaces the statement at loopIter by the statements in replacement and points loopIter at
+// the first of them
+static void ReplaceLoop(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, std::list<IRStatement*>& replacement)
+{
+    std::list<IRStatement*>::iterator next = stms.erase(loopIter);
+    loopIter = stms.insert(next, replacement.begin(), replacement.end());
+}
+
+bool StripMineLoop(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int64_t tileSize)
+{
+    ForLoop* loop = dynamic_cast<ForLoop*>(*loopIter);
+    int64_t count = loop ? GetConstantIterationCount(*loop) : -1;
+    if (tileSize < 2 || count < tileSize)
+        return false;
+    int64_t start = AsIntegerConstant(loop->GetStart())->GetValue();
+    int64_t end = AsIntegerConstant(loop->GetEnd())->GetValue();
+    int64_t tileStep = tileSize * loop->GetStep();
+    int64_t tiledEnd = start + count / tileSize * tileStep;
+
+    ForLoop& tileLoop = ForLoop::Create(IntegerConstant::Create(start), IntegerConstant::Create(tiledEnd), tileStep);
+    tileLoop.SetParallel(loop->IsParallel());
+    Variable& tileIndex = tileLoop.GetIndexVariable();
+    ForLoop& pointLoop = ForLoop::Create(tileIndex, BinaryAdd::Create(tileIndex, IntegerConstant::Create(tileStep)), loop->GetStep());
+    CloneLoopBody(*loop, pointLoop.GetIndexVariable(), pointLoop.GetStatements());
+    tileLoop.AddStatement(pointLoop);
+    std::list<IRStatement*> replacement(1, &tileLoop);
+    if (tiledEnd < end)
+        replacement.push_back(&CloneLoopRange(*loop, tiledEnd, end));
+    ReplaceLoop(stms, loopIter, replacement);
+    return true;
+}
+
+bool InterchangeLoops(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter)
+{
+    ForLoop* outer = dynamic_cast<ForLoop*>(*loopIter);
+    ForLoop* inner = outer ? GetPerfectlyNestedLoop(*outer) : nullptr;
+    if (inner == nullptr || !outer->IsParallel())
+        return false;
+    ForLoop& newOuter = ForLoop::Create(inner->GetStart(), inner->GetEnd(), inner->GetStep());
+    ForLoop& newInner = ForLoop::Create(outer->GetStart(), outer->GetEnd(), outer->GetStep());
+    CloneLoopNestBody(*outer, newInner.GetIndexVariable(), *inner, newOuter.GetIndexVariable(), newInner.GetStatements());
+    newOuter.AddStatement(newInner);
+    std::list<IRStatement*> replacement(1, &newOuter);
+    ReplaceLoop(stms, loopIter, replacement);
+    return true;
+}
+
+bool TileLoopNest(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int64_t outerTileSize, int64_t innerTileSize)
+{
+    ForLoop* outer = dynamic_cast<ForLoop*>(*loopIter);
+    ForLoop* inner = outer ? GetPerfectlyNestedLoop(*outer) : nullptr;
+    if (inner == nullptr || !outer->IsParallel())
+        return false;
+    int64_t outerCount = GetConstantIterationCount(*outer);
+    int64_t innerCount = GetConstantIterationCount(*inner);
+    if (outerTileSize < 1 || innerTileSize < 1 || outerCount < outerTileSize || innerCount < innerTileSize ||
+        (outerCount == outerTileSize && innerCount == innerTileSize))
+        return false;
+    int64_t outerStart = AsIntegerConstant(outer->GetStart())->GetValue();
+    int64_t outerEnd = AsIntegerConstant(outer->GetEnd())->GetValue();
+    int64_t outerTileStep = outerTileSize * outer->GetStep();
+    int64_t outerTiledEnd = outerStart + outerCount / outerTileSize * outerTileStep;
+    int64_t innerStart = AsIntegerConstant(inner->GetStart())->GetValue();
+    int64_t innerEnd = AsIntegerConstant(inner->GetEnd())->GetValue();
+    int64_t innerTileStep = innerTileSize * inner->GetStep();
+    int64_t innerTiledEnd = innerStart + innerCount / innerTileSize * innerTileStep;
+
+    // Tiles of the outer loop stay independent
+    ForLoop& outerTileLoop = ForLoop::Create(IntegerConstant::Create(outerStart), IntegerConstant::Create(outerTiledEnd), outerTileStep);
+    outerTileLoop.SetParallel(true);
+    Variable& outerTileIndex = outerTileLoop.GetIndexVariable();
+    ForLoop& innerTileLoop = ForLoop::Create(IntegerConstant::Create(innerStart), IntegerConstant::Create(innerTiledEnd), innerTileStep);
+    Variable& innerTileIndex = innerTileLoop.GetIndexVariable();
+    ForLoop& outerPointLoop = ForLoop::Create(outerTileIndex, BinaryAdd::Create(outerTileIndex, IntegerConstant::Create(outerTileStep)),
+                                              outer->GetStep());
+    ForLoop& innerPointLoop = ForLoop::Create(innerTileIndex, BinaryAdd::Create(innerTileIndex, IntegerConstant::Create(innerTileStep)),
+                                              inner->GetStep());
+    CloneLoopNestBody(*outer, outerPointLoop.GetIndexVariable(), *inner, innerPointLoop.GetIndexVariable(), innerPointLoop.GetStatements());
+    outerPointLoop.AddStatement(innerPointLoop);
+    innerTileLoop.AddStatement(outerPointLoop);
+    outerTileLoop.AddStatement(innerTileLoop);
+    // The rest of the inner loop for the rows of an outer tile
+    if (innerTiledEnd < innerEnd)
+    {
+        ForLoop& rowLoop = ForLoop::Create(outerTileIndex, BinaryAdd::Create(outerTileIndex, IntegerConstant::Create(outerTileStep)),
+                                           outer->GetStep());
+        ForLoop& restLoop = ForLoop::Create(IntegerConstant::Create(innerTiledEnd), IntegerConstant::Create(innerEnd), inner->GetStep());
+        CloneLoopNestBody(*outer, rowLoop.GetIndexVariable(), *inner, restLoop.GetIndexVariable(), restLoop.GetStatements());
+        rowLoop.AddStatement(restLoop);
+        outerTileLoop.AddStatement(rowLoop);
+    }
+    std::list<IRStatement*> replacement(1, &outerTileLoop);
+    // The rest of the outer loop is not tiled
+    if (outerTiledEnd < outerEnd)
+        replacement.push_back(&CloneLoopRange(*outer, outerTiledEnd, outerEnd));
+    ReplaceLoop(stms, loopIter, replacement);
+    return true;
+}
+
+// Appends copies of a loop body, one per substitution of the index, to stms. Loops that have
+// the same bounds in all copies become one loop whose iterations run the copies' iterations
+// one after the other, so values that do not depend on the index are loaded once for all
+// copies. The copies must be independent.
+static void JamCopies(std::list<IRStatement*>& body, std::vector<SubstitutionVisitor>& substitutions, std::list<IRStatement*>& stms)
+{
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+    {
+        if (ForLoop* loop = dynamic_cast<ForLoop*>(*iter))
+        {
+            Value& start = substitutions[0].Substitute(loop->GetStart());
+            Value& end = substitutions[0].Substitute(loop->GetEnd());
+            bool sameBounds = true;
+            for (size_t i=1 ; i<substitutions.size() ; ++i)
+            {
+                sameBounds = sameBounds && AreSameBounds(substitutions[i].Substitute(loop->GetStart()), start) &&
+                             AreSameBounds(substitutions[i].Substitute(loop->GetEnd()), end);
+            }
+            if (sameBounds)
+            {
+                ForLoop& jammed = ForLoop::Create(start, end, loop->GetStep());
+                for (size_t i=0 ; i<substitutions.size() ; ++i)
+                    substitutions[i].AddReplacement(loop->GetIndexVariable(), jammed.GetIndexVariable());
+                JamCopies(loop->GetStatements(), substitutions, jammed.GetStatements());
+                stms.push_back(&jammed);
+                continue;
+            }
+        }
+        for (size_t i=0 ; i<substitutions.size() ; ++i)
+        {
+            StatementSubstitutionVisitor stmSubstitution(substitutions[i], true);
+            stms.push_back(&stmSubstitution.Substitute(*(*iter)));
+        }
+    }
+}
+
+bool UnrollAndJamLoop(std::list<IRStatement*>& stms, std::list<IRStatement*>::iterator& loopIter, int32_t factor)
+{
+    ForLoop* loop = dynamic_cast<ForLoop*>(*loopIter);
+    int64_t count = loop ? GetConstantIterationCount(*loop) : -1;
+    if (factor < 2 || count < factor || !loop->IsParallel())
+        return false;
+    int64_t start = AsIntegerConstant(loop->GetStart())->GetValue();
+    int64_t end = AsIntegerConstant(loop->GetEnd())->GetValue();
+    int64_t unrolledStep = factor * loop->GetStep();
+    int64_t unrolledEnd = start + count / factor * unrolledStep;
+
+    ForLoop& unrolled = ForLoop::Create(IntegerConstant::Create(start), IntegerConstant::Create(unrolledEnd), unrolledStep);
+    unrolled.SetParallel(true);
+    Variable& index = unrolled.GetIndexVariable();
+    std::vector<SubstitutionVisitor> substitutions(factor);
+    for (int32_t i=0 ; i<factor ; ++i)
+    {
+        Value& copyIndex = i == 0 ? static_cast<Value&>(index) : BinaryAdd::Create(index, IntegerConstant::Create(i * loop->GetStep()));
+        substitutions[i].AddReplacement(loop->GetIndexVariable(), copyIndex);
+    }
+    JamCopies(loop->GetStatements(), substitutions, unrolled.GetStatements());
+    std::list<IRStatement*> replacement(1, &unrolled);
+    if (unrolledEnd < end)
+        replacement.push_back(&CloneLoopRange(*loop, unrolledEnd, end));
+    ReplaceLoop(stms, loopIter, replacement);
+    return true;
+}
+
+// Largest power of two n for which an n x n tile of the vector a loop nest reads and of the
+// vector it writes fit in the cache
+static int64_t GetTileSize(int64_t cacheSize)
+{
+    int64_t tileSize = 1;
+    // Doubles the tile while the two tiles of the next size still fit
+    for (int64_t next=2 ; next * next * 2 * static_cast<int64_t>(sizeof(double)) <= cacheSize ; next*=2)
+        tileSize = next;
+    return tileSize;
+}
+
+static bool ContainsLoop(ForLoop& loop)
+{
+    std::list<IRStatement*>& body = loop.GetStatements();
+    for (std::list<IRStatement*>::iterator iter=body.begin() ; iter!=body.end() ; ++iter)
+    {
+        if (dynamic_cast<ForLoop*>(*iter) != nullptr)
+            return true;
+    }
+    return false;
+}
+
+void TransformLoops(Function& function, const LoweringOptions& options)
+{
+    std::list<IRStatement*>& stms = function.GetStatements();
+    std::list<IRStatement*>::iterator iter = stms.begin();
+    while (iter != stms.end())
+    {
+        ForLoop* loop = dynamic_cast<ForLoop*>(*iter);
+        if (loop == nullptr || !loop->IsParallel())
+        {
+            ++iter;
+            continue;
+        }
+        int64_t tileSize = options.cacheSize > 0 ? GetTileSize(options.cacheSize) : 0;
+        ForLoop* inner = GetPerfectlyNestedLoop(*loop);
+        if (inner != nullptr && tileSize > 1)
+        {
+            int64_t outerCount = GetConstantIterationCount(*loop);
+            int64_t innerCount = GetConstantIterationCount(*inner);
+            TileLoopNest(stms, iter, std::min(outerCount, tileSize), std::min(innerCount, tileSize));
+        }
+        // Ensembles whose neurons reduce over their inputs share the input loads
+        else if (ContainsLoop(*loop))
+            UnrollAndJamLoop(stms, iter, options.unrollAndJamFactor);
+        // The loop that replaced this one is not transformed again, the rest of it may be
+        ++iter;
+    }
+}
@@ -5,6 +5,10 @@ class IRStatement;
 class Assignment;
 class ForLoop;
 class VariableDefinition;
+class DenseLayer;
+class VectorOperation;
+class VectorReduction;
+class VectorActivation;
 
 class IRStatementVisitor
 {
@@ -16,6 +20,10 @@ public:
     virtual void Visit(Assignment& assignment) = 0;
     virtual void Visit(ForLoop& forLoop) = 0;
     virtual void Visit(VariableDefinition& varDefinition) = 0;
+    virtual void Visit(DenseLayer& denseLayer) = 0;
+    virtual void Visit(VectorOperation& vectorOperation) = 0;
+    virtual void Visit(VectorReduction& vectorReduction) = 0;
+    virtual void Visit(VectorActivation& vectorActivation) = 0;
 };
 
 #endif // _IRSTATEMENTVISITOR_H_
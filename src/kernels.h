@@ -0,0 +1,1064 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+// Compute kernels shared by the interpreter and the generated native code.
+// This header is self-contained (no ml-dsl types) because the native backend
+// includes it from the emitted translation unit.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MLDSL_X86_SIMD 1
+#endif
+
+// Activation functions, which the lowering resolves from their names. The elementwise ones
+// apply to each neuron's value on its own, softmax normalizes a whole layer output.
+enum KernelActivation
+{
+    KernelActivationNone = 0,
+    KernelActivationSigmoid,
+    KernelActivationTanh,
+    KernelActivationRelu,
+    KernelActivationLeakyRelu,
+    KernelActivationSoftplus,
+    KernelActivationGelu,
+    KernelActivationSoftmax,
+    KernelActivationCount
+};
+
+// Accuracy tiers of the activation kernels. Exact calls the C library. Polynomial evaluates
+// exp and log by polynomials after range reduction, with relative errors around 1e-9 (erf
+// for gelu is good to 1.5e-7), and is vectorized. Table interpolates linearly in a table of
+// the function, with absolute errors up to about 2e-6. Default leaves the choice to the
+// lowering and is evaluated as Exact.
+enum KernelAccuracy
+{
+    KernelAccuracyDefault = -1,
+    KernelAccuracyExact = 0,
+    KernelAccuracyPolynomial,
+    KernelAccuracyTable
+};
+
+struct KernelActivationInfo
+{
+    const char* name;
+    bool elementwise;
+};
+
+// Indexed by KernelActivation
+static const KernelActivationInfo sKernelActivations[KernelActivationCount] =
+{
+    { "", true },
+    { "sigmoid", true },
+    { "tanh", true },
+    { "relu", true },
+    { "leaky_relu", true },
+    { "softplus", true },
+    { "gelu", true },
+    { "softmax", false }
+};
+
+static const double KernelLeakyReluSlope = 0.01;
+
+// Returns -1 for names that have no kernel implementation
+static inline int32_t GetKernelActivation(const char* name)
+{
+    if (name == nullptr)
+        return KernelActivationNone;
+    for (int32_t i=0 ; i<KernelActivationCount ; ++i)
+    {
+        if (strcmp(name, sKernelActivations[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// exp(x) = 2^n * exp(r) with x = n * ln2 + r and |r| <= ln2 / 2, where exp(r) is a Taylor
+// polynomial. Arguments are clamped to the range of normal results.
+static inline double KernelExpPolynomial(double x)
+{
+    x = x < -708.0 ? -708.0 : (x > 709.0 ? 709.0 : x);
+    double n = std::floor(x * 1.4426950408889634 + 0.5);
+    double r = (x - n * 0.6931471803691238) - n * 1.9082149292705877e-10;
+    double p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720 +
+               r * (1.0 / 5040 + r * (1.0 / 40320))))))));
+    int64_t bits = (static_cast<int64_t>(n) + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// log(1 + y) for 0 <= y <= 1 as 2 atanh(s) with s = y / (2 + y) <= 1/3
+static inline double KernelLog1pPolynomial(double y)
+{
+    double s = y / (2.0 + y);
+    double s2 = s * s;
+    return 2.0 * s * (1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9 + s2 * (1.0 / 11 +
+           s2 * (1.0 / 13 + s2 * (1.0 / 15))))))));
+}
+
+// Abramowitz and Stegun 7.1.26
+static inline double KernelErfPolynomial(double x)
+{
+    double z = std::fabs(x);
+    double t = 1.0 / (1.0 + 0.3275911 * z);
+    double p = t * (0.254829592 + t * (-0.284496736 + t * (1.421413741 + t * (-1.453152027 + t * 1.061405429))));
+    return std::copysign(1.0 - p * KernelExpPolynomial(-z * z), x);
+}
+
+// Softmax is the identity on a single value, it is applied to whole layers only
+static inline double ApplyKernelActivationExact(double x, int32_t activation)
+{
+    switch (activation)
+    {
+    case KernelActivationSigmoid:
+        return 1.0 / (1.0 + std::exp(-x));
+    case KernelActivationTanh:
+        return std::tanh(x);
+    case KernelActivationRelu:
+        return x > 0.0 ? x : 0.0;
+    case KernelActivationLeakyRelu:
+        return x > 0.0 ? x : KernelLeakyReluSlope * x;
+    case KernelActivationSoftplus:
+        return x > 0.0 ? x + std::log1p(std::exp(-x)) : std::log1p(std::exp(x));
+    case KernelActivationGelu:
+        return 0.5 * x * (1.0 + std::erf(x * 0.7071067811865476));
+    default:
+        return x;
+    }
+}
+
+static inline double ApplyKernelActivationPolynomial(double x, int32_t activation)
+{
+    switch (activation)
+    {
+    case KernelActivationSigmoid:
+        return 1.0 / (1.0 + KernelExpPolynomial(-x));
+    case KernelActivationTanh:
+    {
+        double t = KernelExpPolynomial(-2.0 * std::fabs(x));
+        return std::copysign((1.0 - t) / (1.0 + t), x);
+    }
+    case KernelActivationSoftplus:
+        return (x > 0.0 ? x : 0.0) + KernelLog1pPolynomial(KernelExpPolynomial(-std::fabs(x)));
+    case KernelActivationGelu:
+        return 0.5 * x * (1.0 + KernelErfPolynomial(x * 0.7071067811865476));
+    default:
+        return ApplyKernelActivationExact(x, activation);
+    }
+}
+
+// Values of a function at KernelActivationTableSize + 1 evenly spaced points of [lo, hi].
+// Outside the range the function is taken as slope * x + offset.
+static const int32_t KernelActivationTableSize = 4096;
+
+struct KernelActivationTable
+{
+    double lo;
+    double scale;
+    double belowSlope;
+    double belowOffset;
+    double aboveSlope;
+    double aboveOffset;
+    double values[KernelActivationTableSize + 1];
+};
+
+static inline void InitializeKernelActivationTable(KernelActivationTable& table, int32_t activation)
+{
+    double range = 1.0;
+    table.belowSlope = 1.0;
+    table.belowOffset = 0.0;
+    table.aboveSlope = 1.0;
+    table.aboveOffset = 0.0;
+    switch (activation)
+    {
+    case KernelActivationSigmoid:
+        range = 16.0;
+        table.belowSlope = 0.0;
+        table.aboveSlope = 0.0;
+        table.aboveOffset = 1.0;
+        break;
+    case KernelActivationTanh:
+        range = 8.0;
+        table.belowSlope = 0.0;
+        table.belowOffset = -1.0;
+        table.aboveSlope = 0.0;
+        table.aboveOffset = 1.0;
+        break;
+    case KernelActivationRelu:
+    case KernelActivationSoftplus:
+        range = 16.0;
+        table.belowSlope = 0.0;
+        break;
+    case KernelActivationLeakyRelu:
+        table.belowSlope = KernelLeakyReluSlope;
+        break;
+    case KernelActivationGelu:
+        range = 8.0;
+        table.belowSlope = 0.0;
+        break;
+    }
+    table.lo = -range;
+    table.scale = KernelActivationTableSize / (2.0 * range);
+    for (int32_t i=0 ; i<=KernelActivationTableSize ; ++i)
+        table.values[i] = ApplyKernelActivationExact(table.lo + i / table.scale, activation);
+}
+
+static inline bool InitializeKernelActivationTables(KernelActivationTable* tables)
+{
+    for (int32_t i=0 ; i<KernelActivationCount ; ++i)
+        InitializeKernelActivationTable(tables[i], i);
+    return true;
+}
+
+// Indexed by KernelActivation. Built on first use.
+static inline const KernelActivationTable* GetKernelActivationTables()
+{
+    static KernelActivationTable tables[KernelActivationCount];
+    static const bool initialized = InitializeKernelActivationTables(tables);
+    (void)initialized;
+    return tables;
+}
+
+static inline double LookUpKernelActivation(const KernelActivationTable& table, double x)
+{
+    double position = (x - table.lo) * table.scale;
+    if (!(position >= 0.0))
+        return table.belowSlope * x + table.belowOffset;
+    if (position >= KernelActivationTableSize)
+        return table.aboveSlope * x + table.aboveOffset;
+    int64_t i = static_cast<int64_t>(position);
+    double fraction = position - i;
+    return table.values[i] + fraction * (table.values[i + 1] - table.values[i]);
+}
+
+static inline double ApplyKernelActivation(double x, int32_t activation, int32_t accuracy = KernelAccuracyExact)
+{
+    if (accuracy == KernelAccuracyPolynomial)
+        return ApplyKernelActivationPolynomial(x, activation);
+    if (accuracy == KernelAccuracyTable)
+        return LookUpKernelActivation(GetKernelActivationTables()[activation], x);
+    return ApplyKernelActivationExact(x, activation);
+}
+
+// Applies an activation to a vector of values in place. Defined with the vector kernels below.
+static inline void ApplyKernelActivationVector(double* values, int64_t length, int32_t activation, int32_t accuracy);
+
+// Blocking of the dense kernel. A block of DenseKernelInputBlock inputs for
+// DenseKernelNeuronBlock neurons (128KB of weights) stays in L2 while all rows
+// of the batch stream past it. Inside a block, DenseKernelTileNeurons x
+// DenseKernelTileRows outputs are accumulated in registers.
+static const int64_t DenseKernelInputBlock = 256;
+static const int64_t DenseKernelNeuronBlock = 64;
+static const int32_t DenseKernelTileNeurons = 4;
+static const int32_t DenseKernelTileRows = 4;
+
+// Storage types of real constants narrower than double. The 16-bit formats hold the bits of an
+// IEEE half precision or a bfloat16 number (a float with the low 16 bits dropped).
+struct KernelFloat16
+{
+    uint16_t bits;
+};
+
+struct KernelBFloat16
+{
+    uint16_t bits;
+};
+
+static inline float KernelFloat16ToFloat(uint16_t h)
+{
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else
+    {
+        // Zero or subnormal, mantissa * 2^-24
+        float value = mantissa * 5.9604644775390625e-8f;
+        return sign ? -value : value;
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Rounds to the nearest half precision number, ties to even
+static inline uint16_t KernelFloatToFloat16(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    uint32_t absBits = bits & 0x7fffffffu;
+    if (absBits > 0x7f800000u)
+        return sign | 0x7e00;
+    // 65520 and up round to infinity
+    if (absBits >= 0x477ff000u)
+        return sign | 0x7c00;
+    // Below 2^-14 the result is subnormal, a multiple of 2^-24
+    if (absBits < 0x38800000u)
+        return sign | static_cast<uint16_t>(std::nearbyint(std::fabs(value) * 16777216.0f));
+    uint32_t rounded = absBits + 0xfff + ((absBits >> 13) & 1);
+    return sign | static_cast<uint16_t>((rounded - 0x38000000u) >> 13);
+}
+
+static inline float KernelBFloat16ToFloat(uint16_t b)
+{
+    uint32_t bits = static_cast<uint32_t>(b) << 16;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Rounds to the nearest bfloat16 number, ties to even
+static inline uint16_t KernelFloatToBFloat16(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u)
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+// A stored value converted to T
+template<typename T> static inline T KernelFromStorage(double x) { return static_cast<T>(x); }
+template<typename T> static inline T KernelFromStorage(float x) { return static_cast<T>(x); }
+template<typename T> static inline T KernelFromStorage(KernelFloat16 x) { return static_cast<T>(KernelFloat16ToFloat(x.bits)); }
+template<typename T> static inline T KernelFromStorage(KernelBFloat16 x) { return static_cast<T>(KernelBFloat16ToFloat(x.bits)); }
+
+static inline void KernelToStorage(double x, double& stored) { stored = x; }
+static inline void KernelToStorage(double x, float& stored) { stored = static_cast<float>(x); }
+static inline void KernelToStorage(double x, KernelFloat16& stored) { stored.bits = KernelFloatToFloat16(static_cast<float>(x)); }
+static inline void KernelToStorage(double x, KernelBFloat16& stored) { stored.bits = KernelFloatToBFloat16(static_cast<float>(x)); }
+
+// Weight k of neuron n is weights[n * neuronStride + k * weightInputStride], so both
+// the row major and the transposed value set layouts can be used directly.
+// WeightType is the storage type of the weights and biases and AccumulatorType (double
+// or float) the type the sums are computed in. Inputs and outputs are doubles.
+
+// Register tile : MR neurons x NR batch rows over numInputs inputs. The
+// accumulators start from the bias on the first input block and from the
+// partial sums in output on later blocks.
+template<int MR, int NR, typename AccumulatorType, typename WeightType, typename BiasType>
+static inline void DenseMicroKernel(const WeightType* weights, int64_t neuronStride, int64_t weightInputStride, const double* input, int64_t inputStride,
+                                    double* output, int64_t outputStride, int64_t numInputs,
+                                    const BiasType* bias, bool firstBlock)
+{
+    AccumulatorType acc[MR][NR];
+    for (int i=0 ; i<MR ; ++i)
+        for (int j=0 ; j<NR ; ++j)
+            acc[i][j] = firstBlock ? (bias ? KernelFromStorage<AccumulatorType>(bias[i]) : 0) : static_cast<AccumulatorType>(output[j * outputStride + i]);
+    for (int64_t k=0 ; k<numInputs ; ++k)
+    {
+        for (int i=0 ; i<MR ; ++i)
+        {
+            AccumulatorType w = KernelFromStorage<AccumulatorType>(weights[i * neuronStride + k * weightInputStride]);
+            for (int j=0 ; j<NR ; ++j)
+                acc[i][j] += w * static_cast<AccumulatorType>(input[j * inputStride + k]);
+        }
+    }
+    for (int i=0 ; i<MR ; ++i)
+        for (int j=0 ; j<NR ; ++j)
+            output[j * outputStride + i] = acc[i][j];
+}
+
+// Same computation for the partial tiles at the edges of the output
+template<typename AccumulatorType, typename WeightType, typename BiasType>
+static inline void DenseEdgeKernel(int32_t mr, int32_t nr, const WeightType* weights, int64_t neuronStride, int64_t weightInputStride,
+                                   const double* input, int64_t inputStride,
+                                   double* output, int64_t outputStride, int64_t numInputs,
+                                   const BiasType* bias, bool firstBlock)
+{
+    for (int32_t i=0 ; i<mr ; ++i)
+    {
+        for (int32_t j=0 ; j<nr ; ++j)
+        {
+            AccumulatorType acc = firstBlock ? (bias ? KernelFromStorage<AccumulatorType>(bias[i]) : 0)
+                                             : static_cast<AccumulatorType>(output[j * outputStride + i]);
+            for (int64_t k=0 ; k<numInputs ; ++k)
+                acc += KernelFromStorage<AccumulatorType>(weights[i * neuronStride + k * weightInputStride]) *
+                       static_cast<AccumulatorType>(input[j * inputStride + k]);
+            output[j * outputStride + i] = acc;
+        }
+    }
+}
+
+// Runs the register tiles of one block of neurons over one block of inputs
+template<typename AccumulatorType, typename WeightType, typename BiasType>
+static inline void DenseBlockForward(const WeightType* weights, int64_t neuronStride, int64_t weightInputStride, const BiasType* bias,
+                                     int64_t numNeurons, int64_t numInputs, const double* input, int64_t inputStride,
+                                     double* output, int64_t outputStride, int64_t batchSize, bool firstBlock)
+{
+    const int32_t MR = DenseKernelTileNeurons;
+    const int32_t NR = DenseKernelTileRows;
+    for (int64_t b=0 ; b<batchSize ; b+=NR)
+    {
+        int32_t nr = batchSize - b < NR ? static_cast<int32_t>(batchSize - b) : NR;
+        for (int64_t n=0 ; n<numNeurons ; n+=MR)
+        {
+            int32_t mr = numNeurons - n < MR ? static_cast<int32_t>(numNeurons - n) : MR;
+            const WeightType* w = weights + n * neuronStride;
+            const double* x = input + b * inputStride;
+            double* y = output + b * outputStride + n;
+            const BiasType* tileBias = bias ? bias + n : nullptr;
+            if (mr == MR && nr == NR)
+                DenseMicroKernel<DenseKernelTileNeurons, DenseKernelTileRows, AccumulatorType>(w, neuronStride, weightInputStride, x, inputStride,
+                                                                                               y, outputStride, numInputs, tileBias, firstBlock);
+            else if (mr == MR && nr == 1)
+                DenseMicroKernel<DenseKernelTileNeurons, 1, AccumulatorType>(w, neuronStride, weightInputStride, x, inputStride,
+                                                                             y, outputStride, numInputs, tileBias, firstBlock);
+            else
+                DenseEdgeKernel<AccumulatorType>(mr, nr, w, neuronStride, weightInputStride, x, inputStride, y, outputStride, numInputs,
+                                                 tileBias, firstBlock);
+        }
+    }
+}
+
+// output[b * outputStride + n] = activation(bias[n] + sum_k weights[n * neuronStride + k * weightInputStride] * input[b * inputStride + k])
+// for 0 <= n < numNeurons and 0 <= b < batchSize. bias may be null. With a batch
+// size of 1 this is a matrix-vector product, otherwise a matrix-matrix product.
+// The activation is applied to the outputs of a block of neurons as one vector
+// once their last input block has been added, while they are still in cache.
+// 16-bit weights are converted a block at a time into a buffer of AccumulatorType,
+// which the register tiles then read like double or float weights.
+template<typename AccumulatorType = double, typename WeightType>
+static inline void DenseLayerForward(const WeightType* weights, int64_t neuronStride, int64_t weightInputStride,
+                                     const WeightType* bias, int64_t numNeurons, int64_t numInputs,
+                                     const double* input, int64_t inputStride, double* output, int64_t outputStride,
+                                     int64_t batchSize, int32_t activation, int32_t accuracy)
+{
+    const bool convertBlocks = sizeof(WeightType) == 2;
+    static thread_local AccumulatorType convertedBlock[convertBlocks ? DenseKernelNeuronBlock * DenseKernelInputBlock : 1];
+    for (int64_t k0=0 ; k0<numInputs ; k0+=DenseKernelInputBlock)
+    {
+        int64_t kc = numInputs - k0 < DenseKernelInputBlock ? numInputs - k0 : DenseKernelInputBlock;
+        bool firstBlock = k0 == 0;
+        bool lastBlock = k0 + kc >= numInputs;
+        for (int64_t n0=0 ; n0<numNeurons ; n0+=DenseKernelNeuronBlock)
+        {
+            int64_t n1 = numNeurons - n0 < DenseKernelNeuronBlock ? numNeurons : n0 + DenseKernelNeuronBlock;
+            const WeightType* blockWeights = weights + n0 * neuronStride + k0 * weightInputStride;
+            const WeightType* blockBias = bias ? bias + n0 : nullptr;
+            if (convertBlocks)
+            {
+                for (int64_t n=0 ; n<n1 - n0 ; ++n)
+                    for (int64_t k=0 ; k<kc ; ++k)
+                        convertedBlock[n * kc + k] = KernelFromStorage<AccumulatorType>(blockWeights[n * neuronStride + k * weightInputStride]);
+                DenseBlockForward<AccumulatorType>(convertedBlock, kc, 1, blockBias, n1 - n0, kc, input + k0, inputStride,
+                                                   output + n0, outputStride, batchSize, firstBlock);
+            }
+            else
+                DenseBlockForward<AccumulatorType>(blockWeights, neuronStride, weightInputStride, blockBias, n1 - n0, kc, input + k0, inputStride,
+                                                   output + n0, outputStride, batchSize, firstBlock);
+            if (lastBlock && activation != KernelActivationNone)
+            {
+                for (int64_t b=0 ; b<batchSize ; ++b)
+                    ApplyKernelActivationVector(output + b * outputStride + n0, n1 - n0, activation, accuracy);
+            }
+        }
+    }
+}
+
+// Affine int8 quantization: a real x is stored as q = round(x / scale) + zeroPoint,
+// saturated to [-128, 127], and read back as scale * (q - zeroPoint). The range
+// always includes 0, so that zero is represented exactly.
+struct KernelQuantization
+{
+    double scale;
+    int32_t zeroPoint;
+};
+
+static inline KernelQuantization GetKernelQuantization(double minimum, double maximum)
+{
+    minimum = std::min(minimum, 0.0);
+    maximum = std::max(maximum, 0.0);
+    KernelQuantization quantization;
+    quantization.scale = maximum > minimum ? (maximum - minimum) / 255.0 : 1.0;
+    double zeroPoint = std::nearbyint(-128.0 - minimum / quantization.scale);
+    quantization.zeroPoint = static_cast<int32_t>(std::max(-128.0, std::min(127.0, zeroPoint)));
+    return quantization;
+}
+
+static inline int8_t KernelQuantize(double x, double scale, int32_t zeroPoint)
+{
+    double q = std::nearbyint(x / scale) + zeroPoint;
+    return static_cast<int8_t>(std::max(-128.0, std::min(127.0, q)));
+}
+
+// Dense layer with int8 weights. Weight k of neuron n is
+//     scales[n] * (weights[n * neuronStride + k * weightInputStride] - zeroPoints[n])
+// and weightSums[n] is the sum of the neuron's stored weights. The rows of the input are
+// quantized with inputScale and inputZeroPoint (values outside the calibrated range
+// saturate) and the products are summed in int32. Expanding
+//     sum_k (qw - zw) * (qx - zx) = sum_k qw * qx - zx * sum_k qw - zw * sum_k qx + numInputs * zw * zx
+// leaves only int8 multiply-adds in the inner loop. The sums are dequantized in double
+// before the bias and the activation are applied. Sums stay exact for fewer than 2^17 inputs.
+template<typename BiasType>
+static inline void QuantizedDenseLayerForward(const int8_t* weights, int64_t neuronStride, int64_t weightInputStride,
+                                              const double* scales, const int32_t* zeroPoints, const int32_t* weightSums,
+                                              const BiasType* bias, int64_t numNeurons, int64_t numInputs,
+                                              double inputScale, int32_t inputZeroPoint, const double* input, int64_t inputStride,
+                                              double* output, int64_t outputStride, int64_t batchSize, int32_t activation, int32_t accuracy)
+{
+    const int32_t NR = DenseKernelTileRows;
+    static thread_local std::vector<int8_t> quantizedRows;
+    quantizedRows.resize(static_cast<size_t>(NR * numInputs));
+    int32_t inputSums[NR];
+    for (int64_t b=0 ; b<batchSize ; b+=NR)
+    {
+        int32_t nr = batchSize - b < NR ? static_cast<int32_t>(batchSize - b) : NR;
+        for (int32_t j=0 ; j<nr ; ++j)
+        {
+            int8_t* row = quantizedRows.data() + j * numInputs;
+            inputSums[j] = 0;
+            for (int64_t k=0 ; k<numInputs ; ++k)
+            {
+                row[k] = KernelQuantize(input[(b + j) * inputStride + k], inputScale, inputZeroPoint);
+                inputSums[j] += row[k];
+            }
+        }
+        const int8_t* x0 = quantizedRows.data();
+        const int8_t* x1 = x0 + numInputs;
+        const int8_t* x2 = x1 + numInputs;
+        const int8_t* x3 = x2 + numInputs;
+        for (int64_t n=0 ; n<numNeurons ; ++n)
+        {
+            const int8_t* w = weights + n * neuronStride;
+            int32_t acc[NR] = { 0 };
+            if (nr == NR && weightInputStride == 1)
+            {
+                int32_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+                for (int64_t k=0 ; k<numInputs ; ++k)
+                {
+                    int32_t wk = w[k];
+                    acc0 += wk * x0[k];
+                    acc1 += wk * x1[k];
+                    acc2 += wk * x2[k];
+                    acc3 += wk * x3[k];
+                }
+                acc[0] = acc0; acc[1] = acc1; acc[2] = acc2; acc[3] = acc3;
+            }
+            else
+            {
+                for (int32_t j=0 ; j<nr ; ++j)
+                {
+                    const int8_t* x = quantizedRows.data() + j * numInputs;
+                    for (int64_t k=0 ; k<numInputs ; ++k)
+                        acc[j] += static_cast<int32_t>(w[k * weightInputStride]) * x[k];
+                }
+            }
+            double scale = scales[n] * inputScale;
+            double biasValue = bias ? KernelFromStorage<double>(bias[n]) : 0.0;
+            int32_t offset = static_cast<int32_t>(numInputs) * zeroPoints[n] * inputZeroPoint - inputZeroPoint * weightSums[n];
+            for (int32_t j=0 ; j<nr ; ++j)
+                output[(b + j) * outputStride + n] = biasValue + scale * (acc[j] + offset - zeroPoints[n] * inputSums[j]);
+        }
+        if (activation != KernelActivationNone)
+        {
+            for (int32_t j=0 ; j<nr ; ++j)
+                ApplyKernelActivationVector(output + (b + j) * outputStride, numNeurons, activation, accuracy);
+        }
+    }
+}
+
+// Elementwise and reduction kernels for vector operations. The AVX2 and AVX-512
+// versions are compiled with target attributes, so they are available whatever
+// flags the including file is built with, and are picked at runtime from what
+// the CPU supports. Strided operands use the scalar version.
+enum KernelVectorOperation
+{
+    KernelVectorAdd = 0,
+    KernelVectorSubtract,
+    KernelVectorMultiply,
+    KernelVectorDivide
+};
+
+// Same order as Reduction::ReductionType
+enum KernelReduction
+{
+    KernelReductionSum = 0,
+    KernelReductionMultiply,
+    KernelReductionMax
+};
+
+enum KernelSimdLevel
+{
+    KernelSimdScalar = 0,
+    KernelSimdAVX2,
+    KernelSimdAVX512
+};
+
+static inline int32_t DetectKernelSimdLevel()
+{
+#ifdef MLDSL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return KernelSimdAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return KernelSimdAVX2;
+#endif
+    return KernelSimdScalar;
+}
+
+static inline int32_t GetKernelSimdLevel()
+{
+    static const int32_t level = DetectKernelSimdLevel();
+    return level;
+}
+
+static inline double ApplyKernelVectorOperation(double a, double b, int32_t operation)
+{
+    switch (operation)
+    {
+    case KernelVectorAdd:
+        return a + b;
+    case KernelVectorSubtract:
+        return a - b;
+    case KernelVectorMultiply:
+        return a * b;
+    default:
+        return a / b;
+    }
+}
+
+static inline double GetKernelReductionIdentity(int32_t reduction)
+{
+    if (reduction == KernelReductionSum)
+        return 0.0;
+    if (reduction == KernelReductionMultiply)
+        return 1.0;
+    return -std::numeric_limits<double>::infinity();
+}
+
+static inline double ApplyKernelReduction(double acc, double value, int32_t reduction)
+{
+    if (reduction == KernelReductionSum)
+        return acc + value;
+    if (reduction == KernelReductionMultiply)
+        return acc * value;
+    return value > acc ? value : acc;
+}
+
+static inline void VectorOperationScalar(int32_t operation, const double* a, int64_t aStride, const double* b, int64_t bStride,
+                                         double* output, int64_t length)
+{
+    for (int64_t i=0 ; i<length ; ++i)
+        output[i] = ApplyKernelVectorOperation(a[i * aStride], b[i * bStride], operation);
+}
+
+// Four independent accumulators break the dependency between consecutive elements
+static inline double VectorReduceScalar(int32_t reduction, const double* a, int64_t stride, int64_t length)
+{
+    double identity = GetKernelReductionIdentity(reduction);
+    double acc[4] = { identity, identity, identity, identity };
+    int64_t i = 0;
+    for ( ; i+4<=length ; i+=4)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] = ApplyKernelReduction(acc[j], a[(i + j) * stride], reduction);
+    }
+    for ( ; i<length ; ++i)
+        acc[0] = ApplyKernelReduction(acc[0], a[i * stride], reduction);
+    return ApplyKernelReduction(ApplyKernelReduction(acc[0], acc[1], reduction), ApplyKernelReduction(acc[2], acc[3], reduction), reduction);
+}
+
+static inline double VectorDotProductScalar(const double* a, int64_t aStride, const double* b, int64_t bStride, int64_t length)
+{
+    double acc[4] = { 0.0, 0.0, 0.0, 0.0 };
+    int64_t i = 0;
+    for ( ; i+4<=length ; i+=4)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] += a[(i + j) * aStride] * b[(i + j) * bStride];
+    }
+    // The tail is bounded by the remainder rather than by i, which gcc otherwise analyses as an
+    // unbounded loop when length is a constant multiple of 4
+    for (int64_t r=0 ; r<length % 4 ; ++r)
+        acc[0] += a[(i + r) * aStride] * b[(i + r) * bStride];
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+#ifdef MLDSL_X86_SIMD
+// a and b are contiguous, or b is a broadcast scalar (bStride 0)
+__attribute__((target("avx2,fma")))
+static inline void VectorOperationAVX2(int32_t operation, const double* a, const double* b, int64_t bStride, double* output, int64_t length)
+{
+    int64_t i = 0;
+    __m256d broadcast = _mm256_set1_pd(b[0]);
+    for ( ; i+4<=length ; i+=4)
+    {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = bStride == 0 ? broadcast : _mm256_loadu_pd(b + i);
+        __m256d r;
+        switch (operation)
+        {
+        case KernelVectorAdd: r = _mm256_add_pd(x, y); break;
+        case KernelVectorSubtract: r = _mm256_sub_pd(x, y); break;
+        case KernelVectorMultiply: r = _mm256_mul_pd(x, y); break;
+        default: r = _mm256_div_pd(x, y); break;
+        }
+        _mm256_storeu_pd(output + i, r);
+    }
+    for ( ; i<length ; ++i)
+        output[i] = ApplyKernelVectorOperation(a[i], b[i * bStride], operation);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d ApplyKernelReductionAVX2(__m256d acc, __m256d value, int32_t reduction)
+{
+    if (reduction == KernelReductionSum)
+        return _mm256_add_pd(acc, value);
+    if (reduction == KernelReductionMultiply)
+        return _mm256_mul_pd(acc, value);
+    return _mm256_max_pd(acc, value);
+}
+
+__attribute__((target("avx2,fma")))
+static inline double VectorReduceAVX2(int32_t reduction, const double* a, int64_t length)
+{
+    __m256d acc[4];
+    for (int j=0 ; j<4 ; ++j)
+        acc[j] = _mm256_set1_pd(GetKernelReductionIdentity(reduction));
+    int64_t i = 0;
+    for ( ; i+16<=length ; i+=16)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] = ApplyKernelReductionAVX2(acc[j], _mm256_loadu_pd(a + i + 4 * j), reduction);
+    }
+    for ( ; i+4<=length ; i+=4)
+        acc[0] = ApplyKernelReductionAVX2(acc[0], _mm256_loadu_pd(a + i), reduction);
+    __m256d combined = ApplyKernelReductionAVX2(ApplyKernelReductionAVX2(acc[0], acc[1], reduction),
+                                                ApplyKernelReductionAVX2(acc[2], acc[3], reduction), reduction);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, combined);
+    double result = ApplyKernelReduction(ApplyKernelReduction(lanes[0], lanes[1], reduction), ApplyKernelReduction(lanes[2], lanes[3], reduction), reduction);
+    for ( ; i<length ; ++i)
+        result = ApplyKernelReduction(result, a[i], reduction);
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+static inline double VectorDotProductAVX2(const double* a, const double* b, int64_t length)
+{
+    __m256d acc[4];
+    for (int j=0 ; j<4 ; ++j)
+        acc[j] = _mm256_setzero_pd();
+    int64_t i = 0;
+    for ( ; i+16<=length ; i+=16)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4 * j), _mm256_loadu_pd(b + i + 4 * j), acc[j]);
+    }
+    for ( ; i+4<=length ; i+=4)
+        acc[0] = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc[0]);
+    __m256d combined = _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]), _mm256_add_pd(acc[2], acc[3]));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, combined);
+    double result = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for ( ; i<length ; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+__attribute__((target("avx512f")))
+static inline void VectorOperationAVX512(int32_t operation, const double* a, const double* b, int64_t bStride, double* output, int64_t length)
+{
+    int64_t i = 0;
+    __m512d broadcast = _mm512_set1_pd(b[0]);
+    for ( ; i+8<=length ; i+=8)
+    {
+        __m512d x = _mm512_loadu_pd(a + i);
+        __m512d y = bStride == 0 ? broadcast : _mm512_loadu_pd(b + i);
+        __m512d r;
+        switch (operation)
+        {
+        case KernelVectorAdd: r = _mm512_add_pd(x, y); break;
+        case KernelVectorSubtract: r = _mm512_sub_pd(x, y); break;
+        case KernelVectorMultiply: r = _mm512_mul_pd(x, y); break;
+        default: r = _mm512_div_pd(x, y); break;
+        }
+        _mm512_storeu_pd(output + i, r);
+    }
+    for ( ; i<length ; ++i)
+        output[i] = ApplyKernelVectorOperation(a[i], b[i * bStride], operation);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d ApplyKernelReductionAVX512(__m512d acc, __m512d value, int32_t reduction)
+{
+    if (reduction == KernelReductionSum)
+        return _mm512_add_pd(acc, value);
+    if (reduction == KernelReductionMultiply)
+        return _mm512_mul_pd(acc, value);
+    return _mm512_max_pd(acc, value);
+}
+
+__attribute__((target("avx512f")))
+static inline double VectorReduceAVX512(int32_t reduction, const double* a, int64_t length)
+{
+    __m512d acc[4];
+    for (int j=0 ; j<4 ; ++j)
+        acc[j] = _mm512_set1_pd(GetKernelReductionIdentity(reduction));
+    int64_t i = 0;
+    for ( ; i+32<=length ; i+=32)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] = ApplyKernelReductionAVX512(acc[j], _mm512_loadu_pd(a + i + 8 * j), reduction);
+    }
+    for ( ; i+8<=length ; i+=8)
+        acc[0] = ApplyKernelReductionAVX512(acc[0], _mm512_loadu_pd(a + i), reduction);
+    __m512d combined = ApplyKernelReductionAVX512(ApplyKernelReductionAVX512(acc[0], acc[1], reduction),
+                                                  ApplyKernelReductionAVX512(acc[2], acc[3], reduction), reduction);
+    double lanes[8];
+    _mm512_storeu_pd(lanes, combined);
+    double result = lanes[0];
+    for (int j=1 ; j<8 ; ++j)
+        result = ApplyKernelReduction(result, lanes[j], reduction);
+    for ( ; i<length ; ++i)
+        result = ApplyKernelReduction(result, a[i], reduction);
+    return result;
+}
+
+__attribute__((target("avx512f")))
+static inline double VectorDotProductAVX512(const double* a, const double* b, int64_t length)
+{
+    __m512d acc[4];
+    for (int j=0 ; j<4 ; ++j)
+        acc[j] = _mm512_setzero_pd();
+    int64_t i = 0;
+    for ( ; i+32<=length ; i+=32)
+    {
+        for (int j=0 ; j<4 ; ++j)
+            acc[j] = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8 * j), _mm512_loadu_pd(b + i + 8 * j), acc[j]);
+    }
+    for ( ; i+8<=length ; i+=8)
+        acc[0] = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), acc[0]);
+    __m512d combined = _mm512_add_pd(_mm512_add_pd(acc[0], acc[1]), _mm512_add_pd(acc[2], acc[3]));
+    double lanes[8];
+    _mm512_storeu_pd(lanes, combined);
+    double result = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    for (int64_t r=0 ; r<length % 8 ; ++r)
+        result += a[i + r] * b[i + r];
+    return result;
+}
+#endif
+
+// output[i] = a[i * aStride] op b[i * bStride] for 0 <= i < length. A stride of 0 broadcasts a scalar.
+static inline void VectorOperationForward(int32_t operation, const double* a, int64_t aStride, const double* b, int64_t bStride,
+                                          double* output, int64_t length)
+{
+#ifdef MLDSL_X86_SIMD
+    // The operation commutes, or the kernel handles the broadcast operand on the right
+    if (aStride == 0 && bStride == 1 && (operation == KernelVectorAdd || operation == KernelVectorMultiply))
+    {
+        const double* scalar = a;
+        a = b;
+        b = scalar;
+        aStride = 1;
+        bStride = 0;
+    }
+    if (aStride == 1 && (bStride == 1 || bStride == 0))
+    {
+        int32_t level = GetKernelSimdLevel();
+        if (level == KernelSimdAVX512)
+            return VectorOperationAVX512(operation, a, b, bStride, output, length);
+        if (level == KernelSimdAVX2)
+            return VectorOperationAVX2(operation, a, b, bStride, output, length);
+    }
+#endif
+    VectorOperationScalar(operation, a, aStride, b, bStride, output, length);
+}
+
+// a[0] op a[stride] op ... op a[(length - 1) * stride], evaluated in a different order than written
+static inline double VectorReduceForward(int32_t reduction, const double* a, int64_t stride, int64_t length)
+{
+#ifdef MLDSL_X86_SIMD
+    if (stride == 1)
+    {
+        int32_t level = GetKernelSimdLevel();
+        if (level == KernelSimdAVX512)
+            return VectorReduceAVX512(reduction, a, length);
+        if (level == KernelSimdAVX2)
+            return VectorReduceAVX2(reduction, a, length);
+    }
+#endif
+    return VectorReduceScalar(reduction, a, stride, length);
+}
+
+// Sum of a[i * aStride] * b[i * bStride] for 0 <= i < length, without storing the products
+static inline double VectorDotProductForward(const double* a, int64_t aStride, const double* b, int64_t bStride, int64_t length)
+{
+#ifdef MLDSL_X86_SIMD
+    if (aStride == 1 && bStride == 1)
+    {
+        int32_t level = GetKernelSimdLevel();
+        if (level == KernelSimdAVX512)
+            return VectorDotProductAVX512(a, b, length);
+        if (level == KernelSimdAVX2)
+            return VectorDotProductAVX2(a, b, length);
+    }
+#endif
+    return VectorDotProductScalar(a, aStride, b, bStride, length);
+}
+
+// Activation kernels over a contiguous vector. The polynomial tier evaluates the same
+// polynomials as the scalar version four lanes at a time.
+static inline void KernelSoftmax(double* values, int64_t length)
+{
+    if (length <= 0)
+        return;
+    double maxValue = VectorReduceForward(KernelReductionMax, values, 1, length);
+    double sum = 0.0;
+    for (int64_t i=0 ; i<length ; ++i)
+    {
+        values[i] = std::exp(values[i] - maxValue);
+        sum += values[i];
+    }
+    double scale = 1.0 / sum;
+    VectorOperationForward(KernelVectorMultiply, values, 1, &scale, 0, values, length);
+}
+
+#ifdef MLDSL_X86_SIMD
+__attribute__((target("avx2,fma")))
+static inline __m256d KernelExpAVX2(__m256d x)
+{
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-708.0)), _mm256_set1_pd(709.0));
+    __m256d n = _mm256_floor_pd(_mm256_fmadd_pd(x, _mm256_set1_pd(1.4426950408889634), _mm256_set1_pd(0.5)));
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(0.6931471803691238), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.9082149292705877e-10), r);
+    __m256d p = _mm256_set1_pd(1.0 / 40320);
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 5040));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 720));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 120));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 24));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 6));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 2));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+    // Adding 1.5 * 2^52 leaves the integer n in the low bits of the mantissa
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+    __m256i bits = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)), _mm256_castpd_si256(magic));
+    bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d KernelLog1pAVX2(__m256d y)
+{
+    __m256d s = _mm256_div_pd(y, _mm256_add_pd(y, _mm256_set1_pd(2.0)));
+    __m256d s2 = _mm256_mul_pd(s, s);
+    __m256d p = _mm256_set1_pd(1.0 / 15);
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 13));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 11));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 9));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 7));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 5));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0 / 3));
+    p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1.0));
+    return _mm256_mul_pd(_mm256_add_pd(s, s), p);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d KernelErfAVX2(__m256d x)
+{
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    __m256d z = _mm256_andnot_pd(signMask, x);
+    __m256d t = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_fmadd_pd(z, _mm256_set1_pd(0.3275911), _mm256_set1_pd(1.0)));
+    __m256d p = _mm256_set1_pd(1.061405429);
+    p = _mm256_fmadd_pd(p, t, _mm256_set1_pd(-1.453152027));
+    p = _mm256_fmadd_pd(p, t, _mm256_set1_pd(1.421413741));
+    p = _mm256_fmadd_pd(p, t, _mm256_set1_pd(-0.284496736));
+    p = _mm256_fmadd_pd(p, t, _mm256_set1_pd(0.254829592));
+    p = _mm256_mul_pd(p, t);
+    __m256d e = KernelExpAVX2(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_mul_pd(z, z)));
+    __m256d result = _mm256_fnmadd_pd(p, e, _mm256_set1_pd(1.0));
+    return _mm256_or_pd(result, _mm256_and_pd(signMask, x));
+}
+
+__attribute__((target("avx2,fma")))
+static inline void ApplyKernelActivationPolynomialAVX2(double* values, int64_t length, int32_t activation)
+{
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    int64_t i = 0;
+    for ( ; i+4<=length ; i+=4)
+    {
+        __m256d x = _mm256_loadu_pd(values + i);
+        __m256d r;
+        switch (activation)
+        {
+        case KernelActivationSigmoid:
+            r = _mm256_div_pd(one, _mm256_add_pd(one, KernelExpAVX2(_mm256_sub_pd(zero, x))));
+            break;
+        case KernelActivationTanh:
+        {
+            __m256d t = KernelExpAVX2(_mm256_mul_pd(_mm256_set1_pd(-2.0), _mm256_andnot_pd(signMask, x)));
+            r = _mm256_div_pd(_mm256_sub_pd(one, t), _mm256_add_pd(one, t));
+            r = _mm256_or_pd(r, _mm256_and_pd(signMask, x));
+            break;
+        }
+        case KernelActivationRelu:
+            r = _mm256_max_pd(x, zero);
+            break;
+        case KernelActivationLeakyRelu:
+            r = _mm256_blendv_pd(_mm256_mul_pd(x, _mm256_set1_pd(KernelLeakyReluSlope)), x, _mm256_cmp_pd(x, zero, _CMP_GT_OQ));
+            break;
+        case KernelActivationSoftplus:
+            r = _mm256_add_pd(_mm256_max_pd(x, zero), KernelLog1pAVX2(KernelExpAVX2(_mm256_or_pd(x, signMask))));
+            break;
+        case KernelActivationGelu:
+            r = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(0.5), x),
+                              _mm256_add_pd(one, KernelErfAVX2(_mm256_mul_pd(x, _mm256_set1_pd(0.7071067811865476)))));
+            break;
+        default:
+            r = x;
+            break;
+        }
+        _mm256_storeu_pd(values + i, r);
+    }
+    for ( ; i<length ; ++i)
+        values[i] = ApplyKernelActivationPolynomial(values[i], activation);
+}
+#endif
+
+static inline void ApplyKernelActivationVector(double* values, int64_t length, int32_t activation, int32_t accuracy)
+{
+    if (activation == KernelActivationNone)
+        return;
+    if (activation == KernelActivationSoftmax)
+        return KernelSoftmax(values, length);
+    if (accuracy == KernelAccuracyTable)
+    {
+        const KernelActivationTable& table = GetKernelActivationTables()[activation];
+        for (int64_t i=0 ; i<length ; ++i)
+            values[i] = LookUpKernelActivation(table, values[i]);
+        return;
+    }
+#ifdef MLDSL_X86_SIMD
+    if (accuracy == KernelAccuracyPolynomial && GetKernelSimdLevel() >= KernelSimdAVX2)
+        return ApplyKernelActivationPolynomialAVX2(values, length, activation);
+#endif
+    for (int64_t i=0 ; i<length ; ++i)
+        values[i] = ApplyKernelActivation(values[i], activation, accuracy);
+}
+
+// Applies an activation in place to rows of length values that start rowLength apart.
+// Contiguous rows of an elementwise activation are swept as a single vector.
+static inline void LayerActivationForward(double* values, int64_t length, int64_t rowLength, int64_t rows, int32_t activation, int32_t accuracy)
+{
+    if (length == rowLength && sKernelActivations[activation].elementwise)
+        return ApplyKernelActivationVector(values, length * rows, activation, accuracy);
+    for (int64_t b=0 ; b<rows ; ++b)
+        ApplyKernelActivationVector(values + b * rowLength, length, activation, accuracy);
+}
+
+#endif // _KERNELS_H_
@@ -7,6 +7,7 @@
 class Neuron;
 class Network;
 class NetworkVisitor;
+class Connection;
 
 class Ensemble
 {
@@ -26,7 +27,8 @@ class Layer
 {
     friend class Network;
 
-	Layer()
+	Layer(int32_t layerID)
+        :m_layerID(layerID)
 	{ }
 	const NeuronList& GetNeurons() { return m_neurons; }
 public:
@@ -42,10 +44,12 @@ public:
     Neuron& operator[](int32_t index) { return *m_neurons[index]; }
     int32_t GetNumberOfNeurons() { return static_cast<int32_t>(m_neurons.size()); }
 
+    int32_t GetLayerID() { return m_layerID; }
+
 	Neuron& AddNeuron(int32_t& neuronID)
     {
-        Neuron* newNeuron = new Neuron(*this);
         neuronID = m_neurons.size();
+        Neuron* newNeuron = new Neuron(*this, neuronID);
         m_neurons.push_back(newNeuron);
         return *newNeuron;
     }
@@ -66,7 +70,8 @@ public:
         return *newNeuron;
     }
 
-    int32_t GetNeuronID(Neuron& neuron) { return std::find(m_neurons.begin(), m_neurons.end(), &neuron) - m_neurons.begin(); }
+    // Neurons are only ever appended, so the ID given to a neuron when it is added stays its index
+    int32_t GetNeuronID(Neuron& neuron) { return neuron.GetNeuronID(); }
 
     virtual void AcceptVisitor(NetworkVisitor& visitor) { visitor.Visit(*this); }
     
@@ -79,9 +84,17 @@ public:
 
     Ensembles& GetEnsembles() { return m_ensembles; }
 
+    // Connections from the layers feeding this layer and to the layers reading its outputs.
+    // They are owned by the network.
+    std::vector<Connection*>& GetInputConnections() { return m_inputConnections; }
+    std::vector<Connection*>& GetOutputConnections() { return m_outputConnections; }
+
 private:
+    int32_t m_layerID;
 	NeuronList m_neurons;
     Ensembles m_ensembles;
+    std::vector<Connection*> m_inputConnections;
+    std::vector<Connection*> m_outputConnections;
 };
 
 #endif // _LAYER_H_  
@@ -1,6 +1,18 @@
 #include <iostream>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include "mldslapi.h"
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "benchmark.h"
+#include "cppemitter.h"
+#include "threadpool.h"
+#include "arena.h"
 
 void ConstructWeightedNeuronForwardPropFunction(Neuron& neuron, std::vector<double>& weights, double bias)
 {
@@ -125,6 +137,91 @@ void TestConvolutionalNet(int32_t numInputNeurons, int32_t blockSize)
     Network::Destroy(net);
 }
 
+// The sources and sinks computed from the connection descriptors must agree with each other
+void CheckConnectedNeurons(Layer& sourceLayer, Layer& sinkLayer)
+{
+    for (int32_t i=0 ; i<sinkLayer.GetNumberOfNeurons() ; ++i)
+    {
+        ConnectedNeurons sources = sinkLayer.GetNeuron(i).GetSources();
+        for (size_t j=0 ; j<sources.size() ; ++j)
+        {
+            ConnectedNeurons sinks = sources[j]->GetSinks();
+            bool found = false;
+            for (size_t k=0 ; k<sinks.size() ; ++k)
+                found = found || sinks[k] == &sinkLayer.GetNeuron(i);
+            assert(found);
+        }
+    }
+    int32_t numEdges = 0;
+    for (int32_t i=0 ; i<sourceLayer.GetNumberOfNeurons() ; ++i)
+        numEdges += static_cast<int32_t>(sourceLayer.GetNeuron(i).GetSinks().size());
+    for (int32_t i=0 ; i<sinkLayer.GetNumberOfNeurons() ; ++i)
+        numEdges -= sinkLayer.GetNeuron(i).GetNumInputs();
+    assert(numEdges == 0);
+}
+
+void TestConnections()
+{
+    Network& net = Network::Create();
+    int32_t layer1ID, layer2ID, layer3ID;
+    Layer& inputLayer = net.AddLayer(layer1ID);
+    Layer& hiddenLayer = net.AddLayer(layer2ID);
+    Layer& outputLayer = net.AddLayer(layer3ID);
+    for (int32_t i=0 ; i<11 ; ++i)
+    {
+        int32_t id = 0;
+        inputLayer.AddInputNeuron(id);
+    }
+    // Windows of 3 inputs, 2 apart
+    AddWeightedNeuronsToLayer(hiddenLayer, 5);
+    for (int32_t i=0 ; i<3 ; ++i)
+    {
+        int32_t id = 0;
+        outputLayer.AddOutputNeuron(id);
+    }
+    net.ConnectConvolutionalLayer(layer1ID, layer2ID, 0, 3, 2);
+    std::map<int32_t, std::vector<int32_t>> connections;
+    connections[0] = { 0, 4 };
+    connections[1] = { 1, 2, 3 };
+    connections[2] = { 4 };
+    net.ConnectLayers(layer2ID, layer3ID, connections);
+
+    assert(hiddenLayer.GetNeuron(3).GetNumInputs() == 3);
+    assert(hiddenLayer.GetNeuron(3).GetSources()[0] == &inputLayer.GetNeuron(6));
+    assert(inputLayer.GetNeuron(4).GetSinks().size() == 2);
+    assert(hiddenLayer.GetNeuron(4).GetSinks().size() == 2);
+    CheckConnectedNeurons(inputLayer, hiddenLayer);
+    CheckConnectedNeurons(hiddenLayer, outputLayer);
+
+    // Neurons added after connecting have no sources or sinks
+    int32_t id = 0;
+    Neuron& lateInput = inputLayer.AddInputNeuron(id);
+    AddWeightedNeuronsToLayer(hiddenLayer, 1);
+    Neuron& lateHidden = hiddenLayer.GetNeuron(hiddenLayer.GetNumberOfNeurons() - 1);
+    Neuron& lateOutput = outputLayer.AddOutputNeuron(id);
+    int32_t first, stride;
+    assert(lateInput.GetSinks().size() == 0);
+    assert(lateHidden.GetSources().size() == 0 && !lateHidden.GetAffineSources(first, stride));
+    assert(lateHidden.GetSinks().size() == 0);
+    assert(lateOutput.GetSources().size() == 0 && !lateOutput.GetAffineSources(first, stride));
+    Network::Destroy(net);
+
+    Network& denseNet = Network::Create();
+    Layer& denseInputLayer = denseNet.AddLayer(layer1ID);
+    Layer& denseOutputLayer = denseNet.AddLayer(layer2ID);
+    for (int32_t i=0 ; i<4 ; ++i)
+        denseInputLayer.AddInputNeuron(id);
+    AddWeightedNeuronsToLayer(denseOutputLayer, 2);
+    denseNet.FullyConnectLayers(layer1ID, layer2ID);
+    Neuron& lateDenseInput = denseInputLayer.AddInputNeuron(id);
+    AddWeightedNeuronsToLayer(denseOutputLayer, 1);
+    Neuron& lateDenseOutput = denseOutputLayer.GetNeuron(2);
+    assert(denseInputLayer.GetNeuron(0).GetSinks().size() == 2);
+    assert(lateDenseInput.GetSinks().size() == 0);
+    assert(lateDenseOutput.GetSources().size() == 0 && !lateDenseOutput.GetAffineSources(first, stride));
+    Network::Destroy(denseNet);
+}
+
 void TestValueComparison()
 {
     {
@@ -160,8 +257,8 @@ void TestIRValuesAndStatements()
         auto start = Constant(0);
         auto end = Constant(10);
         auto forLoop = ForLoop::Create(start, end);
-        auto x = Variable::Create("x", *(new IntegerType)); // int x
-        auto arr = Variable::Create("arr", *(new VectorType(*(new IntegerType), 10))); // int arr[10]
+        auto x = Variable::Create("x", IntegerType::Get()); // int x
+        auto arr = Variable::Create("arr", VectorType::Get(IntegerType::Get(), 10)); // int arr[10]
         auto arrRef = IndexedValue(arr, forLoop.GetIndexVariable());
         auto assignmentRHS = x + arrRef;
         auto assignmentStm = Assignment::Create(x, assignmentRHS);
@@ -170,9 +267,1243 @@ void TestIRValuesAndStatements()
     }
 }
 
+double GetTestWeight(int32_t layerID, int32_t neuronID, int32_t inputID)
+{
+    return ((layerID * 31 + neuronID * 7 + inputID * 3) % 11) / 10.0 - 0.5;
+}
+
+double GetTestBias(int32_t layerID, int32_t neuronID)
+{
+    return ((layerID * 5 + neuronID * 3) % 7) / 10.0 - 0.3;
+}
+
+// Fully connected network of weighted sigmoid neurons with deterministic weights.
+// layerSizes[0] is the number of inputs.
+Network& ConstructTestNetwork(std::vector<int32_t>& layerSizes)
+{
+    Network& net = Network::Create();
+    for (size_t l=0 ; l<layerSizes.size() ; ++l)
+    {
+        int32_t layerID;
+        Layer& layer = net.AddLayer(layerID);
+        bool outputLayer = l == layerSizes.size() - 1;
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            int32_t id = 0;
+            if (l == 0)
+            {
+                InputNeuron& neuron = layer.AddInputNeuron(id);
+                neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+                continue;
+            }
+            std::vector<double> w(layerSizes[l-1]);
+            for (int32_t j=0 ; j<layerSizes[l-1] ; ++j)
+                w[j] = GetTestWeight(layerID, i, j);
+            Neuron& neuron = outputLayer ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+            ConstructWeightedNeuronForwardPropFunction(neuron, w, GetTestBias(layerID, i));
+        }
+        if (l > 0)
+            net.FullyConnectLayers(layerID - 1, layerID);
+    }
+    return net;
+}
+
+std::vector<double> ComputeTestNetworkOutput(std::vector<int32_t>& layerSizes, const double* input)
+{
+    std::vector<double> values(input, input + layerSizes[0]);
+    for (size_t l=1 ; l<layerSizes.size() ; ++l)
+    {
+        std::vector<double> next(layerSizes[l]);
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            double sum = 0.0;
+            for (int32_t j=0 ; j<layerSizes[l-1] ; ++j)
+                sum += GetTestWeight(l, i, j) * values[j];
+            next[i] = 1.0 / (1.0 + exp(-(sum + GetTestBias(l, i))));
+        }
+        values = next;
+    }
+    return values;
+}
+
+void CheckTestNetworkOutput(std::vector<int32_t>& layerSizes, const double* input, const double* output)
+{
+    std::vector<double> expected = ComputeTestNetworkOutput(layerSizes, input);
+    for (size_t i=0 ; i<expected.size() ; ++i)
+        assert(fabs(expected[i] - output[i]) < 1e-9);
+}
+
+void TestInterpreter()
+{
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    Function& func = ConstructIRForNetwork(net);
+
+    Interpreter interpreter(func);
+    std::vector<double> x(interpreter.GetInputLength());
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(interpreter.GetOutputLength());
+    interpreter.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+
+    double throughput = MeasureInferencesPerSecond([&]() { interpreter.Run(x.data(), y.data()); });
+    std::cout << "Interpreter : " << throughput << " inferences/sec" << std::endl;
+
+    // Per neuron loops instead of the dense kernel
+    LoweringOptions options;
+    options.useDenseKernels = false;
+    Interpreter loopInterpreter(ConstructIRForNetwork(net, options));
+    loopInterpreter.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+
+    throughput = MeasureInferencesPerSecond([&]() { loopInterpreter.Run(x.data(), y.data()); });
+    std::cout << "Interpreter without dense kernels : " << throughput << " inferences/sec" << std::endl;
+
+    // Scalar multiply-accumulate loops instead of the vector kernels
+    options.useVectorKernels = false;
+    Interpreter scalarInterpreter(ConstructIRForNetwork(net, options));
+    scalarInterpreter.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+    Network::Destroy(net);
+}
+
+// Generated models are written and compiled in a temporary directory, which main removes when
+// the tests are done
+static std::string sTestModelDirectory;
+static std::vector<std::string> sTestModelFiles;
+
+// Emits function as name.cpp, compiles it and returns the path of the shared object
+std::string CompileTestModel(Function& function, const std::string& name, bool parallel = false)
+{
+    if (sTestModelDirectory.empty())
+    {
+        const char* tmpDir = getenv("TMPDIR");
+        std::string pattern = std::string(tmpDir ? tmpDir : "/tmp") + "/mldsl-test-XXXXXX";
+        std::vector<char> path(pattern.begin(), pattern.end());
+        path.push_back('\0');
+        if (mkdtemp(path.data()) == nullptr)
+            throw std::runtime_error("CompileTestModel : Cannot create a directory from " + pattern);
+        sTestModelDirectory = path.data();
+    }
+    std::string sourcePath = sTestModelDirectory + "/" + name + ".cpp";
+    std::string sharedObjectPath = sTestModelDirectory + "/" + name + ".so";
+    {
+        std::ofstream source(sourcePath.c_str());
+        EmitCPlusPlus(function, source, "mldsl_forward", parallel);
+    }
+    sTestModelFiles.push_back(sourcePath);
+    sTestModelFiles.push_back(sharedObjectPath);
+    CompileNativeModel(sourcePath, sharedObjectPath);
+    return sharedObjectPath;
+}
+
+void RemoveTestModels()
+{
+    for (size_t i=0 ; i<sTestModelFiles.size() ; ++i)
+        remove(sTestModelFiles[i].c_str());
+    if (!sTestModelDirectory.empty())
+        rmdir(sTestModelDirectory.c_str());
+}
+
+void TestNativeModel()
+{
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    Function& func = ConstructIRForNetwork(net);
+    NativeModel model(CompileTestModel(func, "test_model"));
+    std::vector<double> x(model.GetInputLength());
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(model.GetOutputLength());
+    model.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+
+    double throughput = MeasureInferencesPerSecond([&]() { model.Run(x.data(), y.data()); });
+    std::cout << "Native model : " << throughput << " inferences/sec" << std::endl;
+
+    // Paths are passed to the compiler as they are, without being interpreted by the shell
+    NativeModel quoted(CompileTestModel(func, "test model 'quoted'; exit 1"));
+    std::fill(y.begin(), y.end(), 0.0);
+    quoted.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+    Network::Destroy(net);
+}
+
+void TestBatchedInference()
+{
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    int32_t outputLength = layerSizes.back();
+
+    // Batch size fixed at lowering time, lowered to per neuron loops over transposed value sets
+    LoweringOptions fixedOptions;
+    fixedOptions.batchSize = 4;
+    fixedOptions.useDenseKernels = false;
+    fixedOptions.valueSetLayout = ValueSet::Transposed;
+    Interpreter fixedInterpreter(ConstructIRForNetwork(net, fixedOptions));
+    std::vector<double> x(32 * inputLength);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(32 * outputLength);
+    fixedInterpreter.Run(x.data(), y.data());
+    for (int32_t b=0 ; b<4 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+    // Batch size given on every run
+    LoweringOptions runtimeOptions;
+    runtimeOptions.batchSize = LoweringOptions::RuntimeBatchSize;
+    runtimeOptions.valueSetLayout = ValueSet::Transposed;
+    Function& func = ConstructIRForNetwork(net, runtimeOptions);
+    Interpreter interpreter(func);
+    for (int32_t batchSize : { 3, 7 })
+    {
+        interpreter.Run(x.data(), y.data(), batchSize);
+        for (int32_t b=0 ; b<batchSize ; ++b)
+            CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+    }
+
+    NativeModel model(CompileTestModel(func, "test_batched_model"));
+    model.Run(x.data(), y.data(), 32);
+    for (int32_t b=0 ; b<32 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+    double throughput = MeasureInferencesPerSecond([&]() { model.Run(x.data(), y.data(), 32); }, 32);
+    std::cout << "Native model, batch 32 : " << throughput << " inferences/sec" << std::endl;
+    Network::Destroy(net);
+}
+
+// Values, types and IR built inside an ArenaScope are freed together with the arena
+void TestArenaLowering()
+{
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    std::vector<double> x(layerSizes.front());
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(layerSizes.back());
+
+    auto compile = [&](bool run)
+    {
+        Arena arena;
+        Network* net;
+        {
+            ArenaScope scope(arena);
+            net = &ConstructTestNetwork(layerSizes);
+            CollectMergeableNeuronsIntoEnsembles(*net);
+            Function& func = ConstructIRForNetwork(*net);
+            if (run)
+            {
+                Interpreter interpreter(func);
+                interpreter.Run(x.data(), y.data());
+            }
+        }
+        assert(Arena::GetCurrent() == nullptr && arena.GetNumberOfObjects() > 0);
+        // The network's neurons refer to values in the arena
+        Network::Destroy(*net);
+    };
+    compile(true);
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+
+    double throughput = MeasureInferencesPerSecond([&]() { compile(false); });
+    std::cout << "Network construction and lowering in an arena : " << throughput << " compilations/sec" << std::endl;
+}
+
+// Even output neurons use sigmoid and odd ones tanh. Each kind forms one ensemble with an output stride of 2.
+void TestInterleavedEnsembles()
+{
+    const int32_t numInputs = 24;
+    const int32_t numOutputs = 12;
+    Network& net = Network::Create();
+    int32_t inputLayerID, outputLayerID;
+    Layer& inputLayer = net.AddLayer(inputLayerID);
+    Layer& outputLayer = net.AddLayer(outputLayerID);
+    for (int32_t i=0 ; i<numInputs ; ++i)
+    {
+        int32_t id = 0;
+        InputNeuron& neuron = inputLayer.AddInputNeuron(id);
+        neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+    }
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+    {
+        std::vector<double> w(numInputs);
+        for (int32_t j=0 ; j<numInputs ; ++j)
+            w[j] = GetTestWeight(outputLayerID, i, j);
+        int32_t id = 0;
+        Neuron& neuron = outputLayer.AddOutputNeuron(id);
+        Value& sum = Reduction::Create(Constant(w) * GetInputValue::Create(neuron), Reduction::Sum) + Constant(GetTestBias(outputLayerID, i));
+        neuron.SetForwardPropagationValue(ActivationFunction::Create(sum, i % 2 == 0 ? "sigmoid" : "tanh"));
+    }
+    net.FullyConnectLayers(inputLayerID, outputLayerID);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    assert(outputLayer.GetEnsembles().size() == 2);
+    assert(outputLayer.GetEnsembles()[1]->GetNeurons()[1] == &outputLayer.GetNeuron(3));
+
+    const int32_t batchSize = 3;
+    std::vector<double> x(batchSize * numInputs);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    LoweringOptions options;
+    options.batchSize = LoweringOptions::RuntimeBatchSize;
+    Interpreter interpreter(ConstructIRForNetwork(net, options));
+    std::vector<double> y(batchSize * numOutputs);
+    interpreter.Run(x.data(), y.data(), batchSize);
+    for (int32_t b=0 ; b<batchSize ; ++b)
+    {
+        for (int32_t i=0 ; i<numOutputs ; ++i)
+        {
+            double sum = GetTestBias(outputLayerID, i);
+            for (int32_t j=0 ; j<numInputs ; ++j)
+                sum += GetTestWeight(outputLayerID, i, j) * x[b * numInputs + j];
+            double expected = i % 2 == 0 ? 1.0 / (1.0 + exp(-sum)) : tanh(sum);
+            assert(fabs(expected - y[b * numOutputs + i]) < 1e-9);
+        }
+    }
+    Network::Destroy(net);
+}
+
+// Weighted sums written with redundant operations that simplification removes
+void TestValueSimplification()
+{
+    const int32_t numInputs = 16;
+    const int32_t numOutputs = 8;
+    // With the offset no bias is 0. Without it, the neurons with a zero bias keep their
+    // addition so that all neurons still form one ensemble.
+    for (int32_t biasOffset=0 ; biasOffset<2 ; ++biasOffset)
+    {
+        Network& net = Network::Create();
+        int32_t inputLayerID, outputLayerID;
+        Layer& inputLayer = net.AddLayer(inputLayerID);
+        Layer& outputLayer = net.AddLayer(outputLayerID);
+        for (int32_t i=0 ; i<numInputs ; ++i)
+        {
+            int32_t id = 0;
+            InputNeuron& neuron = inputLayer.AddInputNeuron(id);
+            neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+        }
+        std::vector<double> biases(numOutputs);
+        for (int32_t i=0 ; i<numOutputs ; ++i)
+        {
+            std::vector<double> w(numInputs);
+            for (int32_t j=0 ; j<numInputs ; ++j)
+                w[j] = GetTestWeight(outputLayerID, i, j);
+            biases[i] = GetTestBias(outputLayerID, i) + 0.05 * biasOffset;
+            int32_t id = 0;
+            Neuron& neuron = outputLayer.AddOutputNeuron(id);
+            // 0.5 * Sum(2 * w * x) + -(-(b * 1)) + 0
+            Value& product = Constant(2.0) * Constant(w) * GetInputValue::Create(neuron);
+            Value& sum = Constant(0.5) * Reduction::Create(product, Reduction::Sum);
+            Value& bias = -(-(Constant(biases[i]) * Constant(1.0)));
+            neuron.SetForwardPropagationValue(ActivationFunction::Create(sum + bias + Constant(0), "sigmoid"));
+        }
+        net.FullyConnectLayers(inputLayerID, outputLayerID);
+        CollectMergeableNeuronsIntoEnsembles(net);
+        assert(outputLayer.GetEnsembles().size() == 1);
+
+        // Simplified to sigmoid(Sum(w*x) + b), the dense kernel computes the layer
+        Function& func = ConstructIRForNetwork(net);
+        int32_t denseLayers = 0;
+        const std::list<IRStatement*>& stms = func.GetStatementList();
+        for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            denseLayers += dynamic_cast<DenseLayer*>(*iter) != nullptr;
+        assert(denseLayers == biasOffset);
+
+        std::vector<double> x(numInputs);
+        for (size_t i=0 ; i<x.size() ; ++i)
+            x[i] = (double)rand()/RAND_MAX;
+        std::vector<double> y(numOutputs);
+        Interpreter interpreter(func);
+        interpreter.Run(x.data(), y.data());
+        for (int32_t i=0 ; i<numOutputs ; ++i)
+        {
+            double sum = biases[i];
+            for (int32_t j=0 ; j<numInputs ; ++j)
+                sum += GetTestWeight(outputLayerID, i, j) * x[j];
+            assert(fabs(1.0 / (1.0 + exp(-sum)) - y[i]) < 1e-9);
+        }
+        Network::Destroy(net);
+    }
+}
+
+// Neurons reading the same irregular set of inputs, with subexpressions built twice
+void TestValueNumbering()
+{
+    const int32_t numInputs = 12;
+    const int32_t numOutputs = 6;
+    const int32_t sources[] = { 0, 3, 4, 7, 11 };
+    const int32_t numSources = 5;
+    Network& net = Network::Create();
+    int32_t inputLayerID, outputLayerID;
+    Layer& inputLayer = net.AddLayer(inputLayerID);
+    Layer& outputLayer = net.AddLayer(outputLayerID);
+    for (int32_t i=0 ; i<numInputs ; ++i)
+    {
+        int32_t id = 0;
+        InputNeuron& neuron = inputLayer.AddInputNeuron(id);
+        neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+    }
+    std::map<int32_t, std::vector<int32_t>> connections;
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+    {
+        std::vector<double> w(numSources);
+        for (int32_t j=0 ; j<numSources ; ++j)
+            w[j] = GetTestWeight(outputLayerID, i, j);
+        int32_t id = 0;
+        Neuron& neuron = outputLayer.AddOutputNeuron(id);
+        // w*x and x*w are the same product and both inputs are the same vector
+        Value& weights = Constant(w);
+        Value& product = weights * GetInputValue::Create(neuron);
+        Value& sameProduct = GetInputValue::Create(neuron) * weights;
+        Value& sum = Reduction::Create(product, Reduction::Sum) + Reduction::Create(sameProduct, Reduction::Sum);
+        neuron.SetForwardPropagationValue(ActivationFunction::Create(sum, i % 2 == 0 ? "sigmoid" : "tanh"));
+        connections[i] = std::vector<int32_t>(sources, sources + numSources);
+    }
+    net.ConnectLayers(inputLayerID, outputLayerID, connections);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    assert(outputLayer.GetEnsembles().size() == 2);
+
+    std::vector<double> x(numInputs);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    for (int32_t vectorKernels=0 ; vectorKernels<2 ; ++vectorKernels)
+    {
+        LoweringOptions options;
+        options.useVectorKernels = vectorKernels != 0;
+        Function& func = ConstructIRForNetwork(net, options);
+        // The input layer's output and a single gather of the inputs made before the loops of both ensembles
+        int32_t topLevelDefinitions = 0;
+        const std::list<IRStatement*>& stms = func.GetStatementList();
+        for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            topLevelDefinitions += dynamic_cast<VariableDefinition*>(*iter) != nullptr;
+        assert(topLevelDefinitions == 2);
+        std::stringstream source;
+        EmitCPlusPlus(func, source, "mldsl_forward", true);
+
+        Interpreter interpreter(func);
+        std::vector<double> y(numOutputs);
+        interpreter.Run(x.data(), y.data());
+        for (int32_t i=0 ; i<numOutputs ; ++i)
+        {
+            double sum = 0.0;
+            for (int32_t j=0 ; j<numSources ; ++j)
+                sum += 2.0 * GetTestWeight(outputLayerID, i, j) * x[sources[j]];
+            double expected = i % 2 == 0 ? 1.0 / (1.0 + exp(-sum)) : tanh(sum);
+            assert(fabs(expected - y[i]) < 1e-9);
+        }
+    }
+    Network::Destroy(net);
+}
+
+// Two layers whose neurons read irregular sets of inputs gather them at the top level
+// of the function, and the gathers of both layers must have distinct names
+void TestSharedInputsAcrossLayers()
+{
+    const int32_t layerSizes[] = { 12, 6, 4 };
+    const int32_t sources[2][4] = { { 0, 3, 4, 11 }, { 1, 2, 5, 5 } };
+    Network& net = Network::Create();
+    int32_t layerIDs[3];
+    for (int32_t l=0 ; l<3 ; ++l)
+    {
+        Layer& layer = net.AddLayer(layerIDs[l]);
+        std::map<int32_t, std::vector<int32_t>> connections;
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            int32_t id = 0;
+            if (l == 0)
+            {
+                InputNeuron& neuron = layer.AddInputNeuron(id);
+                neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+                continue;
+            }
+            std::vector<double> w(4);
+            for (int32_t j=0 ; j<4 ; ++j)
+                w[j] = GetTestWeight(layerIDs[l], i, j);
+            Neuron& neuron = l == 2 ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+            ConstructWeightedNeuronForwardPropFunction(neuron, w, GetTestBias(layerIDs[l], i));
+            connections[i] = std::vector<int32_t>(sources[l - 1], sources[l - 1] + 4);
+        }
+        if (l > 0)
+            net.ConnectLayers(layerIDs[l - 1], layerIDs[l], connections);
+    }
+    CollectMergeableNeuronsIntoEnsembles(net);
+    Function& func = ConstructIRForNetwork(net);
+    std::set<std::string> names;
+    int32_t gathers = 0;
+    const std::list<IRStatement*>& stms = func.GetStatementList();
+    for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        if (VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter))
+        {
+            gathers += definition->GetVariable().GetName().find("_sharedInput") == 0;
+            assert(names.insert(definition->GetVariable().GetName()).second);
+        }
+    }
+    assert(gathers == 2);
+
+    std::vector<double> x(layerSizes[0]);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> values(x);
+    for (int32_t l=1 ; l<3 ; ++l)
+    {
+        std::vector<double> next(layerSizes[l]);
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            double sum = GetTestBias(layerIDs[l], i);
+            for (int32_t j=0 ; j<4 ; ++j)
+                sum += GetTestWeight(layerIDs[l], i, j) * values[sources[l - 1][j]];
+            next[i] = 1.0 / (1.0 + exp(-sum));
+        }
+        values = next;
+    }
+    NativeModel model(CompileTestModel(func, "test_gather_model", true));
+    std::vector<double> y(layerSizes[2]);
+    model.Run(x.data(), y.data());
+    for (int32_t i=0 ; i<layerSizes[2] ; ++i)
+        assert(fabs(values[i] - y[i]) < 1e-9);
+    Network::Destroy(net);
+}
+
+// Output neuron i computes Max(w*x - b) + Sum(x / v) + Multiply(x * 0.5 + 1)
+void TestVectorKernels()
+{
+    const int32_t numInputs = 37;
+    const int32_t numOutputs = 20;
+    Network& net = Network::Create();
+    int32_t inputLayerID, outputLayerID;
+    Layer& inputLayer = net.AddLayer(inputLayerID);
+    Layer& outputLayer = net.AddLayer(outputLayerID);
+    for (int32_t i=0 ; i<numInputs ; ++i)
+    {
+        int32_t id = 0;
+        InputNeuron& neuron = inputLayer.AddInputNeuron(id);
+        neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+    }
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+    {
+        std::vector<double> w(numInputs), v(numInputs);
+        for (int32_t j=0 ; j<numInputs ; ++j)
+        {
+            w[j] = GetTestWeight(outputLayerID, i, j);
+            v[j] = 1.0 + w[j] * w[j];
+        }
+        int32_t id = 0;
+        Neuron& neuron = outputLayer.AddOutputNeuron(id);
+        Value& x = GetInputValue::Create(neuron);
+        Value& max = Reduction::Create(Constant(w) * x - Constant(GetTestBias(outputLayerID, i)), Reduction::Max);
+        Value& sum = Reduction::Create(x / Constant(v), Reduction::Sum);
+        Value& product = Reduction::Create(x * Constant(0.5) + Constant(1.0), Reduction::Multiply);
+        neuron.SetForwardPropagationValue(max + sum + product);
+    }
+    net.FullyConnectLayers(inputLayerID, outputLayerID);
+    CollectMergeableNeuronsIntoEnsembles(net);
+
+    std::vector<double> x(numInputs);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> expected(numOutputs);
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+    {
+        double max = -INFINITY, sum = 0.0, product = 1.0;
+        for (int32_t j=0 ; j<numInputs ; ++j)
+        {
+            double w = GetTestWeight(outputLayerID, i, j);
+            max = std::max(max, w * x[j] - GetTestBias(outputLayerID, i));
+            sum += x[j] / (1.0 + w * w);
+            product *= x[j] * 0.5 + 1.0;
+        }
+        expected[i] = max + sum + product;
+    }
+
+    Function& func = ConstructIRForNetwork(net);
+    Interpreter interpreter(func);
+    std::vector<double> y(numOutputs);
+    interpreter.Run(x.data(), y.data());
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+        assert(fabs(expected[i] - y[i]) < 1e-9 * fabs(expected[i]));
+
+    NativeModel model(CompileTestModel(func, "test_vector_model"));
+    std::fill(y.begin(), y.end(), 0.0);
+    model.Run(x.data(), y.data());
+    for (int32_t i=0 ; i<numOutputs ; ++i)
+        assert(fabs(expected[i] - y[i]) < 1e-9 * fabs(expected[i]));
+    Network::Destroy(net);
+
+    // The dot product kernels, contiguous and strided, over lengths with every remainder
+    std::vector<double> a(2 * 40), b(2 * 40);
+    for (size_t i=0 ; i<a.size() ; ++i)
+    {
+        a[i] = (double)rand()/RAND_MAX;
+        b[i] = (double)rand()/RAND_MAX;
+    }
+    for (int64_t stride=1 ; stride<=2 ; ++stride)
+    {
+        for (int64_t length=0 ; length<=40 ; ++length)
+        {
+            double dot = 0.0;
+            for (int64_t i=0 ; i<length ; ++i)
+                dot += a[i * stride] * b[i * stride];
+            assert(fabs(VectorDotProductForward(a.data(), stride, b.data(), stride, length) - dot) < 1e-12);
+        }
+    }
+}
+
+// Temporaries that only carry a value to the next statement are forwarded, and the row offsets
+// in the batch loop become induction variables
+void TestLoopOptimizations()
+{
+    std::vector<int32_t> layerSizes = { 16, 8, 4 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    int32_t outputLength = layerSizes.back();
+    std::vector<double> x(5 * inputLength);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(5 * outputLength);
+
+    size_t batchLoopSizes[2];
+    for (int32_t optimize=0 ; optimize<2 ; ++optimize)
+    {
+        LoweringOptions options;
+        options.batchSize = LoweringOptions::RuntimeBatchSize;
+        options.useDenseKernels = false;
+        options.useVectorKernels = false;
+        options.optimizeLoops = optimize != 0;
+        Function& func = ConstructIRForNetwork(net, options);
+        Interpreter interpreter(func);
+        interpreter.Run(x.data(), y.data(), 5);
+        for (int32_t b=0 ; b<5 ; ++b)
+            CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+        ForLoop* ensembleLoop = dynamic_cast<ForLoop*>(func.GetStatementList().back());
+        ForLoop* batchLoop = dynamic_cast<ForLoop*>(ensembleLoop->GetStatements().back());
+        batchLoopSizes[optimize] = batchLoop->GetStatements().size();
+        if (!options.optimizeLoops)
+            continue;
+        NativeModel model(CompileTestModel(func, "test_loop_model"));
+        std::fill(y.begin(), y.end(), 0.0);
+        model.Run(x.data(), y.data(), 5);
+        for (int32_t b=0 ; b<5 ; ++b)
+            CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+    }
+    assert(batchLoopSizes[1] < batchLoopSizes[0]);
+    Network::Destroy(net);
+}
+
+// Unroll-and-jam of the ensemble loops and tiling of the input copy keep the results, also
+// when the stepped loops are split across threads
+void TestLoopTransforms()
+{
+    std::vector<int32_t> layerSizes = { 24, 18, 7 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    int32_t outputLength = layerSizes.back();
+    std::vector<double> x(10 * inputLength);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(10 * outputLength);
+    ThreadPool pool(4);
+
+    LoweringOptions options;
+    options.batchSize = 10;
+    options.useDenseKernels = false;
+    options.useVectorKernels = false;
+    options.cacheSize = 1024;
+    Function& func = ConstructIRForNetwork(net, options);
+    int32_t numSteppedLoops = 0;
+    const std::list<IRStatement*>& stms = func.GetStatementList();
+    for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        ForLoop* forLoop = dynamic_cast<ForLoop*>(*iter);
+        numSteppedLoops += forLoop != nullptr && forLoop->GetStep() > 1 ? 1 : 0;
+    }
+    // The input copy tiles and both layers' unrolled ensemble loops
+    assert(numSteppedLoops >= 3);
+
+    Interpreter interpreter(func);
+    interpreter.SetThreadPool(&pool);
+    interpreter.Run(x.data(), y.data());
+    for (int32_t b=0 ; b<10 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+    NativeModel model(CompileTestModel(func, "test_transformed_model", true));
+    model.SetThreadPool(&pool);
+    std::fill(y.begin(), y.end(), 0.0);
+    model.Run(x.data(), y.data());
+    for (int32_t b=0 ; b<10 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+    // Strip mining and interchange on their own
+    options.cacheSize = 0;
+    options.unrollAndJamFactor = 1;
+    options.optimizeLoops = false;
+    Function& reordered = ConstructIRForNetwork(net, options);
+    std::list<IRStatement*>& reorderedStms = reordered.GetStatements();
+    int32_t numInterchanged = 0;
+    for (std::list<IRStatement*>::iterator iter=reorderedStms.begin() ; iter!=reorderedStms.end() ; ++iter)
+    {
+        if (InterchangeLoops(reorderedStms, iter))
+            ++numInterchanged;
+        else
+            StripMineLoop(reorderedStms, iter, 5);
+    }
+    assert(numInterchanged == 1);
+    Interpreter(reordered).Run(x.data(), y.data());
+    for (int32_t b=0 ; b<10 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+    Network::Destroy(net);
+}
+
+// A chain of convolutional layers is fused into sequential loops that produce each window of a
+// layer just before the next layer reads it
+void TestLoopFusion()
+{
+    std::vector<int32_t> layerSizes = { 13, 11, 9 };
+    Network& net = Network::Create();
+    int32_t prevLayerID = 0;
+    for (size_t l=0 ; l<layerSizes.size() ; ++l)
+    {
+        int32_t layerID = 0;
+        Layer& layer = net.AddLayer(layerID);
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            int32_t id = 0;
+            if (l == 0)
+            {
+                InputNeuron& neuron = layer.AddInputNeuron(id);
+                neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+                continue;
+            }
+            std::vector<double> w(3);
+            for (int32_t j=0 ; j<3 ; ++j)
+                w[j] = GetTestWeight(layerID, i, j);
+            Neuron& neuron = l + 1 == layerSizes.size() ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+            ConstructWeightedNeuronForwardPropFunction(neuron, w, GetTestBias(layerID, i));
+        }
+        if (l > 0)
+            net.ConnectConvolutionalLayer(prevLayerID, layerID, 0, 3);
+        prevLayerID = layerID;
+    }
+    CollectMergeableNeuronsIntoEnsembles(net);
+
+    std::vector<double> x(layerSizes.front());
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> expected(layerSizes.back());
+    std::vector<double> y(layerSizes.back());
+    for (int32_t vectorKernels=0 ; vectorKernels<2 ; ++vectorKernels)
+    {
+        LoweringOptions options;
+        options.useDenseKernels = false;
+        options.useVectorKernels = vectorKernels != 0;
+        Interpreter(ConstructIRForNetwork(net, options)).Run(x.data(), expected.data());
+
+        options.fuseLoops = true;
+        Function& func = ConstructIRForNetwork(net, options);
+        // Every layer ends up in the last loop, which runs sequentially
+        ForLoop* fusedLoop = dynamic_cast<ForLoop*>(func.GetStatementList().back());
+        assert(fusedLoop != nullptr && !fusedLoop->IsParallel());
+        int32_t numLoops = 0;
+        const std::list<IRStatement*>& stms = func.GetStatementList();
+        for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+            numLoops += dynamic_cast<ForLoop*>(*iter) != nullptr ? 1 : 0;
+        assert(numLoops == 3);
+
+        Interpreter interpreter(func);
+        interpreter.Run(x.data(), y.data());
+        for (size_t i=0 ; i<y.size() ; ++i)
+            assert(fabs(expected[i] - y[i]) < 1e-12);
+        NativeModel model(CompileTestModel(func, "test_fused_model"));
+        std::fill(y.begin(), y.end(), 0.0);
+        model.Run(x.data(), y.data());
+        for (size_t i=0 ; i<y.size() ; ++i)
+            assert(fabs(expected[i] - y[i]) < 1e-9);
+    }
+    Network::Destroy(net);
+}
+
+// Layer outputs of a chain share the workspace, so it only holds two adjacent layers
+void TestWorkspacePlan()
+{
+    std::vector<int32_t> layerSizes = { 64, 512, 256, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    LoweringOptions options;
+    options.useDenseKernels = false;
+    Function& func = ConstructIRForNetwork(net, options);
+    WorkspacePlan plan = PlanWorkspace(func);
+    assert(plan.offsets.size() == 4);
+    assert(plan.size == 512 + 256);
+
+    Interpreter interpreter(func);
+    std::vector<double> x(interpreter.GetInputLength());
+    std::vector<double> y(interpreter.GetOutputLength());
+    for (int32_t run=0 ; run<2 ; ++run)
+    {
+        for (size_t i=0 ; i<x.size() ; ++i)
+            x[i] = (double)rand()/RAND_MAX;
+        interpreter.Run(x.data(), y.data());
+        CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+    }
+    Network::Destroy(net);
+}
+
+void TestParallelInference()
+{
+    std::vector<int32_t> layerSizes = { 64, 512, 256, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    int32_t outputLength = layerSizes.back();
+    ThreadPool pool(4);
+
+    std::vector<double> x(16 * inputLength);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> y(16 * outputLength);
+
+    // Dense kernels split by neurons, and per neuron loops split into chunks of iterations
+    Interpreter denseInterpreter(ConstructIRForNetwork(net));
+    denseInterpreter.SetThreadPool(&pool);
+    denseInterpreter.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+    LoweringOptions loopOptions;
+    loopOptions.useDenseKernels = false;
+    Interpreter loopInterpreter(ConstructIRForNetwork(net, loopOptions));
+    loopInterpreter.SetThreadPool(&pool);
+    loopInterpreter.Run(x.data(), y.data());
+    CheckTestNetworkOutput(layerSizes, x.data(), y.data());
+
+    LoweringOptions batchOptions;
+    batchOptions.batchSize = LoweringOptions::RuntimeBatchSize;
+    Function& func = ConstructIRForNetwork(net, batchOptions);
+    Interpreter batchInterpreter(func);
+    batchInterpreter.SetThreadPool(&pool);
+    batchInterpreter.Run(x.data(), y.data(), 5);
+    for (int32_t b=0 ; b<5 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+    NativeModel model(CompileTestModel(func, "test_parallel_model", true));
+    double sequentialThroughput = MeasureInferencesPerSecond([&]() { model.Run(x.data(), y.data(), 16); }, 16);
+    model.SetThreadPool(&pool);
+    model.Run(x.data(), y.data(), 16);
+    for (int32_t b=0 ; b<16 ; ++b)
+        CheckTestNetworkOutput(layerSizes, &x[b * inputLength], &y[b * outputLength]);
+
+    double parallelThroughput = MeasureInferencesPerSecond([&]() { model.Run(x.data(), y.data(), 16); }, 16);
+    std::cout << "Native model, batch 16 : " << sequentialThroughput << " inferences/sec on 1 thread, "
+              << parallelThroughput << " on " << pool.GetNumberOfThreads() << " threads" << std::endl;
+    Network::Destroy(net);
+}
+
+// The polynomial and table tiers follow the exact activation functions, one value at a time
+// and swept over a vector, and networks lowered with them match the exact network
+void TestActivationKernels()
+{
+    assert(GetKernelActivation("gelu") == KernelActivationGelu && GetKernelActivation("swish") == -1);
+    std::vector<double> x(2001);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = -40.0 + 0.04 * i;
+    for (int32_t activation=KernelActivationSigmoid ; activation<KernelActivationSoftmax ; ++activation)
+    {
+        const double tolerances[] = { 0.0, 5e-7, 3e-6 };
+        for (int32_t accuracy=KernelAccuracyPolynomial ; accuracy<=KernelAccuracyTable ; ++accuracy)
+        {
+            std::vector<double> y(x);
+            ApplyKernelActivationVector(y.data(), y.size(), activation, accuracy);
+            for (size_t i=0 ; i<x.size() ; ++i)
+            {
+                double exact = ApplyKernelActivation(x[i], activation);
+                double scalar = ApplyKernelActivation(x[i], activation, accuracy);
+                assert(fabs(scalar - exact) <= tolerances[accuracy] * std::max(1.0, fabs(exact)));
+                assert(fabs(y[i] - scalar) <= 1e-12 * std::max(1.0, fabs(exact)));
+            }
+        }
+    }
+    std::vector<double> softmax(x.begin(), x.begin() + 100);
+    ApplyKernelActivationVector(softmax.data(), softmax.size(), KernelActivationSoftmax, KernelAccuracyExact);
+    double sum = 0.0;
+    for (size_t i=0 ; i<softmax.size() ; ++i)
+        sum += softmax[i];
+    assert(fabs(sum - 1.0) < 1e-12 && softmax.back() > softmax.front());
+
+    std::vector<double> values(4096);
+    for (int32_t accuracy=KernelAccuracyExact ; accuracy<=KernelAccuracyTable ; ++accuracy)
+    {
+        double throughput = MeasureInferencesPerSecond([&]() {
+            std::copy(x.begin(), x.begin() + 2000, values.begin());
+            std::copy(x.begin(), x.begin() + 2000, values.begin() + 2000);
+            ApplyKernelActivationVector(values.data(), values.size(), KernelActivationTanh, accuracy);
+        }, values.size());
+        std::cout << "Tanh sweep, accuracy tier " << accuracy << " : " << throughput << " values/sec" << std::endl;
+    }
+
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    std::vector<double> input(layerSizes.front());
+    for (size_t i=0 ; i<input.size() ; ++i)
+        input[i] = (double)rand()/RAND_MAX;
+    std::vector<double> expected(layerSizes.back());
+    std::vector<double> output(layerSizes.back());
+    Interpreter(ConstructIRForNetwork(net)).Run(input.data(), expected.data());
+    for (int32_t denseKernels=0 ; denseKernels<2 ; ++denseKernels)
+    {
+        for (int32_t accuracy=KernelAccuracyPolynomial ; accuracy<=KernelAccuracyTable ; ++accuracy)
+        {
+            LoweringOptions options;
+            options.useDenseKernels = denseKernels != 0;
+            options.activationAccuracy = accuracy;
+            Interpreter(ConstructIRForNetwork(net, options)).Run(input.data(), output.data());
+            for (size_t i=0 ; i<output.size() ; ++i)
+                assert(fabs(expected[i] - output[i]) < 1e-4);
+        }
+    }
+    LoweringOptions options;
+    options.activationAccuracy = KernelAccuracyPolynomial;
+    NativeModel model(CompileTestModel(ConstructIRForNetwork(net, options), "test_activation_model"));
+    model.Run(input.data(), output.data());
+    for (size_t i=0 ; i<output.size() ; ++i)
+        assert(fabs(expected[i] - output[i]) < 1e-6);
+    Network::Destroy(net);
+
+    // Activations created with an explicit tier keep it, even when it is Exact
+    Network& exactNet = ConstructTestNetwork(layerSizes);
+    for (size_t l=1 ; l<layerSizes.size() ; ++l)
+    {
+        Layer& layer = exactNet.GetLayer(static_cast<int32_t>(l));
+        for (int32_t i=0 ; i<layer.GetNumberOfNeurons() ; ++i)
+        {
+            ActivationFunction& activation = dynamic_cast<ActivationFunction&>(layer[i].GetForwardPropagationValue());
+            layer[i].SetForwardPropagationValue(ActivationFunction::Create(activation.GetOperand(), activation.GetName(), KernelAccuracyExact));
+        }
+    }
+    CollectMergeableNeuronsIntoEnsembles(exactNet);
+    for (int32_t denseKernels=0 ; denseKernels<2 ; ++denseKernels)
+    {
+        LoweringOptions exactOptions;
+        exactOptions.useDenseKernels = denseKernels != 0;
+        exactOptions.activationAccuracy = KernelAccuracyTable;
+        Interpreter(ConstructIRForNetwork(exactNet, exactOptions)).Run(input.data(), output.data());
+        for (size_t i=0 ; i<output.size() ; ++i)
+            assert(fabs(expected[i] - output[i]) < 1e-12);
+    }
+    Network::Destroy(exactNet);
+}
+
+// Layers whose neurons share an activation are lowered to a pre-activation pass followed by a
+// VectorActivation, always for softmax and for the others with splitActivations
+void TestSplitActivations()
+{
+    std::vector<int32_t> layerSizes = { 20, 24, 16, 10 };
+    Network& net = Network::Create();
+    for (size_t l=0 ; l<layerSizes.size() ; ++l)
+    {
+        int32_t layerID;
+        Layer& layer = net.AddLayer(layerID);
+        for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+        {
+            int32_t id = 0;
+            if (l == 0)
+            {
+                InputNeuron& neuron = layer.AddInputNeuron(id);
+                neuron.SetForwardPropagationValue(GetInputValue::Create(neuron));
+                continue;
+            }
+            std::vector<double> w(layerSizes[l-1]);
+            for (int32_t j=0 ; j<layerSizes[l-1] ; ++j)
+                w[j] = GetTestWeight(layerID, i, j);
+            Neuron& neuron = l + 1 == layerSizes.size() ? layer.AddOutputNeuron(id) : layer.AddNeuron(id);
+            Value& sum = Reduction::Create(Constant(w) * GetInputValue::Create(neuron), Reduction::Sum) + Constant(GetTestBias(layerID, i));
+            const char* name = l == 1 ? "gelu" : (l == 2 ? (i % 2 == 0 ? "sigmoid" : "tanh") : "softmax");
+            neuron.SetForwardPropagationValue(ActivationFunction::Create(sum, name));
+        }
+        if (l > 0)
+            net.FullyConnectLayers(layerID - 1, layerID);
+    }
+    CollectMergeableNeuronsIntoEnsembles(net);
+
+    const int32_t batchSize = 3;
+    std::vector<double> x(batchSize * layerSizes.front());
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> expected;
+    for (int32_t b=0 ; b<batchSize ; ++b)
+    {
+        std::vector<double> values(&x[b * layerSizes.front()], &x[(b + 1) * layerSizes.front()]);
+        for (size_t l=1 ; l<layerSizes.size() ; ++l)
+        {
+            std::vector<double> next(layerSizes[l]);
+            double total = 0.0;
+            for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+            {
+                double sum = GetTestBias(l, i);
+                for (int32_t j=0 ; j<layerSizes[l-1] ; ++j)
+                    sum += GetTestWeight(l, i, j) * values[j];
+                if (l == 1)
+                    next[i] = 0.5 * sum * (1.0 + erf(sum / sqrt(2.0)));
+                else if (l == 2)
+                    next[i] = i % 2 == 0 ? 1.0 / (1.0 + exp(-sum)) : tanh(sum);
+                else
+                    total += next[i] = exp(sum);
+            }
+            if (l == 3)
+            {
+                for (int32_t i=0 ; i<layerSizes[l] ; ++i)
+                    next[i] /= total;
+            }
+            values = next;
+        }
+        expected.insert(expected.end(), values.begin(), values.end());
+    }
+
+    std::vector<double> y(expected.size());
+    for (int32_t split=0 ; split<2 ; ++split)
+    {
+        for (int32_t denseKernels=0 ; denseKernels<2 ; ++denseKernels)
+        {
+            LoweringOptions options;
+            options.batchSize = LoweringOptions::RuntimeBatchSize;
+            options.splitActivations = split != 0;
+            options.useDenseKernels = denseKernels != 0;
+            Function& func = ConstructIRForNetwork(net, options);
+            int32_t numActivations = 0;
+            const std::list<IRStatement*>& stms = func.GetStatementList();
+            for (std::list<IRStatement*>::const_iterator iter=stms.begin() ; iter!=stms.end() ; ++iter)
+                numActivations += dynamic_cast<VectorActivation*>(*iter) != nullptr ? 1 : 0;
+            // The mixed sigmoid and tanh layer keeps its activations in the ensemble loops
+            assert(numActivations == (split ? 2 : 1));
+
+            std::fill(y.begin(), y.end(), 0.0);
+            Interpreter(func).Run(x.data(), y.data(), batchSize);
+            for (size_t i=0 ; i<y.size() ; ++i)
+                assert(fabs(expected[i] - y[i]) < 1e-9);
+            if (split && denseKernels)
+            {
+                NativeModel model(CompileTestModel(func, "test_split_model"));
+                std::fill(y.begin(), y.end(), 0.0);
+                model.Run(x.data(), y.data(), batchSize);
+                for (size_t i=0 ; i<y.size() ; ++i)
+                    assert(fabs(expected[i] - y[i]) < 1e-9);
+            }
+        }
+    }
+    Network::Destroy(net);
+}
+
+// Real types join to the wider precision, and networks whose weights are stored at a lower
+// precision or whose dense kernels accumulate in float stay close to the double results
+void TestMixedPrecision()
+{
+    RealType& float64 = RealType::Get();
+    RealType& float32 = RealType::Get(RealType::Float32);
+    RealType& float16 = RealType::Get(RealType::Float16);
+    RealType& bfloat16 = RealType::Get(RealType::BFloat16);
+    Variable& half = Variable::Create("half", float16);
+    Variable& brain = Variable::Create("brain", bfloat16);
+    Variable& single = Variable::Create("single", float32);
+    Variable& vec = Variable::Create("vec", VectorType::Get(float16, 8));
+    assert(&BinaryAdd::Create(half, brain).GetType() == &float32);
+    assert(&BinaryMultiply::Create(single, Constant(1.0)).GetType() == &float64);
+    assert(&BinaryMultiply::Create(half, Constant(2)).GetType() == &float16);
+    assert(&BinaryMultiply::Create(vec, single).GetType() == &VectorType::Get(float32, 8));
+    assert(&GetTypeWithPrecision(VectorType::Get(float64, 8), RealType::Float16) == &vec.GetType());
+
+    // Every finite half converts to float and back unchanged, rounding is to nearest even
+    for (uint32_t bits=0 ; bits<0x10000 ; ++bits)
+    {
+        if ((bits & 0x7c00) != 0x7c00)
+            assert(KernelFloatToFloat16(KernelFloat16ToFloat(static_cast<uint16_t>(bits))) == bits);
+    }
+    assert(KernelFloatToFloat16(1.0f) == 0x3c00 && KernelFloatToFloat16(65504.0f) == 0x7bff && KernelFloatToFloat16(65520.0f) == 0x7c00);
+    assert(KernelFloatToFloat16(1.0f + 1.0f / 2048) == 0x3c00 && KernelFloatToFloat16(1.0f + 3.0f / 2048) == 0x3c02);
+    assert(KernelFloatToBFloat16(1.0f) == 0x3f80 && KernelBFloat16ToFloat(KernelFloatToBFloat16(-2.5f)) == -2.5f);
+
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    int32_t outputLength = layerSizes.back();
+    const int32_t batchSize = 32;
+    std::vector<double> x(batchSize * inputLength);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = (double)rand()/RAND_MAX;
+    std::vector<double> expected;
+    for (int32_t b=0 ; b<batchSize ; ++b)
+    {
+        std::vector<double> output = ComputeTestNetworkOutput(layerSizes, &x[b * inputLength]);
+        expected.insert(expected.end(), output.begin(), output.end());
+    }
+
+    const RealType::Precision precisions[] = { RealType::Float32, RealType::Float16, RealType::BFloat16 };
+    const double tolerances[] = { 1e-6, 2e-3, 2e-2 };
+    std::vector<double> y(batchSize * outputLength);
+    for (int32_t p=0 ; p<3 ; ++p)
+    {
+        for (int32_t denseKernels=0 ; denseKernels<2 ; ++denseKernels)
+        {
+            LoweringOptions options;
+            options.batchSize = LoweringOptions::RuntimeBatchSize;
+            options.useDenseKernels = denseKernels != 0;
+            options.weightPrecision = precisions[p];
+            options.accumulatePrecision = denseKernels ? RealType::Float32 : RealType::Float64;
+            Interpreter(ConstructIRForNetwork(net, options)).Run(x.data(), y.data(), batchSize);
+            for (size_t i=0 ; i<y.size() ; ++i)
+                assert(fabs(expected[i] - y[i]) < tolerances[p]);
+        }
+    }
+
+    LoweringOptions options;
+    options.batchSize = LoweringOptions::RuntimeBatchSize;
+    options.weightPrecision = RealType::Float16;
+    options.accumulatePrecision = RealType::Float32;
+    Function& func = ConstructIRForNetwork(net, options);
+    std::vector<double> interpreted(y.size());
+    Interpreter(func).Run(x.data(), interpreted.data(), batchSize);
+    NativeModel model(CompileTestModel(func, "test_precision_model"));
+    model.Run(x.data(), y.data(), batchSize);
+    for (size_t i=0 ; i<y.size() ; ++i)
+        assert(fabs(interpreted[i] - y[i]) < 1e-6);
+
+    double throughput = MeasureInferencesPerSecond([&]() { model.Run(x.data(), y.data(), batchSize); }, batchSize);
+    std::cout << "Native model, float16 weights, float accumulators, batch 32 : " << throughput << " inferences/sec" << std::endl;
+    Network::Destroy(net);
+}
+
+// Int8 weights are within half a step of the real weights, the integer kernel computes exactly
+// the dot products of the dequantized weights and inputs, and a calibrated network stays close to
+// the real one
+void TestQuantization()
+{
+    const int32_t numNeurons = 6;
+    const int32_t numInputs = 37;
+    ValueSet& weights = *(new ValueSet(0, VectorType::Get(RealType::Get(), numInputs)));
+    ValueSet& biases = *(new ValueSet(1, RealType::Get()));
+    std::vector<std::vector<double> > real(numNeurons, std::vector<double>(numInputs));
+    for (int32_t n=0 ; n<numNeurons ; ++n)
+    {
+        for (int32_t k=0 ; k<numInputs ; ++k)
+            real[n][k] = n == 0 ? 0.25 * k : (double)rand()/RAND_MAX * n - 0.3 * n;
+        weights.AddValue(RealVectorConstant::Create(real[n]));
+        biases.AddValue(RealConstant::Create(0.1 * n));
+    }
+    weights.Quantize();
+    assert(weights.IsQuantized() && weights.GetScales().size() == numNeurons);
+    for (int32_t n=0 ; n<numNeurons ; ++n)
+    {
+        int32_t sum = 0;
+        for (int32_t k=0 ; k<numInputs ; ++k)
+        {
+            assert(fabs(weights.GetScalar(n, k) - real[n][k]) <= 0.5 * weights.GetScales()[n] + 1e-12);
+            sum += static_cast<const int8_t*>(weights.GetData())[n * numInputs + k];
+        }
+        assert(sum == weights.GetQuantizedSums()[n]);
+    }
+    // All weights of neuron 0 are positive, zero stays exact
+    assert(weights.GetZeroPoints()[0] == -128 && weights.GetScalar(0, 0) == 0.0);
+
+    const int32_t batchSize = 5;
+    std::vector<double> x(batchSize * numInputs);
+    for (size_t i=0 ; i<x.size() ; ++i)
+        x[i] = 2.0 * rand() / RAND_MAX - 0.5;
+    KernelQuantization inputQuantization = GetKernelQuantization(-0.5, 1.0);
+    std::vector<double> expected(batchSize * numNeurons);
+    for (int32_t b=0 ; b<batchSize ; ++b)
+    {
+        for (int32_t n=0 ; n<numNeurons ; ++n)
+        {
+            double sum = biases.GetScalar(n, 0);
+            for (int32_t k=0 ; k<numInputs ; ++k)
+            {
+                int8_t q = KernelQuantize(x[b * numInputs + k], inputQuantization.scale, inputQuantization.zeroPoint);
+                sum += weights.GetScalar(n, k) * inputQuantization.scale * (q - inputQuantization.zeroPoint);
+            }
+            expected[b * numNeurons + n] = ApplyKernelActivation(sum, KernelActivationTanh);
+        }
+    }
+    for (int32_t layout=0 ; layout<2 ; ++layout)
+    {
+        weights.SetLayout(layout ? ValueSet::Transposed : ValueSet::RowMajor);
+        std::vector<double> y(expected.size());
+        QuantizedDenseLayerForward(static_cast<const int8_t*>(weights.GetData()), weights.GetValueStride(), weights.GetScalarStride(),
+                                   weights.GetScales().data(), weights.GetZeroPoints().data(), weights.GetQuantizedSums().data(),
+                                   static_cast<const double*>(biases.GetData()), numNeurons, numInputs, inputQuantization.scale,
+                                   inputQuantization.zeroPoint, x.data(), numInputs, y.data(), numNeurons, batchSize,
+                                   KernelActivationTanh, KernelAccuracyExact);
+        for (size_t i=0 ; i<y.size() ; ++i)
+            assert(fabs(expected[i] - y[i]) < 1e-12);
+    }
+    ArenaObject::Release(&weights);
+    ArenaObject::Release(&biases);
+
+    std::vector<int32_t> layerSizes = { 64, 128, 32 };
+    Network& net = ConstructTestNetwork(layerSizes);
+    CollectMergeableNeuronsIntoEnsembles(net);
+    int32_t inputLength = layerSizes.front();
+    const int32_t numSamples = 64;
+    std::vector<double> samples(numSamples * inputLength);
+    for (size_t i=0 ; i<samples.size() ; ++i)
+        samples[i] = (double)rand()/RAND_MAX;
+    QuantizationCalibration calibration = CalibrateQuantization(net, samples.data(), numSamples);
+    assert(calibration.minimums.size() == 3 && calibration.minimums[0] >= 0.0 && calibration.maximums[0] <= 1.0);
+    assert(calibration.minimums[1] > 0.0 && calibration.maximums[1] < 1.0);
+
+    LoweringOptions options;
+    options.batchSize = LoweringOptions::RuntimeBatchSize;
+    options.quantization = &calibration;
+    Function& func = ConstructIRForNetwork(net, options);
+    int32_t quantizedLayers = 0;
+    for (auto iter=func.GetStatementList().begin() ; iter!=func.GetStatementList().end() ; ++iter)
+    {
+        DenseLayer* denseLayer = dynamic_cast<DenseLayer*>(*iter);
+        quantizedLayers += denseLayer != nullptr && denseLayer->IsQuantized();
+    }
+    assert(quantizedLayers == 2);
+
+    QuantizationReport report = CompareQuantizedNetwork(net, options, samples.data(), numSamples);
+    PrintQuantizationReport(report, std::cout);
+    assert(report.numSamples == numSamples && report.maxAbsoluteError < 0.02 && report.argmaxAgreement >= 0.9);
+
+    std::vector<double> y(numSamples * layerSizes.back());
+    std::vector<double> interpreted(y.size());
+    Interpreter(func).Run(samples.data(), interpreted.data(), numSamples);
+    NativeModel model(CompileTestModel(func, "test_quantized_model"));
+    model.Run(samples.data(), y.data(), numSamples);
+    for (size_t i=0 ; i<y.size() ; ++i)
+        assert(fabs(interpreted[i] - y[i]) < 1e-9);
+
+    double throughput = MeasureInferencesPerSecond([&]() { model.Run(samples.data(), y.data(), 32); }, 32);
+    std::cout << "Native model, int8 weights, batch 32 : " << throughput << " inferences/sec" << std::endl;
+    Network::Destroy(net);
+}
+
 int main()
 {
 	ConstructSimpleThreeLayerNet(4);
+    TestConnections();
+    TestInterpreter();
+    TestNativeModel();
+    TestBatchedInference();
+    TestInterleavedEnsembles();
+    TestValueNumbering();
+    TestSharedInputsAcrossLayers();
+    TestValueSimplification();
+    TestArenaLowering();
+    TestWorkspacePlan();
+    TestLoopOptimizations();
+    TestLoopFusion();
+    TestLoopTransforms();
+    TestVectorKernels();
+    TestActivationKernels();
+    TestSplitActivations();
+    TestMixedPrecision();
+    TestQuantization();
+    TestParallelInference();
+    RemoveTestModels();
     // TestConvolutionalNet(5, 3);
     // TestValueComparison();
     // TestIRValuesAndStatements();
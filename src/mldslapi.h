@@ -9,5 +9,6 @@
 #include "layer.h"
 #include "network.h"
 #include "ir.h"
+#include "interpreter.h"
 
 #endif // _MLDSLAPI_H_
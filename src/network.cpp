@@ -1,46 +1,41 @@
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include "valuetype.h"
 #include "value.h"
 #include "neuronproperty.h"
 #include "neuron.h"
 #include "layer.h"
+#include "connection.h"
 #include "network.h"
 
 Network::~Network()
 {
+    for (size_t i=0 ; i<m_connections.size() ; ++i)
+        delete m_connections[i];
     for (size_t i=0 ; i<m_layers.size() ; ++i)
         delete m_layers[i];
 }
 
+void Network::AddConnection(Connection& connection)
+{
+    m_connections.push_back(&connection);
+    connection.GetSourceLayer().m_outputConnections.push_back(&connection);
+    connection.GetSinkLayer().m_inputConnections.push_back(&connection);
+}
+
 Layer& Network::AddLayer(int32_t& layerID)
 {
     layerID = static_cast<int32_t>(m_layers.size());
-    Layer *newLayer = new Layer;
+    Layer *newLayer = new Layer(layerID);
     m_layers.push_back(newLayer);
     return *newLayer;
 }
 
 void Network::ConnectLayers(int32_t sourceLayerID, int32_t sinkLayerID, std::map<int32_t, std::vector<int32_t>>& connections)
 {
-    Layer& sourceLayer = GetLayer(sourceLayerID);
-    Layer& sinkLayer = GetLayer(sinkLayerID);
-
-    for (int32_t sinkNeuronIndex=0 ; sinkNeuronIndex<sinkLayer.GetNumberOfNeurons() ; ++sinkNeuronIndex)
-    {
-        std::map<int32_t, std::vector<int32_t>>::iterator iter = connections.find(sinkNeuronIndex);
-        if (iter == connections.end())
-        {
-            throw std::runtime_error("Connections for all neurons in sink layer not specified by the connection map");
-        }
-        Neuron& sinkNeuron = sinkLayer.GetNeuron(sinkNeuronIndex);
-        std::vector<int32_t>& sourceNeuronIndices = iter->second;
-        for (size_t i=0; i<sourceNeuronIndices.size() ; ++i)
-        {
-            ConnectNeurons(sourceLayer.GetNeuron(sourceNeuronIndices[i]), sinkNeuron);
-        }
-    }
+    AddConnection(SparseConnection::Create(GetLayer(sourceLayerID), GetLayer(sinkLayerID), connections));
 }
 
 bool Network::CheckTypes()
@@ -67,29 +62,12 @@ bool Network::CheckTypes()
 
 void Network::FullyConnectLayers(int32_t sourceLayer, int32_t sinkLayer)
 {
-    Layer& sourceLayerRef = GetLayer(sourceLayer);
-    Layer& sinkLayerRef = GetLayer(sinkLayer);
-    for (int32_t i=0 ; i<sinkLayerRef.GetNumberOfNeurons() ; ++i)
-    {
-        Neuron& sinkNeuron = sinkLayerRef.GetNeuron(i);
-        for (int32_t j=0; j<sourceLayerRef.GetNumberOfNeurons() ; ++j)
-            ConnectNeurons(sourceLayerRef.GetNeuron(j), sinkNeuron);
-    }
+    AddConnection(DenseConnection::Create(GetLayer(sourceLayer), GetLayer(sinkLayer)));
 }
 
-void Network::ConnectConvolutionalLayer(int32_t sourceLayer, int32_t sinkLayer, int32_t sourceLayerStartNeuron, int32_t blockSize)
+void Network::ConnectConvolutionalLayer(int32_t sourceLayer, int32_t sinkLayer, int32_t sourceLayerStartNeuron, int32_t blockSize, int32_t blockStride)
 {
-    Layer& sourceLayerRef = GetLayer(sourceLayer);
-    Layer& sinkLayerRef = GetLayer(sinkLayer);
-    int32_t currBlockStart = sourceLayerStartNeuron;
-    for (int32_t i=0 ; i<sinkLayerRef.GetNumberOfNeurons() ; ++i)
-    {
-        Neuron& sinkNeuron = sinkLayerRef.GetNeuron(i);
-        for (int32_t j=currBlockStart; j<currBlockStart + blockSize ; ++j)
-            ConnectNeurons(sourceLayerRef.GetNeuron(j), sinkNeuron);
-
-        currBlockStart += 1;
-    }
+    AddConnection(ConvolutionalConnection::Create(GetLayer(sourceLayer), GetLayer(sinkLayer), sourceLayerStartNeuron, blockSize, blockStride));
 }
 
 Network& Network::Create()
@@ -102,20 +80,73 @@ void Network::Destroy(Network& network)
     delete &network;
 }
 
+// Rewrites that depend on the values of constants are only applied to a group of structurally
+// identical neurons when they apply to all of them, so that the group can still form an ensemble
+// (a neuron whose bias happens to be 0 keeps its addition when the other neurons have one).
+void SimplifyNetworkValues(Network& network)
+{
+    for (int32_t i=0 ; i<network.GetNumberOfLayers() ; ++i)
+    {
+        Layer& layer = network.GetLayer(i);
+        int32_t numNeurons = layer.GetNumberOfNeurons();
+        std::vector<Value*> folded(numNeurons);
+        std::vector<Value*> simplified(numNeurons);
+        bool valueIdentitiesApplicable = false;
+        for (int32_t j=0 ; j<numNeurons ; ++j)
+        {
+            bool applicable = false;
+            folded[j] = &SimplifyValue(layer.GetNeuron(j).GetForwardPropagationValue(), false, &applicable);
+            simplified[j] = applicable ? &SimplifyValue(*folded[j]) : folded[j];
+            valueIdentitiesApplicable = valueIdentitiesApplicable || applicable;
+        }
+        if (!valueIdentitiesApplicable)
+        {
+            for (int32_t j=0 ; j<numNeurons ; ++j)
+                layer.GetNeuron(j).SetForwardPropagationValue(*folded[j]);
+            continue;
+        }
+
+        // Groups of structurally identical neurons, by hash
+        std::unordered_map<size_t, std::vector<std::vector<int32_t> > > groups;
+        for (int32_t j=0 ; j<numNeurons ; ++j)
+        {
+            std::vector<std::vector<int32_t> >& bucket = groups[GetStructuralHash(*folded[j])];
+            size_t k = 0;
+            while (k < bucket.size() && !AreValuesStructurallyIdentical(*folded[bucket[k].front()], *folded[j]))
+                ++k;
+            if (k == bucket.size())
+                bucket.push_back(std::vector<int32_t>());
+            bucket[k].push_back(j);
+        }
+        for (auto bucket=groups.begin() ; bucket!=groups.end() ; ++bucket)
+        {
+            for (size_t k=0 ; k<bucket->second.size() ; ++k)
+            {
+                std::vector<int32_t>& group = bucket->second[k];
+                bool uniform = true;
+                for (size_t n=1 ; n<group.size() && uniform ; ++n)
+                    uniform = AreValuesStructurallyIdentical(*simplified[group.front()], *simplified[group[n]]);
+                for (size_t n=0 ; n<group.size() ; ++n)
+                    layer.GetNeuron(group[n]).SetForwardPropagationValue(uniform ? *simplified[group[n]] : *folded[group[n]]);
+            }
+        }
+    }
+}
+
 class NetworkPrintVisitor : public NetworkVisitor
 {
     std::ostream& m_ostr;
     int32_t m_indent = 0;
     void PrintSourceNeurons(Neuron& neuron)
     {
-        NeuronList& sources = neuron.GetSources();
+        ConnectedNeurons sources = neuron.GetSources();
         Indent();
         m_ostr << "<sources>" << std::endl;
         m_indent++;
         for (int32_t i=0 ; i<sources.size() ; ++i)
         {
             Indent();
-            m_ostr << "<id>" << sources[i]->GetLayer().GetNeuronID(*sources[i]) << "</id>\n";
+            m_ostr << "<id>" << sources[i]->GetNeuronID() << "</id>\n";
         }
         m_indent--;
         Indent();
@@ -123,14 +154,14 @@ class NetworkPrintVisitor : public NetworkVisitor
     }
     void PrintSinkNeurons(Neuron& neuron)
     {
-        NeuronList& sinks = neuron.GetSinks();
+        ConnectedNeurons sinks = neuron.GetSinks();
         Indent();
         m_indent++;
         m_ostr << "<sinks>" << std::endl;
         for (int32_t i=0 ; i<sinks.size() ; ++i)
         {
             Indent();
-            m_ostr << "<id>" << sinks[i]->GetLayer().GetNeuronID(*sinks[i]) << "</id>\n";
+            m_ostr << "<id>" << sinks[i]->GetNeuronID() << "</id>\n";
         }
         m_indent--;
         Indent();
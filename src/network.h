@@ -6,10 +6,13 @@
 #include "networkvisitor.h"
 
 class Layer;
+class Connection;
 
 class Network
 {
     std::vector<Layer*> m_layers;
+    std::vector<Connection*> m_connections;
+    void AddConnection(Connection& connection);
 public:
     Network() { }
     ~Network();
@@ -23,7 +26,8 @@ public:
     void ConnectLayers(int32_t sourceLayer, int32_t sinkLayer, std::map<int32_t, std::vector<int32_t>>& connections);
     void FullyConnectLayers(int32_t sourceLayer, int32_t sinkLayer);
     // TODO is this the right API for a convolutional layer?
-    void ConnectConvolutionalLayer(int32_t sourceLayer, int32_t sinkLayer, int32_t sourceLayerStartNeuron, int32_t blockSize);
+    // Sink neuron i reads the blockSize source neurons starting at sourceLayerStartNeuron + i * blockStride
+    void ConnectConvolutionalLayer(int32_t sourceLayer, int32_t sinkLayer, int32_t sourceLayerStartNeuron, int32_t blockSize, int32_t blockStride = 1);
     bool CheckTypes();
 
     virtual void AcceptVisitor(NetworkVisitor& visitor) { visitor.Visit(*this); }
@@ -33,6 +37,9 @@ public:
 };
 
 void PrintNetwork(Network& network, std::ostream& ostr);
+// Simplifies the forward propagation values of all neurons (see SimplifyValue)
+void SimplifyNetworkValues(Network& network);
+// Simplifies the network's values and groups neurons computing the same function into ensembles
 void CollectMergeableNeuronsIntoEnsembles(Network& network);
 
 #endif // _NETWORK_H_
@@ -4,6 +4,7 @@
 #include "neuronproperty.h"
 #include "neuron.h"
 #include "layer.h"
+#include "connection.h"
 #include <limits>
 
 /*
@@ -22,10 +23,9 @@ int32_t Neuron::AddVectorDoubleNeuronProperty(std::vector<double>& val)
 }
 */
 
-int32_t Neuron::GetNeuronID()
-{
-    return m_layer.GetNeuronID(*this);
-}
+Neuron::Neuron(Layer &layer, int32_t neuronID)
+    :m_layer(layer), m_layerID(layer.GetLayerID()), m_neuronID(neuronID), m_forwardValue(nullptr), m_ensemble(nullptr)
+{ }
 
 void Neuron::CheckTypes()
 {
@@ -37,16 +37,45 @@ void Neuron::CheckTypes()
         throw std::runtime_error("Neuron output must be scalar");
 }
 
-void ConnectNeurons(Neuron& src, Neuron& sink)
+size_t ConnectedNeurons::size()
 {
-    if (dynamic_cast<OutputNeuron*>(&src) != nullptr)
-        throw std::runtime_error("An output neuron cannot be a source");
+    Layer& layer = m_neuron.GetLayer();
+    std::vector<Connection*>& connections = m_sources ? layer.GetInputConnections() : layer.GetOutputConnections();
+    size_t count = 0;
+    for (size_t i=0 ; i<connections.size() ; ++i)
+    {
+        if (m_sources)
+            count += connections[i]->GetNumberOfSources(m_neuron.GetNeuronID());
+        else
+            count += connections[i]->GetNumberOfSinks(m_neuron.GetNeuronID());
+    }
+    return count;
+}
 
-    if (dynamic_cast<InputNeuron*>(&sink) != nullptr)
-        throw std::runtime_error("An input neuron cannot be a sink");
+Neuron* ConnectedNeurons::operator[](size_t index)
+{
+    Layer& layer = m_neuron.GetLayer();
+    std::vector<Connection*>& connections = m_sources ? layer.GetInputConnections() : layer.GetOutputConnections();
+    int32_t neuronID = m_neuron.GetNeuronID();
+    for (size_t i=0 ; i<connections.size() ; ++i)
+    {
+        Connection& connection = *connections[i];
+        size_t count = m_sources ? connection.GetNumberOfSources(neuronID) : connection.GetNumberOfSinks(neuronID);
+        if (index < count)
+        {
+            if (m_sources)
+                return &connection.GetSourceLayer().GetNeuron(connection.GetSourceID(neuronID, static_cast<int32_t>(index)));
+            return &connection.GetSinkLayer().GetNeuron(connection.GetSinkID(neuronID, static_cast<int32_t>(index)));
+        }
+        index -= count;
+    }
+    throw std::runtime_error("Connected neuron index out of range");
+}
 
-    src.AddSink(sink);
-    sink.AddSource(src);
+bool Neuron::GetAffineSources(int32_t& first, int32_t& stride)
+{
+    std::vector<Connection*>& connections = m_layer.GetInputConnections();
+    return connections.size() == 1 && connections.front()->GetAffineSources(m_neuronID, first, stride);
 }
 
 bool AreNeuronsMergeable(Neuron& n1, Neuron& n2)
@@ -54,22 +83,28 @@ bool AreNeuronsMergeable(Neuron& n1, Neuron& n2)
     bool mergeable = AreValuesStructurallyIdentical(n1.GetForwardPropagationValue(), n2.GetForwardPropagationValue());
     if (!mergeable) return false;
 
-    NeuronList& inputList1 = n1.GetSources();
-    NeuronList& inputList2 = n2.GetSources();
+    ConnectedNeurons inputList1 = n1.GetSources();
+    ConnectedNeurons inputList2 = n2.GetSources();
     
     // Since we already checked that the neurons have structurally identically forward propagation values, we expect the
     // number of inputs to be the same.
-    if (inputList1.size() != inputList2.size())
+    size_t numInputs = inputList1.size();
+    if (numInputs != inputList2.size())
         throw std::runtime_error("Expected input list lengths to be equal!");
+
+    // Affine ranges with the same stride have the same pattern without looking at every input
+    int32_t first1, stride1, first2, stride2;
+    if (n1.GetAffineSources(first1, stride1) && n2.GetAffineSources(first2, stride2))
+        return numInputs < 2 || stride1 == stride2;
     
     // The difference between the index of every neuron in each input list and the index of the first neuron 
     // in that list must be pairwise equal for all input neurons for the two argument neurons to be mergeable.
     // This is essentially saying that the input neurons have the same "pattern" relative to the first input.
     // Three neurons are mergeable if they are pairwise mergeable (transitivity holds).
-    for (NeuronList::iterator iter1=inputList1.begin(), iter2=inputList2.begin() ; iter1!=inputList1.end() ; ++iter1, ++iter2)
+    for (size_t i=0 ; i<numInputs ; ++i)
     {
-        int32_t difference1 = (*iter1)->GetNeuronID() - (*inputList1.begin())->GetNeuronID();
-        int32_t difference2 = (*iter2)->GetNeuronID() - (*inputList2.begin())->GetNeuronID();
+        int32_t difference1 = inputList1[i]->GetNeuronID() - inputList1.front()->GetNeuronID();
+        int32_t difference2 = inputList2[i]->GetNeuronID() - inputList2.front()->GetNeuronID();
         if (difference1 != difference2)
             return false;
     }
@@ -4,6 +4,7 @@
 #include <vector>
 #include <list>
 #include <cstdint>
+#include <cstddef>
 #include "networkvisitor.h"
 
 class Layer;
@@ -15,6 +16,23 @@ class Ensemble;
 
 typedef std::vector<Neuron*> NeuronList;
 
+// The sources or the sinks of a neuron. They are computed from the connections of
+// the neuron's layer (see connection.h) when accessed, so the view is cheap to copy
+// but each access costs a lookup.
+class ConnectedNeurons
+{
+    Neuron& m_neuron;
+    bool m_sources;
+public:
+    ConnectedNeurons(Neuron& neuron, bool sources)
+        :m_neuron(neuron), m_sources(sources)
+    { }
+    size_t size();
+    bool empty() { return size() == 0; }
+    Neuron* operator[](size_t index);
+    Neuron* front() { return (*this)[0]; }
+};
+
 // Neuron needs to have a forward propagation function specified in our IR
 // Specialized neuron types like weighted neuron will automatically be 
 // decomposed into the IR by the compiler. Users are responsible for providing
@@ -37,7 +55,6 @@ class Neuron
 {
 	friend class Layer;
 	friend class Ensemble;
-    friend void ConnectNeurons(Neuron& src, Neuron& sink);
 public:
 
 	// int32_t AddScalarDoubleNeuronProperty(double val);
@@ -48,11 +65,17 @@ public:
     void SetForwardPropagationValue(Value& value) { m_forwardValue = &value; }
     Value& GetForwardPropagationValue() { return *m_forwardValue; }
 
-    NeuronList& GetSources() { return m_sources; }
-    NeuronList& GetSinks() { return m_sinks; }
+    ConnectedNeurons GetSources() { return ConnectedNeurons(*this, true); }
+    ConnectedNeurons GetSinks() { return ConnectedNeurons(*this, false); }
 
-    int32_t GetNumInputs() { return m_sources.size(); }
-    int32_t GetNeuronID();
+    int32_t GetNumInputs() { return static_cast<int32_t>(GetSources().size()); }
+    // True when the neuron reads from a single connection which gives its source IDs
+    // as first, first + stride, first + 2*stride, ...
+    bool GetAffineSources(int32_t& first, int32_t& stride);
+    // Index of the neuron in its layer
+    int32_t GetNeuronID() { return m_neuronID; }
+    // Index of the neuron's layer in the network
+    int32_t GetLayerID() { return m_layerID; }
 
     Layer& GetLayer() { return m_layer; }
     Ensemble* GetEnsemble() { return m_ensemble; }
@@ -66,33 +89,26 @@ public:
 protected:
 	// The layer that this neuron belongs to
 	Layer &m_layer;
+    int32_t m_layerID;
+    int32_t m_neuronID;
 
 	// Represents the expression used to compute the output value
     // of a neuron
     Value* m_forwardValue;
 
-	NeuronList m_sources;
-	NeuronList m_sinks;
-
 	std::vector<NeuronProperty*> m_properties;
 
     Ensemble *m_ensemble;
 
     void SetEnsemble(Ensemble *e) { m_ensemble = e; }
 
-	Neuron(Layer &layer) 
-		:m_layer(layer), m_forwardValue(nullptr), m_ensemble(nullptr)
-   	{ }
-
-	void AddSource(Neuron& src) { m_sources.push_back(&src); }
-	void AddSink(Neuron& sink) { m_sinks.push_back(&sink); }
+	Neuron(Layer &layer, int32_t neuronID);
 };
 
 // TODO Not all functions that are on neuron make sense for input and output neurons. We need to refactor
 class InputNeuron : public Neuron
 {
     friend class Layer;
-    friend void ConnectNeurons(Neuron& src, Neuron& sink);
 public:
     int32_t GetIndex() { return m_index; }
     virtual void CheckTypes() { } // Input neurons will always have a real scalar output
@@ -100,25 +116,23 @@ public:
 protected:
     int32_t m_index;
     InputNeuron(Layer& layer, int32_t index)
-        :Neuron(layer), m_index(index)
+        :Neuron(layer, index), m_index(index)
     { }
 };
 
 class OutputNeuron : public Neuron
 {
     friend class Layer;
-    friend void ConnectNeurons(Neuron& src, Neuron& sink);
 public:
     int32_t GetIndex() { return m_index; }
     virtual void AcceptVisitor(NetworkVisitor& visitor) { visitor.Visit(*this); }
 protected:
     int32_t m_index;
     OutputNeuron(Layer& layer, int32_t index)
-        :Neuron(layer), m_index(index)
+        :Neuron(layer, index), m_index(index)
     { }
 };
 
-void ConnectNeurons(Neuron& src, Neuron& sink);
 bool AreNeuronsMergeable(Neuron& n1, Neuron& n2);
 
 #endif // _NEURON_H_
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <list>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+#include "arena.h"
+#include "ir.h"
+#include "interpreter.h"
+#include "neuron.h"
+#include "layer.h"
+#include "network.h"
+
+// Post-training quantization of the dense layers. The weights are quantized per neuron
+// when the network is lowered. The inputs of a layer are quantized with the range of the
+// previous layer, which is calibrated by running the unquantized network on sample inputs.
+
+// Lowered functions and their value sets only live as long as the arena of the calling function
+static Function& LowerWithRuntimeBatchSize(Network& network, const LoweringOptions& options)
+{
+    LoweringOptions batchOptions = options;
+    batchOptions.batchSize = LoweringOptions::RuntimeBatchSize;
+    return ConstructIRForNetwork(network, batchOptions);
+}
+
+static void UpdateRange(const double* values, int64_t length, double& minimum, double& maximum)
+{
+    for (int64_t i=0 ; i<length ; ++i)
+    {
+        minimum = std::min(minimum, values[i]);
+        maximum = std::max(maximum, values[i]);
+    }
+}
+
+QuantizationCalibration CalibrateQuantization(Network& network, const double* samples, int32_t numSamples)
+{
+    if (numSamples < 1)
+        throw std::runtime_error("CalibrateQuantization : Expected at least one sample");
+    int32_t numLayers = network.GetNumberOfLayers();
+    QuantizationCalibration calibration;
+    calibration.minimums.assign(numLayers, std::numeric_limits<double>::infinity());
+    calibration.maximums.assign(numLayers, -std::numeric_limits<double>::infinity());
+
+    Arena arena;
+    Function* function;
+    {
+        ArenaScope scope(arena);
+        function = &LowerWithRuntimeBatchSize(network, LoweringOptions());
+    }
+    // The outputs of every layer but the last are top level variables, the last writes the output
+    std::vector<Variable*> layerVariables(numLayers - 1, nullptr);
+    const std::list<IRStatement*>& stms = function->GetStatementList();
+    for (auto iter=stms.begin() ; iter!=stms.end() ; ++iter)
+    {
+        VariableDefinition* definition = dynamic_cast<VariableDefinition*>(*iter);
+        for (int32_t i=0 ; definition != nullptr && i<numLayers - 1 ; ++i)
+        {
+            if (definition->GetVariable().GetName() == ConstructLayerOutputName(i))
+                layerVariables[i] = &definition->GetVariable();
+        }
+    }
+    Interpreter interpreter(*function);
+    for (int32_t i=0 ; i<numLayers - 1 ; ++i)
+    {
+        if (layerVariables[i] == nullptr)
+            throw std::runtime_error("CalibrateQuantization : Missing the output variable of a layer");
+        interpreter.KeepVariable(*layerVariables[i]);
+    }
+    std::vector<double> output(static_cast<size_t>(numSamples) * interpreter.GetOutputLength());
+    interpreter.Run(samples, output.data(), numSamples);
+    for (int32_t i=0 ; i<numLayers ; ++i)
+    {
+        int64_t length = static_cast<int64_t>(network.GetLayer(i).GetNumberOfNeurons()) * numSamples;
+        const double* values = i < numLayers - 1 ? interpreter.GetValues(*layerVariables[i]) : output.data();
+        UpdateRange(values, length, calibration.minimums[i], calibration.maximums[i]);
+    }
+    return calibration;
+}
+
+QuantizationReport CompareQuantizedNetwork(Network& network, const LoweringOptions& options, const double* samples, int32_t numSamples)
+{
+    if (numSamples < 1)
+        throw std::runtime_error("CompareQuantizedNetwork : Expected at least one sample");
+    LoweringOptions referenceOptions = options;
+    referenceOptions.quantization = nullptr;
+    Arena arena;
+    Function* reference;
+    Function* quantized;
+    {
+        ArenaScope scope(arena);
+        reference = &LowerWithRuntimeBatchSize(network, referenceOptions);
+        quantized = &LowerWithRuntimeBatchSize(network, options);
+    }
+    Interpreter referenceInterpreter(*reference);
+    Interpreter quantizedInterpreter(*quantized);
+    int32_t outputLength = referenceInterpreter.GetOutputLength();
+    std::vector<double> expected(static_cast<size_t>(numSamples) * outputLength);
+    std::vector<double> actual(expected.size());
+    referenceInterpreter.Run(samples, expected.data(), numSamples);
+    quantizedInterpreter.Run(samples, actual.data(), numSamples);
+
+    QuantizationReport report;
+    report.numSamples = numSamples;
+    report.maxAbsoluteError = 0.0;
+    report.meanAbsoluteError = 0.0;
+    double minimum = std::numeric_limits<double>::infinity();
+    double maximum = -minimum;
+    UpdateRange(expected.data(), static_cast<int64_t>(expected.size()), minimum, maximum);
+    report.outputRange = maximum - minimum;
+    int32_t agreements = 0;
+    for (int32_t b=0 ; b<numSamples ; ++b)
+    {
+        const double* expectedRow = expected.data() + static_cast<size_t>(b) * outputLength;
+        const double* actualRow = actual.data() + static_cast<size_t>(b) * outputLength;
+        for (int32_t i=0 ; i<outputLength ; ++i)
+        {
+            double error = std::fabs(expectedRow[i] - actualRow[i]);
+            report.maxAbsoluteError = std::max(report.maxAbsoluteError, error);
+            report.meanAbsoluteError += error;
+        }
+        agreements += std::max_element(expectedRow, expectedRow + outputLength) - expectedRow ==
+                      std::max_element(actualRow, actualRow + outputLength) - actualRow;
+    }
+    report.meanAbsoluteError /= static_cast<double>(expected.size());
+    report.argmaxAgreement = static_cast<double>(agreements) / numSamples;
+    return report;
+}
+
+void PrintQuantizationReport(const QuantizationReport& report, std::ostream& ostr)
+{
+    ostr << "Quantized outputs over " << report.numSamples << " samples : max abs error " << report.maxAbsoluteError
+         << ", mean abs error " << report.meanAbsoluteError << " (outputs span " << report.outputRange << "), argmax agreement "
+         << 100.0 * report.argmaxAgreement << "%" << std::endl;
+}
@@ -0,0 +1,120 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int32_t numThreads)
+    :m_function(nullptr), m_generation(0), m_remainingTasks(0), m_shutdown(false)
+{
+    if (numThreads <= 0)
+        numThreads = static_cast<int32_t>(std::thread::hardware_concurrency());
+    if (numThreads <= 0)
+        numThreads = 1;
+    for (int32_t i=0 ; i<numThreads ; ++i)
+        m_queues.push_back(new WorkQueue);
+    for (int32_t i=1 ; i<numThreads ; ++i)
+        m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shutdown = true;
+    }
+    m_wakeCondition.notify_all();
+    for (size_t i=0 ; i<m_threads.size() ; ++i)
+        m_threads[i].join();
+    for (size_t i=0 ; i<m_queues.size() ; ++i)
+        delete m_queues[i];
+}
+
+bool ThreadPool::PopTask(int32_t threadIndex, int64_t& task)
+{
+    {
+        WorkQueue& own = *m_queues[threadIndex];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    int32_t numQueues = GetNumberOfThreads();
+    for (int32_t i=1 ; i<numQueues ; ++i)
+    {
+        WorkQueue& victim = *m_queues[(threadIndex + i) % numQueues];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::RunOneTask(int32_t threadIndex)
+{
+    int64_t task;
+    if (!PopTask(threadIndex, task))
+        return false;
+    (*m_function)(task, threadIndex);
+    if (--m_remainingTasks == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_doneCondition.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::WorkerLoop(int32_t threadIndex)
+{
+    int64_t seenGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeCondition.wait(lock, [&]() { return m_shutdown || m_generation != seenGeneration; });
+            if (m_shutdown)
+                return;
+            seenGeneration = m_generation;
+        }
+        while (RunOneTask(threadIndex))
+            ;
+    }
+}
+
+void ThreadPool::RunTasks(int64_t numTasks, const TaskFunction& function)
+{
+    if (numTasks <= 0)
+        return;
+    if (numTasks == 1 || m_threads.empty())
+    {
+        for (int64_t task=0 ; task<numTasks ; ++task)
+            function(task, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> runLock(m_runMutex);
+    m_function = &function;
+    m_remainingTasks = numTasks;
+    // Consecutive tasks go to the same queue so neighbouring chunks tend to run on one thread
+    int32_t numQueues = GetNumberOfThreads();
+    for (int32_t q=0 ; q<numQueues ; ++q)
+    {
+        WorkQueue& queue = *m_queues[q];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (int64_t task=numTasks*q/numQueues ; task<numTasks*(q+1)/numQueues ; ++task)
+            queue.tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_generation;
+    }
+    m_wakeCondition.notify_all();
+
+    while (RunOneTask(0))
+        ;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCondition.wait(lock, [&]() { return m_remainingTasks == 0; });
+}
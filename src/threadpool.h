@@ -0,0 +1,71 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+// Work stealing thread pool used by the parallel execution modes. Every thread
+// owns a queue of task indices. A thread takes work from the back of its own
+// queue and, when that is empty, steals from the front of the other queues, so
+// uneven tasks (for example ensembles of different sizes) balance themselves.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    typedef std::function<void(int64_t task, int32_t threadIndex)> TaskFunction;
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<int64_t> tasks;
+    };
+
+    std::vector<std::thread> m_threads;
+    std::vector<WorkQueue*> m_queues;
+    std::mutex m_runMutex; // one RunTasks at a time
+    std::mutex m_mutex;
+    std::condition_variable m_wakeCondition;
+    std::condition_variable m_doneCondition;
+    const TaskFunction* m_function;
+    int64_t m_generation;
+    std::atomic<int64_t> m_remainingTasks;
+    bool m_shutdown;
+
+    bool PopTask(int32_t threadIndex, int64_t& task);
+    bool RunOneTask(int32_t threadIndex);
+    void WorkerLoop(int32_t threadIndex);
+public:
+    // numThreads includes the thread calling RunTasks. 0 uses one thread per hardware thread.
+    ThreadPool(int32_t numThreads = 0);
+    ~ThreadPool();
+    int32_t GetNumberOfThreads() { return static_cast<int32_t>(m_queues.size()); }
+    // Calls function(task, threadIndex) for every task in [0, numTasks) and returns when all of
+    // them have finished. The calling thread takes part as thread 0. threadIndex is below
+    // GetNumberOfThreads() and is unique among concurrently running tasks.
+    void RunTasks(int64_t numTasks, const TaskFunction& function);
+
+    // First iteration of chunk 'chunk' when count iterations are split into numChunks chunks
+    // that start at multiples of grain. numChunks must not exceed max(1, count / grain).
+    static int64_t GetChunkStart(int64_t count, int64_t grain, int64_t numChunks, int64_t chunk)
+    {
+        if (chunk >= numChunks)
+            return count;
+        return (count / grain) * chunk / numChunks * grain;
+    }
+    // Number of chunks to split count iterations into when about targetChunks are wanted
+    static int64_t GetNumberOfChunks(int64_t count, int64_t grain, int64_t targetChunks)
+    {
+        int64_t maxChunks = count / grain;
+        if (targetChunks > maxChunks)
+            targetChunks = maxChunks;
+        return targetChunks < 1 ? 1 : targetChunks;
+    }
+};
+
+#endif // _THREADPOOL_H_
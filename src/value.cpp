@@ -1,4 +1,6 @@
 #include <map>
+#include <algorithm>
+#include <functional>
 #include <string>
 #include <sstream>
 #include "valuetype.h"
@@ -9,35 +11,37 @@
 
 ValueType* JoinScalarTypes(ValueType* type1, ValueType* type2)
 {
-    BooleanType* boolType1 = dynamic_cast<BooleanType*>(type1);
-    IntegerType* intType1 = dynamic_cast<IntegerType*>(type1);
-    RealType* realType1 = dynamic_cast<RealType*>(type1);
+    bool boolType1 = type1->IsBoolean();
+    bool intType1 = type1->IsInteger();
+    bool realType1 = type1->IsReal();
     
-    BooleanType* boolType2 = dynamic_cast<BooleanType*>(type2);
-    IntegerType* intType2 = dynamic_cast<IntegerType*>(type2);
-    RealType* realType2 = dynamic_cast<RealType*>(type2);
+    bool boolType2 = type2->IsBoolean();
+    bool intType2 = type2->IsInteger();
+    bool realType2 = type2->IsReal();
 
     if (boolType1 && boolType2)
     {
-        return new BooleanType;
+        return &BooleanType::Get();
     }
     else if (realType1)
     {
-        if (realType2 || intType2)
-            return new RealType;
+        if (realType2)
+            return &JoinRealTypes(static_cast<RealType&>(*type1), static_cast<RealType&>(*type2));
+        else if (intType2)
+            return type1;
         else
             throw std::runtime_error("Invalid binary operator argument types");
     }
     else if (realType2)
     {
         if (intType1)
-            return new RealType;
+            return type2;
         else
             throw std::runtime_error("Invalid binary operator argument types");
     }
     else if (intType1 && intType2)
     {
-        return new IntegerType;
+        return &IntegerType::Get();
     }
     else
     {
@@ -47,27 +51,28 @@ ValueType* JoinScalarTypes(ValueType* type1, ValueType* type2)
 
 ValueType* JoinTypes(ValueType* type1, ValueType* type2)
 {
-    VectorType *vector1 = dynamic_cast<VectorType*>(type1);
+    VectorType *vector1 = type1->AsVectorType();
     bool isType1Vector = vector1 != nullptr;
     
-    VectorType *vector2 = dynamic_cast<VectorType*>(type2);
+    VectorType *vector2 = type2->AsVectorType();
     bool isType2Vector = vector2 != nullptr;
     
+    // Joined element types are scalars because the element types of vectors are
     if (isType1Vector && isType2Vector)
     {
-        ScalarType *elemType = dynamic_cast<ScalarType*>(JoinTypes(&(vector1->GetElementType()), &(vector2->GetElementType())));
+        ScalarType *elemType = static_cast<ScalarType*>(JoinTypes(&(vector1->GetElementType()), &(vector2->GetElementType())));
         int32_t resultLen = std::min(vector1->GetLength(), vector2->GetLength());
-        return new VectorType(*elemType, resultLen);
+        return &VectorType::Get(*elemType, resultLen);
     }
     else if (isType1Vector)
     {
-        ScalarType *elemType = dynamic_cast<ScalarType*>(JoinTypes(&(vector1->GetElementType()), type2));
-        return new VectorType(*elemType, vector1->GetLength());
+        ScalarType *elemType = static_cast<ScalarType*>(JoinTypes(&(vector1->GetElementType()), type2));
+        return &VectorType::Get(*elemType, vector1->GetLength());
     }
     else if (isType2Vector)
     {
-        ScalarType *elemType = dynamic_cast<ScalarType*>(JoinTypes(type1, &(vector2->GetElementType())));
-        return new VectorType(*elemType, vector2->GetLength());
+        ScalarType *elemType = static_cast<ScalarType*>(JoinTypes(type1, &(vector2->GetElementType())));
+        return &VectorType::Get(*elemType, vector2->GetLength());
     }
     else
     {
@@ -88,11 +93,10 @@ void GetProperty::InferType()
 {
     NeuronProperty& neuronProperty = m_neuron.GetNeuronProperty(m_propertyID);
     if (dynamic_cast<ScalarDoubleNeuronProperty*>(&neuronProperty) != nullptr)
-        m_type = new RealType();
+        m_type = &RealType::Get();
     else if (dynamic_cast<VectorDoubleNeuronProperty*>(&neuronProperty) != nullptr)
     {
-        ScalarType *elemType = new RealType();
-        m_type = new VectorType(*elemType);
+        m_type = &VectorType::Get(RealType::Get());
     }
     else
         throw std::runtime_error("Unknown property type");
@@ -102,35 +106,37 @@ void GetProperty::InferType()
 void GetInputValue::InferType()
 {
     if (dynamic_cast<InputNeuron*>(&m_neuron) != nullptr)
-        m_type = new RealType;
+        m_type = &RealType::Get();
     else
     {
         int32_t numInputs = m_neuron.GetNumInputs();
-        ScalarType *elemType = new RealType;
-        m_type = new VectorType(*elemType, numInputs);
+        m_type = &VectorType::Get(RealType::Get(), numInputs);
     }
 }
 
 void Reduction::InferType()
 {
     ValueType& operandType = m_operand->GetType();
-    VectorType* operandVectorType = dynamic_cast<VectorType*>(&operandType);
+    VectorType* operandVectorType = operandType.AsVectorType();
     if (operandVectorType == nullptr)
     {
         throw std::runtime_error("Reduction argument must be a vector type");
     }
-    m_type = operandVectorType->GetElementType().Clone();
+    m_type = &operandVectorType->GetElementType();
 }
 
 void ActivationFunction::InferType()
 {
     ValueType& operandType = m_operand->GetType();
-    ScalarType* operandScalarType = dynamic_cast<ScalarType*>(&operandType);
-    if (operandScalarType == nullptr)
+    if (!operandType.IsScalar())
     {
         throw std::runtime_error("Activation function argument must be a scalar type");
     }
-    m_type = operandScalarType->Clone();
+    if (m_activation < 0)
+    {
+        throw std::runtime_error("Unknown activation function " + m_functionName);
+    }
+    m_type = &operandType;
 }
 
 class PrintValueVisitor : public IRValueVisitor
@@ -360,9 +366,12 @@ public:
     virtual void Visit(GetValue& getValue)
     {
         std::string valueID = GetValueTempName(getValue.GetElementID());
+        std::string scalarIndex = getValue.GetScalarIndex() ? GetValueTempName(*getValue.GetScalarIndex()) : "";
         Indent();
         std::string temp = GetTemp(getValue);
         m_ostr << temp << " = " << "GetValue("<< getValue.GetValueSet().GetID() << ", " << valueID << ")";
+        if (getValue.GetScalarIndex())
+            m_ostr << "[" << scalarIndex << "]";
         PrintType(getValue);
         m_ostr << std::endl;
         SetValueTempName(getValue, temp);
@@ -495,6 +504,12 @@ public:
         m_ostr << "GetValue("<< getValue.GetValueSet().GetID() << ", ";
         getValue.GetElementID().AcceptIRValueVisitor(*this);
         m_ostr << ")"; 
+        if (getValue.GetScalarIndex())
+        {
+            m_ostr << "[";
+            getValue.GetScalarIndex()->AcceptIRValueVisitor(*this);
+            m_ostr << "]";
+        }
     }
 };
 
@@ -629,7 +644,7 @@ public:
         StoreAndResetValuePtr resetVal(&m_val);
         ActivationFunction *otherFunction = dynamic_cast<ActivationFunction*>(m_val);
         if (otherFunction == nullptr || !(otherFunction->GetType() == function.GetType()) ||
-            otherFunction->GetName() != function.GetName())
+            otherFunction->GetActivation() != function.GetActivation() || otherFunction->GetAccuracy() != function.GetAccuracy())
         {
             m_equal = false;
             return;
@@ -646,3 +661,455 @@ bool AreValuesStructurallyIdentical(Value& v1, Value& v2)
     v2.AcceptVisitor(compareVisitor);
     return compareVisitor.GetResult();
 }
+
+size_t CombineHash(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+// The types of operations follow from the types of their operands, so only the kinds of
+// the nodes and the types and lengths of the leaves are hashed.
+class ValueStructuralHashVisitor : public ValueVisitor
+{
+    enum NodeKind
+    {
+        IntegerConstantNode = 1, BooleanConstantNode, RealConstantNode, RealVectorConstantNode, UnaryPlusNode, UnaryMinusNode,
+        BinaryAddNode, BinarySubtractNode, BinaryMultiplyNode, BinaryDivideNode, GetInputValueNode, ReductionNode, ActivationFunctionNode
+    };
+    size_t m_hash;
+
+    size_t HashOperand(Value& operand)
+    {
+        ValueStructuralHashVisitor operandVisitor;
+        operand.AcceptVisitor(operandVisitor);
+        return operandVisitor.GetHash();
+    }
+    void HandleBinaryOperator(BinaryOp& binOp, NodeKind kind)
+    {
+        m_hash = CombineHash(CombineHash(kind, HashOperand(binOp.GetLHS())), HashOperand(binOp.GetRHS()));
+    }
+public:
+    ValueStructuralHashVisitor()
+        :m_hash(0)
+    { }
+    size_t GetHash() { return m_hash; }
+    virtual void Visit(IntegerConstant& intConst) { m_hash = IntegerConstantNode; }
+    virtual void Visit(BooleanConstant& boolConst) { m_hash = BooleanConstantNode; }
+    virtual void Visit(RealConstant& realConst) { m_hash = RealConstantNode; }
+    virtual void Visit(RealVectorConstant& realVecConst)
+    {
+        m_hash = CombineHash(RealVectorConstantNode, realVecConst.GetValue().size());
+    }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        m_hash = CombineHash(UnaryPlusNode, HashOperand(unaryPlus.GetOperand()));
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        m_hash = CombineHash(UnaryMinusNode, HashOperand(unaryMinus.GetOperand()));
+    }
+    virtual void Visit(BinaryAdd& binaryAdd) { HandleBinaryOperator(binaryAdd, BinaryAddNode); }
+    virtual void Visit(BinarySubtract& binarySubtract) { HandleBinaryOperator(binarySubtract, BinarySubtractNode); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { HandleBinaryOperator(binaryMultiply, BinaryMultiplyNode); }
+    virtual void Visit(BinaryDivide& binaryDivide) { HandleBinaryOperator(binaryDivide, BinaryDivideNode); }
+    virtual void Visit(GetInputValue& getInput)
+    {
+        VectorType* vecType = getInput.GetType().AsVectorType();
+        m_hash = CombineHash(GetInputValueNode, vecType ? vecType->GetLength() + 1 : 0);
+    }
+    virtual void Visit(Reduction& reduction)
+    {
+        m_hash = CombineHash(CombineHash(ReductionNode, reduction.GetReductionType()), HashOperand(reduction.GetOperand()));
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        m_hash = CombineHash(CombineHash(ActivationFunctionNode, function.GetActivation()),
+                             HashOperand(function.GetOperand()));
+    }
+};
+
+size_t GetStructuralHash(Value& v)
+{
+    ValueStructuralHashVisitor hashVisitor;
+    v.AcceptVisitor(hashVisitor);
+    return hashVisitor.GetHash();
+}
+
+static bool operator==(const ValueNumbering::Key& key1, const ValueNumbering::Key& key2)
+{
+    return key1.kind == key2.kind && key1.type == key2.type && key1.attribute == key2.attribute && key1.name == key2.name &&
+           key1.operands[0] == key2.operands[0] && key1.operands[1] == key2.operands[1];
+}
+
+// Builds the value numbering key of a value from the representatives of its operands. Values
+// without a key are their own representatives, except for unary plus which is its operand.
+class ValueNumberingKeyVisitor : public ValueVisitor
+{
+    enum NodeKind
+    {
+        UnaryMinusNode = 1, BinaryAddNode, BinarySubtractNode, BinaryMultiplyNode, BinaryDivideNode,
+        GetInputValueNode, ReductionNode, ActivationFunctionNode
+    };
+    ValueNumbering& m_numbering;
+    ValueNumbering::Key m_key;
+    Value* m_representative;
+
+    void SetKey(Value& v, NodeKind kind, Value* operand1 = nullptr, Value* operand2 = nullptr)
+    {
+        m_representative = nullptr;
+        m_key.kind = kind;
+        m_key.type = &(v.GetType());
+        m_key.operands[0] = operand1 ? &(m_numbering.GetRepresentative(*operand1)) : nullptr;
+        m_key.operands[1] = operand2 ? &(m_numbering.GetRepresentative(*operand2)) : nullptr;
+    }
+    void HandleCommutativeOperator(BinaryOp& binOp, NodeKind kind)
+    {
+        SetKey(binOp, kind, &(binOp.GetLHS()), &(binOp.GetRHS()));
+        if (std::less<Value*>()(m_key.operands[1], m_key.operands[0]))
+            std::swap(m_key.operands[0], m_key.operands[1]);
+    }
+public:
+    ValueNumberingKeyVisitor(ValueNumbering& numbering, Value& v)
+        :m_numbering(numbering), m_representative(&v)
+    {
+        m_key.attribute = 0;
+    }
+    ValueNumbering::Key& GetKey() { return m_key; }
+    // nullptr when the representative has to be looked up with the key
+    Value* GetRepresentative() { return m_representative; }
+    virtual void Visit(Value& value) { }
+    virtual void Visit(IntegerConstant& intConst) { }
+    virtual void Visit(BooleanConstant& boolConst) { }
+    virtual void Visit(RealConstant& realConst) { }
+    virtual void Visit(RealVectorConstant& realVecConst) { }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        m_representative = &(m_numbering.GetRepresentative(unaryPlus.GetOperand()));
+    }
+    virtual void Visit(UnaryMinus& unaryMinus) { SetKey(unaryMinus, UnaryMinusNode, &(unaryMinus.GetOperand())); }
+    virtual void Visit(BinaryAdd& binaryAdd) { HandleCommutativeOperator(binaryAdd, BinaryAddNode); }
+    virtual void Visit(BinarySubtract& binarySubtract)
+    {
+        SetKey(binarySubtract, BinarySubtractNode, &(binarySubtract.GetLHS()), &(binarySubtract.GetRHS()));
+    }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { HandleCommutativeOperator(binaryMultiply, BinaryMultiplyNode); }
+    virtual void Visit(BinaryDivide& binaryDivide)
+    {
+        SetKey(binaryDivide, BinaryDivideNode, &(binaryDivide.GetLHS()), &(binaryDivide.GetRHS()));
+    }
+    virtual void Visit(GetInputValue& getInput)
+    {
+        SetKey(getInput, GetInputValueNode);
+        m_key.attribute = reinterpret_cast<size_t>(&(getInput.GetOwningNeuron()));
+    }
+    virtual void Visit(Reduction& reduction)
+    {
+        SetKey(reduction, ReductionNode, &(reduction.GetOperand()));
+        m_key.attribute = reduction.GetReductionType();
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        SetKey(function, ActivationFunctionNode, &(function.GetOperand()));
+        m_key.name = function.GetName();
+        m_key.attribute = function.GetAccuracy();
+    }
+};
+
+Value& ValueNumbering::GetRepresentative(Value& v)
+{
+    auto iter = m_representatives.find(&v);
+    if (iter != m_representatives.end())
+        return *(iter->second);
+
+    ValueNumberingKeyVisitor keyVisitor(*this, v);
+    v.AcceptVisitor(keyVisitor);
+    Value* representative = keyVisitor.GetRepresentative();
+    if (representative == nullptr)
+    {
+        ValueNumbering::Key& key = keyVisitor.GetKey();
+        size_t hash = CombineHash(CombineHash(CombineHash(key.kind, std::hash<Value*>()(key.operands[0])), std::hash<Value*>()(key.operands[1])),
+                                  CombineHash(key.attribute, std::hash<std::string>()(key.name)));
+        auto range = m_numberedValues.equal_range(hash);
+        for (auto numbered=range.first ; numbered!=range.second && representative == nullptr ; ++numbered)
+        {
+            if (numbered->second.first == key)
+                representative = numbered->second.second;
+        }
+        if (representative == nullptr)
+        {
+            representative = &v;
+            m_numberedValues.insert(std::make_pair(hash, std::make_pair(key, &v)));
+        }
+    }
+    m_representatives[&v] = representative;
+    return *representative;
+}
+
+// Arithmetic on constants. Returns nullptr when the operation cannot be folded : boolean operands,
+// or an integer division that is not exact.
+static Value* FoldConstants(char operation, Value& lhs, Value& rhs)
+{
+    if (dynamic_cast<ConstantValue*>(&lhs) == nullptr || dynamic_cast<ConstantValue*>(&rhs) == nullptr)
+        return nullptr;
+    IntegerConstant* lhsInt = dynamic_cast<IntegerConstant*>(&lhs);
+    IntegerConstant* rhsInt = dynamic_cast<IntegerConstant*>(&rhs);
+    if (lhsInt != nullptr && rhsInt != nullptr)
+    {
+        int64_t a = lhsInt->GetValue();
+        int64_t b = rhsInt->GetValue();
+        switch (operation)
+        {
+        case '+': return &IntegerConstant::Create(a + b);
+        case '-': return &IntegerConstant::Create(a - b);
+        case '*': return &IntegerConstant::Create(a * b);
+        default: return (b != 0 && a % b == 0) ? &IntegerConstant::Create(a / b) : nullptr;
+        }
+    }
+
+    // Reals, mixed with integers or vectors. Scalars are broadcast and vectors are cut to the
+    // shortest length like in JoinTypes.
+    std::vector<double> a, b;
+    bool isVector[] = { false, false };
+    Value* operands[] = { &lhs, &rhs };
+    std::vector<double>* values[] = { &a, &b };
+    for (int32_t i=0 ; i<2 ; ++i)
+    {
+        if (RealVectorConstant* vectorConst = dynamic_cast<RealVectorConstant*>(operands[i]))
+        {
+            *values[i] = vectorConst->GetValue();
+            isVector[i] = true;
+        }
+        else if (RealConstant* realConst = dynamic_cast<RealConstant*>(operands[i]))
+            values[i]->push_back(realConst->GetValue());
+        else if (IntegerConstant* intConst = dynamic_cast<IntegerConstant*>(operands[i]))
+            values[i]->push_back(static_cast<double>(intConst->GetValue()));
+        else
+            return nullptr;
+    }
+    size_t length = 1;
+    if (isVector[0] && isVector[1])
+        length = std::min(a.size(), b.size());
+    else if (isVector[0] || isVector[1])
+        length = isVector[0] ? a.size() : b.size();
+    std::vector<double> result(length);
+    for (size_t i=0 ; i<length ; ++i)
+    {
+        double x = a[isVector[0] ? i : 0];
+        double y = b[isVector[1] ? i : 0];
+        switch (operation)
+        {
+        case '+': result[i] = x + y; break;
+        case '-': result[i] = x - y; break;
+        case '*': result[i] = x * y; break;
+        default: result[i] = x / y; break;
+        }
+    }
+    if (isVector[0] || isVector[1])
+        return &RealVectorConstant::Create(result);
+    return &RealConstant::Create(result[0]);
+}
+
+// Is v a scalar constant equal to value
+static bool IsScalarConstant(Value& v, double value)
+{
+    if (IntegerConstant* intConst = dynamic_cast<IntegerConstant*>(&v))
+        return intConst->GetValue() == value;
+    if (RealConstant* realConst = dynamic_cast<RealConstant*>(&v))
+        return realConst->GetValue() == value;
+    return false;
+}
+
+static bool IsRealConstant(Value& v)
+{
+    return dynamic_cast<RealConstant*>(&v) != nullptr || dynamic_cast<RealVectorConstant*>(&v) != nullptr;
+}
+
+// Rewrites values bottom up. Shared subexpressions are rewritten once so they stay shared, and
+// values with nothing to simplify are kept as they are.
+class ValueSimplificationVisitor : public ValueVisitor
+{
+    std::map<Value*, Value*> m_simplified;
+    Value* m_result;
+    bool m_valueIdentities;
+    bool m_skippedValueIdentities;
+
+    // c * (k * y) with real constants c and k
+    Value* ScaleProduct(Value& constant, Value& v)
+    {
+        BinaryMultiply* product = dynamic_cast<BinaryMultiply*>(&v);
+        if (product == nullptr || !IsRealConstant(constant))
+            return nullptr;
+        Value* other = nullptr;
+        Value* scaled = nullptr;
+        if (IsRealConstant(product->GetLHS()))
+        {
+            scaled = FoldConstants('*', constant, product->GetLHS());
+            other = &(product->GetRHS());
+        }
+        else if (IsRealConstant(product->GetRHS()))
+        {
+            scaled = FoldConstants('*', constant, product->GetRHS());
+            other = &(product->GetLHS());
+        }
+        if (scaled == nullptr)
+            return nullptr;
+        return &BinaryMultiply::Create(*scaled, *other);
+    }
+    // c * Sum(k * y) with a real scalar c
+    Value* ScaleSum(Value& constant, Value& v)
+    {
+        Reduction* sum = dynamic_cast<Reduction*>(&v);
+        if (sum == nullptr || sum->GetReductionType() != Reduction::Sum || dynamic_cast<RealConstant*>(&constant) == nullptr)
+            return nullptr;
+        Value* scaledOperand = ScaleProduct(constant, sum->GetOperand());
+        if (scaledOperand == nullptr)
+            return nullptr;
+        return &Reduction::Create(*scaledOperand, Reduction::Sum);
+    }
+    // Rewrites depending on the values of constants are only applied with m_valueIdentities
+    bool ApplyValueIdentity(bool applicable)
+    {
+        if (applicable && !m_valueIdentities)
+            m_skippedValueIdentities = true;
+        return applicable && m_valueIdentities;
+    }
+    template<typename T>
+    void HandleBinaryOperator(T& binOp, char operation)
+    {
+        Value& lhs = Simplify(binOp.GetLHS());
+        Value& rhs = Simplify(binOp.GetRHS());
+        m_result = nullptr;
+        // All rewrites but x + -y need a constant operand
+        bool lhsConstant = dynamic_cast<ConstantValue*>(&lhs) != nullptr;
+        bool rhsConstant = dynamic_cast<ConstantValue*>(&rhs) != nullptr;
+        if (lhsConstant && rhsConstant)
+        {
+            // Whether an integer division folds depends on the values
+            bool integerDivision = operation == '/' && lhs.GetType().IsInteger() && rhs.GetType().IsInteger();
+            if (!integerDivision || ApplyValueIdentity(true))
+                m_result = FoldConstants(operation, lhs, rhs);
+        }
+        else if (lhsConstant || rhsConstant)
+        {
+            // Identities, as long as they do not change the type of the result. x + 0 may turn a -0 into a +0.
+            Value& constant = lhsConstant ? lhs : rhs;
+            Value& other = lhsConstant ? rhs : lhs;
+            bool sameType = other.GetType() == binOp.GetType();
+            if (operation == '+' || (operation == '-' && rhsConstant))
+            {
+                if (ApplyValueIdentity(sameType && IsScalarConstant(constant, 0.0)))
+                    m_result = &other;
+            }
+            else if (operation == '*' || (operation == '/' && rhsConstant))
+            {
+                if (ApplyValueIdentity(sameType && IsScalarConstant(constant, 1.0)))
+                    m_result = &other;
+            }
+            if (m_result == nullptr && operation == '*')
+            {
+                // Constant factors are folded into the weights of a product or a weighted sum
+                m_result = ScaleProduct(constant, other);
+                if (m_result == nullptr)
+                    m_result = ScaleSum(constant, other);
+                if (m_result != nullptr)
+                    m_result = &Simplify(*m_result);
+            }
+        }
+        if (m_result == nullptr && (operation == '+' || operation == '-'))
+        {
+            // x + -y = x - y and x - -y = x + y
+            if (UnaryMinus* negated = dynamic_cast<UnaryMinus*>(&rhs))
+            {
+                if (operation == '+')
+                    m_result = &BinarySubtract::Create(lhs, negated->GetOperand());
+                else
+                    m_result = &BinaryAdd::Create(lhs, negated->GetOperand());
+            }
+        }
+        if (m_result == nullptr && (&lhs != &(binOp.GetLHS()) || &rhs != &(binOp.GetRHS())))
+            m_result = &T::Create(lhs, rhs);
+        if (m_result == nullptr)
+            m_result = &binOp;
+    }
+public:
+    ValueSimplificationVisitor(bool valueIdentities)
+        :m_result(nullptr), m_valueIdentities(valueIdentities), m_skippedValueIdentities(false)
+    { }
+    bool SkippedValueIdentities() { return m_skippedValueIdentities; }
+    Value& Simplify(Value& v)
+    {
+        auto iter = m_simplified.find(&v);
+        if (iter != m_simplified.end())
+            return *(iter->second);
+        v.AcceptVisitor(*this);
+        m_simplified[&v] = m_result;
+        return *m_result;
+    }
+    virtual void Visit(Value& value) { m_result = &value; }
+    virtual void Visit(IntegerConstant& intConst) { m_result = &intConst; }
+    virtual void Visit(BooleanConstant& boolConst) { m_result = &boolConst; }
+    virtual void Visit(RealConstant& realConst) { m_result = &realConst; }
+    virtual void Visit(RealVectorConstant& realVecConst) { m_result = &realVecConst; }
+    virtual void Visit(UnaryPlus& unaryPlus)
+    {
+        m_result = &Simplify(unaryPlus.GetOperand());
+    }
+    virtual void Visit(UnaryMinus& unaryMinus)
+    {
+        Value& operand = Simplify(unaryMinus.GetOperand());
+        if (UnaryMinus* negated = dynamic_cast<UnaryMinus*>(&operand))
+        {
+            m_result = &(negated->GetOperand());
+            return;
+        }
+        // Multiplying by -1 negates exactly, zeros included
+        m_result = nullptr;
+        if (dynamic_cast<ConstantValue*>(&operand) != nullptr)
+            m_result = FoldConstants('*', IntegerConstant::Create(-1), operand);
+        if (m_result == nullptr)
+            m_result = &operand == &(unaryMinus.GetOperand()) ? &unaryMinus : &UnaryMinus::Create(operand);
+    }
+    virtual void Visit(BinaryAdd& binaryAdd) { HandleBinaryOperator(binaryAdd, '+'); }
+    virtual void Visit(BinarySubtract& binarySubtract) { HandleBinaryOperator(binarySubtract, '-'); }
+    virtual void Visit(BinaryMultiply& binaryMultiply) { HandleBinaryOperator(binaryMultiply, '*'); }
+    virtual void Visit(BinaryDivide& binaryDivide) { HandleBinaryOperator(binaryDivide, '/'); }
+    virtual void Visit(GetInputValue& getInput) { m_result = &getInput; }
+    virtual void Visit(Reduction& reduction)
+    {
+        Value& operand = Simplify(reduction.GetOperand());
+        if (RealVectorConstant* vectorConst = dynamic_cast<RealVectorConstant*>(&operand))
+        {
+            std::vector<double>& values = vectorConst->GetValue();
+            if (!values.empty())
+            {
+                double result = values[0];
+                for (size_t i=1 ; i<values.size() ; ++i)
+                {
+                    if (reduction.GetReductionType() == Reduction::Sum)
+                        result += values[i];
+                    else if (reduction.GetReductionType() == Reduction::Multiply)
+                        result *= values[i];
+                    else
+                        result = std::max(result, values[i]);
+                }
+                m_result = &RealConstant::Create(result);
+                return;
+            }
+        }
+        m_result = &operand == &(reduction.GetOperand()) ? &reduction : &Reduction::Create(operand, reduction.GetReductionType());
+    }
+    virtual void Visit(ActivationFunction& function)
+    {
+        Value& operand = Simplify(function.GetOperand());
+        m_result = &operand == &(function.GetOperand()) ? &function : &ActivationFunction::Create(operand, function.GetName(), function.GetAccuracy());
+    }
+};
+
+Value& SimplifyValue(Value& v, bool valueIdentities, bool* skippedValueIdentities)
+{
+    ValueSimplificationVisitor simplificationVisitor(valueIdentities);
+    Value& simplified = simplificationVisitor.Simplify(v);
+    if (skippedValueIdentities != nullptr)
+        *skippedValueIdentities = simplificationVisitor.SkippedValueIdentities();
+    return simplified;
+}
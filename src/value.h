@@ -3,6 +3,10 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include "arena.h"
+#include "kernels.h"
 #include "valuetype.h"
 #include "valuevisitor.h"
 #include "irvaluevisitor.h"
@@ -36,10 +40,10 @@ class Neuron;
 // TODO Write create methods for each type of Value. So that we can not leak Value objects.
 // TODO Write operator overloads so that users can write expressions that look like code (val1 + val2 for example)
 
-class Value
+class Value : public ArenaObject
 {
 protected:
-	ValueType *m_type;
+	ValueType *m_type; // interned, see valuetype.h
 public:
     Value()
         :m_type(nullptr)
@@ -60,7 +64,7 @@ public:
         AcceptVisitor(visitor);
     }
 
-	virtual ~Value() { delete m_type; }
+	virtual ~Value() { }
 };
 
 class ConstantValue : public Value
@@ -79,7 +83,7 @@ public:
 		:m_val(val)
 	{ }
 	int64_t GetValue() { return m_val; }
-	virtual void InferType() { m_type = new IntegerType; }
+	virtual void InferType() { m_type = &IntegerType::Get(); }
 	virtual void AcceptVisitor(ValueVisitor& visitor) { visitor.Visit(*this); }
 
     static IntegerConstant& Create(int64_t val)
@@ -97,7 +101,7 @@ public:
 		:m_val(val)
 	{ }
 	bool GetValue() { return m_val; }
-	virtual void InferType() { m_type = new BooleanType; }
+	virtual void InferType() { m_type = &BooleanType::Get(); }
 	virtual void AcceptVisitor(ValueVisitor& visitor) { visitor.Visit(*this); }
 
     static BooleanConstant& Create(bool val)
@@ -115,7 +119,7 @@ public:
 		:m_val(val)
 	{ }
 	double GetValue() { return m_val; }
-	virtual void InferType() { m_type = new RealType; }
+	virtual void InferType() { m_type = &RealType::Get(); }
 	virtual void AcceptVisitor(ValueVisitor& visitor) { visitor.Visit(*this); }
 
     static RealConstant& Create(double val)
@@ -135,10 +139,7 @@ public:
 	std::vector<double>& GetValue() { return m_val; }
 	virtual void InferType()
     {
-        ScalarType& elemType = *(new RealType);
-        VectorType* vecType  = new VectorType(elemType);
-        vecType->SetLength(m_val.size());
-        m_type = vecType;
+        m_type = &VectorType::Get(RealType::Get(), static_cast<int32_t>(m_val.size()));
     }
 	virtual void AcceptVisitor(ValueVisitor& visitor) { visitor.Visit(*this); }
 
@@ -161,7 +162,7 @@ public:
 		:m_operand(operand)
 	{ }
 	Value& GetOperand() { return *m_operand; }
-	virtual void InferType() { m_type = m_operand->GetType().Clone(); }
+	virtual void InferType() { m_type = &(m_operand->GetType()); }
 };
 
 class UnaryPlus : public UnaryOp
@@ -216,7 +217,7 @@ public:
 
     static BinaryAdd& Create(Value& lhs, Value& rhs)
     {
-        return *(new BinaryAdd(&lhs, &rhs));
+        return *(new BinaryAdd(&rhs, &lhs));
     }
 };
 
@@ -230,7 +231,7 @@ public:
 
     static BinarySubtract& Create(Value& lhs, Value& rhs)
     {
-        return *(new BinarySubtract(&lhs, &rhs));
+        return *(new BinarySubtract(&rhs, &lhs));
     }
 };
 
@@ -244,7 +245,7 @@ public:
 
     static BinaryMultiply& Create(Value& lhs, Value& rhs)
     {
-        return *(new BinaryMultiply(&lhs, &rhs));
+        return *(new BinaryMultiply(&rhs, &lhs));
     }
 };
 
@@ -258,7 +259,7 @@ public:
 
     static BinaryDivide& Create(Value& lhs, Value& rhs)
     {
-        return *(new BinaryDivide(&lhs, &rhs));
+        return *(new BinaryDivide(&rhs, &lhs));
     }
 };
 
@@ -311,7 +312,7 @@ private:
     ReductionType m_reductionType;
 public:
     Reduction(Value *operand, ReductionType reductionType)
-        :m_operand(operand)
+        :m_operand(operand), m_reductionType(reductionType)
     { }
     Value& GetOperand() { return *m_operand; }
     ReductionType GetReductionType() { return m_reductionType; }
@@ -324,22 +325,29 @@ public:
     }
 };
 
+// The name is resolved to a kernel activation once, on construction. Accuracy selects
+// the kernel tier (KernelAccuracy) used when the function is evaluated.
 class ActivationFunction : public Value
 {
     std::string m_functionName;
     Value *m_operand;
+    int32_t m_activation;
+    int32_t m_accuracy;
 public:
-    ActivationFunction(Value& operand, const std::string& name)
-        :m_operand(&operand), m_functionName(name)
+    ActivationFunction(Value& operand, const std::string& name, int32_t accuracy)
+        :m_functionName(name), m_operand(&operand), m_activation(GetKernelActivation(name.c_str())), m_accuracy(accuracy)
     { }
     Value& GetOperand() { return *m_operand; }
     std::string& GetName() { return m_functionName; }
+    // A KernelActivation, or -1 if there is no kernel with this name
+    int32_t GetActivation() { return m_activation; }
+    int32_t GetAccuracy() { return m_accuracy; }
     virtual void InferType();
 	virtual void AcceptVisitor(ValueVisitor& visitor) { visitor.Visit(*this); }
 
-    static ActivationFunction& Create(Value& operand, const std::string& name)
+    static ActivationFunction& Create(Value& operand, const std::string& name, int32_t accuracy = KernelAccuracyDefault)
     {
-        return *(new ActivationFunction(operand, name));
+        return *(new ActivationFunction(operand, name, accuracy));
     }
 };
 
@@ -385,22 +393,22 @@ inline UnaryMinus& operator-(Value& operand)
 
 inline BinaryAdd& operator+(Value& lhs, Value& rhs)
 {
-    return BinaryAdd::Create(rhs, lhs);
+    return BinaryAdd::Create(lhs, rhs);
 }
 
 inline BinarySubtract& operator-(Value& lhs, Value& rhs)
 {
-    return BinarySubtract::Create(rhs, lhs);
+    return BinarySubtract::Create(lhs, rhs);
 }
 
 inline BinaryMultiply& operator*(Value& lhs, Value& rhs)
 {
-    return BinaryMultiply::Create(rhs, lhs);
+    return BinaryMultiply::Create(lhs, rhs);
 }
 
 inline BinaryDivide& operator/(Value& lhs, Value& rhs)
 {
-    return BinaryDivide::Create(rhs, lhs);
+    return BinaryDivide::Create(lhs, rhs);
 }
 
 // Print out the expression represented by v. The final value is assigned to a temporary and the 
@@ -417,5 +425,42 @@ void PrintValueExpression(Value& v, std::ostream& ostr);
 // Determine if the two values passed can be implemented with the same code.
 // Basically, are they the same apart from particular numerical values.
 bool AreValuesStructurallyIdentical(Value& v1, Value& v2);
+// Hash of the structure compared by AreValuesStructurallyIdentical. Structurally identical
+// values have the same hash, so values can be grouped with a hash map and only values in
+// the same bucket need to be compared.
+size_t GetStructuralHash(Value& v);
+size_t CombineHash(size_t seed, size_t value);
+
+// Folds arithmetic on constants and removes operations that do not change their operand
+// (-(-x), +x). Constant factors of products and weighted sums are folded into the weights :
+// c*Sum(w*x) becomes Sum((c*w)*x). With valueIdentities, the rewrites that depend on the values
+// of constants are applied as well (x*1, x+0, x-0, x/1 and integer divisions) : they can make
+// otherwise structurally identical values different. skippedValueIdentities tells whether some
+// of them would have applied. The rewritten value is returned, v itself when there is nothing
+// to simplify.
+Value& SimplifyValue(Value& v, bool valueIdentities = true, bool* skippedValueIdentities = nullptr);
+
+// Value numbering : maps every value to a representative value computing the same result, so
+// a subexpression that is built several times is only evaluated once. Values applying the same
+// operation to operands with the same representatives share a representative (additions and
+// multiplications in either operand order). Constants are only equivalent to themselves since
+// they stand for per neuron parameters, and all inputs of a neuron are equivalent.
+class ValueNumbering
+{
+public:
+    struct Key
+    {
+        int32_t kind;
+        ValueType* type;
+        size_t attribute;
+        std::string name;
+        Value* operands[2];
+    };
+private:
+    std::unordered_map<Value*, Value*> m_representatives;
+    std::unordered_multimap<size_t, std::pair<Key, Value*>> m_numberedValues;
+public:
+    Value& GetRepresentative(Value& v);
+};
 
 #endif // _EXPRESSION_H_
@@ -1,4 +1,6 @@
 #include <iostream>
+#include <map>
+#include <mutex>
 #include "valuetype.h"
 
 class PrintValueTypeVisitor : public ValueTypeVisitor
@@ -22,7 +24,8 @@ public:
     }
     virtual void Visit(RealType& theType)
     {
-        m_ostr << "[real]";
+        static const char* names[] = { "[real]", "[float32]", "[float16]", "[bfloat16]" };
+        m_ostr << names[theType.GetPrecision()];
     }
 	virtual void Visit(VectorType& theType)
     {
@@ -41,48 +44,51 @@ void PrintValueType(ValueType& valueType, std::ostream& ostr)
     valueType.AcceptVisitor(printVisitor);
 }
 
-class CompareValueTypesVisitor : public ValueTypeVisitor
+BooleanType& BooleanType::Get()
 {
-    ValueType* m_type;
-    bool m_equal;
-public:
-    CompareValueTypesVisitor(ValueType& type)
-        :m_type(&type), m_equal(true)
-    { }
-    bool GetResult() { return m_equal; }
-    virtual void Visit(ScalarType& theType)
-    {
-        
-    }
-	virtual void Visit(BooleanType& theType)
-    {
-        if (dynamic_cast<BooleanType*>(m_type) == nullptr)
-            m_equal = false;
-    }
-	virtual void Visit(IntegerType& theType)
-    {
-        if (dynamic_cast<IntegerType*>(m_type) == nullptr)
-            m_equal = false;
-    }
-    virtual void Visit(RealType& theType)
-    {
-        if (dynamic_cast<RealType*>(m_type) == nullptr)
-            m_equal = false;
-    }
-	virtual void Visit(VectorType& theType)
-    {
-        VectorType* otherType = dynamic_cast<VectorType*>(m_type);
-        if (m_type == nullptr)
-            m_equal = false;
-        m_type = &otherType->GetElementType();
-        theType.GetElementType().AcceptVisitor(*this);
-    }
-};
+    static BooleanType* type = new BooleanType;
+    return *type;
+}
 
-bool operator==(ValueType& type1, ValueType& type2)
+IntegerType& IntegerType::Get()
 {
-    CompareValueTypesVisitor compareVisitor(type1);
-    type2.AcceptVisitor(compareVisitor);
-    return compareVisitor.GetResult();
+    static IntegerType* type = new IntegerType;
+    return *type;
 }
 
+RealType& RealType::Get(Precision precision)
+{
+    static RealType* types[] = { new RealType(Float64), new RealType(Float32), new RealType(Float16), new RealType(BFloat16) };
+    return *types[precision];
+}
+
+VectorType& VectorType::Get(ScalarType& elem, int32_t len)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<ScalarType*, int32_t>, VectorType*> types;
+    std::lock_guard<std::mutex> lock(mutex);
+    VectorType*& type = types[std::make_pair(&elem, len)];
+    if (type == nullptr)
+        type = new VectorType(elem, len);
+    return *type;
+}
+
+RealType& JoinRealTypes(RealType& type1, RealType& type2)
+{
+    RealType::Precision precision1 = type1.GetPrecision();
+    RealType::Precision precision2 = type2.GetPrecision();
+    if (precision1 == precision2)
+        return type1;
+    if (precision1 == RealType::Float64 || precision2 == RealType::Float64)
+        return RealType::Get(RealType::Float64);
+    return RealType::Get(RealType::Float32);
+}
+
+ValueType& GetTypeWithPrecision(ValueType& type, RealType::Precision precision)
+{
+    if (VectorType* vecType = type.AsVectorType())
+        return VectorType::Get(static_cast<ScalarType&>(GetTypeWithPrecision(vecType->GetElementType(), precision)), vecType->GetLength());
+    if (type.IsReal())
+        return RealType::Get(precision);
+    return type;
+}
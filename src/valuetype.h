@@ -1,6 +1,8 @@
 #ifndef _NEURONPROPERTYTYPE_H_
 #define _NEURONPROPERTYTYPE_H_
 
+#include <cstdint>
+
 class ValueType;
 class ScalarType;
 class BooleanType;
@@ -18,14 +20,31 @@ public:
 	virtual void Visit(VectorType& theType) = 0;
 };
 
+// Types are interned and immutable: there is exactly one object for every distinct type,
+// obtained with the Get functions below. Types are therefore compared by address, shared by
+// all values having them and never freed. The kind tag answers type checks without RTTI.
 class ValueType
 {
 public:
+    enum Kind { Boolean, Integer, Real, Vector };
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) = 0;
-	virtual ValueType* Clone() = 0;
-    virtual ~ValueType() { }
+    Kind GetKind() { return m_kind; }
+    bool IsScalar() { return m_kind != Vector; }
+    bool IsVector() { return m_kind == Vector; }
+    bool IsReal() { return m_kind == Real; }
+    bool IsInteger() { return m_kind == Integer; }
+    bool IsBoolean() { return m_kind == Boolean; }
+    // nullptr unless the type is a vector type
+    VectorType* AsVectorType();
 protected:
-	ValueType() { }
+	ValueType(Kind kind)
+        :m_kind(kind)
+    { }
+    virtual ~ValueType() { }
+private:
+    const Kind m_kind;
+	ValueType(const ValueType&);
+    ValueType& operator=(const ValueType&);
 };
 
 class ScalarType : public ValueType
@@ -33,55 +52,76 @@ class ScalarType : public ValueType
 public:
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) { visitor.Visit(*this); }
 protected:
-	ScalarType() { }
+	ScalarType(Kind kind)
+        :ValueType(kind)
+    { }
 };
 
 class BooleanType : public ScalarType
 {
-public:
 	BooleanType()
+        :ScalarType(Boolean)
 	{ }
+public:
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) { visitor.Visit(*this); }
-	virtual ValueType* Clone() { return new BooleanType(*this); }
+    static BooleanType& Get();
 };
 
 class IntegerType : public ScalarType
 {
+	IntegerType()
+        :ScalarType(Integer)
+    { }
 public:
-	IntegerType() { }
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) { visitor.Visit(*this); }
-	virtual ValueType* Clone() { return new IntegerType(*this); }
+    static IntegerType& Get();
 };
 
+// There is one real type per storage precision. Float64 is the default; the narrower ones are
+// used for storing constants. Variables hold doubles whatever the precision of their type.
 class RealType : public ScalarType
 {
 public:
-	RealType() { }
+    enum Precision { Float64, Float32, Float16, BFloat16 };
+private:
+    Precision m_precision;
+	RealType(Precision precision)
+        :ScalarType(Real), m_precision(precision)
+    { }
+public:
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) { visitor.Visit(*this); }
-	virtual ValueType* Clone() { return new RealType(*this); }
+    Precision GetPrecision() { return m_precision; }
+    // Bytes per value
+    int32_t GetSize() { return m_precision == Float64 ? 8 : (m_precision == Float32 ? 4 : 2); }
+    static RealType& Get(Precision precision = Float64);
 };
 
 class VectorType : public ValueType
 {
 	ScalarType& m_elemType;
     int32_t m_len;
-public:
-	VectorType(ScalarType& elem)
-		:m_elemType(elem), m_len(-1)
-	{ }
 	VectorType(ScalarType& elem, int32_t len)
-		:m_elemType(elem), m_len(len)
+		:ValueType(Vector), m_elemType(elem), m_len(len)
 	{ }
+public:
 	ScalarType& GetElementType() { return m_elemType; }
 	virtual void AcceptVisitor(ValueTypeVisitor& visitor) { visitor.Visit(*this); }
-	virtual ValueType* Clone(){ return new VectorType(*dynamic_cast<ScalarType*>(m_elemType.Clone()), m_len); }
-
+    // -1 when the length is unknown
     int32_t GetLength() { return m_len; }
-    void SetLength(int32_t len) { m_len = len; }
-    ~VectorType() { delete &m_elemType; }
+    static VectorType& Get(ScalarType& elem, int32_t len = -1);
 };
 
+inline VectorType* ValueType::AsVectorType()
+{
+    return m_kind == Vector ? static_cast<VectorType*>(this) : nullptr;
+}
+
+// The narrowest real type that holds the values of both. Float16 and BFloat16 join to Float32.
+RealType& JoinRealTypes(RealType& type1, RealType& type2);
+// The type with its real scalars stored at the given precision
+ValueType& GetTypeWithPrecision(ValueType& type, RealType::Precision precision);
+
 void PrintValueType(ValueType& type, std::ostream& ostr);
-bool operator==(ValueType& type1, ValueType& type2);
+inline bool operator==(ValueType& type1, ValueType& type2) { return &type1 == &type2; }
 
 #endif // _NEURONPROPERTYTYPE_H_